@@ -0,0 +1,155 @@
+#include "loader.h"
+#include "mesh_loader.h"
+#include "scene/compressed_bvh.hpp"
+#include "scene/scene.hpp"
+#include "scene/scene_file.hpp"
+#include "scene/texture_tiles.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// Bakes a model into a .pxscene file, which both renderers load without
+// building anything. Nothing here needs an OpenGL context.
+
+static void PrintUsage(const char *program)
+{
+	printf("Usage: %s [options]\n", program);
+	printf("  --model <path>       glTF / GLB, OBJ or binary PLY model to bake (default: res/models/CornellBox_lit.glb)\n");
+	printf("  --output <path>      scene file to write (default: the model path with the extension %s)\n", SCENE_FILE_EXTENSION);
+	printf("  --builder <name>     BVH builder: sweep, binned, sbvh, lbvh or ploc (default: sweep)\n");
+	printf("  --optimize-bvh       run reinsertion, leaf collapsing and node layout passes after the BVH build\n");
+	printf("  --no-cache           always rebuild the scene and the texture pages instead of using <model>.cache and <model>.textures\n");
+	printf("  --texture-budget <MB> memory the texture pages may take on the GPU (default: %llu)\n", TEXTURE_BUDGET_BYTES / (1024 * 1024));
+	printf("  --no-textures        bake the materials without their textures\n");
+}
+
+// "res/models/CornellBox_lit.glb" -> "res/models/CornellBox_lit.pxscene"
+static std::string scene_file_path(const char *model_path)
+{
+	std::string path(model_path);
+	size_t extension = path.find_last_of('.');
+	if (extension == std::string::npos || path.find_first_of("/\\", extension) != std::string::npos)
+	{
+		extension = path.size();
+	}
+	return path.substr(0, extension) + SCENE_FILE_EXTENSION;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *model_path = "res/models/CornellBox_lit.glb";
+	std::string output_path;
+	BVHBuildOptions bvh_options;
+	bool use_scene_cache = true;
+	bool use_textures = true;
+	uint64 texture_budget_bytes = TEXTURE_BUDGET_BYTES;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (strcmp(arg, "--model") == 0 && has_value)
+			model_path = argv[++i];
+		else if (strcmp(arg, "--output") == 0 && has_value)
+			output_path = argv[++i];
+		else if (strcmp(arg, "--builder") == 0 && has_value)
+		{
+			const char *name = argv[++i];
+			if (!ParseBVHBuilder(name, bvh_options.builder))
+			{
+				printf("ERROR: Unknown BVH builder '%s'!\n", name);
+				return -1;
+			}
+		}
+		else if (strcmp(arg, "--optimize-bvh") == 0)
+			bvh_options.optimize = true;
+		else if (strcmp(arg, "--no-cache") == 0)
+			use_scene_cache = false;
+		else if (strcmp(arg, "--texture-budget") == 0 && has_value)
+			texture_budget_bytes = strtoull(argv[++i], nullptr, 10) * 1024 * 1024;
+		else if (strcmp(arg, "--no-textures") == 0)
+			use_textures = false;
+		else
+		{
+			PrintUsage(argv[0]);
+			return strcmp(arg, "--help") == 0 ? 0 : -1;
+		}
+	}
+
+	if (IsSceneFile(model_path))
+	{
+		printf("ERROR: %s is already baked!\n", model_path);
+		return -1;
+	}
+
+	if (output_path.empty())
+	{
+		output_path = scene_file_path(model_path);
+	}
+
+	auto start_time = std::chrono::steady_clock::now();
+
+	Scene scene;
+	if (!LoadScene(model_path, scene, false, bvh_options, use_scene_cache))
+	{
+		printf("Failed to load model!\n");
+		return -1;
+	}
+
+	if (scene.animation.meshes.size > 0 || scene.model.animation_duration > 0.0f)
+	{
+		printf("WARNING: %s is animated, only its rest pose is baked.\n", model_path);
+	}
+
+	CompressedBVH compressed_bvh;
+	CompressBVH(scene.bvh_nodes, scene.meshes, compressed_bvh);
+
+	uint64 source_hash = 0;
+	if (!HashModelSource(model_path, source_hash))
+	{
+		printf("Failed to hash model!\n");
+		return -1;
+	}
+
+	bool has_textures = false;
+	for (uint32 i = 0; i < scene.materials.size; i++)
+	{
+		has_textures = has_textures || scene.materials[i].data3.w > -1.0f;
+	}
+
+	// The pages are uploaded by the OpenGL renderer, the CPU renderer reads
+	// the same textures as tiles from `<output>.tiles`
+	TextureAtlas atlas;
+	TextureAtlas *baked_atlas = nullptr;
+	if (has_textures && use_textures)
+	{
+		std::string tiles_path = output_path + ".tiles";
+		if (!BuildGLTFTextureAtlas(model_path, texture_budget_bytes, use_scene_cache, atlas) ||
+			!WriteGLTFTextureTiles(model_path, tiles_path.c_str(), TextureTilesKey(source_hash)))
+		{
+			printf("Failed to bake textures!\n");
+			return -1;
+		}
+		baked_atlas = &atlas;
+	}
+	else if (has_textures)
+	{
+		for (uint32 i = 0; i < scene.materials.size; i++)
+		{
+			scene.materials[i].data3.w = -1.0f;
+		}
+	}
+
+	if (!WriteSceneFile(output_path.c_str(), source_hash, scene, compressed_bvh, baked_atlas))
+	{
+		return -1;
+	}
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+	printf("Baked %s in %.1f ms.\n", model_path, elapsed.count());
+	return 0;
+}
@@ -1,9 +1,21 @@
 #pragma once
+#include <atomic>
 #include <cstdio>
 #include <cstring>
 
 constexpr int ARRAY_STARTING_SIZE = 0;
 
+// Number of buffers that all Arrays have allocated so far, which the load
+// reports print to show the allocator traffic of a load
+inline std::atomic<unsigned long long> array_allocation_count { 0 };
+
+template<typename T>
+T *allocate_array_buffer(unsigned int count)
+{
+    array_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    return new T[count];
+}
+
 template<typename T>
 struct Array
 {
@@ -26,7 +38,7 @@ struct Array
         if (data == nullptr)
         {
             size = 0;
-            _data = new T[count];
+            _data = allocate_array_buffer<T>(count);
         }
         else
         {
@@ -40,7 +52,7 @@ struct Array
     {
         if (size > 0)
         {
-            _data = new T[size];
+            _data = allocate_array_buffer<T>(size);
         }
     }
 
@@ -49,7 +61,7 @@ struct Array
     {
         if (size > 0)
         {
-            _data = new T[size];
+            _data = allocate_array_buffer<T>(size);
             memcpy(_data, other._data, size * sizeof(T));
         }
     }
@@ -64,7 +76,7 @@ struct Array
 
         if (other.internal_size > 0)
         {
-            _data = new T[other.internal_size];
+            _data = allocate_array_buffer<T>(other.internal_size);
             if (other.size > 0)
             {
                 memcpy(_data, other._data, other.size * sizeof(T));
@@ -102,7 +114,7 @@ struct Array
 
             // Allocate new buffer with new size and
             // copy over the contents from the old buffer.
-            T *tmp_data = new T[internal_size];
+            T *tmp_data = allocate_array_buffer<T>(internal_size);
             memcpy(tmp_data, _data, old_size * sizeof(T));
             delete[] _data;
             _data = tmp_data;
@@ -130,7 +142,7 @@ struct Array
         }
 
         // Shift all elements to the right
-        T *tmp_data = new T[internal_size];
+        T *tmp_data = allocate_array_buffer<T>(internal_size);
         if (size < internal_size)
         {
             memcpy(tmp_data + 1, _data, size * sizeof(T));
@@ -147,6 +159,39 @@ struct Array
         size++;
     }
 
+    // Sets the number of elements to `count`, reallocating only when the
+    // current buffer is too small. Existing elements are kept.
+    void resize(unsigned int count)
+    {
+        if (count > internal_size)
+        {
+            T *tmp_data = allocate_array_buffer<T>(count);
+            if (size > 0)
+            {
+                memcpy(tmp_data, _data, size * sizeof(T));
+            }
+            delete[] _data;
+            _data = tmp_data;
+            internal_size = count;
+        }
+
+        size = count;
+    }
+
+    // Exchanges the buffers of the two arrays without copying any element
+    void swap(Array &other)
+    {
+        T *other_data = other._data;
+        unsigned int other_size = other.size;
+        unsigned int other_internal_size = other.internal_size;
+        other._data = _data;
+        other.size = size;
+        other.internal_size = internal_size;
+        _data = other_data;
+        size = other_size;
+        internal_size = other_internal_size;
+    }
+
     T pop()
     {
         if (size == 0)
@@ -0,0 +1,63 @@
+#pragma once
+#include "../defines.hpp"
+
+#include <cstddef>
+#include <cstring>
+
+// Final mix of MurmurHash3, spreads every input bit over the whole hash
+inline uint64 HashMix(uint64 x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+inline uint64 HashCombine(uint64 hash, uint64 value)
+{
+	return HashMix(hash ^ (value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2)));
+}
+
+// Non-cryptographic 64-bit hash of a block of memory. It runs 4 independent
+// multiply-rotate lanes over 32 bytes at a time, so it hashes large files
+// at memory bandwidth instead of one dependent multiply per byte.
+inline uint64 HashBytes(const void *data, size_t size, uint64 seed = 0)
+{
+	constexpr uint64 prime1 = 0x9e3779b185ebca87ULL;
+	constexpr uint64 prime2 = 0xc2b2ae3d27d4eb4fULL;
+
+	auto rotate = [](uint64 x, uint32 bits) { return (x << bits) | (x >> (64 - bits)); };
+
+	const uint8 *bytes = (const uint8 *) data;
+	uint64 lanes[4] = { seed + prime1, seed + prime2, seed, seed - prime1 };
+
+	size_t offset = 0;
+	for (; offset + 32 <= size; offset += 32)
+	{
+		for (uint32 i = 0; i < 4; i++)
+		{
+			uint64 word;
+			memcpy(&word, bytes + offset + 8 * i, sizeof(word));
+			lanes[i] = rotate(lanes[i] + word * prime2, 31) * prime1;
+		}
+	}
+
+	uint64 hash = rotate(lanes[0], 1) + rotate(lanes[1], 7) + rotate(lanes[2], 12) + rotate(lanes[3], 18);
+	hash = HashCombine(hash, (uint64) size);
+
+	for (; offset + 8 <= size; offset += 8)
+	{
+		uint64 word;
+		memcpy(&word, bytes + offset, sizeof(word));
+		hash = HashCombine(hash, word);
+	}
+
+	for (; offset < size; offset++)
+	{
+		hash = HashCombine(hash, bytes[offset]);
+	}
+
+	return HashMix(hash);
+}
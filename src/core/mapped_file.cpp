@@ -0,0 +1,192 @@
+#include "mapped_file.hpp"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+static size_t page_size();
+
+// Pages are the unit of both prefetching and releasing. A release leaves
+// out the pages at either end, which other data may share.
+static bool page_range(size_t offset, size_t length, size_t size, bool inner, size_t &out_begin, size_t &out_end)
+{
+	size_t page = page_size();
+	out_end = offset + length < size ? offset + length : size;
+	if (inner)
+	{
+		out_begin = (offset + page - 1) / page * page;
+		out_end = out_end / page * page;
+	}
+	else
+	{
+		out_begin = offset / page * page;
+	}
+	return out_begin < out_end;
+}
+
+#if defined(_WIN32)
+
+bool MappedFile::Open(const char *path)
+{
+	Close();
+
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (view == nullptr)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	file_handle = file;
+	mapping_handle = mapping;
+	data = (const uint8 *) view;
+	size = (size_t) file_size.QuadPart;
+	return true;
+}
+
+static size_t page_size()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (size_t) info.dwPageSize;
+}
+
+void MappedFile::Prefetch(size_t offset, size_t length) const
+{
+	size_t begin, end;
+	if (data != nullptr && page_range(offset, length, size, false, begin, end))
+	{
+		WIN32_MEMORY_RANGE_ENTRY range { (void *) (data + begin), end - begin };
+		PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+	}
+}
+
+void MappedFile::Release(size_t offset, size_t length) const
+{
+	// Unlocking pages that aren't locked takes them out of the working set
+	size_t begin, end;
+	if (data != nullptr && page_range(offset, length, size, true, begin, end))
+	{
+		VirtualUnlock((void *) (data + begin), end - begin);
+	}
+}
+
+void MappedFile::Close()
+{
+	if (data != nullptr)
+	{
+		UnmapViewOfFile(data);
+		CloseHandle((HANDLE) mapping_handle);
+		CloseHandle((HANDLE) file_handle);
+	}
+
+	data = nullptr;
+	size = 0;
+	file_handle = nullptr;
+	mapping_handle = nullptr;
+}
+
+#else
+
+bool MappedFile::Open(const char *path)
+{
+	Close();
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	void *view = mmap(nullptr, (size_t) file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	// The mapping keeps its own reference to the file
+	close(fd);
+
+	if (view == MAP_FAILED)
+	{
+		return false;
+	}
+
+	data = (const uint8 *) view;
+	size = (size_t) file_stat.st_size;
+	return true;
+}
+
+static size_t page_size()
+{
+	return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+void MappedFile::Prefetch(size_t offset, size_t length) const
+{
+	size_t begin, end;
+	if (data != nullptr && page_range(offset, length, size, false, begin, end))
+	{
+		madvise((void *) (data + begin), end - begin, MADV_WILLNEED);
+	}
+}
+
+void MappedFile::Release(size_t offset, size_t length) const
+{
+	// The mapping is private and never written, so the dropped pages are
+	// read back from the file instead of being zero filled
+	size_t begin, end;
+	if (data != nullptr && page_range(offset, length, size, true, begin, end))
+	{
+		madvise((void *) (data + begin), end - begin, MADV_DONTNEED);
+	}
+}
+
+void MappedFile::Close()
+{
+	if (data != nullptr)
+	{
+		munmap((void *) data, size);
+	}
+
+	data = nullptr;
+	size = 0;
+}
+
+#endif
@@ -0,0 +1,33 @@
+#pragma once
+#include "../defines.hpp"
+
+#include <cstddef>
+
+// Read-only memory mapping of a whole file. The pages are only read from
+// disk when they are first touched, and stay in the page cache between runs.
+struct MappedFile
+{
+	const uint8 *data = nullptr;
+	size_t size = 0;
+
+#if defined(_WIN32)
+	void *file_handle = nullptr;
+	void *mapping_handle = nullptr;
+#endif
+
+	MappedFile() = default;
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+	~MappedFile();
+
+	bool Open(const char *path);
+	void Close();
+
+	// Starts reading the pages of a range in the background, so that they
+	// are in memory by the time they are touched
+	void Prefetch(size_t offset, size_t length) const;
+
+	// Drops the pages that lie completely inside a range from the process.
+	// They are read from the file again if they are touched after all.
+	void Release(size_t offset, size_t length) const;
+};
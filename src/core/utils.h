@@ -1,19 +1,28 @@
 #pragma once
+#include "../defines.hpp"
 #include "array.hpp"
 #include <glad/glad.h>
 
+// `data` doesn't have to outlive the call, the buffer gets its own copy.
+// The buffer is immutable, see SceneBuffers for buffers that are edited.
 template<class T>
-void PushDataToSSBO(Array<T> &data, Array<GLuint> &ssbo_array)
+void PushDataToSSBO(const T *data, uint32 count, Array<GLuint> &ssbo_array)
 {
 	GLuint ssbo = 0;
-	if (data.size > 0)
+	if (count > 0)
 	{
 		glCreateBuffers(1, &ssbo);
 
 		glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
 		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, ssbo_array.size, ssbo);
-		glNamedBufferStorage(ssbo, (GLsizeiptr) (data.size * sizeof(T)), &(data[0]), 0);
+		glNamedBufferStorage(ssbo, (GLsizeiptr) ((uint64) count * sizeof(T)), data, 0);
 	}
 
 	ssbo_array.append(ssbo);
-}
\ No newline at end of file
+}
+
+template<class T>
+void PushDataToSSBO(Array<T> &data, Array<GLuint> &ssbo_array)
+{
+	PushDataToSSBO(data._data, data.size, ssbo_array);
+}
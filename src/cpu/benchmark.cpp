@@ -0,0 +1,370 @@
+#include "benchmark.hpp"
+#include "../core/mapped_file.hpp"
+#include "../math/math.hpp"
+#include "../mesh_loader.h"
+#include "ray_packet.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+void RunScalingBenchmark(Scene &scene, EnvironmentMap &environment, const WideBVH *wide_bvh, const CompressedBVH *compressed_bvh, const RenderSettings &settings, uint32 max_threads)
+{
+	if (max_threads == 0)
+	{
+		max_threads = pixl::max(1u, std::thread::hardware_concurrency());
+	}
+
+	Array<uint32> thread_counts;
+	for (uint32 count = 1; count < max_threads; count *= 2)
+	{
+		thread_counts.append(count);
+	}
+	thread_counts.append(max_threads);
+
+	printf("Scaling benchmark: %ux%u, %u spp, %u bounces\n", settings.width, settings.height, settings.samples_per_pixel, settings.bounce_count);
+	printf("%8s %10s %12s %10s %9s %11s %8s\n", "threads", "seconds", "Msamples/s", "Mrays/s", "speedup", "efficiency", "stolen");
+
+	Array<glm::vec3> image;
+	double single_thread_seconds = 0.0;
+	for (uint32 i = 0; i < thread_counts.size; i++)
+	{
+		RenderSettings run_settings = settings;
+		run_settings.thread_count = thread_counts[i];
+
+		RenderStats stats = RenderImageCPU(scene, environment, wide_bvh, compressed_bvh, nullptr, run_settings, image);
+		if (i == 0)
+		{
+			single_thread_seconds = stats.seconds;
+		}
+
+		double speedup = single_thread_seconds / stats.seconds;
+		printf("%8u %10.3f %12.3f %10.3f %8.2fx %10.1f%% %8llu\n",
+			   stats.thread_count,
+			   stats.seconds,
+			   (double) stats.samples / stats.seconds / 1e6,
+			   (double) stats.rays / stats.seconds / 1e6,
+			   speedup,
+			   100.0 * speedup / stats.thread_count,
+			   stats.tiles_stolen);
+	}
+}
+
+struct BenchmarkRay
+{
+	glm::vec3 origin;
+	glm::vec3 direction;
+};
+
+// Traces every ray, stores whether and where it hit, and returns the seconds it took
+static double trace_rays(TraceContext &ctx, Array<BenchmarkRay> &rays, Array<float> &out_t)
+{
+	out_t.resize(rays.size);
+
+	auto start_time = std::chrono::steady_clock::now();
+	for (uint32 i = 0; i < rays.size; i++)
+	{
+		HitData data {};
+		bool hit = Intersect(ctx, rays[i].origin, rays[i].direction, data);
+		out_t[i] = hit ? data.t : -1.0f;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+
+	return elapsed.count();
+}
+
+// Same as trace_rays, but as packets of PACKET_RAY_COUNT rays that share their origin
+static double trace_packets(TraceContext &ctx, Array<BenchmarkRay> &rays, Array<float> &out_t)
+{
+	out_t.resize(rays.size);
+
+	RayPacket packet;
+	PrimaryHit hits[PACKET_RAY_COUNT];
+
+	auto start_time = std::chrono::steady_clock::now();
+	for (uint32 first = 0; first < rays.size; first += PACKET_RAY_COUNT)
+	{
+		packet.origin = rays[first].origin;
+		packet.ray_count = pixl::min(PACKET_RAY_COUNT, rays.size - first);
+		for (uint32 i = 0; i < packet.ray_count; i++)
+		{
+			packet.directions[i] = rays[first + i].direction;
+		}
+
+		IntersectPacket(ctx, packet, hits);
+
+		for (uint32 i = 0; i < packet.ray_count; i++)
+		{
+			out_t[first + i] = hits[i].hit ? hits[i].data.t : -1.0f;
+		}
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+
+	return elapsed.count();
+}
+
+// Every traversal finds the closest hit, so the distances should agree. The
+// Moller-Trumbore test isn't watertight though, and the packet version rounds
+// slightly differently, so a few rays that hit the shared edge of two
+// triangles can slip through in one traversal but not in the other.
+static uint32 count_mismatches(Array<float> &reference_t, Array<float> &t)
+{
+	uint32 mismatches = 0;
+	for (uint32 i = 0; i < reference_t.size; i++)
+	{
+		if (fabsf(reference_t[i] - t[i]) > 1e-4f * pixl::max(1.0f, fabsf(reference_t[i])))
+		{
+			mismatches++;
+		}
+	}
+	return mismatches;
+}
+
+static void print_result(const char *rays_name, const char *traversal_name, uint32 ray_count, double seconds, double reference_seconds, uint32 mismatches)
+{
+	printf("%-10s %-10s %10u %10.3f %9.2fx %11u\n",
+		   rays_name,
+		   traversal_name,
+		   ray_count,
+		   (double) ray_count / seconds / 1e6,
+		   reference_seconds / seconds,
+		   mismatches);
+}
+
+// Node memory of a BVH. The binary nodes count as 2 wide, since their
+// children are stored next to each other.
+static void print_nodes(const char *bvh_name, uint32 node_count, uint32 width, size_t node_size)
+{
+	printf("%-10s %10u %10u %10.2f\n", bvh_name, node_count, width, (double) (node_count * node_size) / (1024.0 * 1024.0));
+}
+
+void RunBVHBenchmark(Scene &scene, EnvironmentMap &environment, const WideBVH &wide_bvh, const CompressedBVH &compressed_bvh, const RenderSettings &settings)
+{
+	CameraGrid cam(settings.cam_origin, settings.cam_forward, settings.cam_right, settings.width, settings.height);
+
+	pcg32_random_t rng;
+	pcg32_srandom_r(&rng, settings.seed, 54u);
+
+	// Coherent camera rays through the pixel centers, in blocks of 8x8 pixels
+	// so that consecutive rays make up the packets of the renderer.
+	Array<BenchmarkRay> primary_rays;
+	for (uint32 y0 = 0; y0 < settings.height; y0 += PACKET_WIDTH)
+	{
+		for (uint32 x0 = 0; x0 < settings.width; x0 += PACKET_WIDTH)
+		{
+			for (uint32 y = y0; y < pixl::min(y0 + PACKET_WIDTH, settings.height); y++)
+			{
+				for (uint32 x = x0; x < pixl::min(x0 + PACKET_WIDTH, settings.width); x++)
+				{
+					float u = ((float) x + 0.5f) / (float) settings.width;
+					float v = ((float) y + 0.5f) / (float) settings.height;
+					glm::vec3 point_on_grid = cam.grid_origin + u * cam.grid_x + v * cam.grid_y;
+					primary_rays.append({ cam.origin, glm::normalize(point_on_grid - cam.origin) });
+				}
+			}
+		}
+	}
+
+	// Incoherent rays, cosine distributed around the normal at every primary hit
+	TraceContext binary_ctx { &scene, &environment, 0, nullptr, nullptr, 0 };
+	TraceContext wide_ctx { &scene, &environment, 0, &wide_bvh, nullptr, 0 };
+	TraceContext compressed_ctx { &scene, &environment, 0, nullptr, &compressed_bvh, 0 };
+
+	Array<BenchmarkRay> secondary_rays;
+	for (uint32 i = 0; i < primary_rays.size; i++)
+	{
+		HitData data {};
+		if (Intersect(wide_ctx, primary_rays[i].origin, primary_rays[i].direction, data))
+		{
+			glm::vec3 origin = primary_rays[i].origin + primary_rays[i].direction * data.t + NORMAL_OFFSET * data.normal;
+			glm::vec3 direction = pixl::map_to_unit_hemisphere_cosine_weighted_criver(pixl::random_vec2_PCG(&rng), data.normal);
+			secondary_rays.append({ origin, glm::normalize(direction) });
+		}
+	}
+
+	printf("BVH benchmark: %u instances, 1 thread\n", scene.instances.size);
+	printf("%-10s %10s %10s %10s\n", "bvh", "nodes", "width", "MB");
+	print_nodes("binary", scene.bvh_nodes.size, 2, sizeof(BVHNodeGLSL));
+	print_nodes("wide", wide_bvh.nodes.size, WIDE_BVH_WIDTH, sizeof(WideBVHNode));
+	print_nodes("compressed", compressed_bvh.nodes.size, COMPRESSED_BVH_WIDTH, sizeof(CompressedBVHNode));
+
+	printf("%-10s %-10s %10s %10s %10s %11s\n", "rays", "traversal", "count", "Mrays/s", "speedup", "mismatches");
+
+	Array<float> binary_t;
+	Array<float> t;
+
+	double binary_seconds = trace_rays(binary_ctx, primary_rays, binary_t);
+	print_result("primary", "binary", primary_rays.size, binary_seconds, binary_seconds, 0);
+
+	double seconds = trace_rays(wide_ctx, primary_rays, t);
+	print_result("primary", "wide", primary_rays.size, seconds, binary_seconds, count_mismatches(binary_t, t));
+
+	seconds = trace_rays(compressed_ctx, primary_rays, t);
+	print_result("primary", "compressed", primary_rays.size, seconds, binary_seconds, count_mismatches(binary_t, t));
+
+	seconds = trace_packets(wide_ctx, primary_rays, t);
+	print_result("primary", "packets", primary_rays.size, seconds, binary_seconds, count_mismatches(binary_t, t));
+
+	binary_seconds = trace_rays(binary_ctx, secondary_rays, binary_t);
+	print_result("secondary", "binary", secondary_rays.size, binary_seconds, binary_seconds, 0);
+
+	seconds = trace_rays(wide_ctx, secondary_rays, t);
+	print_result("secondary", "wide", secondary_rays.size, seconds, binary_seconds, count_mismatches(binary_t, t));
+
+	seconds = trace_rays(compressed_ctx, secondary_rays, t);
+	print_result("secondary", "compressed", secondary_rays.size, seconds, binary_seconds, count_mismatches(binary_t, t));
+}
+
+// Grid of `size` x `size` vertices on a gentle wave, two triangles per quad
+static glm::vec3 grid_position(uint32 x, uint32 z, uint32 size)
+{
+	float u = (float) x / (float) (size - 1);
+	float v = (float) z / (float) (size - 1);
+	return glm::vec3(u, 0.05f * sinf(20.0f * u) * cosf(20.0f * v), v);
+}
+
+static void grid_triangle_corners(uint32 quad, uint32 size, uint32 out_corners[6])
+{
+	uint32 x = quad % (size - 1);
+	uint32 z = quad / (size - 1);
+	uint32 i = z * size + x;
+	uint32 corners[6] = { i, i + size, i + 1, i + 1, i + size, i + size + 1 };
+	memcpy(out_corners, corners, sizeof(corners));
+}
+
+// Positions, normals and faces that reference both, like scans exported with normals
+static bool write_obj_grid(const char *path, uint32 size)
+{
+	FILE *file = fopen(path, "wb");
+	if (file == nullptr)
+	{
+		return false;
+	}
+
+	for (uint32 i = 0; i < size * size; i++)
+	{
+		glm::vec3 position = grid_position(i % size, i / size, size);
+		fprintf(file, "v %.6f %.6f %.6f\n", position.x, position.y, position.z);
+	}
+	for (uint32 i = 0; i < size * size; i++)
+	{
+		fprintf(file, "vn 0.000000 1.000000 0.000000\n");
+	}
+	for (uint32 quad = 0; quad < (size - 1) * (size - 1); quad++)
+	{
+		uint32 c[6];
+		grid_triangle_corners(quad, size, c);
+		fprintf(file, "f %u//%u %u//%u %u//%u\nf %u//%u %u//%u %u//%u\n", c[0] + 1, c[0] + 1, c[1] + 1, c[1] + 1, c[2] + 1, c[2] + 1,
+				c[3] + 1, c[3] + 1, c[4] + 1, c[4] + 1, c[5] + 1, c[5] + 1);
+	}
+	return fclose(file) == 0;
+}
+
+// Float positions and normals, and triangles as lists with a uchar count
+static bool write_ply_grid(const char *path, uint32 size)
+{
+	FILE *file = fopen(path, "wb");
+	if (file == nullptr)
+	{
+		return false;
+	}
+
+	uint32 tri_count = 2 * (size - 1) * (size - 1);
+	fprintf(file, "ply\nformat binary_little_endian 1.0\nelement vertex %u\n"
+				  "property float x\nproperty float y\nproperty float z\nproperty float nx\nproperty float ny\nproperty float nz\n"
+				  "element face %u\nproperty list uchar int vertex_indices\nend_header\n",
+			size * size, tri_count);
+
+	for (uint32 i = 0; i < size * size; i++)
+	{
+		glm::vec3 position = grid_position(i % size, i / size, size);
+		float vertex[6] = { position.x, position.y, position.z, 0.0f, 1.0f, 0.0f };
+		fwrite(vertex, sizeof(vertex), 1, file);
+	}
+	for (uint32 quad = 0; quad < (size - 1) * (size - 1); quad++)
+	{
+		uint32 c[6];
+		grid_triangle_corners(quad, size, c);
+		for (uint32 tri = 0; tri < 2; tri++)
+		{
+			uint8 record[13];
+			record[0] = 3;
+			memcpy(record + 1, &c[3 * tri], 3 * sizeof(uint32));
+			fwrite(record, sizeof(record), 1, file);
+		}
+	}
+	return fclose(file) == 0;
+}
+
+bool RunLoaderBenchmark(uint32 max_megabytes)
+{
+	struct LoaderFormat
+	{
+		const char *name;
+		const char *path;
+		double bytes_per_vertex; // about, with two triangles per vertex
+		bool (*write)(const char *path, uint32 size);
+		bool (*load)(const char *path, Model &out_mesh);
+	};
+
+	const LoaderFormat formats[] = {
+		{ "obj", "loader_benchmark.obj", 140.0, write_obj_grid, LoadOBJ },
+		{ "ply", "loader_benchmark.ply", 50.0, write_ply_grid, LoadPLY }
+	};
+
+	struct LoaderResult
+	{
+		const char *name;
+		double megabytes;
+		uint32 tri_count;
+		double milliseconds;
+	};
+	Array<LoaderResult> results;
+
+	for (uint32 megabytes = 16; megabytes <= pixl::max(max_megabytes, 16u); megabytes *= 2)
+	{
+		for (const LoaderFormat &format : formats)
+		{
+			uint32 size = (uint32) sqrt((double) megabytes * 1024.0 * 1024.0 / format.bytes_per_vertex);
+			if (!format.write(format.path, size))
+			{
+				printf("ERROR: Failed to write %s!\n", format.path);
+				remove(format.path);
+				return false;
+			}
+
+			MappedFile file;
+			double file_megabytes = file.Open(format.path) ? (double) file.size / (1024.0 * 1024.0) : 0.0;
+			file.Close();
+
+			Model model;
+			auto start_time = std::chrono::steady_clock::now();
+			bool loaded = format.load(format.path, model);
+			std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+			remove(format.path);
+
+			if (!loaded)
+			{
+				printf("ERROR: Failed to load the %.0f MB %s grid!\n", file_megabytes, format.name);
+				return false;
+			}
+			results.append({ format.name, file_megabytes, model.triangles.size, elapsed.count() });
+		}
+	}
+
+	printf("Loader benchmark: generated grids, everything from mapping the file to the finished vertices\n");
+	printf("%-6s %10s %12s %10s %10s %10s\n", "format", "MB", "triangles", "ms", "MB/s", "Mtris/s");
+	for (uint32 i = 0; i < results.size; i++)
+	{
+		LoaderResult &result = results[i];
+		printf("%-6s %10.1f %12u %10.1f %10.0f %10.2f\n",
+			   result.name,
+			   result.megabytes,
+			   result.tri_count,
+			   result.milliseconds,
+			   result.megabytes / (result.milliseconds / 1000.0),
+			   (double) result.tri_count / (result.milliseconds / 1000.0) / 1e6);
+	}
+	return true;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include "../pathtracer.hpp"
+#include "../scene/compressed_bvh.hpp"
+#include "../scene/scene.hpp"
+#include "renderer.hpp"
+#include "wide_bvh.hpp"
+
+// Renders the same image with 1, 2, 4, ... up to `max_threads` threads (0 uses
+// every hardware thread) and prints the throughput, speedup and parallel
+// efficiency relative to the single threaded render.
+void RunScalingBenchmark(Scene &scene, EnvironmentMap &environment, const WideBVH *wide_bvh, const CompressedBVH *compressed_bvh, const RenderSettings &settings, uint32 max_threads);
+
+// Traces the same primary rays and diffuse secondary rays on a single thread
+// through the binary BVH (scalar port of `intersect_bvh_stack`), through
+// `wide_bvh`, through `compressed_bvh` and (primary rays only) as 8x8 packets
+// through `wide_bvh`, and prints the throughput of each and whether their
+// hits agree, along with the memory the nodes of each BVH take.
+void RunBVHBenchmark(Scene &scene, EnvironmentMap &environment, const WideBVH &wide_bvh, const CompressedBVH &compressed_bvh, const RenderSettings &settings);
+
+// Writes OBJ and binary PLY grids of 16 MB, 32 MB, ... up to `max_megabytes`
+// to the working directory, loads each one with LoadOBJ / LoadPLY and prints
+// the throughput. The files were just written and are still in the page
+// cache, so this measures the parsers, not the disk. Returns false if a
+// grid couldn't be written or loaded.
+bool RunLoaderBenchmark(uint32 max_megabytes);
@@ -0,0 +1,215 @@
+#include "compressed_traversal.hpp"
+#include "../pathtracer.hpp"
+#include "traversal_stack.hpp"
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#include <cstring>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static uint32 count_set_bits(uint32 mask)
+{
+#if defined(_MSC_VER)
+	return (uint32) __popcnt(mask);
+#else
+	return (uint32) __builtin_popcount(mask);
+#endif
+}
+
+#if defined(__SSE4_1__) && !defined(__AVX2__)
+// Four quantized planes as floats
+static __m128 load_quantized4(const uint8 *q)
+{
+	int32 bits;
+	memcpy(&bits, q, sizeof(bits));
+	return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bits)));
+}
+#endif
+
+// The planes are decoded exactly the way CompressBVH checked them, and then
+// go through the same slab test as the wide BVH. See IntersectWideChildren
+// for how rays that are parallel to an axis are handled.
+uint32 IntersectCompressedChildren(const CompressedBVHNode &node, const glm::vec3 &ro, const glm::vec3 &inv_dir, float tmax, float *out_tnear)
+{
+#if defined(__AVX2__)
+	__m256 tnear = _mm256_set1_ps(TMIN);
+	__m256 tfar = _mm256_set1_ps(tmax);
+	for (uint32 axis = 0; axis < 3; axis++)
+	{
+		bool negative = inv_dir[(int32) axis] < 0.0f;
+		const uint8 *near_q = negative ? node.hi[axis] : node.lo[axis];
+		const uint8 *far_q = negative ? node.lo[axis] : node.hi[axis];
+
+		__m256 origin = _mm256_set1_ps(node.origin[(int32) axis]);
+		__m256 scale = _mm256_set1_ps(CompressedBVHScale(node, axis));
+		__m256 near_plane = _mm256_add_ps(origin, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) near_q))), scale));
+		__m256 far_plane = _mm256_add_ps(origin, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) far_q))), scale));
+
+		__m256 ray_origin = _mm256_set1_ps(ro[(int32) axis]);
+		__m256 ray_inv_dir = _mm256_set1_ps(inv_dir[(int32) axis]);
+		__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(near_plane, ray_origin), ray_inv_dir);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(far_plane, ray_origin), ray_inv_dir);
+		tnear = _mm256_max_ps(t0, tnear);
+		tfar = _mm256_min_ps(t1, tfar);
+	}
+
+	_mm256_storeu_ps(out_tnear, tnear);
+	return (uint32) _mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+#elif defined(__SSE4_1__)
+	uint32 mask = 0;
+	for (uint32 half = 0; half < COMPRESSED_BVH_WIDTH; half += 4)
+	{
+		__m128 tnear = _mm_set1_ps(TMIN);
+		__m128 tfar = _mm_set1_ps(tmax);
+		for (uint32 axis = 0; axis < 3; axis++)
+		{
+			bool negative = inv_dir[(int32) axis] < 0.0f;
+			const uint8 *near_q = (negative ? node.hi[axis] : node.lo[axis]) + half;
+			const uint8 *far_q = (negative ? node.lo[axis] : node.hi[axis]) + half;
+
+			__m128 origin = _mm_set1_ps(node.origin[(int32) axis]);
+			__m128 scale = _mm_set1_ps(CompressedBVHScale(node, axis));
+			__m128 near_plane = _mm_add_ps(origin, _mm_mul_ps(load_quantized4(near_q), scale));
+			__m128 far_plane = _mm_add_ps(origin, _mm_mul_ps(load_quantized4(far_q), scale));
+
+			__m128 ray_origin = _mm_set1_ps(ro[(int32) axis]);
+			__m128 ray_inv_dir = _mm_set1_ps(inv_dir[(int32) axis]);
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(near_plane, ray_origin), ray_inv_dir);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(far_plane, ray_origin), ray_inv_dir);
+			tnear = _mm_max_ps(t0, tnear);
+			tfar = _mm_min_ps(t1, tfar);
+		}
+
+		_mm_storeu_ps(out_tnear + half, tnear);
+		mask |= (uint32) _mm_movemask_ps(_mm_cmple_ps(tnear, tfar)) << half;
+	}
+	return mask;
+#else
+	uint32 mask = 0;
+	for (uint32 i = 0; i < COMPRESSED_BVH_WIDTH; i++)
+	{
+		float tnear = TMIN;
+		float tfar = tmax;
+		for (uint32 axis = 0; axis < 3; axis++)
+		{
+			bool negative = inv_dir[(int32) axis] < 0.0f;
+			float scale = CompressedBVHScale(node, axis);
+			float near_plane = node.origin[(int32) axis] + (float) (negative ? node.hi[axis][i] : node.lo[axis][i]) * scale;
+			float far_plane = node.origin[(int32) axis] + (float) (negative ? node.lo[axis][i] : node.hi[axis][i]) * scale;
+
+			float t0 = (near_plane - ro[(int32) axis]) * inv_dir[(int32) axis];
+			float t1 = (far_plane - ro[(int32) axis]) * inv_dir[(int32) axis];
+			tnear = t0 > tnear ? t0 : tnear;
+			tfar = t1 < tfar ? t1 : tfar;
+		}
+
+		out_tnear[i] = tnear;
+		mask |= (uint32) (tnear <= tfar) << i;
+	}
+	return mask;
+#endif
+}
+
+bool IntersectCompressedBVH(TraceContext &ctx, const glm::vec3 &ro, const glm::vec3 &rd, HitData &data, float &tmax, uint32 root)
+{
+	const CompressedBVH &bvh = *ctx.compressed_bvh;
+	if (bvh.nodes.size == 0)
+	{
+		return false;
+	}
+
+	glm::vec3 inv_dir = 1.0f / rd;
+
+	struct StackEntry
+	{
+		uint32 node;
+		float tnear;
+	};
+
+	TraversalStack<StackEntry, COMPRESSED_BVH_STACK_SIZE> stack;
+	stack.Push({ root, TMIN });
+
+	bool hit_anything = false;
+	while (stack.size > 0)
+	{
+		StackEntry entry = stack.Pop();
+
+		// Something closer was hit after this node was pushed
+		if (entry.tnear > tmax)
+		{
+			continue;
+		}
+
+		const CompressedBVHNode &node = bvh.nodes._data[entry.node];
+
+		alignas(32) float tnear[COMPRESSED_BVH_WIDTH];
+		uint32 mask = IntersectCompressedChildren(node, ro, inv_dir, tmax, tnear);
+
+		// Same order as IntersectWideBVH: the hit children sorted by
+		// distance, leaves intersected right away and inner children pushed
+		// furthest first
+		uint32 hits[COMPRESSED_BVH_WIDTH];
+		uint32 hit_count = 0;
+		while (mask != 0)
+		{
+			uint32 slot = 0;
+			while (((mask >> slot) & 1) == 0)
+			{
+				slot++;
+			}
+			mask &= mask - 1;
+
+			uint32 position = hit_count++;
+			while (position > 0 && tnear[hits[position - 1]] > tnear[slot])
+			{
+				hits[position] = hits[position - 1];
+				position--;
+			}
+			hits[position] = slot;
+		}
+
+		// The leaves' triangles follow each other in slot order
+		uint32 first_tri[COMPRESSED_BVH_WIDTH];
+		uint32 next_tri = node.tri_base;
+		for (uint32 slot = 0; slot < COMPRESSED_BVH_WIDTH; slot++)
+		{
+			first_tri[slot] = next_tri;
+			next_tri += node.tri_count[slot];
+		}
+
+		for (uint32 i = 0; i < hit_count; i++)
+		{
+			uint32 slot = hits[i];
+			uint32 tri_count = node.tri_count[slot];
+			if (tri_count == 0 || tnear[slot] > tmax)
+			{
+				continue;
+			}
+
+			for (uint32 j = 0; j < tri_count; j++)
+			{
+				if (IntersectTriangle(ctx, ro, rd, first_tri[slot] + j, data, tmax))
+				{
+					hit_anything = true;
+					tmax = data.t;
+				}
+			}
+		}
+
+		for (uint32 i = hit_count; i-- > 0;)
+		{
+			uint32 slot = hits[i];
+			if (((node.inner_mask >> slot) & 1) != 0 && tnear[slot] <= tmax)
+			{
+				uint32 child = node.child_base + count_set_bits(node.inner_mask & ((1u << slot) - 1));
+				stack.Push({ child, tnear[slot] });
+			}
+		}
+	}
+
+	return hit_anything;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include "../defines.hpp"
+#include "../scene/compressed_bvh.hpp"
+
+#include <glm/vec3.hpp>
+
+struct TraceContext;
+struct HitData;
+
+// Slab test of one ray against the decoded child boxes of a compressed
+// node. Writes the entry distances to `out_tnear` and returns a bit mask
+// of the hit children.
+uint32 IntersectCompressedChildren(const CompressedBVHNode &node, const glm::vec3 &ro, const glm::vec3 &inv_dir, float tmax, float *out_tnear);
+
+// Closest hit traversal of the compressed subtree below `root`, visiting
+// the children of every node front to back
+bool IntersectCompressedBVH(TraceContext &ctx, const glm::vec3 &ro, const glm::vec3 &rd, HitData &data, float &tmax, uint32 root);
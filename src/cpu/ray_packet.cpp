@@ -0,0 +1,532 @@
+#include "ray_packet.hpp"
+#include "wide_bvh.hpp"
+#include "../math/math.hpp"
+
+#include <cmath>
+#include <limits>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static uint32 lowest_set_bit(uint64 mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, mask);
+	return (uint32) index;
+#else
+	return (uint32) __builtin_ctzll(mask);
+#endif
+}
+
+static uint32 count_set_bits(uint64 mask)
+{
+#if defined(_MSC_VER)
+	return (uint32) __popcnt64(mask);
+#else
+	return (uint32) __builtin_popcountll(mask);
+#endif
+}
+
+// The rays of a packet are processed in groups of 8 lanes, which maps
+// to one AVX register (or gets auto-vectorized on other targets).
+constexpr uint32 PACKET_LANES = 8;
+constexpr uint32 PACKET_GROUPS = PACKET_RAY_COUNT / PACKET_LANES;
+constexpr uint32 PACKET_NO_PRIM = 0xFFFFFFFF;
+
+// Rays of a packet in the space of one instance, SoA so that a group of
+// lanes is one load. Only the rays in `rays` take part, the other lanes get
+// a copy of the first of them.
+struct alignas(32) PacketDirections
+{
+	float dir[3][PACKET_RAY_COUNT];
+	float inv_dir[3][PACKET_RAY_COUNT];
+
+	glm::vec3 origin;
+	WideRay first_ray;
+
+	// Smallest and largest inverse direction per axis, for the frustum test
+	glm::vec3 inv_min;
+	glm::vec3 inv_max;
+
+	// Whether all the rays agree on the direction signs
+	bool coherent;
+};
+
+// Closest hit of every ray of the packet so far, over all instances. The
+// distances are the same in every space, since the transformed directions
+// aren't normalized. The hit data is only filled in at the end.
+struct alignas(32) PacketHits
+{
+	float tmax[PACKET_RAY_COUNT];
+	uint32 prim[PACKET_RAY_COUNT];
+	uint32 instance[PACKET_RAY_COUNT];
+	float u[PACKET_RAY_COUNT];
+	float v[PACKET_RAY_COUNT];
+};
+
+// Conservative slab test of the whole packet against the children of a node.
+// Every ray has the same origin and direction signs, so the entry and exit
+// distances of all rays lie within the bounds computed from the smallest and
+// largest inverse direction of every axis.
+static uint32 intersect_children_frustum(const WideBVHNode &node, const WideRay &first_ray,
+										 const glm::vec3 &inv_min, const glm::vec3 &inv_max, float tmax)
+{
+	uint32 mask = 0;
+	for (uint32 i = 0; i < WIDE_BVH_WIDTH; i++)
+	{
+		float tnear = TMIN;
+		float tfar = tmax;
+		for (uint32 axis = 0; axis < 3; axis++)
+		{
+			auto a = (int32) axis;
+			float near_offset = node.bounds[first_ray.near_row[axis]][i] - first_ray.origin[a];
+			float far_offset = node.bounds[first_ray.far_row[axis]][i] - first_ray.origin[a];
+
+			float t0 = pixl::min(near_offset * inv_min[a], near_offset * inv_max[a]);
+			float t1 = pixl::max(far_offset * inv_min[a], far_offset * inv_max[a]);
+			tnear = pixl::max(tnear, t0);
+			tfar = pixl::min(tfar, t1);
+		}
+
+		mask |= (uint32) (tnear <= tfar) << i;
+	}
+
+	return mask;
+}
+
+// Slab test of one group of rays against a box, given by the offsets of its
+// near and far planes from the shared origin. Returns a mask of the hit lanes,
+// and the smallest entry distance of those through `out_tnear`.
+static uint32 intersect_box_lanes(const PacketDirections &rays, const PacketHits &hits, uint32 first,
+								  const float *near_offset, const float *far_offset, float &out_tnear)
+{
+	float tnear[PACKET_LANES];
+	uint32 mask = 0;
+	for (uint32 lane = 0; lane < PACKET_LANES; lane++)
+	{
+		float t0 = TMIN;
+		float t1 = hits.tmax[first + lane];
+		for (uint32 axis = 0; axis < 3; axis++)
+		{
+			float inv_dir = rays.inv_dir[axis][first + lane];
+			float t_near_plane = near_offset[axis] * inv_dir;
+			float t_far_plane = far_offset[axis] * inv_dir;
+			t0 = t_near_plane > t0 ? t_near_plane : t0;
+			t1 = t_far_plane < t1 ? t_far_plane : t1;
+		}
+
+		tnear[lane] = t0 <= t1 ? t0 : std::numeric_limits<float>::infinity();
+		mask |= (uint32) (t0 <= t1) << lane;
+	}
+
+	for (float t : tnear)
+	{
+		out_tnear = pixl::min(out_tnear, t);
+	}
+
+	return mask;
+}
+
+// Same as `intersect_box_lanes`, but the rays don't need to agree on the
+// direction signs, so the near plane is picked per ray
+static uint32 intersect_aabb_lanes(const PacketDirections &rays, const PacketHits &hits, uint32 first,
+								   const float *min_offset, const float *max_offset, float &out_tnear)
+{
+	uint32 mask = 0;
+	for (uint32 lane = 0; lane < PACKET_LANES; lane++)
+	{
+		float t0 = TMIN;
+		float t1 = hits.tmax[first + lane];
+		for (uint32 axis = 0; axis < 3; axis++)
+		{
+			float inv_dir = rays.inv_dir[axis][first + lane];
+			float t_min_plane = min_offset[axis] * inv_dir;
+			float t_max_plane = max_offset[axis] * inv_dir;
+			t0 = pixl::max(t0, pixl::min(t_min_plane, t_max_plane));
+			t1 = pixl::min(t1, pixl::max(t_min_plane, t_max_plane));
+		}
+
+		if (t0 <= t1)
+		{
+			out_tnear = pixl::min(out_tnear, t0);
+			mask |= 1u << lane;
+		}
+	}
+
+	return mask;
+}
+
+// Moller-Trumbore test of one group of rays against one triangle. Same math
+// as IntersectTriangle, but the terms that only depend on the shared origin
+// are computed once.
+static void intersect_triangle_lanes(const PacketDirections &rays, PacketHits &hits, uint32 first, uint32 lane_mask,
+									 const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2,
+									 uint32 tri_index, uint32 instance_index)
+{
+	glm::vec3 edge1 = v1 - v0;
+	glm::vec3 edge2 = v2 - v0;
+	glm::vec3 tvec = rays.origin - v0;
+	glm::vec3 qvec = glm::cross(tvec, edge1);
+	float t_numerator = glm::dot(edge2, qvec);
+
+	for (uint32 lane = 0; lane < PACKET_LANES; lane++)
+	{
+		uint32 i = first + lane;
+		float dx = rays.dir[0][i];
+		float dy = rays.dir[1][i];
+		float dz = rays.dir[2][i];
+
+		float px = dy * edge2.z - dz * edge2.y;
+		float py = dz * edge2.x - dx * edge2.z;
+		float pz = dx * edge2.y - dy * edge2.x;
+		float dt = edge1.x * px + edge1.y * py + edge1.z * pz;
+
+		float inv_determinant = 1.0f / dt;
+		float u = (tvec.x * px + tvec.y * py + tvec.z * pz) * inv_determinant;
+		float v = inv_determinant * (dx * qvec.x + dy * qvec.y + dz * qvec.z);
+		float t = inv_determinant * t_numerator;
+
+		bool hit = ((lane_mask >> lane) & 1) != 0 && dt != 0.0f &&
+				   u >= 0.0f && u <= 1.0f && v >= 0.0f && u + v <= 1.0f &&
+				   t > TMIN && t < hits.tmax[i];
+
+		hits.tmax[i] = hit ? t : hits.tmax[i];
+		hits.u[i] = hit ? u : hits.u[i];
+		hits.v[i] = hit ? v : hits.v[i];
+		hits.prim[i] = hit ? tri_index : hits.prim[i];
+		hits.instance[i] = hit ? instance_index : hits.instance[i];
+	}
+}
+
+static uint32 group_mask(uint64 rays, uint32 group)
+{
+	return (uint32) (rays >> (group * PACKET_LANES)) & ((1u << PACKET_LANES) - 1);
+}
+
+static uint64 first_rays(uint32 ray_count)
+{
+	return ray_count == PACKET_RAY_COUNT ? ~0ull : (1ull << ray_count) - 1;
+}
+
+static void setup_directions(PacketDirections &out_rays, const glm::vec3 &origin, const glm::vec3 *directions, uint64 rays)
+{
+	glm::vec3 first_direction = directions[lowest_set_bit(rays)];
+
+	out_rays.origin = origin;
+	out_rays.first_ray = WideRay(origin, first_direction);
+	out_rays.inv_min = glm::vec3(std::numeric_limits<float>::infinity());
+	out_rays.inv_max = glm::vec3(-std::numeric_limits<float>::infinity());
+	out_rays.coherent = true;
+
+	for (uint32 i = 0; i < PACKET_RAY_COUNT; i++)
+	{
+		bool is_active = ((rays >> i) & 1) != 0;
+		glm::vec3 direction = is_active ? directions[i] : first_direction;
+		glm::vec3 inv_dir = 1.0f / direction;
+
+		for (uint32 axis = 0; axis < 3; axis++)
+		{
+			auto a = (int32) axis;
+			out_rays.dir[axis][i] = direction[a];
+			out_rays.inv_dir[axis][i] = inv_dir[a];
+
+			out_rays.inv_min[a] = pixl::min(out_rays.inv_min[a], inv_dir[a]);
+			out_rays.inv_max[a] = pixl::max(out_rays.inv_max[a], inv_dir[a]);
+			out_rays.coherent = out_rays.coherent && std::isfinite(inv_dir[a]) &&
+								(inv_dir[a] < 0.0f) == (out_rays.first_ray.inv_dir[a] < 0.0f);
+		}
+	}
+}
+
+// Traces one ray of the packet through the mesh of an instance on its own
+static void trace_single_ray(TraceContext &ctx, const PacketDirections &rays, PacketHits &hits, PrimaryHit *out_hits,
+							 uint32 ray_index, uint32 root, uint32 instance_index)
+{
+	glm::vec3 direction(rays.dir[0][ray_index], rays.dir[1][ray_index], rays.dir[2][ray_index]);
+	HitData &data = out_hits[ray_index].data;
+	if (IntersectWideBVH(ctx, rays.origin, direction, data, hits.tmax[ray_index], root))
+	{
+		// The hit data is complete already, and closer than any triangle found so far
+		InstanceGLSL &instance = ctx.scene->instances[instance_index];
+		data.instance_index = instance_index;
+		data.normal = instance.data.z != 0 ? data.normal : instance.NormalToWorld(data.normal);
+
+		out_hits[ray_index].hit = true;
+		hits.prim[ray_index] = PACKET_NO_PRIM;
+	}
+}
+
+// Shared traversal of the given rays through the wide BVH of one mesh
+static void trace_mesh(TraceContext &ctx, const PacketDirections &rays, PacketHits &hits, PrimaryHit *out_hits,
+					   uint64 active_rays, uint32 root, uint32 instance_index)
+{
+	if (!rays.coherent)
+	{
+		for (uint64 active = active_rays; active != 0; active &= active - 1)
+		{
+			trace_single_ray(ctx, rays, hits, out_hits, lowest_set_bit(active), root, instance_index);
+		}
+		return;
+	}
+
+	const WideBVH &bvh = *ctx.wide_bvh;
+	const WideRay &first_ray = rays.first_ray;
+
+	struct StackEntry
+	{
+		uint32 node;
+		uint64 rays;
+	};
+
+	TraversalStack<StackEntry, WIDE_BVH_STACK_SIZE> stack;
+	stack.Push({ root, active_rays });
+
+	while (stack.size > 0)
+	{
+		StackEntry entry = stack.Pop();
+		const WideBVHNode &node = bvh.nodes._data[entry.node];
+
+		// The frustum only has to reach as far as the furthest closest hit
+		float packet_tmax = 0.0f;
+		for (uint64 active = entry.rays; active != 0; active &= active - 1)
+		{
+			packet_tmax = pixl::max(packet_tmax, hits.tmax[lowest_set_bit(active)]);
+		}
+
+		uint32 frustum_mask = intersect_children_frustum(node, first_ray, rays.inv_min, rays.inv_max, packet_tmax);
+
+		// Find out which of the rays hit the children that are left
+		uint64 child_rays[WIDE_BVH_WIDTH];
+		float child_tnear[WIDE_BVH_WIDTH];
+		uint32 hit_slots[WIDE_BVH_WIDTH];
+		uint32 hit_count = 0;
+
+		for (; frustum_mask != 0; frustum_mask &= frustum_mask - 1)
+		{
+			uint32 slot = lowest_set_bit(frustum_mask);
+
+			float near_offset[3], far_offset[3];
+			for (uint32 axis = 0; axis < 3; axis++)
+			{
+				near_offset[axis] = node.bounds[first_ray.near_row[axis]][slot] - rays.origin[(int32) axis];
+				far_offset[axis] = node.bounds[first_ray.far_row[axis]][slot] - rays.origin[(int32) axis];
+			}
+
+			child_rays[slot] = 0;
+			child_tnear[slot] = std::numeric_limits<float>::infinity();
+			for (uint32 group = 0; group < PACKET_GROUPS; group++)
+			{
+				uint32 lanes = group_mask(entry.rays, group);
+				if (lanes != 0)
+				{
+					lanes &= intersect_box_lanes(rays, hits, group * PACKET_LANES, near_offset, far_offset, child_tnear[slot]);
+					child_rays[slot] |= (uint64) lanes << (group * PACKET_LANES);
+				}
+			}
+
+			if (child_rays[slot] == 0)
+			{
+				continue;
+			}
+
+			// Visit the children by the distance of their closest ray
+			uint32 position = hit_count++;
+			while (position > 0 && child_tnear[hit_slots[position - 1]] > child_tnear[slot])
+			{
+				hit_slots[position] = hit_slots[position - 1];
+				position--;
+			}
+			hit_slots[position] = slot;
+		}
+
+		for (uint32 i = 0; i < hit_count; i++)
+		{
+			uint32 slot = hit_slots[i];
+			uint32 prim_count = node.prim_count[slot];
+			uint32 child = node.child[slot];
+
+			if (prim_count > 0)
+			{
+				for (uint32 j = 0; j < prim_count; j++)
+				{
+					IndexedTriangleGLSL &tri = ctx.scene->triangles._data[child + j];
+					const glm::vec3 &v0 = ctx.scene->vertices._data[tri.vertices[0]].position;
+					const glm::vec3 &v1 = ctx.scene->vertices._data[tri.vertices[1]].position;
+					const glm::vec3 &v2 = ctx.scene->vertices._data[tri.vertices[2]].position;
+					for (uint32 group = 0; group < PACKET_GROUPS; group++)
+					{
+						uint32 lanes = group_mask(child_rays[slot], group);
+						if (lanes != 0)
+						{
+							intersect_triangle_lanes(rays, hits, group * PACKET_LANES, lanes, v0, v1, v2, child + j, instance_index);
+						}
+					}
+				}
+			}
+			else if (count_set_bits(child_rays[slot]) < PACKET_MIN_ACTIVE_RAYS)
+			{
+				// The packet has diverged, so the few rays left continue on their own
+				for (uint64 active = child_rays[slot]; active != 0; active &= active - 1)
+				{
+					trace_single_ray(ctx, rays, hits, out_hits, lowest_set_bit(active), child, instance_index);
+				}
+			}
+		}
+
+		// Push the remaining inner children furthest first
+		for (uint32 i = hit_count; i-- > 0;)
+		{
+			uint32 slot = hit_slots[i];
+			if (node.prim_count[slot] == 0 && count_set_bits(child_rays[slot]) >= PACKET_MIN_ACTIVE_RAYS)
+			{
+				stack.Push({ node.child[slot], child_rays[slot] });
+			}
+		}
+	}
+}
+
+// Moves the rays that reached the instance into the space of its mesh and
+// traces them through it
+static void trace_instance(TraceContext &ctx, const RayPacket &packet, const PacketDirections &world_rays, PacketHits &hits,
+						   PrimaryHit *out_hits, uint64 active_rays, uint32 instance_index)
+{
+	InstanceGLSL &instance = ctx.scene->instances[instance_index];
+	uint32 root = ctx.wide_bvh->mesh_roots._data[instance.data.y];
+	if (instance.data.z != 0)
+	{
+		trace_mesh(ctx, world_rays, hits, out_hits, active_rays, root, instance_index);
+		return;
+	}
+
+	glm::vec3 object_directions[PACKET_RAY_COUNT];
+	for (uint64 active = active_rays; active != 0; active &= active - 1)
+	{
+		uint32 i = lowest_set_bit(active);
+		object_directions[i] = instance.DirectionToObject(packet.directions[i]);
+	}
+
+	PacketDirections object_rays;
+	setup_directions(object_rays, instance.PointToObject(packet.origin), object_directions, active_rays);
+	trace_mesh(ctx, object_rays, hits, out_hits, active_rays, root, instance_index);
+}
+
+void IntersectPacket(TraceContext &ctx, const RayPacket &packet, PrimaryHit *out_hits)
+{
+	Scene &scene = *ctx.scene;
+	uint32 ray_count = packet.ray_count;
+	ctx.ray_count += ray_count;
+	if (ray_count == 0)
+	{
+		return;
+	}
+
+	uint64 all_rays = first_rays(ray_count);
+
+	PacketDirections world_rays;
+	setup_directions(world_rays, packet.origin, packet.directions, all_rays);
+
+	PacketHits hits;
+	for (uint32 i = 0; i < PACKET_RAY_COUNT; i++)
+	{
+		hits.tmax[i] = TMAX;
+		hits.prim[i] = PACKET_NO_PRIM;
+		hits.instance[i] = 0;
+	}
+
+	for (uint32 i = 0; i < ray_count; i++)
+	{
+		out_hits[i].hit = false;
+	}
+
+	// Top level BVH, the rays are only split up by the boxes they hit. The
+	// frustum test doesn't pay off for the few nodes it has.
+	struct StackEntry
+	{
+		uint32 node;
+		uint64 rays;
+	};
+
+	TraversalStack<StackEntry, 64> stack;
+	if (scene.tlas_nodes.size > 0)
+	{
+		stack.Push({ 0, all_rays });
+	}
+
+	while (stack.size > 0)
+	{
+		StackEntry entry = stack.Pop();
+		BVHNodeGLSL &node = scene.tlas_nodes[entry.node];
+
+		if (node.IsLeaf())
+		{
+			auto first_instance = node.FirstChildOrTri();
+			auto num_instances = node.TriCount();
+			for (uint32 i = 0; i < num_instances; i++)
+			{
+				trace_instance(ctx, packet, world_rays, hits, out_hits, entry.rays, first_instance + i);
+			}
+			continue;
+		}
+
+		auto first_child = node.FirstChildOrTri();
+		uint64 child_rays[2] = {};
+		float child_tnear[2];
+		for (uint32 c = 0; c < 2; c++)
+		{
+			BVHNodeGLSL &child = scene.tlas_nodes[first_child + c];
+
+			float min_offset[3], max_offset[3];
+			for (uint32 axis = 0; axis < 3; axis++)
+			{
+				min_offset[axis] = child.data1[(int32) axis] - packet.origin[(int32) axis];
+				max_offset[axis] = child.data2[(int32) axis] - packet.origin[(int32) axis];
+			}
+
+			child_tnear[c] = std::numeric_limits<float>::infinity();
+			for (uint32 group = 0; group < PACKET_GROUPS; group++)
+			{
+				uint32 lanes = group_mask(entry.rays, group);
+				if (lanes != 0)
+				{
+					lanes &= intersect_aabb_lanes(world_rays, hits, group * PACKET_LANES, min_offset, max_offset, child_tnear[c]);
+					child_rays[c] |= (uint64) lanes << (group * PACKET_LANES);
+				}
+			}
+		}
+
+		// Closest child last, so that it is popped first
+		uint32 first = child_tnear[0] <= child_tnear[1] ? 0 : 1;
+		uint32 second = 1 - first;
+		if (child_rays[second] != 0)
+		{
+			stack.Push({ first_child + second, child_rays[second] });
+		}
+		if (child_rays[first] != 0)
+		{
+			stack.Push({ first_child + first, child_rays[first] });
+		}
+	}
+
+	for (uint32 i = 0; i < ray_count; i++)
+	{
+		if (hits.prim[i] != PACKET_NO_PRIM)
+		{
+			InstanceGLSL &instance = scene.instances[hits.instance[i]];
+			bool is_identity = instance.data.z != 0;
+			glm::vec3 object_rd = is_identity ? packet.directions[i] : instance.DirectionToObject(packet.directions[i]);
+
+			HitData &data = out_hits[i].data;
+			FillTriangleHit(ctx, object_rd, hits.prim[i], hits.tmax[i], hits.u[i], hits.v[i], data);
+			data.instance_index = hits.instance[i];
+			data.normal = is_identity ? data.normal : instance.NormalToWorld(data.normal);
+			out_hits[i].hit = true;
+		}
+
+		if (IntersectSpheres(ctx, packet.origin, packet.directions[i], out_hits[i].data, hits.tmax[i]))
+		{
+			out_hits[i].hit = true;
+		}
+	}
+}
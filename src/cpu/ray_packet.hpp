@@ -0,0 +1,29 @@
+#pragma once
+#include "../defines.hpp"
+#include "../pathtracer.hpp"
+
+#include <glm/vec3.hpp>
+
+// Camera rays are traced in blocks of 8x8 pixels
+constexpr uint32 PACKET_WIDTH = 8;
+constexpr uint32 PACKET_RAY_COUNT = PACKET_WIDTH * PACKET_WIDTH;
+
+// Once fewer rays than this still hit a subtree, the packet has diverged
+// and those rays traverse the rest of the subtree on their own.
+constexpr uint32 PACKET_MIN_ACTIVE_RAYS = 8;
+
+// Rays that start at the same point, like the rays of a pinhole camera
+struct RayPacket
+{
+	glm::vec3 origin;
+	glm::vec3 directions[PACKET_RAY_COUNT];
+	uint32 ray_count;
+};
+
+// Closest hit of every ray in the packet against the instances and the
+// spheres of `ctx`. The rays that reach an instance share one traversal of
+// the wide BVH of its mesh, in which children that no ray of the packet can
+// hit are culled with an interval arithmetic frustum test. Rays that don't
+// agree on the direction signs in the space of the mesh are traced as
+// single rays.
+void IntersectPacket(TraceContext &ctx, const RayPacket &packet, PrimaryHit *out_hits);
@@ -0,0 +1,236 @@
+#include "renderer.hpp"
+#include "../math/math.hpp"
+#include "ray_packet.hpp"
+#include "tile_scheduler.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+RenderStats RenderImageCPU(Scene &scene, EnvironmentMap &environment, const WideBVH *wide_bvh, const CompressedBVH *compressed_bvh,
+						   TextureCache *texture_cache, const RenderSettings &settings, Array<glm::vec3> &out_image)
+{
+	uint32 thread_count = settings.thread_count;
+	if (thread_count == 0)
+	{
+		thread_count = pixl::max(1u, std::thread::hardware_concurrency());
+	}
+
+	uint32 num_pixels = settings.width * settings.height;
+	out_image.resize(num_pixels);
+
+	// One seed per sample, just like the per-frame seed of the compute shader
+	pcg32_random_t rng;
+	pcg32_srandom_r(&rng, settings.seed, 54u);
+	Array<uint32> sample_seeds(settings.samples_per_pixel);
+	for (uint32 i = 0; i < settings.samples_per_pixel; i++)
+	{
+		sample_seeds.append(pcg32_random_r(&rng));
+	}
+
+	CameraGrid cam(settings.cam_origin, settings.cam_forward, settings.cam_right, settings.width, settings.height);
+
+	Array<Tile> tiles;
+	BuildTilesMorton(settings.width, settings.height, tiles);
+
+	TileScheduler scheduler(thread_count, tiles.size);
+	PassBarrier barrier(thread_count);
+
+	// Every pass adds one sample to each pixel of the accumulation buffer,
+	// so the image is complete (just noisier) after any pass.
+	Array<glm::vec3> accumulation;
+	accumulation.resize(num_pixels);
+	memset(accumulation._data, 0, num_pixels * sizeof(glm::vec3));
+
+	std::atomic<uint64> total_rays { 0 };
+
+	std::mutex texture_stats_mutex;
+	TextureLookupStats texture_stats;
+	uint64 start_bytes_paged_in = texture_cache != nullptr ? texture_cache->BytesPagedIn() : 0;
+
+	// Packets need the wide BVH, the others are only traversed by single rays
+	bool use_packets = settings.use_packets && wide_bvh != nullptr && compressed_bvh == nullptr;
+
+	auto worker = [&](uint32 thread_index)
+	{
+		TraceContext ctx { &scene, &environment, settings.bounce_count, wide_bvh, compressed_bvh, 0 };
+		ctx.texture_cache = texture_cache;
+		ctx.camera = &cam;
+
+		// The camera rays of every 8x8 block of the tile are traced as one packet,
+		// the rest of the paths continue as single rays.
+		auto render_tile_packets = [&](const Tile &tile, uint32 sample_seed)
+		{
+			RayPacket packet;
+			packet.origin = cam.origin;
+			uint32 rng_states[PACKET_RAY_COUNT];
+			PrimaryHit hits[PACKET_RAY_COUNT];
+
+			for (uint32 y0 = tile.y0; y0 < tile.y1; y0 += PACKET_WIDTH)
+			{
+				for (uint32 x0 = tile.x0; x0 < tile.x1; x0 += PACKET_WIDTH)
+				{
+					uint32 y1 = pixl::min(y0 + PACKET_WIDTH, tile.y1);
+					uint32 x1 = pixl::min(x0 + PACKET_WIDTH, tile.x1);
+
+					packet.ray_count = 0;
+					for (uint32 y = y0; y < y1; y++)
+					{
+						for (uint32 x = x0; x < x1; x++)
+						{
+							uint32 &rng_state = rng_states[packet.ray_count];
+							rng_state = seed3(x, y, sample_seed);
+							packet.directions[packet.ray_count++] = CameraRayDirection(cam, x, y, settings.width, settings.height, rng_state);
+						}
+					}
+
+					IntersectPacket(ctx, packet, hits);
+
+					uint32 ray_index = 0;
+					for (uint32 y = y0; y < y1; y++)
+					{
+						for (uint32 x = x0; x < x1; x++, ray_index++)
+						{
+							accumulation[y * settings.width + x] += ShadePath(ctx, settings.view_mode, packet.origin, packet.directions[ray_index],
+																			  rng_states[ray_index], &hits[ray_index]);
+						}
+					}
+				}
+			}
+		};
+
+		for (uint32 pass = 0; pass < settings.samples_per_pixel; pass++)
+		{
+			uint32 sample_seed = sample_seeds[pass];
+
+			uint32 tile_index;
+			while (scheduler.Next(thread_index, tile_index))
+			{
+				Tile &tile = tiles[tile_index];
+				if (use_packets)
+				{
+					render_tile_packets(tile, sample_seed);
+					continue;
+				}
+
+				for (uint32 y = tile.y0; y < tile.y1; y++)
+				{
+					for (uint32 x = tile.x0; x < tile.x1; x++)
+					{
+						uint32 rng_state = seed3(x, y, sample_seed);
+						accumulation[y * settings.width + x] += RenderPixel(ctx, cam, settings.view_mode, x, y, settings.width, settings.height, rng_state);
+					}
+				}
+			}
+
+			// The last thread to finish the pass refills the deques for the next one
+			barrier.Wait([&]() { scheduler.Reset(); });
+		}
+
+		total_rays += ctx.ray_count;
+
+		std::lock_guard<std::mutex> lock(texture_stats_mutex);
+		texture_stats.Add(ctx.texture_stats);
+	};
+
+	auto start_time = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> threads;
+	threads.reserve(thread_count);
+	for (uint32 i = 0; i < thread_count; i++)
+	{
+		threads.emplace_back(worker, i);
+	}
+
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+
+	RenderStats stats {};
+	stats.thread_count = thread_count;
+	stats.seconds = elapsed.count();
+	stats.samples = (uint64) num_pixels * settings.samples_per_pixel;
+	stats.rays = total_rays;
+	stats.tiles_stolen = scheduler.steal_count;
+	stats.texture_lookups = texture_stats;
+	stats.texture_bytes_paged_in = texture_cache != nullptr ? texture_cache->BytesPagedIn() - start_bytes_paged_in : 0;
+
+	for (uint32 i = 0; i < num_pixels; i++)
+	{
+		out_image[i] = accumulation[i] / (float) settings.samples_per_pixel;
+	}
+
+	return stats;
+}
+
+void PrintRenderStats(const RenderStats &stats)
+{
+	double samples_per_second = (double) stats.samples / stats.seconds;
+	double rays_per_second = (double) stats.rays / stats.seconds;
+
+	printf("Rendered on %u threads in %.3fs\n", stats.thread_count, stats.seconds);
+	printf("--> Samples: %llu (%.3f Msamples/s)\n", stats.samples, samples_per_second / 1e6);
+	printf("--> Rays: %llu (%.3f Mrays/s)\n", stats.rays, rays_per_second / 1e6);
+	printf("--> Tiles stolen: %llu\n", stats.tiles_stolen);
+
+	const TextureLookupStats &lookups = stats.texture_lookups;
+	if (lookups.samples > 0)
+	{
+		double hit_rate = 100.0 * (double) lookups.tile_hits / (double) lookups.tile_lookups;
+		double sample_nanoseconds = lookups.timed_samples > 0 ? (double) lookups.timed_nanoseconds / (double) lookups.timed_samples : 0.0;
+		printf("--> Texture samples: %llu, %.2f%% of %llu tile lookups hit, %.1f MB paged in, %.0f ns per sample\n",
+			   lookups.samples, hit_rate, lookups.tile_lookups, (double) stats.texture_bytes_paged_in / (1024.0 * 1024.0), sample_nanoseconds);
+	}
+}
+
+bool WriteImage(const char *path, Array<glm::vec3> &image, uint32 width, uint32 height)
+{
+	FILE *file = fopen(path, "wb");
+	if (file == nullptr)
+	{
+		printf("ERROR (CPU Renderer): Failed to open %s for writing!\n", path);
+		return false;
+	}
+
+	size_t path_length = strlen(path);
+	bool is_pfm = path_length > 4 && strcmp(path + path_length - 4, ".pfm") == 0;
+
+	if (is_pfm)
+	{
+		// PFM scanlines go from the bottom to the top of the image,
+		// which matches the layout of the render buffer.
+		fprintf(file, "PF\n%u %u\n-1.0\n", width, height);
+		fwrite(image._data, sizeof(glm::vec3), (size_t) width * height, file);
+	}
+	else
+	{
+		fprintf(file, "P6\n%u %u\n255\n", width, height);
+
+		Array<uint8> row;
+		row.resize(width * 3);
+		for (uint32 y = height; y-- > 0;)
+		{
+			for (uint32 x = 0; x < width; x++)
+			{
+				glm::vec3 color = image[y * width + x];
+				for (uint32 c = 0; c < 3; c++)
+				{
+					// Same gamma as the framebuffer fragment shader
+					float value = powf(pixl::max(0.0f, color[(int32) c]), 1.0f / 2.2f);
+					row[x * 3 + c] = (uint8) (pixl::min(1.0f, value) * 255.0f + 0.5f);
+				}
+			}
+			fwrite(row._data, 1, row.size, file);
+		}
+	}
+
+	fclose(file);
+	return true;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "../core/array.hpp"
+#include "../defines.hpp"
+#include "../pathtracer.hpp"
+#include "../scene/camera.hpp"
+#include "../scene/scene.hpp"
+#include <glm/vec3.hpp>
+
+struct RenderSettings
+{
+	uint32 width = WIDTH;
+	uint32 height = HEIGHT;
+	uint32 samples_per_pixel = 16;
+	uint32 bounce_count = BOUNCE_COUNT;
+	uint32 thread_count = 0; // 0 uses every hardware thread
+	uint32 seed = 0;
+	ViewMode view_mode = ViewMode::MULTIPLE_IMPORTANCE_SAMPLING_BRDF_NEE;
+	bool use_packets = true; // trace camera rays as 8x8 packets (wide BVH only)
+
+	glm::vec3 cam_origin = glm::vec3(0.0f);
+	glm::vec3 cam_forward = glm::vec3(0.0f, 0.0f, -1.0f);
+	glm::vec3 cam_right = glm::vec3(1.0f, 0.0f, 0.0f);
+};
+
+struct RenderStats
+{
+	uint32 thread_count;
+	double seconds;
+	uint64 samples; // camera samples, i.e. pixels * spp
+	uint64 rays;    // every ray traced through the scene, shadow rays included
+	uint64 tiles_stolen;
+
+	// Only counted when the scene is rendered with a texture cache
+	TextureLookupStats texture_lookups;
+	uint64 texture_bytes_paged_in;
+};
+
+// Renders the scene with the CPU estimators on `settings.thread_count` threads,
+// in progressive passes of one sample per pixel over work-stolen tiles.
+// `out_image` receives the averaged linear radiance, bottom row first (same
+// orientation as the render buffer texture of the compute shader).
+// Rays traverse `compressed_bvh` or `wide_bvh` when given (in that order),
+// and the binary BVH of the scene otherwise. Base color textures are only
+// sampled with a `texture_cache`.
+RenderStats RenderImageCPU(Scene &scene, EnvironmentMap &environment, const WideBVH *wide_bvh, const CompressedBVH *compressed_bvh,
+						   TextureCache *texture_cache, const RenderSettings &settings, Array<glm::vec3> &out_image);
+
+void PrintRenderStats(const RenderStats &stats);
+
+// Writes a .pfm (linear float) or otherwise a binary .ppm (gamma corrected 8-bit)
+bool WriteImage(const char *path, Array<glm::vec3> &image, uint32 width, uint32 height);
@@ -0,0 +1,319 @@
+#include "texture_cache.hpp"
+#include "../math/math.hpp"
+
+#include <glm/common.hpp>
+
+#include <chrono>
+#include <cmath>
+
+constexpr uint32 EMPTY_SLOT = ~0u;
+constexpr uint32 EMPTY_TILE = ~0u;
+
+// What a tile that can't be read samples as, so it leaves the material as it is
+constexpr uint32 WHITE_TEXEL = 0xFFFFFFFFu;
+
+// Fewer slots than this would already thrash on the up to 8 tiles that one
+// trilinear sample reads
+constexpr uint32 MIN_SLOT_COUNT = 16;
+
+void TextureLookupStats::Add(const TextureLookupStats &other)
+{
+	tile_lookups += other.tile_lookups;
+	tile_hits += other.tile_hits;
+	samples += other.samples;
+	timed_samples += other.timed_samples;
+	timed_nanoseconds += other.timed_nanoseconds;
+}
+
+TextureCache::~TextureCache()
+{
+	Close();
+}
+
+bool TextureCache::Open(const char *tiles_path, uint64 key, uint64 capacity_bytes)
+{
+	Close();
+
+	file = fopen(tiles_path, "rb");
+	if (file == nullptr)
+	{
+		return false;
+	}
+
+	if (!ReadTextureTilesIndex(file, key, textures, levels, tile_count))
+	{
+		printf("Texture tiles %s are out of date, rebuilding them.\n", tiles_path);
+		Close();
+		return false;
+	}
+
+	// No more slots than there are tiles to put in them
+	uint64 capacity_tiles = capacity_bytes / TEXTURE_TILE_BYTES;
+	capacity_tiles = capacity_tiles < tile_count ? capacity_tiles : tile_count;
+	slot_count = pixl::max((uint32) capacity_tiles, MIN_SLOT_COUNT);
+
+	tile_slots = std::make_unique<std::atomic<uint32>[]>(tile_count);
+	for (uint32 i = 0; i < tile_count; i++)
+	{
+		tile_slots[i].store(EMPTY_SLOT, std::memory_order_relaxed);
+	}
+
+	slots = std::make_unique<Slot[]>(slot_count);
+	for (uint32 i = 0; i < slot_count; i++)
+	{
+		slots[i].sequence.store(0, std::memory_order_relaxed);
+		slots[i].tile.store(EMPTY_TILE, std::memory_order_relaxed);
+		slots[i].referenced.store(0, std::memory_order_relaxed);
+	}
+
+	// Left uninitialized, a slot is only read once it holds a tile
+	texels = std::make_unique<std::atomic<uint32>[]>((size_t) slot_count * TEXTURE_TILE_TEXELS);
+
+	staging.resize(TEXTURE_TILE_TEXELS);
+	clock_hand = 0;
+	tiles_paged_in = 0;
+	read_failed = false;
+
+	printf("Opened texture tiles %s: %u textures in %u tiles, caching up to %u tiles (%.1f MB).\n",
+		   tiles_path, textures.size, tile_count, slot_count, (double) CapacityBytes() / (1024.0 * 1024.0));
+	return true;
+}
+
+void TextureCache::Close()
+{
+	if (file != nullptr)
+	{
+		fclose(file);
+		file = nullptr;
+	}
+
+	textures = Array<TiledTexture>();
+	levels = Array<TiledTextureLevel>();
+	tile_count = 0;
+	slot_count = 0;
+	tile_slots.reset();
+	slots.reset();
+	texels.reset();
+}
+
+// Reads a tile that wasn't resident into the slot the clock hand picks, and
+// returns the texels at `offsets` from it. Another thread may have read the
+// same tile while this one waited for the mutex.
+static void page_in_texels(TextureCache &cache, uint32 tile, const uint32 *offsets, uint32 count, uint32 *out_texels)
+{
+	std::lock_guard<std::mutex> lock(cache.miss_mutex);
+
+	uint32 resident_slot = cache.tile_slots[tile].load(std::memory_order_relaxed);
+	if (resident_slot != EMPTY_SLOT)
+	{
+		for (uint32 i = 0; i < count; i++)
+		{
+			out_texels[i] = cache.texels[(size_t) resident_slot * TEXTURE_TILE_TEXELS + offsets[i]].load(std::memory_order_relaxed);
+		}
+		return;
+	}
+
+	// The tile is read before a slot is given up, so that readers of the
+	// evicted tile only have to retry while its texels are replaced
+	if (!ReadTextureTile(cache.file, tile, cache.staging._data))
+	{
+		if (!cache.read_failed)
+		{
+			printf("WARNING: Failed to read texture tile %u, sampling it as white.\n", tile);
+			cache.read_failed = true;
+		}
+		for (uint32 i = 0; i < count; i++)
+		{
+			out_texels[i] = WHITE_TEXEL;
+		}
+		return;
+	}
+
+	// Slots that were looked up since the hand last passed get another round
+	uint32 slot_index;
+	for (;;)
+	{
+		slot_index = cache.clock_hand;
+		cache.clock_hand = (cache.clock_hand + 1) % cache.slot_count;
+		if (cache.slots[slot_index].referenced.exchange(0, std::memory_order_relaxed) == 0)
+		{
+			break;
+		}
+	}
+
+	TextureCache::Slot &slot = cache.slots[slot_index];
+	uint32 evicted_tile = slot.tile.load(std::memory_order_relaxed);
+	if (evicted_tile != EMPTY_TILE)
+	{
+		cache.tile_slots[evicted_tile].store(EMPTY_SLOT, std::memory_order_relaxed);
+	}
+
+	uint32 sequence = slot.sequence.load(std::memory_order_relaxed);
+	slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	std::atomic<uint32> *slot_texels = &cache.texels[(size_t) slot_index * TEXTURE_TILE_TEXELS];
+	for (uint32 i = 0; i < TEXTURE_TILE_TEXELS; i++)
+	{
+		slot_texels[i].store(cache.staging._data[i], std::memory_order_relaxed);
+	}
+
+	slot.tile.store(tile, std::memory_order_relaxed);
+	slot.referenced.store(1, std::memory_order_relaxed);
+	slot.sequence.store(sequence + 2, std::memory_order_release);
+	cache.tile_slots[tile].store(slot_index, std::memory_order_release);
+
+	cache.tiles_paged_in++;
+	for (uint32 i = 0; i < count; i++)
+	{
+		out_texels[i] = cache.staging._data[offsets[i]];
+	}
+}
+
+// The texels are read between two loads of the slot's sequence number, and
+// only count if neither saw a refill in progress or the number change
+static void lookup_texels(TextureCache &cache, uint32 tile, const uint32 *offsets, uint32 count, uint32 *out_texels, TextureLookupStats &stats)
+{
+	stats.tile_lookups++;
+
+	uint32 slot_index = cache.tile_slots[tile].load(std::memory_order_acquire);
+	if (slot_index != EMPTY_SLOT)
+	{
+		TextureCache::Slot &slot = cache.slots[slot_index];
+		uint32 sequence = slot.sequence.load(std::memory_order_acquire);
+		if ((sequence & 1) == 0 && slot.tile.load(std::memory_order_relaxed) == tile)
+		{
+			const std::atomic<uint32> *slot_texels = &cache.texels[(size_t) slot_index * TEXTURE_TILE_TEXELS];
+			for (uint32 i = 0; i < count; i++)
+			{
+				out_texels[i] = slot_texels[offsets[i]].load(std::memory_order_relaxed);
+			}
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.sequence.load(std::memory_order_relaxed) == sequence)
+			{
+				// Only written when it changes, so that hits on the same tile
+				// from many threads don't fight over its cache line
+				if (slot.referenced.load(std::memory_order_relaxed) == 0)
+				{
+					slot.referenced.store(1, std::memory_order_relaxed);
+				}
+				stats.tile_hits++;
+				return;
+			}
+		}
+	}
+
+	page_in_texels(cache, tile, offsets, count, out_texels);
+}
+
+static glm::vec3 unpack_texel(uint32 texel)
+{
+	return glm::vec3((float) (texel & 0xFF), (float) ((texel >> 8) & 0xFF), (float) ((texel >> 16) & 0xFF)) * (1.0f / 255.0f);
+}
+
+static uint32 wrap_coordinate(int32 coordinate, uint32 size, bool repeat)
+{
+	if (repeat)
+	{
+		auto wrapped = coordinate % (int32) size;
+		return (uint32) (wrapped < 0 ? wrapped + (int32) size : wrapped);
+	}
+	return (uint32) glm::clamp(coordinate, 0, (int32) size - 1);
+}
+
+// `uvs` are already wrapped into [0, 1], texel centers are at half texels
+static glm::vec3 sample_bilinear(TextureCache &cache, const TiledTexture &texture, const TiledTextureLevel &level, glm::vec2 uvs, TextureLookupStats &stats)
+{
+	float x = uvs.x * (float) level.width - 0.5f;
+	float y = uvs.y * (float) level.height - 0.5f;
+	float floor_x = std::floor(x);
+	float floor_y = std::floor(y);
+	float fraction_x = x - floor_x;
+	float fraction_y = y - floor_y;
+
+	uint32 xs[2] = { wrap_coordinate((int32) floor_x, level.width, texture.repeat_s != 0),
+					 wrap_coordinate((int32) floor_x + 1, level.width, texture.repeat_s != 0) };
+	uint32 ys[2] = { wrap_coordinate((int32) floor_y, level.height, texture.repeat_t != 0),
+					 wrap_coordinate((int32) floor_y + 1, level.height, texture.repeat_t != 0) };
+
+	uint32 tiles[4];
+	uint32 offsets[4];
+	for (uint32 i = 0; i < 4; i++)
+	{
+		uint32 texel_x = xs[i & 1];
+		uint32 texel_y = ys[i >> 1];
+		tiles[i] = level.first_tile + (texel_y / TEXTURE_TILE_SIZE) * level.tiles_x + texel_x / TEXTURE_TILE_SIZE;
+		offsets[i] = (texel_y % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + texel_x % TEXTURE_TILE_SIZE;
+	}
+
+	// Usually all 4 texels are in one tile, which is then looked up once
+	uint32 texels[4];
+	for (uint32 i = 0; i < 4;)
+	{
+		uint32 count = 1;
+		while (i + count < 4 && tiles[i + count] == tiles[i])
+		{
+			count++;
+		}
+		lookup_texels(cache, tiles[i], &offsets[i], count, &texels[i], stats);
+		i += count;
+	}
+
+	glm::vec3 top = glm::mix(unpack_texel(texels[0]), unpack_texel(texels[1]), fraction_x);
+	glm::vec3 bottom = glm::mix(unpack_texel(texels[2]), unpack_texel(texels[3]), fraction_x);
+	return glm::mix(top, bottom, fraction_y);
+}
+
+glm::vec3 TextureCache::Sample(uint32 texture_index, glm::vec2 uvs, float footprint, TextureLookupStats &stats)
+{
+	if (texture_index >= textures.size || !std::isfinite(uvs.x) || !std::isfinite(uvs.y))
+	{
+		return glm::vec3(1.0f);
+	}
+
+	bool timed = stats.samples++ % TEXTURE_TIMED_SAMPLE_INTERVAL == 0;
+	auto start_time = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+	const TiledTexture &texture = textures._data[texture_index];
+	const TiledTextureLevel &first_level = levels._data[texture.first_level];
+
+	// Same wrapping as sample_base_color in the shader
+	uvs.x = texture.repeat_s != 0 ? uvs.x - std::floor(uvs.x) : glm::clamp(uvs.x, 0.0f, 1.0f);
+	uvs.y = texture.repeat_t != 0 ? uvs.y - std::floor(uvs.y) : glm::clamp(uvs.y, 0.0f, 1.0f);
+
+	// The level where the footprint covers about one texel
+	float texels_covered = footprint * (float) pixl::max(first_level.width, first_level.height);
+	float lod = texels_covered > 1.0f ? std::log2(texels_covered) : 0.0f;
+	lod = pixl::min(lod, (float) (texture.level_count - 1));
+
+	auto level_index = (uint32) lod;
+	float level_blend = lod - (float) level_index;
+
+	glm::vec3 color = sample_bilinear(*this, texture, levels._data[texture.first_level + level_index], uvs, stats);
+	if (level_blend > 0.0f && level_index + 1 < texture.level_count)
+	{
+		glm::vec3 next_color = sample_bilinear(*this, texture, levels._data[texture.first_level + level_index + 1], uvs, stats);
+		color = glm::mix(color, next_color, level_blend);
+	}
+
+	if (timed)
+	{
+		std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start_time;
+		stats.timed_samples++;
+		stats.timed_nanoseconds += (uint64) elapsed.count();
+	}
+
+	return color;
+}
+
+uint64 TextureCache::BytesPagedIn()
+{
+	std::lock_guard<std::mutex> lock(miss_mutex);
+	return tiles_paged_in * TEXTURE_TILE_BYTES;
+}
+
+uint64 TextureCache::CapacityBytes() const
+{
+	return (uint64) slot_count * TEXTURE_TILE_BYTES;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include "../core/array.hpp"
+#include "../defines.hpp"
+#include "../scene/texture_tiles.hpp"
+
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+
+// Default for the tiles kept in memory, 4096 tiles of 64x64 texels
+constexpr uint64 TEXTURE_CACHE_BYTES = 64ull * 1024 * 1024;
+
+// Only every this many samples are timed, reading the clock costs about as
+// much as a lookup that hits
+constexpr uint32 TEXTURE_TIMED_SAMPLE_INTERVAL = 64;
+
+// Counted by every render thread on its own and summed up at the end
+struct TextureLookupStats
+{
+	uint64 tile_lookups = 0; // one per tile that a bilinear lookup reads from
+	uint64 tile_hits = 0;    // lookups whose tile was resident
+	uint64 samples = 0;
+	uint64 timed_samples = 0;
+	uint64 timed_nanoseconds = 0;
+
+	void Add(const TextureLookupStats &other);
+};
+
+// Keeps a fixed number of tiles of a tile file in memory and reads the
+// others from disk when a lookup misses. Lookups of resident tiles take no
+// lock: a slot's sequence number is odd while the slot is refilled, and a
+// reader that sees it change retries the lookup. Misses are read under a
+// mutex, which also picks the slot to evict with the CLOCK approximation of
+// LRU, since true LRU would need every hit to write to a shared list.
+struct TextureCache
+{
+	struct Slot
+	{
+		std::atomic<uint32> sequence;
+		std::atomic<uint32> tile;       // ~0u while empty
+		std::atomic<uint32> referenced; // since the clock hand last passed it
+	};
+
+	FILE *file = nullptr;
+	Array<TiledTexture> textures;
+	Array<TiledTextureLevel> levels;
+	uint32 tile_count = 0;
+	uint32 slot_count = 0;
+
+	std::unique_ptr<std::atomic<uint32>[]> tile_slots; // slot of every tile of the file, ~0u if not resident
+	std::unique_ptr<Slot[]> slots;
+	std::unique_ptr<std::atomic<uint32>[]> texels; // TEXTURE_TILE_TEXELS RGBA8 texels per slot
+
+	// Everything below is only touched under the mutex
+	std::mutex miss_mutex;
+	Array<uint32> staging; // the tile being read
+	uint32 clock_hand = 0;
+	uint64 tiles_paged_in = 0;
+	bool read_failed = false;
+
+	TextureCache() = default;
+	TextureCache(const TextureCache &) = delete;
+	TextureCache &operator=(const TextureCache &) = delete;
+	~TextureCache();
+
+	// Opens a tile file that was written for `key`, with room for
+	// `capacity_bytes` of tiles. Returns false if the file is missing or
+	// out of date.
+	bool Open(const char *tiles_path, uint64 key, uint64 capacity_bytes);
+	void Close();
+
+	// Trilinear filtered color of a texture. `footprint` is the width of the
+	// ray where it hit, in UVs, and picks the two mip levels that are blended.
+	// Unknown textures are white, so they leave the material as it is.
+	glm::vec3 Sample(uint32 texture_index, glm::vec2 uvs, float footprint, TextureLookupStats &stats);
+
+	uint64 BytesPagedIn();
+	uint64 CapacityBytes() const;
+};
@@ -0,0 +1,129 @@
+#include "tile_scheduler.hpp"
+#include "../math/math.hpp"
+
+#include <algorithm>
+
+static uint64 PackRange(uint32 begin, uint32 end)
+{
+	return ((uint64) end << 32) | begin;
+}
+
+// Interleaves the lower 16 bits of x and y: ...y1x1y0x0
+static uint32 MortonCode(uint32 x, uint32 y)
+{
+	auto spread = [](uint32 v)
+	{
+		v &= 0x0000FFFF;
+		v = (v | (v << 8)) & 0x00FF00FF;
+		v = (v | (v << 4)) & 0x0F0F0F0F;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	};
+
+	return spread(x) | (spread(y) << 1);
+}
+
+void BuildTilesMorton(uint32 width, uint32 height, Array<Tile> &out_tiles)
+{
+	uint32 tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+	uint32 tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+	out_tiles.resize(tiles_x * tiles_y);
+
+	// The tile grid is usually not a power of two, so instead of walking
+	// the curve the tiles are sorted by their code.
+	Array<uint64> keys;
+	keys.resize(tiles_x * tiles_y);
+	for (uint32 ty = 0; ty < tiles_y; ty++)
+	{
+		for (uint32 tx = 0; tx < tiles_x; tx++)
+		{
+			uint32 index = ty * tiles_x + tx;
+			keys[index] = ((uint64) MortonCode(tx, ty) << 32) | index;
+		}
+	}
+	std::sort(keys._data, keys._data + keys.size);
+
+	for (uint32 i = 0; i < keys.size; i++)
+	{
+		uint32 index = (uint32) keys[i];
+		uint32 tx = index % tiles_x;
+		uint32 ty = index / tiles_x;
+
+		Tile &tile = out_tiles[i];
+		tile.x0 = tx * TILE_SIZE;
+		tile.y0 = ty * TILE_SIZE;
+		tile.x1 = pixl::min(tile.x0 + TILE_SIZE, width);
+		tile.y1 = pixl::min(tile.y0 + TILE_SIZE, height);
+	}
+}
+
+TileScheduler::TileScheduler(uint32 thread_count, uint32 tile_count)
+	: deques(new TileDeque[thread_count]), thread_count(thread_count), tile_count(tile_count), steal_count(0)
+{
+	Reset();
+}
+
+void TileScheduler::Reset()
+{
+	for (uint32 i = 0; i < thread_count; i++)
+	{
+		uint32 begin = (uint32) ((uint64) tile_count * i / thread_count);
+		uint32 end = (uint32) ((uint64) tile_count * (i + 1) / thread_count);
+		deques[i].range.store(PackRange(begin, end), std::memory_order_relaxed);
+	}
+}
+
+bool TileScheduler::Next(uint32 thread_index, uint32 &out_tile)
+{
+	// Pop from the back of our own deque
+	std::atomic<uint64> &own = deques[thread_index].range;
+	uint64 range = own.load(std::memory_order_relaxed);
+	while (true)
+	{
+		uint32 begin = (uint32) range;
+		uint32 end = (uint32) (range >> 32);
+		if (begin >= end)
+		{
+			break;
+		}
+
+		if (own.compare_exchange_weak(range, PackRange(begin, end - 1), std::memory_order_relaxed))
+		{
+			out_tile = end - 1;
+			return true;
+		}
+	}
+
+	// Steal from the front of the others, which is the part of their
+	// range that is furthest away from what their owners work on.
+	for (uint32 offset = 1; offset < thread_count; offset++)
+	{
+		std::atomic<uint64> &victim = deques[(thread_index + offset) % thread_count].range;
+		range = victim.load(std::memory_order_relaxed);
+		while (true)
+		{
+			uint32 begin = (uint32) range;
+			uint32 end = (uint32) (range >> 32);
+			if (begin >= end)
+			{
+				break;
+			}
+
+			if (victim.compare_exchange_weak(range, PackRange(begin + 1, end), std::memory_order_relaxed))
+			{
+				steal_count.fetch_add(1, std::memory_order_relaxed);
+				out_tile = begin;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+PassBarrier::PassBarrier(uint32 thread_count)
+	: thread_count(thread_count), waiting(0), generation(0)
+{
+}
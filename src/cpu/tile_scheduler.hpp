@@ -0,0 +1,82 @@
+#pragma once
+#include "../core/array.hpp"
+#include "../defines.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+// 16x16 pixels keep a tile's accumulation (3 KiB of vec3) and the rows of
+// the image it touches resident in L1/L2 while the tile is being sampled.
+constexpr uint32 TILE_SIZE = 16;
+
+struct Tile
+{
+	uint32 x0, y0; // inclusive
+	uint32 x1, y1; // exclusive
+};
+
+// Splits the film into TILE_SIZE tiles, sorted along a Morton (Z-order)
+// curve so that tiles which are close in the array are close on screen.
+void BuildTilesMorton(uint32 width, uint32 height, Array<Tile> &out_tiles);
+
+// Hands out tile indices to a fixed set of worker threads. Every worker owns
+// a deque that covers a contiguous range of the Morton ordered tiles. The
+// owner pops from the back of its own deque, and once it runs dry steals
+// from the front of the other deques, so a thread that got stuck behind
+// expensive tiles (e.g. the ones that see the light) is helped out instead
+// of leaving the other cores idle.
+struct TileScheduler
+{
+	// Tiles are only ever removed during a pass, so each deque is just a
+	// [begin, end) range packed into one atomic and updated with a CAS.
+	struct alignas(64) TileDeque
+	{
+		std::atomic<uint64> range;
+	};
+
+	std::unique_ptr<TileDeque[]> deques;
+	uint32 thread_count;
+	uint32 tile_count;
+	std::atomic<uint64> steal_count;
+
+	TileScheduler(uint32 thread_count, uint32 tile_count);
+
+	// Refills every deque with its share of all the tiles
+	void Reset();
+
+	// Returns false once every deque is empty
+	bool Next(uint32 thread_index, uint32 &out_tile);
+};
+
+// Reusable barrier that runs `on_completion` on the last thread to arrive,
+// before any thread is released (std::barrier is C++20).
+struct PassBarrier
+{
+	std::mutex mutex;
+	std::condition_variable condition;
+	uint32 thread_count;
+	uint32 waiting;
+	uint64 generation;
+
+	explicit PassBarrier(uint32 thread_count);
+
+	template<typename F>
+	void Wait(F on_completion)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		uint64 current_generation = generation;
+
+		if (++waiting == thread_count)
+		{
+			on_completion();
+			waiting = 0;
+			generation++;
+			condition.notify_all();
+			return;
+		}
+
+		condition.wait(lock, [&]() { return generation != current_generation; });
+	}
+};
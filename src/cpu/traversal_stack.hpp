@@ -0,0 +1,50 @@
+#pragma once
+#include "../defines.hpp"
+
+#include <cstring>
+#include <memory>
+
+// Stack of the CPU BVH traversals. The first N entries are kept in the
+// stack itself, on the call stack of the traversal. No builder bounds the
+// depth of its trees (LBVH, PLOC and the reinsertion optimizer can go past
+// any fixed depth), so the entries beyond N go to the heap instead, which
+// trees of a usual depth never get to.
+template<typename T, uint32 N>
+struct TraversalStack
+{
+	T entries[N];
+	std::unique_ptr<T[]> spill;
+	uint32 spill_capacity = 0;
+	uint32 size = 0;
+
+	void Push(const T &entry)
+	{
+		if (size < N)
+		{
+			entries[size++] = entry;
+			return;
+		}
+
+		uint32 spill_index = size - N;
+		if (spill_index == spill_capacity)
+		{
+			uint32 capacity = spill_capacity == 0 ? N : 2 * spill_capacity;
+			std::unique_ptr<T[]> grown = std::make_unique<T[]>(capacity);
+			if (spill_capacity > 0)
+			{
+				memcpy(grown.get(), spill.get(), spill_capacity * sizeof(T));
+			}
+			spill = std::move(grown);
+			spill_capacity = capacity;
+		}
+
+		spill[spill_index] = entry;
+		size++;
+	}
+
+	T Pop()
+	{
+		size--;
+		return size < N ? entries[size] : spill[size - N];
+	}
+};
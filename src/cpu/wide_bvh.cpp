@@ -0,0 +1,260 @@
+#include "wide_bvh.hpp"
+#include "../pathtracer.hpp"
+
+#include <limits>
+
+#if defined(__AVX2__) || defined(__SSE4_1__) || defined(_M_X64) || defined(__x86_64__)
+#include <immintrin.h>
+#define WIDE_BVH_SIMD 1
+#else
+#define WIDE_BVH_SIMD 0
+#endif
+
+static void collapse_node(Array<BVHNodeGLSL> &bvh_nodes, uint32 binary_index, uint32 wide_index, WideBVH &out_bvh)
+{
+	uint32 children[WIDE_BVH_WIDTH];
+	uint32 child_count = CollectWideChildren(bvh_nodes, binary_index, WIDE_BVH_WIDTH, children);
+
+	// Reserve the wide nodes of the inner children first, so that their
+	// indices are known while filling in this node.
+	uint32 wide_children[WIDE_BVH_WIDTH];
+	for (uint32 i = 0; i < child_count; i++)
+	{
+		if (bvh_nodes[children[i]].IsLeaf())
+		{
+			wide_children[i] = WIDE_BVH_EMPTY;
+		}
+		else
+		{
+			wide_children[i] = out_bvh.nodes.size;
+			out_bvh.nodes.append(WideBVHNode {});
+		}
+	}
+
+	WideBVHNode &wide_node = out_bvh.nodes[wide_index];
+	for (uint32 i = 0; i < WIDE_BVH_WIDTH; i++)
+	{
+		if (i >= child_count)
+		{
+			float inf = std::numeric_limits<float>::infinity();
+			for (uint32 axis = 0; axis < 3; axis++)
+			{
+				wide_node.bounds[2 * axis][i] = inf;
+				wide_node.bounds[2 * axis + 1][i] = -inf;
+			}
+			wide_node.child[i] = WIDE_BVH_EMPTY;
+			wide_node.prim_count[i] = 0;
+			continue;
+		}
+
+		BVHNodeGLSL &child = bvh_nodes[children[i]];
+		for (uint32 axis = 0; axis < 3; axis++)
+		{
+			wide_node.bounds[2 * axis][i] = child.data1[(int32) axis];
+			wide_node.bounds[2 * axis + 1][i] = child.data2[(int32) axis];
+		}
+
+		if (child.IsLeaf())
+		{
+			wide_node.child[i] = child.FirstChildOrTri();
+			wide_node.prim_count[i] = child.TriCount();
+		}
+		else
+		{
+			wide_node.child[i] = wide_children[i];
+			wide_node.prim_count[i] = 0;
+		}
+	}
+
+	for (uint32 i = 0; i < child_count; i++)
+	{
+		if (wide_children[i] != WIDE_BVH_EMPTY)
+		{
+			collapse_node(bvh_nodes, children[i], wide_children[i], out_bvh);
+		}
+	}
+}
+
+void CollapseBVH(Array<BVHNodeGLSL> &bvh_nodes, Array<SceneMesh> &meshes, WideBVH &out_bvh)
+{
+	out_bvh.nodes.clear();
+	out_bvh.mesh_roots.clear();
+
+	for (uint32 i = 0; i < meshes.size; i++)
+	{
+		if (meshes[i].tri_count == 0)
+		{
+			// Has no instances, see LoadScene
+			out_bvh.mesh_roots.append(WIDE_BVH_EMPTY);
+			continue;
+		}
+
+		uint32 root = out_bvh.nodes.size;
+		out_bvh.mesh_roots.append(root);
+		out_bvh.nodes.append(WideBVHNode {});
+		collapse_node(bvh_nodes, meshes[i].bvh_root, root, out_bvh);
+	}
+
+	printf("Collapsed BVH into %u nodes that are %u wide.\n", out_bvh.nodes.size, WIDE_BVH_WIDTH);
+}
+
+WideRay::WideRay(const glm::vec3 &origin, const glm::vec3 &direction)
+	: origin(origin), inv_dir(1.0f / direction)
+{
+	for (uint32 axis = 0; axis < 3; axis++)
+	{
+		uint32 negative = inv_dir[(int32) axis] < 0.0f ? 1 : 0;
+		near_row[axis] = 2 * axis + negative;
+		far_row[axis] = 2 * axis + (1 - negative);
+	}
+}
+
+// A ray that is parallel to an axis and starts on one of the planes of a box
+// gets 0 * inf = NaN for that slab. min/max return their second operand
+// when either one is NaN, so with the running interval as the second
+// operand such a slab is ignored, i.e. the ray counts as inside of it.
+uint32 IntersectWideChildren(const WideBVHNode &node, const WideRay &ray, float tmax, float *out_tnear)
+{
+#if WIDE_BVH_SIMD && defined(__AVX2__)
+	__m256 tnear = _mm256_set1_ps(TMIN);
+	__m256 tfar = _mm256_set1_ps(tmax);
+	for (uint32 axis = 0; axis < 3; axis++)
+	{
+		__m256 origin = _mm256_set1_ps(ray.origin[(int32) axis]);
+		__m256 inv_dir = _mm256_set1_ps(ray.inv_dir[(int32) axis]);
+		__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray.near_row[axis]]), origin), inv_dir);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray.far_row[axis]]), origin), inv_dir);
+		tnear = _mm256_max_ps(t0, tnear);
+		tfar = _mm256_min_ps(t1, tfar);
+	}
+
+	_mm256_storeu_ps(out_tnear, tnear);
+	return (uint32) _mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+#elif WIDE_BVH_SIMD
+	__m128 tnear = _mm_set1_ps(TMIN);
+	__m128 tfar = _mm_set1_ps(tmax);
+	for (uint32 axis = 0; axis < 3; axis++)
+	{
+		__m128 origin = _mm_set1_ps(ray.origin[(int32) axis]);
+		__m128 inv_dir = _mm_set1_ps(ray.inv_dir[(int32) axis]);
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.near_row[axis]]), origin), inv_dir);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.far_row[axis]]), origin), inv_dir);
+		tnear = _mm_max_ps(t0, tnear);
+		tfar = _mm_min_ps(t1, tfar);
+	}
+
+	_mm_storeu_ps(out_tnear, tnear);
+	return (uint32) _mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+#else
+	uint32 mask = 0;
+	for (uint32 i = 0; i < WIDE_BVH_WIDTH; i++)
+	{
+		float tnear = TMIN;
+		float tfar = tmax;
+		for (uint32 axis = 0; axis < 3; axis++)
+		{
+			float t0 = (node.bounds[ray.near_row[axis]][i] - ray.origin[(int32) axis]) * ray.inv_dir[(int32) axis];
+			float t1 = (node.bounds[ray.far_row[axis]][i] - ray.origin[(int32) axis]) * ray.inv_dir[(int32) axis];
+			tnear = t0 > tnear ? t0 : tnear;
+			tfar = t1 < tfar ? t1 : tfar;
+		}
+
+		out_tnear[i] = tnear;
+		mask |= (uint32) (tnear <= tfar) << i;
+	}
+	return mask;
+#endif
+}
+
+bool IntersectWideBVH(TraceContext &ctx, const glm::vec3 &ro, const glm::vec3 &rd, HitData &data, float &tmax, uint32 root)
+{
+	const WideBVH &bvh = *ctx.wide_bvh;
+	if (bvh.nodes.size == 0)
+	{
+		return false;
+	}
+
+	WideRay ray(ro, rd);
+
+	struct StackEntry
+	{
+		uint32 node;
+		float tnear;
+	};
+
+	TraversalStack<StackEntry, WIDE_BVH_STACK_SIZE> stack;
+	stack.Push({ root, TMIN });
+
+	bool hit_anything = false;
+	while (stack.size > 0)
+	{
+		StackEntry entry = stack.Pop();
+
+		// Something closer was hit after this node was pushed
+		if (entry.tnear > tmax)
+		{
+			continue;
+		}
+
+		const WideBVHNode &node = bvh.nodes._data[entry.node];
+
+		alignas(32) float tnear[WIDE_BVH_WIDTH];
+		uint32 mask = IntersectWideChildren(node, ray, tmax, tnear);
+
+		// Sort the hit children by distance (insertion sort, there are
+		// at most WIDE_BVH_WIDTH of them).
+		uint32 hits[WIDE_BVH_WIDTH];
+		uint32 hit_count = 0;
+		while (mask != 0)
+		{
+			uint32 slot = 0;
+			while (((mask >> slot) & 1) == 0)
+			{
+				slot++;
+			}
+			mask &= mask - 1;
+
+			uint32 position = hit_count++;
+			while (position > 0 && tnear[hits[position - 1]] > tnear[slot])
+			{
+				hits[position] = hits[position - 1];
+				position--;
+			}
+			hits[position] = slot;
+		}
+
+		// Leaves are intersected right away, closest first, which shrinks
+		// tmax for the remaining children. Inner children are pushed
+		// furthest first, so that the closest one is popped next.
+		for (uint32 i = 0; i < hit_count; i++)
+		{
+			uint32 slot = hits[i];
+			uint32 prim_count = node.prim_count[slot];
+			if (prim_count == 0 || tnear[slot] > tmax)
+			{
+				continue;
+			}
+
+			uint32 first_prim = node.child[slot];
+			for (uint32 j = 0; j < prim_count; j++)
+			{
+				if (IntersectTriangle(ctx, ro, rd, first_prim + j, data, tmax))
+				{
+					hit_anything = true;
+					tmax = data.t;
+				}
+			}
+		}
+
+		for (uint32 i = hit_count; i-- > 0;)
+		{
+			uint32 slot = hits[i];
+			if (node.prim_count[slot] == 0 && tnear[slot] <= tmax)
+			{
+				stack.Push({ node.child[slot], tnear[slot] });
+			}
+		}
+	}
+
+	return hit_anything;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include "../core/array.hpp"
+#include "../defines.hpp"
+#include "../scene/bvh.h"
+#include "../scene/instance.hpp"
+#include "traversal_stack.hpp"
+
+#include <glm/vec3.hpp>
+
+// With AVX2 one ray is tested against 8 child boxes at once, otherwise
+// 4 boxes with SSE (or plain scalar code on non-x86 targets).
+#if defined(__AVX2__)
+constexpr uint32 WIDE_BVH_WIDTH = 8;
+#else
+constexpr uint32 WIDE_BVH_WIDTH = 4;
+#endif
+
+// Child slot that doesn't hold anything. Its bounds are inverted
+// (min = +inf, max = -inf), so the slab test never reports a hit.
+constexpr uint32 WIDE_BVH_EMPTY = 0xFFFFFFFF;
+
+// Stack entries of a traversal that are kept on the call stack. Collapsed
+// trees are at most as deep as the binary tree, and every visited node
+// pushes at most WIDE_BVH_WIDTH - 1 entries, so this covers trees up to 64
+// levels deep. Deeper ones spill into the heap, see TraversalStack.
+constexpr uint32 WIDE_BVH_STACK_SIZE = 64 * (WIDE_BVH_WIDTH - 1);
+
+// Bounds are stored SoA, one row per plane: min x, max x, min y, max y,
+// min z, max z. The near plane of an axis is row 2 * axis + sign, so the
+// traversal can pick it once per ray instead of doing a min/max per child.
+struct alignas(32) WideBVHNode
+{
+	float bounds[6][WIDE_BVH_WIDTH];
+
+	// Inner child: index of its wide node, `prim_count` is 0.
+	// Leaf child: first triangle, `prim_count` is the number of triangles.
+	uint32 child[WIDE_BVH_WIDTH];
+	uint32 prim_count[WIDE_BVH_WIDTH];
+};
+
+struct WideBVH
+{
+	Array<WideBVHNode> nodes;
+	Array<uint32> mesh_roots; // root node of every mesh
+};
+
+// Collapses the binary BVHs of the meshes (as produced by CalculateBVH) into
+// BVHs of WIDE_BVH_WIDTH wide nodes. Leaves keep their triangle ranges, so
+// the same sorted triangle array is used by both.
+void CollapseBVH(Array<BVHNodeGLSL> &bvh_nodes, Array<SceneMesh> &meshes, WideBVH &out_bvh);
+
+// Ray data that stays the same for every node
+struct WideRay
+{
+	glm::vec3 origin;
+	glm::vec3 inv_dir;
+	uint32 near_row[3];
+	uint32 far_row[3];
+
+	WideRay() = default;
+	WideRay(const glm::vec3 &origin, const glm::vec3 &direction);
+};
+
+// Slab test of one ray against all the children of a node. Writes the
+// entry distances to `out_tnear` and returns a bit mask of the hit children.
+uint32 IntersectWideChildren(const WideBVHNode &node, const WideRay &ray, float tmax, float *out_tnear);
+
+struct TraceContext;
+struct HitData;
+
+// Closest hit traversal of the subtree below `root`, visiting the
+// children of every node front to back
+bool IntersectWideBVH(TraceContext &ctx, const glm::vec3 &ro, const glm::vec3 &rd, HitData &data, float &tmax, uint32 root);
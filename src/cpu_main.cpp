@@ -0,0 +1,335 @@
+#include "cpu/benchmark.hpp"
+#include "cpu/renderer.hpp"
+#include "cpu/texture_cache.hpp"
+#include "cpu/wide_bvh.hpp"
+#include "loader.h"
+#include "mesh_loader.h"
+#include "scene/compressed_bvh.hpp"
+#include "pathtracer.hpp"
+#include "scene/scene.hpp"
+#include "scene/scene_file.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+static void PrintUsage(const char *program)
+{
+	printf("Usage: %s [options]\n", program);
+	printf("  --model <path>       glTF / GLB, OBJ, binary PLY or baked .pxscene model to render (default: res/models/CornellBox_lit.glb)\n");
+	printf("  --env <path>         equirectangular environment map (default: res/cubemaps/solitude_interior_4k.hdr)\n");
+	printf("  --output <path>      output image, .ppm or .pfm (default: render.ppm)\n");
+	printf("  --size <w> <h>       image resolution (default: %u %u)\n", WIDTH, HEIGHT);
+	printf("  --spp <n>            samples per pixel (default: 16)\n");
+	printf("  --bounces <n>        number of bounces (default: %u)\n", BOUNCE_COUNT);
+	printf("  --threads <n>        worker threads, 0 for all cores (default: 0)\n");
+	printf("  --seed <n>           seed for the per-sample random numbers (default: 0)\n");
+	printf("  --estimator <name>   brdf, nee or mis (default: mis)\n");
+	printf("  --traversal <name>   wide (%u wide SIMD BVH), compressed (8 wide quantized BVH) or binary (default: wide)\n", WIDE_BVH_WIDTH);
+	printf("  --builder <name>     BVH builder: sweep, binned, sbvh, lbvh or ploc (default: sweep)\n");
+	printf("  --optimize-bvh       run reinsertion, leaf collapsing and node layout passes after the BVH build\n");
+	printf("  --no-cache           always rebuild the scene instead of using <model>.cache\n");
+	printf("  --preview-bvh        start with quick LBVHs while the BVHs of --builder are built, which replace them between frames\n");
+	printf("  --no-packets         trace camera rays one by one instead of as 8x8 packets\n");
+	printf("  --texture-cache <MB> memory for the texture tiles read from <model>.tiles (default: %llu)\n", TEXTURE_CACHE_BYTES / (1024 * 1024));
+	printf("  --no-textures        render with the material colors alone\n");
+	printf("  --frames <n>         render n frames of the model's animation, numbered <output>_0000.ppm, ...\n");
+	printf("  --fps <n>            frame rate of the rendered animation (default: 24)\n");
+	printf("  --rebuild-threshold <x>  rebuild a deforming BVH instead of refitting it once its SAH cost grew x times (default: 1.5)\n");
+	printf("  --bench-scaling      render with 1, 2, 4, ... up to --threads threads and report the scaling\n");
+	printf("  --bench-bvh          compare the traversal speed of the binary, wide and compressed BVHs\n");
+	printf("  --bench-loader <MB>  load generated OBJ and PLY files of 16 MB up to <MB> and report the throughput\n");
+}
+
+// "render.ppm" -> "render_0007.ppm"
+static std::string frame_output_path(const char *output_path, uint32 frame)
+{
+	std::string path(output_path);
+	size_t extension = path.find_last_of('.');
+	if (extension == std::string::npos || path.find_first_of("/\\", extension) != std::string::npos)
+	{
+		extension = path.size();
+	}
+
+	char suffix[16];
+	snprintf(suffix, sizeof(suffix), "_%04u", frame);
+	return path.substr(0, extension) + suffix + path.substr(extension);
+}
+
+// Opens the texture tiles next to the model, and writes them first when
+// they are missing or were written for other source files. The tiles of a
+// .pxscene file are written by pathtracer-bake, it has no textures to
+// write them from.
+static bool open_texture_cache(const char *model_path, Scene &scene, uint64 capacity_bytes, TextureCache &out_cache)
+{
+	bool has_textures = false;
+	for (uint32 i = 0; i < scene.materials.size; i++)
+	{
+		has_textures = has_textures || scene.materials[i].data3.w > -1.0f;
+	}
+
+	uint64 source_hash = 0;
+	if (!has_textures || !HashModelSource(model_path, source_hash))
+	{
+		return false;
+	}
+
+	std::string tiles_path = std::string(model_path) + ".tiles";
+	uint64 key = TextureTilesKey(source_hash);
+	if (out_cache.Open(tiles_path.c_str(), key, capacity_bytes))
+	{
+		return true;
+	}
+
+	if (IsSceneFile(model_path))
+	{
+		printf("WARNING: Texture tiles %s are missing or out of date, bake the scene again.\n", tiles_path.c_str());
+		return false;
+	}
+
+	return WriteGLTFTextureTiles(model_path, tiles_path.c_str(), key) && out_cache.Open(tiles_path.c_str(), key, capacity_bytes);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *model_path = "res/models/CornellBox_lit.glb";
+	const char *environment_path = "res/cubemaps/solitude_interior_4k.hdr";
+	const char *output_path = "render.ppm";
+	RenderSettings settings;
+	bool bench_scaling = false;
+	bool bench_bvh = false;
+	uint32 bench_loader_megabytes = 0;
+	bool use_wide_bvh = true;
+	bool use_compressed_bvh = false;
+	BVHBuildOptions bvh_options;
+	bool use_scene_cache = true;
+	bool preview_bvh = false;
+	uint32 frame_count = 0;
+	float frame_rate = 24.0f;
+	AnimationOptions animation_options;
+	bool use_textures = true;
+	uint64 texture_cache_bytes = TEXTURE_CACHE_BYTES;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (strcmp(arg, "--model") == 0 && has_value)
+			model_path = argv[++i];
+		else if (strcmp(arg, "--env") == 0 && has_value)
+			environment_path = argv[++i];
+		else if (strcmp(arg, "--output") == 0 && has_value)
+			output_path = argv[++i];
+		else if (strcmp(arg, "--size") == 0 && i + 2 < argc)
+		{
+			settings.width = (uint32) atoi(argv[++i]);
+			settings.height = (uint32) atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "--spp") == 0 && has_value)
+			settings.samples_per_pixel = (uint32) atoi(argv[++i]);
+		else if (strcmp(arg, "--bounces") == 0 && has_value)
+			settings.bounce_count = (uint32) atoi(argv[++i]);
+		else if (strcmp(arg, "--threads") == 0 && has_value)
+			settings.thread_count = (uint32) atoi(argv[++i]);
+		else if (strcmp(arg, "--seed") == 0 && has_value)
+			settings.seed = (uint32) atoi(argv[++i]);
+		else if (strcmp(arg, "--estimator") == 0 && has_value)
+		{
+			const char *name = argv[++i];
+			if (strcmp(name, "brdf") == 0)
+				settings.view_mode = ViewMode::BRDF_IMPORTANCE_SAMPLING;
+			else if (strcmp(name, "nee") == 0)
+				settings.view_mode = ViewMode::NEXT_EVENT_ESTIMATION;
+			else if (strcmp(name, "mis") == 0)
+				settings.view_mode = ViewMode::MULTIPLE_IMPORTANCE_SAMPLING_BRDF_NEE;
+			else
+			{
+				printf("ERROR: Unknown estimator '%s'!\n", name);
+				return -1;
+			}
+		}
+		else if (strcmp(arg, "--traversal") == 0 && has_value)
+		{
+			const char *name = argv[++i];
+			use_wide_bvh = strcmp(name, "wide") == 0;
+			use_compressed_bvh = strcmp(name, "compressed") == 0;
+			if (!use_wide_bvh && !use_compressed_bvh && strcmp(name, "binary") != 0)
+			{
+				printf("ERROR: Unknown traversal '%s'!\n", name);
+				return -1;
+			}
+		}
+		else if (strcmp(arg, "--builder") == 0 && has_value)
+		{
+			const char *name = argv[++i];
+			if (!ParseBVHBuilder(name, bvh_options.builder))
+			{
+				printf("ERROR: Unknown BVH builder '%s'!\n", name);
+				return -1;
+			}
+		}
+		else if (strcmp(arg, "--optimize-bvh") == 0)
+			bvh_options.optimize = true;
+		else if (strcmp(arg, "--no-cache") == 0)
+			use_scene_cache = false;
+		else if (strcmp(arg, "--preview-bvh") == 0)
+			preview_bvh = true;
+		else if (strcmp(arg, "--no-packets") == 0)
+			settings.use_packets = false;
+		else if (strcmp(arg, "--texture-cache") == 0 && has_value)
+			texture_cache_bytes = (uint64) atoi(argv[++i]) * 1024 * 1024;
+		else if (strcmp(arg, "--no-textures") == 0)
+			use_textures = false;
+		else if (strcmp(arg, "--frames") == 0 && has_value)
+			frame_count = (uint32) atoi(argv[++i]);
+		else if (strcmp(arg, "--fps") == 0 && has_value)
+			frame_rate = (float) atof(argv[++i]);
+		else if (strcmp(arg, "--rebuild-threshold") == 0 && has_value)
+			animation_options.rebuild_threshold = (float) atof(argv[++i]);
+		else if (strcmp(arg, "--bench-scaling") == 0)
+			bench_scaling = true;
+		else if (strcmp(arg, "--bench-bvh") == 0)
+			bench_bvh = true;
+		else if (strcmp(arg, "--bench-loader") == 0 && has_value)
+			bench_loader_megabytes = (uint32) atoi(argv[++i]);
+		else
+		{
+			PrintUsage(argv[0]);
+			return strcmp(arg, "--help") == 0 ? 0 : -1;
+		}
+	}
+
+	if (settings.width == 0 || settings.height == 0 || settings.samples_per_pixel == 0)
+	{
+		printf("ERROR: Image size and sample count must be non-zero!\n");
+		return -1;
+	}
+
+	if (frame_count > 0 && frame_rate <= 0.0f)
+	{
+		printf("ERROR: The frame rate must be positive!\n");
+		return -1;
+	}
+
+	// Doesn't need a scene, it loads files of its own
+	if (bench_loader_megabytes > 0)
+	{
+		return RunLoaderBenchmark(bench_loader_megabytes) ? 0 : -1;
+	}
+
+	// The cache only has the rest pose, the animation needs the model
+	Scene scene;
+	BVHRefinement refinement;
+	if (!LoadScene(model_path, scene, false, bvh_options, use_scene_cache && frame_count == 0, preview_bvh ? &refinement : nullptr))
+	{
+		printf("Failed to load model!\n");
+		return -1;
+	}
+
+	// The benchmarks measure the BVHs of the chosen builder
+	if (bench_bvh || bench_scaling)
+	{
+		SwapRefinedBVH(refinement, scene, true);
+	}
+
+	TextureCache texture_cache;
+	TextureCache *render_texture_cache = nullptr;
+	if (use_textures && open_texture_cache(model_path, scene, texture_cache_bytes, texture_cache))
+	{
+		render_texture_cache = &texture_cache;
+	}
+
+	EnvironmentMap environment;
+	if (!LoadEnvironmentMap(environment_path, environment))
+	{
+		printf("WARNING: Failed to load environment map at path: %s, using a sky gradient instead.\n", environment_path);
+	}
+
+	WideBVH wide_bvh;
+	if (use_wide_bvh || bench_bvh)
+	{
+		CollapseBVH(scene.bvh_nodes, scene.meshes, wide_bvh);
+	}
+	const WideBVH *traversal_bvh = use_wide_bvh ? &wide_bvh : nullptr;
+
+	CompressedBVH compressed_bvh;
+	if (use_compressed_bvh || bench_bvh)
+	{
+		CompressBVH(scene.bvh_nodes, scene.meshes, compressed_bvh);
+	}
+	const CompressedBVH *traversal_compressed_bvh = use_compressed_bvh ? &compressed_bvh : nullptr;
+
+	if (bench_bvh)
+	{
+		RunBVHBenchmark(scene, environment, wide_bvh, compressed_bvh, settings);
+		return 0;
+	}
+
+	if (bench_scaling)
+	{
+		RunScalingBenchmark(scene, environment, traversal_bvh, traversal_compressed_bvh, settings, settings.thread_count);
+		return 0;
+	}
+
+	if (frame_count > 0)
+	{
+		Array<glm::vec3> image;
+		for (uint32 frame = 0; frame < frame_count; frame++)
+		{
+			// An image is traced with one BVH, the final ones take over
+			// from the next frame on and are posed and refitted below
+			if (SwapRefinedBVH(refinement, scene))
+			{
+				printf("Frame %u: switched from the preview to the final BVHs\n", frame);
+			}
+
+			float time = (float) frame / frame_rate;
+			AnimationStats animation_stats = AnimateScene(scene, time, animation_options);
+			printf("Frame %u (%.3f s): refitted %u and rebuilt %u BVHs (worst SAH cost ratio %.2f), posed in %.1f ms, BVHs in %.1f ms, top level in %.1f ms\n",
+				   frame, time, animation_stats.refit_count, animation_stats.rebuild_count, animation_stats.max_cost_ratio,
+				   animation_stats.pose_ms, animation_stats.bvh_ms, animation_stats.top_level_ms);
+
+			if (use_wide_bvh)
+			{
+				CollapseBVH(scene.bvh_nodes, scene.meshes, wide_bvh);
+			}
+			else if (use_compressed_bvh)
+			{
+				CompressBVH(scene.bvh_nodes, scene.meshes, compressed_bvh);
+			}
+
+			RenderStats stats = RenderImageCPU(scene, environment, traversal_bvh, traversal_compressed_bvh, render_texture_cache, settings, image);
+			PrintRenderStats(stats);
+
+			std::string frame_path = frame_output_path(output_path, frame);
+			if (!WriteImage(frame_path.c_str(), image, settings.width, settings.height))
+			{
+				return -1;
+			}
+		}
+
+		printf("Wrote %u frames to %s\n", frame_count, frame_output_path(output_path, 0).c_str());
+		return 0;
+	}
+
+	Array<glm::vec3> image;
+	RenderStats stats = RenderImageCPU(scene, environment, traversal_bvh, traversal_compressed_bvh, render_texture_cache, settings, image);
+	PrintRenderStats(stats);
+
+	if (!WriteImage(output_path, image, settings.width, settings.height))
+	{
+		return -1;
+	}
+
+	printf("Wrote image to %s\n", output_path);
+
+	// Lets the final BVHs finish, so they are cached for the next run.
+	// Without the cache nothing needs them, ~BVHRefinement cancels them.
+	if (use_scene_cache)
+	{
+		SwapRefinedBVH(refinement, scene, true);
+	}
+	return 0;
+}
@@ -185,7 +185,9 @@ bool Display::InitRenderBuffer()
 	uint8 *data = stbi_load("res/cubemaps/solitude_interior_4k.hdr", &w, &h, &c, 3);
     if (data != nullptr)
     {
-        glTextureStorage2D(cubemap_texture, 1, GL_RGB16F, w, h);
+        // stbi_load already clamped the HDR to 8 bits, a float format would
+        // only double the memory
+        glTextureStorage2D(cubemap_texture, 1, GL_RGB8, w, h);
         glTextureSubImage2D(cubemap_texture, 0, 0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, data);
         stbi_image_free(data);
     }
@@ -1,18 +1,772 @@
 #include "loader.h"
+#include "core/hash.hpp"
+#include "core/mapped_file.hpp"
 #include "math/math.hpp"
 #include "scene/material.hpp"
+#include "scene/scene_cache.hpp"
+#include "scene/texture.hpp"
+#include "scene/texture_tiles.hpp"
 
 #include <cgltf.h>
 #include <glad/glad.h>
-#include <stb_image.h>
-#include <stb_image_resize.h>
 
 #include <glm/fwd.hpp>
 #include <glm/gtc/quaternion.hpp>
 
-bool LoadGLTF(const char *path, Model &out_mesh)
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Like in bvh.cpp, but primitives and images differ a lot in size, so they
+// are handed out one at a time. Serial when OpenMP isn't available.
+#if defined(_OPENMP)
+#define PARALLEL_FOR _Pragma("omp parallel for schedule(dynamic, 1)")
+#else
+#define PARALLEL_FOR
+#endif
+
+// Images decoded at once while writing texture tiles
+constexpr uint32 TEXTURE_TILES_DECODE_BATCH = 16;
+
+// Primitives whose accessors are read ahead of the one being assembled
+constexpr uint32 PRIMITIVE_PREFETCH_DISTANCE = 8;
+
+// cgltf reads a .glb, or a .gltf and its buffer files, into memory as a
+// whole before anything is decoded, so a model took twice its size in RAM
+// while it loaded. These callbacks map the files instead: the accessors are
+// decoded straight from the mapping, and only the pages that are touched
+// are read. The GLB chunk that holds the buffer is used where it lies.
+struct GLTFFileMappings
+{
+    std::vector<std::unique_ptr<MappedFile>> files;
+
+    // Mapping that a buffer lies in and where. Buffers from data URIs are
+    // decoded to the heap and have none.
+    const MappedFile *Find(const void *pointer, size_t &out_offset) const
+    {
+        const uint8 *bytes = (const uint8 *) pointer;
+        for (const std::unique_ptr<MappedFile> &file : files)
+        {
+            if (bytes >= file->data && bytes < file->data + file->size)
+            {
+                out_offset = (size_t) (bytes - file->data);
+                return file.get();
+            }
+        }
+        return nullptr;
+    }
+};
+
+static cgltf_result map_gltf_file(const cgltf_memory_options *, const cgltf_file_options *file_options, const char *path, cgltf_size *size, void **data)
+{
+    GLTFFileMappings *mappings = (GLTFFileMappings *) file_options->user_data;
+    std::unique_ptr<MappedFile> file = std::make_unique<MappedFile>();
+    if (!file->Open(path))
+    {
+        return cgltf_result_file_not_found;
+    }
+
+    // cgltf only ever reads from the data, the mapping is read-only
+    *size = (cgltf_size) file->size;
+    *data = (void *) file->data;
+    mappings->files.push_back(std::move(file));
+    return cgltf_result_success;
+}
+
+static void unmap_gltf_file(const cgltf_memory_options *, const cgltf_file_options *file_options, void *data)
+{
+    GLTFFileMappings *mappings = (GLTFFileMappings *) file_options->user_data;
+    for (size_t i = 0; i < mappings->files.size(); i++)
+    {
+        if (mappings->files[i]->data == data)
+        {
+            mappings->files.erase(mappings->files.begin() + i);
+            return;
+        }
+    }
+}
+
+// The mappings have to outlive the cgltf_data, which releases them in cgltf_free
+static cgltf_options mapped_gltf_options(GLTFFileMappings &mappings)
 {
     cgltf_options options = {};
+    options.file.read = map_gltf_file;
+    options.file.release = unmap_gltf_file;
+    options.file.user_data = &mappings;
+    return options;
+}
+
+// Calls `visit` with the mapping and byte range of every accessor that a
+// primitive reads, from its first element to the stride after its last.
+// Primitives may share a buffer view, so the range ends there and not at
+// the end of the view.
+template <typename Visit>
+static void visit_primitive_ranges(const GLTFFileMappings &mappings, cgltf_primitive *primitive, Visit visit)
+{
+    auto visit_accessor = [&](cgltf_accessor *accessor)
+    {
+        cgltf_buffer_view *view = accessor != nullptr ? accessor->buffer_view : nullptr;
+        if (view == nullptr || view->buffer->data == nullptr || accessor->offset >= view->size)
+        {
+            return;
+        }
+
+        size_t offset = 0;
+        const MappedFile *file = mappings.Find((const uint8 *) view->buffer->data + view->offset, offset);
+        if (file != nullptr)
+        {
+            size_t length = accessor->stride * accessor->count;
+            size_t view_rest = view->size - accessor->offset;
+            visit(*file, offset + accessor->offset, length < view_rest ? length : view_rest);
+        }
+    };
+
+    visit_accessor(primitive->indices);
+    for (cgltf_size i = 0; i < primitive->attributes_count; i++)
+    {
+        visit_accessor(primitive->attributes[i].data);
+    }
+    for (cgltf_size target = 0; target < primitive->targets_count; target++)
+    {
+        for (cgltf_size i = 0; i < primitive->targets[target].attributes_count; i++)
+        {
+            visit_accessor(primitive->targets[target].attributes[i].data);
+        }
+    }
+}
+
+// EXT_texture_compression_s3tc, which every desktop driver has but glad
+// wasn't generated with
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
+// Base color texture of the material, if the material is one that samples it
+static cgltf_texture *base_color_texture(cgltf_material *material)
+{
+    if (material == nullptr || material->has_emissive_strength || !material->has_pbr_metallic_roughness)
+    {
+        return nullptr;
+    }
+    return material->pbr_metallic_roughness.base_color_texture.texture;
+}
+
+// Gives every image that a material samples its own record in the texture
+// atlas, in the order of the materials. An image that several textures or
+// materials use is decoded once. LoadGLTF and LoadGLTFTextures both go
+// through this, so they agree on the records.
+static uint32 assign_texture_records(cgltf_data *data, Array<int32> &out_image_records, Array<cgltf_texture *> &out_record_textures)
+{
+    out_image_records.resize((uint32) data->images_count);
+    for (uint32 i = 0; i < out_image_records.size; i++)
+    {
+        out_image_records[i] = -1;
+    }
+
+    for (cgltf_size material_index = 0; material_index < data->materials_count; material_index++)
+    {
+        cgltf_texture *texture = base_color_texture(&data->materials[material_index]);
+        if (texture == nullptr || texture->image == nullptr)
+        {
+            continue;
+        }
+
+        auto image_index = (uint32) (texture->image - data->images);
+        if (out_image_records[image_index] == -1)
+        {
+            out_image_records[image_index] = (int32) out_record_textures.size;
+            out_record_textures.append(texture);
+        }
+    }
+
+    return out_record_textures.size;
+}
+
+static int32 texture_record(cgltf_data *data, Array<int32> &image_records, cgltf_texture *texture)
+{
+    if (texture == nullptr || texture->image == nullptr)
+    {
+        return -1;
+    }
+    return image_records[(uint32) (texture->image - data->images)];
+}
+
+// cgltf leaves the filters at 0 when the sampler doesn't set them
+static GLint sampler_parameter(cgltf_int value, GLint default_value)
+{
+    return value != 0 ? (GLint) value : default_value;
+}
+
+// Only clamping is told apart, mirrored textures repeat
+static bool sampler_repeats(cgltf_int wrap_mode)
+{
+    return wrap_mode != GL_CLAMP_TO_EDGE;
+}
+
+// Decodes the images of `count` records from `first_record` on in parallel.
+// Every texture that was decoded has to be freed, even when others failed.
+static bool decode_record_textures(Array<cgltf_texture *> &record_textures, uint32 first_record, uint32 count, DecodedTexture *out_textures)
+{
+    Array<uint8> decoded(count);
+    decoded.resize(count);
+
+    PARALLEL_FOR
+    for (uint32 i = 0; i < count; i++)
+    {
+        cgltf_texture *texture = record_textures._data[first_record + i];
+        cgltf_buffer_view *view = texture->image->buffer_view;
+        DecodedTexture &decoded_texture = out_textures[i];
+        decoded_texture.texels = nullptr;
+        decoded_texture.repeat_s = texture->sampler == nullptr || sampler_repeats(texture->sampler->wrap_s);
+        decoded_texture.repeat_t = texture->sampler == nullptr || sampler_repeats(texture->sampler->wrap_t);
+
+        if (view == nullptr || view->buffer->data == nullptr)
+        {
+            printf("ERROR (glTF Loader / Textures): Only images embedded into buffers are supported!\n");
+            decoded._data[i] = 0;
+            continue;
+        }
+
+        const uint8 *encoded = (const uint8 *) view->buffer->data + view->offset;
+        decoded._data[i] = DecodeTexture(encoded, view->size, decoded_texture) ? 1 : 0;
+    }
+
+    bool all_decoded = true;
+    for (uint32 i = 0; i < decoded.size; i++)
+    {
+        all_decoded = all_decoded && decoded[i] != 0;
+    }
+    return all_decoded;
+}
+
+static void free_textures(DecodedTexture *textures, uint32 count)
+{
+    for (uint32 i = 0; i < count; i++)
+    {
+        if (textures[i].texels != nullptr)
+        {
+            FreeTexture(textures[i]);
+        }
+    }
+}
+
+// Decodes the images of all records in parallel and packs them into the
+// pages of the atlas
+static bool build_texture_atlas(Array<cgltf_texture *> &record_textures, uint64 budget_bytes, TextureAtlas &out_atlas)
+{
+    Array<DecodedTexture> textures(record_textures.size);
+    textures.resize(record_textures.size);
+
+    bool all_decoded = decode_record_textures(record_textures, 0, record_textures.size, textures._data);
+    if (all_decoded)
+    {
+        PackTextureAtlas(textures._data, textures.size, budget_bytes, out_atlas);
+    }
+
+    free_textures(textures._data, textures.size);
+    return all_decoded;
+}
+
+static GLenum texture_internal_format(TextureFormat format)
+{
+    switch (format)
+    {
+        case TextureFormat::BC1:
+            return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case TextureFormat::BC7:
+            return GL_COMPRESSED_RGBA_BPTC_UNORM;
+        default:
+            return GL_RGB8;
+    }
+}
+
+// Builds the atlas of the records, or reads it from `<path>.textures` when
+// `cache_textures` allows it. All pages share the filters of the first
+// texture, the shader wraps the UVs itself, each texture by its own sampler.
+static bool prepare_texture_atlas(const char *path, Array<cgltf_texture *> &record_textures, uint64 budget_bytes, bool cache_textures, TextureAtlas &out_atlas)
+{
+    std::string cache_path = std::string(path) + ".textures";
+    uint64 source_hash = 0;
+    bool use_cache = cache_textures && HashGLTFSource(path, source_hash);
+    uint64 cache_key = TextureCacheKey(source_hash, budget_bytes, out_atlas.format);
+
+    if (!use_cache || !LoadTextureCache(cache_path.c_str(), cache_key, out_atlas) || out_atlas.records.size != record_textures.size)
+    {
+        if (!build_texture_atlas(record_textures, budget_bytes, out_atlas))
+        {
+            return false;
+        }
+
+        if (use_cache)
+        {
+            WriteTextureCache(cache_path.c_str(), cache_key, out_atlas);
+        }
+    }
+
+    cgltf_sampler *sampler = record_textures[0]->sampler;
+    out_atlas.min_filter = (sampler != nullptr) ? (int32) sampler->min_filter : 0;
+    out_atlas.mag_filter = (sampler != nullptr) ? (int32) sampler->mag_filter : 0;
+    return true;
+}
+
+// Prepares the atlas of the records and uploads it into a new texture array
+static bool load_texture_atlas(const char *path, Array<cgltf_texture *> &record_textures, Model &out_mesh)
+{
+    auto start_time = std::chrono::steady_clock::now();
+
+    TextureAtlas atlas;
+    if (!prepare_texture_atlas(path, record_textures, out_mesh.texture_budget, out_mesh.cache_textures, atlas))
+    {
+        return false;
+    }
+
+    std::chrono::duration<double, std::milli> build_time = std::chrono::steady_clock::now() - start_time;
+
+    out_mesh.texture_array = UploadTextureAtlas(atlas, atlas.texels._data);
+    out_mesh.texture_records = atlas.records;
+
+    printf("--> Texture atlas: %u textures in %u pages of %ux%u, %.1f MB, PSNR %.1f dB, ready in %.1f ms\n",
+           atlas.records.size, atlas.page_count, atlas.page_size, atlas.page_size,
+           (double) atlas.Bytes() / (1024.0 * 1024.0), atlas.psnr, build_time.count());
+    return true;
+}
+
+// Appends all values of the accessor as floats, sparse ones included
+static void append_accessor_floats(cgltf_accessor *accessor, Array<float> &out_values)
+{
+    cgltf_size float_count = accessor->count * cgltf_num_components(accessor->type);
+    uint32 first_value = out_values.size;
+    out_values.resize(first_value + (uint32) float_count);
+    cgltf_accessor_unpack_floats(accessor, out_values._data + first_value, float_count);
+}
+
+// Unpacks a whole attribute into `out_values`, converting normalized and
+// sparse accessors on the way
+template<typename T>
+static void unpack_accessor(cgltf_accessor *accessor, Array<T> &out_values)
+{
+    out_values.resize((uint32) accessor->count);
+    cgltf_accessor_unpack_floats(accessor, (float *) out_values._data, accessor->count * sizeof(T) / sizeof(float));
+}
+
+template<typename T>
+static void decode_indices(const uint8 *source, cgltf_size stride, uint32 count, uint32 *out_indices)
+{
+    for (uint32 i = 0; i < count; i++)
+    {
+        T index;
+        memcpy(&index, source + stride * i, sizeof(T));
+        out_indices[i] = index;
+    }
+}
+
+// Reads all indices of the primitive at once, 8, 16 or 32 bit. Primitives
+// without indices use their vertices in order.
+static bool read_primitive_indices(cgltf_primitive *primitive, uint32 vertex_count, Array<uint32> &out_indices)
+{
+    cgltf_accessor *accessor = primitive->indices;
+    if (accessor == nullptr)
+    {
+        out_indices.resize(vertex_count);
+        for (uint32 i = 0; i < vertex_count; i++)
+        {
+            out_indices[i] = i;
+        }
+        return true;
+    }
+
+    auto count = (uint32) accessor->count;
+    out_indices.resize(count);
+
+    cgltf_buffer_view *view = accessor->buffer_view;
+    if (accessor->is_sparse || view == nullptr || view->buffer->data == nullptr)
+    {
+        // Rare enough that cgltf can resolve them one by one
+        for (uint32 i = 0; i < count; i++)
+        {
+            out_indices[i] = (uint32) cgltf_accessor_read_index(accessor, i);
+        }
+    }
+    else
+    {
+        const uint8 *source = (const uint8 *) view->buffer->data + view->offset + accessor->offset;
+        switch (accessor->component_type)
+        {
+            case cgltf_component_type_r_8u:
+                decode_indices<uint8>(source, accessor->stride, count, out_indices._data);
+                break;
+            case cgltf_component_type_r_16u:
+                decode_indices<uint16>(source, accessor->stride, count, out_indices._data);
+                break;
+            default:
+                decode_indices<uint32>(source, accessor->stride, count, out_indices._data);
+                break;
+        }
+    }
+
+    for (uint32 i = 0; i < count; i++)
+    {
+        if (out_indices[i] >= vertex_count)
+        {
+            printf("ERROR (glTF Loader): Index %u is out of the %u vertices of the primitive!\n", out_indices[i], vertex_count);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static uint32 mesh_morph_target_count(cgltf_mesh *mesh)
+{
+    return mesh->primitives_count > 0 ? (uint32) mesh->primitives[0].targets_count : 0;
+}
+
+static cgltf_accessor *find_attribute(cgltf_attribute *attributes, cgltf_size attribute_count, cgltf_attribute_type type)
+{
+    for (cgltf_size i = 0; i < attribute_count; i++)
+    {
+        if (attributes[i].type == type && attributes[i].index == 0)
+        {
+            return attributes[i].data;
+        }
+    }
+    return nullptr;
+}
+
+// Rejects the primitives whose attributes or indices the loader can't read,
+// before any of them is assembled
+static bool check_primitive_accessors(cgltf_primitive *primitive)
+{
+    cgltf_accessor *positions = find_attribute(primitive->attributes, primitive->attributes_count, cgltf_attribute_type_position);
+    cgltf_accessor *normals = find_attribute(primitive->attributes, primitive->attributes_count, cgltf_attribute_type_normal);
+    cgltf_accessor *tex_coords = find_attribute(primitive->attributes, primitive->attributes_count, cgltf_attribute_type_texcoord);
+    cgltf_accessor *joints = find_attribute(primitive->attributes, primitive->attributes_count, cgltf_attribute_type_joints);
+    cgltf_accessor *weights = find_attribute(primitive->attributes, primitive->attributes_count, cgltf_attribute_type_weights);
+    if (positions == nullptr || positions->type != cgltf_type_vec3 ||
+        (normals != nullptr && normals->type != cgltf_type_vec3) ||
+        (tex_coords != nullptr && tex_coords->type != cgltf_type_vec2) ||
+        (joints != nullptr && joints->type != cgltf_type_vec4) ||
+        (weights != nullptr && weights->type != cgltf_type_vec4))
+    {
+        printf("ERROR (glTF Loader): This attribute type is unsupported!\n");
+        return false;
+    }
+
+    cgltf_accessor *indices = primitive->indices;
+    if (indices != nullptr && (indices->type != cgltf_type_scalar ||
+                               (indices->component_type != cgltf_component_type_r_8u &&
+                                indices->component_type != cgltf_component_type_r_16u &&
+                                indices->component_type != cgltf_component_type_r_32u)))
+    {
+        printf("ERROR (glTF Loader): Indices accessor type or component type is wrong!\n");
+        return false;
+    }
+
+    return true;
+}
+
+static uint32 primitive_vertex_count(cgltf_primitive *primitive)
+{
+    return (uint32) find_attribute(primitive->attributes, primitive->attributes_count, cgltf_attribute_type_position)->count;
+}
+
+static bool primitive_has_joints(cgltf_primitive *primitive)
+{
+    return find_attribute(primitive->attributes, primitive->attributes_count, cgltf_attribute_type_joints) != nullptr &&
+           find_attribute(primitive->attributes, primitive->attributes_count, cgltf_attribute_type_weights) != nullptr;
+}
+
+// A mesh keeps the joints of all of its vertices as soon as one of its
+// primitives has them
+static bool mesh_has_joints(cgltf_mesh *mesh)
+{
+    for (cgltf_size i = 0; i < mesh->primitives_count; i++)
+    {
+        if (primitive_has_joints(&mesh->primitives[i]))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Where the vertices, triangles, morph target offsets and skin joints of a
+// primitive go in the model
+struct PrimitiveRange
+{
+    cgltf_primitive *primitive;
+    uint32 mat_index;
+    uint32 first_vertex;
+    uint32 vertex_count;
+    uint32 first_tri;
+    uint32 tri_count;
+    uint32 first_morph_delta;
+    uint32 morph_target_count;
+    uint32 first_joint_vertex; // (uint32) -1 when its mesh has no joints
+};
+
+// Decodes one primitive straight into its ranges of the model arrays, which
+// are already allocated. Primitives don't share anything, so any number of
+// them can be assembled at the same time.
+static bool assemble_primitive(const PrimitiveRange &range, Model &out_mesh)
+{
+    cgltf_primitive *primitive = range.primitive;
+
+    Array<glm::vec3> positions;
+    Array<glm::vec3> normals;
+    Array<glm::vec2> tex_coords;
+    unpack_accessor(find_attribute(primitive->attributes, primitive->attributes_count, cgltf_attribute_type_position), positions);
+
+    cgltf_accessor *normal_accessor = find_attribute(primitive->attributes, primitive->attributes_count, cgltf_attribute_type_normal);
+    if (normal_accessor != nullptr && normal_accessor->count == positions.size)
+    {
+        unpack_accessor(normal_accessor, normals);
+    }
+
+    cgltf_accessor *tex_coord_accessor = find_attribute(primitive->attributes, primitive->attributes_count, cgltf_attribute_type_texcoord);
+    if (tex_coord_accessor != nullptr)
+    {
+        unpack_accessor(tex_coord_accessor, tex_coords);
+    }
+
+    Array<uint32> indices;
+    if (!read_primitive_indices(primitive, positions.size, indices))
+    {
+        return false;
+    }
+
+    // Without normals every vertex gets the area weighted normal of the
+    // triangles around it
+    if (normals.size != positions.size)
+    {
+        normals.resize(positions.size);
+        memset(normals._data, 0, positions.size * sizeof(glm::vec3));
+        for (uint32 i = 0; i + 2 < indices.size; i += 3)
+        {
+            uint32 i0 = indices[i];
+            uint32 i1 = indices[i + 1];
+            uint32 i2 = indices[i + 2];
+            glm::vec3 area_normal = glm::cross(positions[i1] - positions[i0], positions[i2] - positions[i0]);
+            normals[i0] += area_normal;
+            normals[i1] += area_normal;
+            normals[i2] += area_normal;
+        }
+        for (uint32 i = 0; i < normals.size; i++)
+        {
+            float length = glm::length(normals[i]);
+            normals[i] = length > 0.0f ? normals[i] / length : glm::vec3(0.0f, 1.0f, 0.0f);
+        }
+    }
+
+    VertexGLSL *vertices = &out_mesh.vertices._data[range.first_vertex];
+    for (uint32 i = 0; i < range.vertex_count; i++)
+    {
+        glm::vec2 uv = i < tex_coords.size ? tex_coords[i] : glm::vec2(0.0f);
+        vertices[i] = VertexGLSL(positions[i], normals[i], uv);
+    }
+
+    IndexedTriangleGLSL *triangles = &out_mesh.triangles._data[range.first_tri];
+    for (uint32 i = 0; i < range.tri_count; i++)
+    {
+        triangles[i].vertices[0] = range.first_vertex + indices[i * 3];
+        triangles[i].vertices[1] = range.first_vertex + indices[i * 3 + 1];
+        triangles[i].vertices[2] = range.first_vertex + indices[i * 3 + 2];
+        triangles[i].mat_index = range.mat_index;
+    }
+
+    // Position offsets of the morph targets, one for each target after the
+    // other for every vertex. Targets that are missing or don't match the
+    // vertices of the primitive don't move it.
+    glm::vec3 *deltas = &out_mesh.morph_deltas._data[range.first_morph_delta];
+    memset(deltas, 0, (size_t) range.vertex_count * range.morph_target_count * sizeof(glm::vec3));
+
+    Array<glm::vec3> target_positions;
+    for (uint32 target_index = 0; target_index < range.morph_target_count && target_index < primitive->targets_count; target_index++)
+    {
+        cgltf_morph_target *target = &primitive->targets[target_index];
+        cgltf_accessor *accessor = find_attribute(target->attributes, target->attributes_count, cgltf_attribute_type_position);
+        if (accessor == nullptr || accessor->count != range.vertex_count || accessor->type != cgltf_type_vec3)
+        {
+            continue;
+        }
+
+        unpack_accessor(accessor, target_positions);
+        for (uint32 i = 0; i < range.vertex_count; i++)
+        {
+            deltas[i * range.morph_target_count + target_index] = target_positions[i];
+        }
+    }
+
+    // Joints and weights of the skin. The vertices of a primitive without
+    // them get no weights, which the skin leaves where they are.
+    if (range.first_joint_vertex != (uint32) -1)
+    {
+        glm::uvec4 *joints = &out_mesh.vertex_joints._data[range.first_joint_vertex];
+        glm::vec4 *weights = &out_mesh.joint_weights._data[range.first_joint_vertex];
+        memset(joints, 0, range.vertex_count * sizeof(glm::uvec4));
+        memset(weights, 0, range.vertex_count * sizeof(glm::vec4));
+
+        cgltf_accessor *joint_accessor = find_attribute(primitive->attributes, primitive->attributes_count, cgltf_attribute_type_joints);
+        cgltf_accessor *weight_accessor = find_attribute(primitive->attributes, primitive->attributes_count, cgltf_attribute_type_weights);
+        if (joint_accessor != nullptr && weight_accessor != nullptr &&
+            joint_accessor->count == range.vertex_count && weight_accessor->count == range.vertex_count)
+        {
+            for (uint32 i = 0; i < range.vertex_count; i++)
+            {
+                cgltf_uint vertex_joints[4];
+                cgltf_accessor_read_uint(joint_accessor, i, vertex_joints, 4);
+                joints[i] = glm::uvec4(vertex_joints[0], vertex_joints[1], vertex_joints[2], vertex_joints[3]);
+                cgltf_accessor_read_float(weight_accessor, i, &weights[i].x, 4);
+            }
+        }
+    }
+
+    return true;
+}
+
+// Rest pose of the node. Its morph target weights default to those of
+// its mesh.
+static ModelNode load_node(cgltf_data *data, cgltf_node *node, Model &out_mesh)
+{
+    ModelNode result;
+    result.parent = node->parent != nullptr ? (int32) (node->parent - data->nodes) : -1;
+    result.translation = node->has_translation ? glm::vec3(node->translation[0], node->translation[1], node->translation[2]) : glm::vec3(0.0f);
+    result.rotation = node->has_rotation ? glm::fquat(node->rotation[3], node->rotation[0], node->rotation[1], node->rotation[2]) : glm::fquat(1.0f, 0.0f, 0.0f, 0.0f);
+    result.scale = node->has_scale ? glm::vec3(node->scale[0], node->scale[1], node->scale[2]) : glm::vec3(1.0f);
+    result.has_matrix = node->has_matrix;
+
+    cgltf_float *m = node->matrix;
+    result.matrix = glm::mat4(glm::vec4(m[0], m[1], m[2], m[3]),
+                              glm::vec4(m[4], m[5], m[6], m[7]),
+                              glm::vec4(m[8], m[9], m[10], m[11]),
+                              glm::vec4(m[12], m[13], m[14], m[15]));
+
+    result.skin = node->skin != nullptr ? (int32) (node->skin - data->skins) : -1;
+
+    result.first_weight = out_mesh.node_weights.size;
+    result.weight_count = node->mesh != nullptr ? mesh_morph_target_count(node->mesh) : 0;
+    for (uint32 i = 0; i < result.weight_count; i++)
+    {
+        float weight = 0.0f;
+        if (i < node->weights_count)
+            weight = node->weights[i];
+        else if (i < node->mesh->weights_count)
+            weight = node->mesh->weights[i];
+        out_mesh.node_weights.append(weight);
+    }
+
+    return result;
+}
+
+// Joint nodes and inverse bind matrices of every skin. Joints without an
+// inverse bind matrix get the identity, as glTF specifies.
+static void load_skins(cgltf_data *data, Model &out_mesh)
+{
+    for (cgltf_size skin_index = 0; skin_index < data->skins_count; skin_index++)
+    {
+        cgltf_skin *skin = &data->skins[skin_index];
+
+        ModelSkin result;
+        result.first_joint = out_mesh.skin_joints.size;
+        result.joint_count = (uint32) skin->joints_count;
+        for (cgltf_size joint = 0; joint < skin->joints_count; joint++)
+        {
+            glm::mat4 inverse_bind_matrix(1.0f);
+            if (skin->inverse_bind_matrices != nullptr && joint < skin->inverse_bind_matrices->count)
+            {
+                cgltf_accessor_read_float(skin->inverse_bind_matrices, joint, &inverse_bind_matrix[0][0], 16);
+            }
+
+            out_mesh.skin_joints.append((uint32) (skin->joints[joint] - data->nodes));
+            out_mesh.inverse_bind_matrices.append(inverse_bind_matrix);
+        }
+        out_mesh.skins.append(result);
+    }
+
+    if (data->skins_count > 0)
+    {
+        printf("--> Skins: %zu, %u joints\n", data->skins_count, out_mesh.skin_joints.size);
+    }
+}
+
+// Loads the channels of the first animation of the file. Other animations
+// are usually alternatives (walk, run, ...) rather than meant to play at
+// the same time.
+static void load_animation(cgltf_data *data, Model &out_mesh)
+{
+    if (data->animations_count == 0)
+    {
+        return;
+    }
+
+    cgltf_animation *animation = &data->animations[0];
+    for (cgltf_size channel_index = 0; channel_index < animation->channels_count; channel_index++)
+    {
+        cgltf_animation_channel *channel = &animation->channels[channel_index];
+        cgltf_animation_sampler *sampler = channel->sampler;
+        if (channel->target_node == nullptr || sampler->input->count == 0)
+        {
+            continue;
+        }
+
+        AnimationChannel result;
+        result.node_index = (uint32) (channel->target_node - data->nodes);
+        switch (channel->target_path)
+        {
+            case cgltf_animation_path_type_translation:
+                result.path = AnimationPath::TRANSLATION;
+                break;
+            case cgltf_animation_path_type_rotation:
+                result.path = AnimationPath::ROTATION;
+                break;
+            case cgltf_animation_path_type_scale:
+                result.path = AnimationPath::SCALE;
+                break;
+            case cgltf_animation_path_type_weights:
+                result.path = AnimationPath::WEIGHTS;
+                break;
+            default:
+                continue;
+        }
+
+        switch (sampler->interpolation)
+        {
+            case cgltf_interpolation_type_step:
+                result.interpolation = AnimationInterpolation::STEP;
+                break;
+            case cgltf_interpolation_type_cubic_spline:
+                result.interpolation = AnimationInterpolation::CUBIC_SPLINE;
+                break;
+            default:
+                result.interpolation = AnimationInterpolation::LINEAR;
+                break;
+        }
+
+        uint32 values_per_key = result.interpolation == AnimationInterpolation::CUBIC_SPLINE ? 3 : 1;
+        result.key_count = (uint32) sampler->input->count;
+        result.component_count = (uint32) (sampler->output->count * cgltf_num_components(sampler->output->type) /
+                                           (sampler->input->count * values_per_key));
+
+        result.first_key = out_mesh.animation_times.size;
+        result.first_value = out_mesh.animation_values.size;
+        append_accessor_floats(sampler->input, out_mesh.animation_times);
+        append_accessor_floats(sampler->output, out_mesh.animation_values);
+        out_mesh.animation_channels.append(result);
+
+        float end_time = out_mesh.animation_times[out_mesh.animation_times.size - 1];
+        out_mesh.animation_duration = pixl::max(out_mesh.animation_duration, end_time);
+    }
+
+    printf("--> Animation channels: %u, %.2f seconds\n", out_mesh.animation_channels.size, out_mesh.animation_duration);
+}
+
+bool LoadGLTF(const char *path, Model &out_mesh, bool upload_textures)
+{
+    unsigned long long start_allocations = array_allocation_count.load();
+
+    GLTFFileMappings mappings;
+    cgltf_options options = mapped_gltf_options(mappings);
     cgltf_data *data = nullptr;
 
     // Parse GLTF / GLB file with given options and put metadata into `data`
@@ -41,32 +795,34 @@ bool LoadGLTF(const char *path, Model &out_mesh)
         printf("--> Number of buffer views: %zu\n", num_buffer_views);
         printf("--> Number of textures: %zu\n", num_textures);
 
-        constexpr uint64 texture_layer_width = 512;
-        constexpr uint64 texture_layer_height = 512;
+        // The materials always get their records, the CPU renderer samples
+        // them from the texture tiles instead of the atlas
+        Array<int32> image_records;
+        Array<cgltf_texture *> record_textures;
+        assign_texture_records(data, image_records, record_textures);
 
-        int32 num_loaded_textures = 0;
-        if (num_textures > 0)
-        {
-            glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &out_mesh.texture_array);
-            glBindTextureUnit(2, out_mesh.texture_array);
-            glTextureStorage3D(out_mesh.texture_array,
-                               1,
-                               GL_RGB8,
-                               texture_layer_width,
-                               texture_layer_height,
-                               (GLsizei) num_textures);
-        }
+        // Where the geometry of every primitive goes is decided up front, so
+        // that the model arrays are allocated once and the primitives can be
+        // assembled in parallel
+        Array<PrimitiveRange> primitive_ranges;
+        uint32 vertex_total = out_mesh.vertices.size;
+        uint32 tri_total = out_mesh.triangles.size;
+        uint32 morph_delta_total = out_mesh.morph_deltas.size;
+        uint32 joint_vertex_total = out_mesh.vertex_joints.size;
 
         for (cgltf_size mesh_index = 0; mesh_index < num_meshes; mesh_index++)
         {
-			Array<glm::vec3> positions;
-			Array<glm::vec3> normals;
-			Array<glm::vec2> tex_coords;
-			Array<uint16> indices;
-
             cgltf_mesh *mesh = &data->meshes[mesh_index];
             cgltf_size num_mesh_primitives = mesh->primitives_count;
 
+            ModelMesh model_mesh;
+            model_mesh.first_tri = tri_total;
+            model_mesh.first_vertex = vertex_total;
+            model_mesh.morph_target_count = mesh_morph_target_count(mesh);
+            model_mesh.first_morph_delta = morph_delta_total;
+            model_mesh.has_joints = mesh_has_joints(mesh);
+            model_mesh.first_joint_vertex = joint_vertex_total;
+
             for (cgltf_size mesh_prim_index = 0; mesh_prim_index < num_mesh_primitives; mesh_prim_index++)
             {
                 cgltf_primitive *primitive = &mesh->primitives[mesh_prim_index];
@@ -79,85 +835,10 @@ bool LoadGLTF(const char *path, Model &out_mesh)
                     return false;
                 }
 
-                // Load attribute data that primitive uses
-                for (cgltf_size attr_index = 0; attr_index < primitive->attributes_count; attr_index++)
-                {
-                    cgltf_attribute *attribute = &primitive->attributes[attr_index];
-                    if (attribute->type == cgltf_attribute_type_position ||
-                        attribute->type == cgltf_attribute_type_normal ||
-                        attribute->type == cgltf_attribute_type_texcoord)
-                    {
-                        cgltf_accessor *accessor = attribute->data;
-                        cgltf_buffer_view *view = accessor->buffer_view;
-                        cgltf_size stride = view->stride != 0 ? view->stride : accessor->stride;
-
-                        for (uint32 i = 0; i < accessor->count; i++)
-                        {
-                            float *start = (float *) ((uint8 *) view->buffer->data + view->offset + accessor->offset +
-                                                      stride * i);
-
-                            if (accessor->type == cgltf_type_vec3)
-                            {
-                                glm::vec3 vec3;
-                                vec3.x = *((float *) start);
-                                vec3.y = *((float *) start + 1);
-                                vec3.z = *((float *) start + 2);
-
-                                if (attribute->type == cgltf_attribute_type_position)
-                                {
-                                    positions.append(vec3);
-                                }
-                                else if (attribute->type == cgltf_attribute_type_normal)
-                                {
-                                    normals.append(vec3);
-                                }
-                                else
-                                {
-                                    printf("ERROR (glTF Loader): This attribute type is unsupported!\n");
-                                    cgltf_free(data);
-                                    return false;
-                                }
-                            }
-                            else if (accessor->type == cgltf_type_vec2)
-                            {
-                                glm::vec2 vec2;
-                                vec2.x = *((float *) start);
-                                vec2.y = *((float *) start + 1);
-
-                                if (attribute->type == cgltf_attribute_type_texcoord)
-                                {
-                                    tex_coords.append(vec2);
-                                }
-                                else
-                                {
-                                    printf("ERROR (glTF Loader): This attribute type is unsupported!\n");
-                                    cgltf_free(data);
-                                    return false;
-                                }
-                            }
-                        }
-                    }
-                }
-
-                // Load indices that primitive uses
+                if (!check_primitive_accessors(primitive))
                 {
-                    cgltf_accessor *indices_accessor = primitive->indices;
-                    if (indices_accessor != nullptr && (indices_accessor->type != cgltf_type_scalar ||
-                                                        indices_accessor->component_type != cgltf_component_type_r_16u))
-                    {
-                        printf("ERROR (glTF Loader): Indices accessor type or component type is wrong!\n");
-                        cgltf_free(data);
-                        return false;
-                    }
-
-                    cgltf_buffer_view *view = indices_accessor->buffer_view;
-                    cgltf_size stride = view->stride != 0 ? view->stride : indices_accessor->stride;
-
-                    for (cgltf_size i = 0; i < indices_accessor->count; i++)
-                    {
-                        uint16 val = *(uint16 *) ((uint8 *) view->buffer->data + view->offset + stride * i);
-                        indices.append(val);
-                    }
+                    cgltf_free(data);
+                    return false;
                 }
 
                 // Load material that primitive uses
@@ -195,77 +876,7 @@ bool LoadGLTF(const char *path, Model &out_mesh)
 								return false;
 							}
 
-							if (mat_properties.base_color_texture.texture != nullptr)
-							{
-								cgltf_image *image = mat_properties.base_color_texture.texture->image;
-
-								void *image_data_start = (void *)((uint8 *)image->buffer_view->buffer->data + image->buffer_view->offset);
-								cgltf_size len = image->buffer_view->size;
-
-								int w = -1;
-								int h = -1;
-								int channels = -1;
-
-								stbi_uc *image_data = stbi_load_from_memory((stbi_uc *)image_data_start,
-																			(int)len,
-																			&w,
-																			&h,
-																			&channels,
-																			3);
-								if (image_data == nullptr)
-								{
-									printf("ERROR (glTF Loader / Textures): Failed to load texture!\n");
-									cgltf_free(data);
-									return false;
-								}
-
-								if ((w != texture_layer_width || h != texture_layer_height) && channels != -1)
-								{
-									stbi_uc *resized_image_data = new stbi_uc[texture_layer_width * texture_layer_height * (uint64)channels];
-									stbir_resize_uint8(image_data, w, h, 0,
-													   resized_image_data, 512, 512, 0, channels);
-
-									if (resized_image_data != nullptr)
-									{
-										stbi_image_free(image_data);
-										image_data = resized_image_data;
-									}
-								}
-
-								// TODO: Abstract away texture loading and keep track how
-								// many textures the program has actually loaded, globally
-								// NOTE: Now the textures that the Display creation creates
-								// are just the framebuffer and the skybox textures.
-								int32 texture_index = num_loaded_textures++;
-								diffuse_tex_index = texture_index;
-
-								cgltf_sampler *sampler = mat_properties.base_color_texture.texture->sampler;
-								cgltf_int min_filter_mode = (sampler != nullptr) ? sampler->min_filter : GL_LINEAR;
-								cgltf_int mag_filter_mode = (sampler != nullptr) ? sampler->mag_filter : GL_LINEAR;
-								cgltf_int wrap_mode_s = (sampler != nullptr) ? sampler->wrap_s : GL_REPEAT;
-								cgltf_int wrap_mode_t = (sampler != nullptr) ? sampler->wrap_t : GL_REPEAT;
-
-								glTextureParameteri(out_mesh.texture_array, GL_TEXTURE_MIN_FILTER, min_filter_mode);
-								glTextureParameteri(out_mesh.texture_array, GL_TEXTURE_MAG_FILTER, mag_filter_mode);
-								glTextureParameteri(out_mesh.texture_array, GL_TEXTURE_WRAP_S, wrap_mode_s);
-								glTextureParameteri(out_mesh.texture_array, GL_TEXTURE_WRAP_T, wrap_mode_t);
-
-								glTextureSubImage3D(out_mesh.texture_array,
-													0,
-													0,
-													0,
-													texture_index,
-													texture_layer_width,
-													texture_layer_height,
-													1,
-													GL_RGB,
-													GL_UNSIGNED_BYTE,
-													image_data);
-
-								glGenerateTextureMipmap(out_mesh.texture_array);
-
-								stbi_image_free(image_data);
-							}
+							diffuse_tex_index = texture_record(data, image_records, base_color_texture(material));
 
 							if (mat_properties.metallic_factor < EPSILON)
 							{
@@ -300,103 +911,345 @@ bool LoadGLTF(const char *path, Model &out_mesh)
                     out_mesh.materials.append(result_mat);
                 }
 
-				// We need to duplicate the triangle data as the engine doesn't support indices
-				for (uint32 i = 0; i <= indices.size - 3; i += 3)
-				{
-					Array<glm::vec3> tri_positions;
-					Array<glm::vec3> tri_normals;
-					Array<glm::vec2> tri_tex_coords;
-
-					uint16 i0 = indices[i];
-					uint16 i1 = indices[i + 1];
-					uint16 i2 = indices[i + 2];
-
-					glm::vec3 v0 = positions[i0];
-					glm::vec3 v1 = positions[i1];
-					glm::vec3 v2 = positions[i2];
-					tri_positions.append(v0);
-					tri_positions.append(v1);
-					tri_positions.append(v2);
-
-					glm::vec3 n0, n1, n2;
-					if (normals.size > 0)
-					{
-						n0 = normals[i0];
-						n1 = normals[i1];
-						n2 = normals[i2];
-						tri_normals.append(n0);
-						tri_normals.append(n1);
-						tri_normals.append(n2);
-					}
-
-					glm::vec2 uv0, uv1, uv2;
-					if (tex_coords.size > 0)
-					{
-						uv0 = tex_coords[i0];
-						uv1 = tex_coords[i1];
-						uv2 = tex_coords[i2];
-						tri_tex_coords.append(uv0);
-						tri_tex_coords.append(uv1);
-						tri_tex_coords.append(uv2);
-					}
-
-					Triangle tri(tri_positions, tri_normals, tri_tex_coords, mat_index);
-					out_mesh.triangles.append(tri);
-				}
+                PrimitiveRange range;
+                range.primitive = primitive;
+                range.mat_index = mat_index;
+                range.first_vertex = vertex_total;
+                range.vertex_count = primitive_vertex_count(primitive);
+                range.first_tri = tri_total;
+                range.tri_count = (primitive->indices != nullptr ? (uint32) primitive->indices->count : range.vertex_count) / 3;
+                range.first_morph_delta = morph_delta_total;
+                range.morph_target_count = model_mesh.morph_target_count;
+                range.first_joint_vertex = model_mesh.has_joints ? joint_vertex_total : (uint32) -1;
+                primitive_ranges.append(range);
+
+                vertex_total += range.vertex_count;
+                tri_total += range.tri_count;
+                morph_delta_total += range.vertex_count * range.morph_target_count;
+                joint_vertex_total += model_mesh.has_joints ? range.vertex_count : 0;
             }
+
+            model_mesh.vertex_count = vertex_total - model_mesh.first_vertex;
+            model_mesh.tri_count = tri_total - model_mesh.first_tri;
+            out_mesh.meshes.append(model_mesh);
         }
 
-        // Find model matrix if any
-		// TODO: Overhaul loading of nodes and their transformations as the below is incorrect
-		// when a specific node has a transformation that the whole hierarchy doesn't
-        for (cgltf_size node_index = 0; node_index < data->nodes_count; node_index++)
+        out_mesh.vertices.resize(vertex_total);
+        out_mesh.triangles.resize(tri_total);
+        out_mesh.morph_deltas.resize(morph_delta_total);
+        out_mesh.vertex_joints.resize(joint_vertex_total);
+        out_mesh.joint_weights.resize(joint_vertex_total);
+
+        Array<uint8> assembled(primitive_ranges.size);
+        assembled.resize(primitive_ranges.size);
+
+        // The disk reads the accessors of the primitives a little ahead while
+        // the ones before them are decoded, and the pages of a primitive are
+        // dropped again once it's in the model
+        auto prefetch = [](const MappedFile &file, size_t offset, size_t length) { file.Prefetch(offset, length); };
+        auto release = [](const MappedFile &file, size_t offset, size_t length) { file.Release(offset, length); };
+        for (uint32 i = 0; i < primitive_ranges.size && i < PRIMITIVE_PREFETCH_DISTANCE; i++)
         {
-            cgltf_node *node = &data->nodes[node_index];
-			if (node->camera != nullptr)
-			{
-				continue;
-			}
+            visit_primitive_ranges(mappings, primitive_ranges[i].primitive, prefetch);
+        }
 
-            if (node->has_matrix)
+        PARALLEL_FOR
+        for (uint32 i = 0; i < primitive_ranges.size; i++)
+        {
+            if (i + PRIMITIVE_PREFETCH_DISTANCE < primitive_ranges.size)
             {
-                cgltf_float *m = node->matrix;
-                out_mesh.model_matrix = glm::mat4(glm::vec4(m[0], m[1], m[2], m[3]),
-												  glm::vec4(m[4], m[5], m[6], m[7]),
-												  glm::vec4(m[8], m[9], m[10], m[11]),
-												  glm::vec4(m[12], m[13], m[14], m[15]));
-
-				out_mesh.ApplyModelMatrixToTris();
+                visit_primitive_ranges(mappings, primitive_ranges._data[i + PRIMITIVE_PREFETCH_DISTANCE].primitive, prefetch);
+            }
+            assembled._data[i] = assemble_primitive(primitive_ranges._data[i], out_mesh) ? 1 : 0;
+            visit_primitive_ranges(mappings, primitive_ranges._data[i].primitive, release);
+        }
 
-				continue;
+        for (uint32 i = 0; i < primitive_ranges.size; i++)
+        {
+            if (assembled[i] == 0)
+            {
+                cgltf_free(data);
+                return false;
             }
+        }
+
+        // Textures are decoded once the materials know their records
+        if (upload_textures && record_textures.size > 0 && !load_texture_atlas(path, record_textures, out_mesh))
+        {
+            cgltf_free(data);
+            return false;
+        }
 
-			if(node->has_scale)
-			{
-				glm::vec3 scale_vec(node->scale[0], node->scale[2], node->scale[1]);
-				out_mesh.model_matrix = glm::scale(out_mesh.model_matrix, scale_vec);
-			}
+        for (cgltf_size node_index = 0; node_index < data->nodes_count; node_index++)
+        {
+            out_mesh.nodes.append(load_node(data, &data->nodes[node_index], out_mesh));
+        }
+        load_skins(data, out_mesh);
 
-			if(node->has_rotation)
-			{
-				cgltf_float *rotation = node->rotation;
-				glm::fquat quaternion(rotation[3], rotation[0], rotation[1], rotation[2]);
-				out_mesh.model_matrix *= glm::mat4_cast(quaternion);
-			}
+        // Every node that references a mesh places an instance of it, with
+        // the transforms of all of its parents applied
+        Array<glm::mat4> local_matrices(out_mesh.nodes.size);
+        for (uint32 i = 0; i < out_mesh.nodes.size; i++)
+        {
+            ModelNode &node = out_mesh.nodes[i];
+            local_matrices.append(NodeLocalMatrix(node, node.translation, node.rotation, node.scale));
+        }
 
-			if(node->has_translation)
-			{
-				glm::vec3 translation_vec(node->translation[0], node->translation[2], node->translation[1]);
-				out_mesh.model_matrix = glm::translate(out_mesh.model_matrix, translation_vec);
-			}
+        Array<glm::mat4> world_matrices;
+        ComputeNodeWorldMatrices(out_mesh.nodes, local_matrices._data, world_matrices);
 
-			out_mesh.ApplyModelMatrixToTris();
+        for (cgltf_size node_index = 0; node_index < data->nodes_count; node_index++)
+        {
+            cgltf_node *node = &data->nodes[node_index];
+            if (node->mesh == nullptr)
+            {
+                continue;
+            }
+
+            ModelInstance instance;
+            instance.mesh_index = (uint32) (node->mesh - data->meshes);
+            instance.node_index = (uint32) node_index;
+            instance.transform = world_matrices[(uint32) node_index];
+            out_mesh.instances.append(instance);
         }
 
+        // Files without any nodes still show all of their meshes
+        if (out_mesh.instances.size == 0)
+        {
+            for (uint32 mesh_index = 0; mesh_index < out_mesh.meshes.size; mesh_index++)
+            {
+                out_mesh.instances.append(ModelInstance { mesh_index, (uint32) -1, glm::mat4(1.0f) });
+            }
+        }
+
+        load_animation(data, out_mesh);
+
         printf("--> Num loaded tris: %u\n", out_mesh.triangles.size);
+        printf("--> Num loaded vertices: %u\n", out_mesh.vertices.size);
+        printf("--> Num mesh instances: %u\n", out_mesh.instances.size);
+        printf("--> Array allocations: %llu\n", array_allocation_count.load() - start_allocations);
 
         cgltf_free(data);
         return true;
     }
 
     return false;
-}
\ No newline at end of file
+}
+
+bool LoadGLTFTextures(const char *path, Model &out_mesh)
+{
+    GLTFFileMappings mappings;
+    cgltf_options options = mapped_gltf_options(mappings);
+    cgltf_data *data = nullptr;
+
+    cgltf_result result = cgltf_parse_file(&options, path, &data);
+    if (result == cgltf_result_success)
+    {
+        result = cgltf_load_buffers(&options, data, path);
+    }
+
+    if (result != cgltf_result_success)
+    {
+        printf("ERROR (glTF Loader / Textures): Failed to load %s!\n", path);
+        cgltf_free(data);
+        return false;
+    }
+
+    Array<int32> image_records;
+    Array<cgltf_texture *> record_textures;
+    if (assign_texture_records(data, image_records, record_textures) > 0 && !load_texture_atlas(path, record_textures, out_mesh))
+    {
+        cgltf_free(data);
+        return false;
+    }
+
+    cgltf_free(data);
+    return true;
+}
+
+bool BuildGLTFTextureAtlas(const char *path, uint64 budget_bytes, bool cache_textures, TextureAtlas &out_atlas)
+{
+    GLTFFileMappings mappings;
+    cgltf_options options = mapped_gltf_options(mappings);
+    cgltf_data *data = nullptr;
+
+    cgltf_result result = cgltf_parse_file(&options, path, &data);
+    if (result == cgltf_result_success)
+    {
+        result = cgltf_load_buffers(&options, data, path);
+    }
+
+    if (result != cgltf_result_success)
+    {
+        printf("ERROR (glTF Loader / Textures): Failed to load %s!\n", path);
+        cgltf_free(data);
+        return false;
+    }
+
+    Array<int32> image_records;
+    Array<cgltf_texture *> record_textures;
+    bool success = assign_texture_records(data, image_records, record_textures) == 0 ||
+                   prepare_texture_atlas(path, record_textures, budget_bytes, cache_textures, out_atlas);
+
+    cgltf_free(data);
+    return success;
+}
+
+uint32 UploadTextureAtlas(const TextureAtlas &atlas, const uint8 *texels)
+{
+    GLuint texture_array = 0;
+    glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &texture_array);
+    glBindTextureUnit(2, texture_array);
+    glTextureStorage3D(texture_array,
+                       (GLsizei) TEXTURE_MIP_COUNT,
+                       texture_internal_format(atlas.format),
+                       (GLsizei) atlas.page_size,
+                       (GLsizei) atlas.page_size,
+                       (GLsizei) atlas.page_count);
+
+    glTextureParameteri(texture_array, GL_TEXTURE_MIN_FILTER, sampler_parameter(atlas.min_filter, GL_LINEAR_MIPMAP_LINEAR));
+    glTextureParameteri(texture_array, GL_TEXTURE_MAG_FILTER, sampler_parameter(atlas.mag_filter, GL_LINEAR));
+    glTextureParameteri(texture_array, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(texture_array, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // Rows of the pages are a multiple of 8 texels, but not of 4 bytes
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (uint32 level = 0; level < TEXTURE_MIP_COUNT; level++)
+    {
+        auto size = (GLsizei) atlas.LevelSize(level);
+        const uint8 *level_texels = texels + atlas.LevelOffset(level);
+        if (atlas.format != TextureFormat::RGB8)
+        {
+            glCompressedTextureSubImage3D(texture_array,
+                                          (GLint) level,
+                                          0,
+                                          0,
+                                          0,
+                                          size,
+                                          size,
+                                          (GLsizei) atlas.page_count,
+                                          texture_internal_format(atlas.format),
+                                          (GLsizei) (atlas.LevelBytes(level) * atlas.page_count),
+                                          level_texels);
+        }
+        else
+        {
+            glTextureSubImage3D(texture_array,
+                                (GLint) level,
+                                0,
+                                0,
+                                0,
+                                size,
+                                size,
+                                (GLsizei) atlas.page_count,
+                                GL_RGB,
+                                GL_UNSIGNED_BYTE,
+                                level_texels);
+        }
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    return texture_array;
+}
+
+bool WriteGLTFTextureTiles(const char *path, const char *tiles_path, uint64 key)
+{
+    auto start_time = std::chrono::steady_clock::now();
+
+    GLTFFileMappings mappings;
+    cgltf_options options = mapped_gltf_options(mappings);
+    cgltf_data *data = nullptr;
+
+    cgltf_result result = cgltf_parse_file(&options, path, &data);
+    if (result == cgltf_result_success)
+    {
+        result = cgltf_load_buffers(&options, data, path);
+    }
+
+    if (result != cgltf_result_success)
+    {
+        printf("ERROR (glTF Loader / Textures): Failed to load %s!\n", path);
+        cgltf_free(data);
+        return false;
+    }
+
+    Array<int32> image_records;
+    Array<cgltf_texture *> record_textures;
+    assign_texture_records(data, image_records, record_textures);
+
+    TextureTilesWriter writer;
+    bool success = writer.Begin(tiles_path, key);
+
+    // Only a batch of images is decoded at a time, the tiles of the whole
+    // model don't have to fit in memory
+    DecodedTexture textures[TEXTURE_TILES_DECODE_BATCH];
+    for (uint32 first = 0; first < record_textures.size && success; first += TEXTURE_TILES_DECODE_BATCH)
+    {
+        uint32 count = pixl::min(TEXTURE_TILES_DECODE_BATCH, record_textures.size - first);
+        success = decode_record_textures(record_textures, first, count, textures);
+        for (uint32 i = 0; i < count && success; i++)
+        {
+            writer.Add(textures[i]);
+        }
+        free_textures(textures, count);
+    }
+
+    success = writer.Finish() && success;
+    cgltf_free(data);
+
+    if (success)
+    {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+        printf("--> Texture tiles of %u textures ready in %.1f ms\n", record_textures.size, elapsed.count());
+    }
+    return success;
+}
+
+static bool hash_file(const char *path, uint64 &hash)
+{
+    MappedFile file;
+    if (!file.Open(path))
+    {
+        return false;
+    }
+
+    hash = HashCombine(hash, HashBytes(file.data, file.size));
+    return true;
+}
+
+bool HashGLTFSource(const char *path, uint64 &out_hash)
+{
+    uint64 hash = 0;
+    if (!hash_file(path, hash))
+    {
+        return false;
+    }
+
+    // A .gltf file can keep its buffers in separate files next to it.
+    // Only the JSON is parsed here, the buffers are hashed as they are.
+    GLTFFileMappings mappings;
+    cgltf_options options = mapped_gltf_options(mappings);
+    cgltf_data *data = nullptr;
+    if (cgltf_parse_file(&options, path, &data) != cgltf_result_success)
+    {
+        return false;
+    }
+
+    std::string directory(path);
+    size_t separator = directory.find_last_of("/\\");
+    directory = separator == std::string::npos ? std::string() : directory.substr(0, separator + 1);
+
+    bool success = true;
+    for (cgltf_size i = 0; i < data->buffers_count && success; i++)
+    {
+        const char *uri = data->buffers[i].uri;
+        if (uri != nullptr && strncmp(uri, "data:", 5) != 0 && strstr(uri, "://") == nullptr)
+        {
+            success = hash_file((directory + uri).c_str(), hash);
+        }
+    }
+
+    cgltf_free(data);
+    out_hash = hash;
+    return success;
+}
@@ -1,4 +1,29 @@
 #pragma once
 #include "scene/model.h"
 
-bool LoadGLTF(const char *path, Model &out_mesh);
+// Loads all meshes of a glTF / GLB file into `out_mesh`. When `upload_textures`
+// is false the base color textures are skipped and no OpenGL calls are made,
+// but the materials still get the record indices of their textures.
+bool LoadGLTF(const char *path, Model &out_mesh, bool upload_textures = true);
+
+// Only packs and uploads the texture atlas of the file, with the same
+// record indices that LoadGLTF gives the materials. Used when the geometry
+// comes from the scene cache.
+bool LoadGLTFTextures(const char *path, Model &out_mesh);
+
+// Builds the texture atlas of the file like LoadGLTFTextures, or reads it
+// from `<path>.textures` with `cache_textures`, but keeps it in memory
+// instead of uploading it. Leaves the atlas empty if nothing is textured.
+bool BuildGLTFTextureAtlas(const char *path, uint64 budget_bytes, bool cache_textures, TextureAtlas &out_atlas);
+
+// Creates a texture array with the pages of the atlas and returns it.
+// `texels` holds the levels in the layout of `atlas.texels`, but doesn't
+// have to be that array, so pages can be uploaded from a mapped file.
+uint32 UploadTextureAtlas(const TextureAtlas &atlas, const uint8 *texels);
+
+// Writes the base color textures of the file as tiled mip pyramids, in the
+// order of their record indices, for the texture cache of the CPU renderer
+bool WriteGLTFTextureTiles(const char *path, const char *tiles_path, uint64 key);
+
+// Hash of the contents of the file and of any external buffer files it uses
+bool HashGLTFSource(const char *path, uint64 &out_hash);
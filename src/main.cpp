@@ -1,66 +1,129 @@
-#include "core/utils.h"
 #include "display/display.hpp"
-#include "glm/trigonometric.hpp"
 #include "loader.h"
 #include "math/math.hpp"
-#include "scene/bvh.h"
 #include "scene/camera.hpp"
-#include "scene/material.hpp"
-#include "scene/sphere.hpp"
+#include "scene/scene.hpp"
+#include "scene/scene_buffers.hpp"
+#include "scene/scene_file.hpp"
 
-int main(int argc, char *argv[])
-{
-    (void) argc;
-    (void) argv;
+#include <cstdlib>
+#include <cstring>
 
-    Display display("Pathtracer", WIDTH, HEIGHT, FRAMERATE);
+// Marks the buffers that PollSceneStream or SwapRefinedBVH replaced. The
+// vertices stay as they are.
+static void mark_geometry(SceneBuffers &scene_buffers)
+{
+    scene_buffers.MarkDirty(SceneBuffer::TRIANGLES);
+    scene_buffers.MarkDirty(SceneBuffer::LIGHT_TRIS);
+    scene_buffers.MarkDirty(SceneBuffer::BVH_NODES);
+    scene_buffers.MarkDirty(SceneBuffer::INSTANCES);
+    scene_buffers.MarkDirty(SceneBuffer::TLAS_NODES);
+}
 
-	Model model;
-    if (!LoadGLTF("res/models/CornellBox_lit.glb", model))
+int main(int argc, char *argv[])
+{
+    const char *model_path = "res/models/CornellBox_lit.glb";
+    BVHBuildOptions bvh_options;
+    bool use_scene_cache = true;
+    bool use_stream = true;
+    bool preview_bvh = true;
+    uint64 texture_budget_mb = TEXTURE_BUDGET_BYTES / (1024 * 1024);
+    for (int i = 1; i < argc; i++)
     {
-        printf("Failed to load model!\n");
-        return -1;
+        if (strcmp(argv[i], "--model") == 0 && i + 1 < argc)
+        {
+            model_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--builder") == 0 && i + 1 < argc)
+        {
+            if (!ParseBVHBuilder(argv[++i], bvh_options.builder))
+            {
+                printf("ERROR: Unknown BVH builder '%s'! Expected sweep, binned, sbvh, lbvh or ploc.\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--optimize-bvh") == 0)
+        {
+            bvh_options.optimize = true;
+        }
+        else if (strcmp(argv[i], "--no-cache") == 0)
+        {
+            use_scene_cache = false;
+        }
+        else if (strcmp(argv[i], "--no-stream") == 0)
+        {
+            use_stream = false;
+        }
+        else if (strcmp(argv[i], "--no-preview-bvh") == 0)
+        {
+            preview_bvh = false;
+        }
+        else if (strcmp(argv[i], "--texture-budget") == 0 && i + 1 < argc)
+        {
+            texture_budget_mb = strtoull(argv[++i], nullptr, 10);
+        }
+        else
+        {
+            printf("Usage: %s [--model <path>] [--builder sweep|binned|sbvh|lbvh|ploc] [--optimize-bvh] [--no-cache] [--no-stream] [--no-preview-bvh] [--texture-budget <MB>]\n", argv[0]);
+            return strcmp(argv[i], "--help") == 0 ? 0 : -1;
+        }
     }
 
-    // Apply model matrix to tris
-	model.Translate(glm::vec3(0.0f, -2.0f, -6.0f));
-	model.Rotate(glm::vec3(0.0f, glm::radians(-90.0f), 0.0f));
-	model.Scale(2.0f);
-	model.ApplyModelMatrixToTris();
-
-    Array<TriangleGLSL> unsorted_model_tris = model.ConvertToSSBOFormat();
-
-    Array<TriangleGLSL> model_glsl_tris;
-    Array<BVHNodeGLSL> bvh_ssbo = CalculateBVH(unsorted_model_tris, model_glsl_tris);
-
-    // Set up data to be passed to SSBOs
+    Display display("Pathtracer", WIDTH, HEIGHT, FRAMERATE);
 
-    Array<MaterialGLSL> materials_ssbo = model.materials;
-//	materials_ssbo.append(MaterialGLSL(glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(1000.0f), 0.0f, 0, MaterialType::MATERIAL_LIGHT));
+    // A scene on the CPU keeps its buffers up to date through the scene
+    // buffers, a baked one is uploaded once into `baked_ssbo_array` and
+    // only takes its stack spill buffer from them
+    Scene scene;
+    SceneBuffers scene_buffers;
+    Array<GLuint> baked_ssbo_array;
+    bool is_baked = IsSceneFile(model_path);
+    GLuint texture_array = (uint32) -1;
+    bool has_geometry = true;
 
-    Array<SphereGLSL> spheres_ssbo;
-//	spheres_ssbo.append(SphereGLSL(glm::vec3(6.5f, 2.0f, -3.0f), 0.1f, materials_ssbo.size - 1));
+    // A model is streamed in by default, rendering starts with its first
+    // meshes while the others are still being built
+    SceneStream scene_stream;
+    bool is_streaming = false;
 
-	materials_ssbo.append(MaterialGLSL(glm::vec3(0.0f), glm::vec3(0.944f, 0.776f, 0.373f), glm::vec3(0.0f), 0.0f, -1, MaterialType::MATERIAL_SPECULAR_METAL));
-	spheres_ssbo.append(SphereGLSL(glm::vec3(-1.0f, 1.0f, -5.0f), 0.3f, materials_ssbo.size - 1));
-	materials_ssbo.append(MaterialGLSL(glm::vec3(0.0f), glm::vec3(0.944f, 0.776f, 0.373f), glm::vec3(0.0f), 0.1f, -1, MaterialType::MATERIAL_SPECULAR_METAL));
-	spheres_ssbo.append(SphereGLSL(glm::vec3(-0.4f, 1.0f, -5.0f), 0.3f, materials_ssbo.size - 1));
-	materials_ssbo.append(MaterialGLSL(glm::vec3(0.0f), glm::vec3(0.944f, 0.776f, 0.373f), glm::vec3(0.0f), 0.15f, -1, MaterialType::MATERIAL_SPECULAR_METAL));
-	spheres_ssbo.append(SphereGLSL(glm::vec3(0.2f, 1.0f, -5.0f), 0.3f, materials_ssbo.size - 1));
-	materials_ssbo.append(MaterialGLSL(glm::vec3(0.0f), glm::vec3(0.944f, 0.776f, 0.373f), glm::vec3(0.0f), 0.2f, -1, MaterialType::MATERIAL_SPECULAR_METAL));
-	spheres_ssbo.append(SphereGLSL(glm::vec3(0.8f, 1.0f, -5.0f), 0.3f, materials_ssbo.size - 1));
+    // A model that has to be built is rendered with quick LBVHs until the
+    // BVHs of the chosen builder are done
+    BVHRefinement refinement;
 
-	// Find all emissive primitives in scene
-	Array<uint32> emissive_tris = FindEmissiveTris(model_glsl_tris, materials_ssbo);
-    Array<uint32> emissive_spheres_ssbo = FindEmissiveSpheres(spheres_ssbo, materials_ssbo);
+    // A baked scene is uploaded from where it is mapped, nothing of it is
+    // needed on the CPU
+    if (is_baked)
+    {
+        SceneFile scene_file;
+        if (!scene_file.Open(model_path))
+        {
+            printf("Failed to load model!\n");
+            return -1;
+        }
+        UploadSceneFile(scene_file, baked_ssbo_array, texture_array);
+        scene_buffers.BindStackSpill(scene_file);
+    }
+    else if (use_stream)
+    {
+        if (!StartSceneStream(model_path, scene_stream, true, texture_budget_mb * 1024 * 1024, bvh_options, use_scene_cache, preview_bvh))
+        {
+            printf("Failed to load model!\n");
+            return -1;
+        }
+        is_streaming = true;
+        has_geometry = false;
+    }
+    else
+    {
+        scene.model.texture_budget = texture_budget_mb * 1024 * 1024;
+        if (!LoadScene(model_path, scene, true, bvh_options, use_scene_cache, preview_bvh ? &refinement : nullptr))
+        {
+            printf("Failed to load model!\n");
+            return -1;
+        }
 
-    Array<GLuint> ssbo_array;
-    PushDataToSSBO(spheres_ssbo, ssbo_array);
-    PushDataToSSBO(model_glsl_tris, ssbo_array);
-    PushDataToSSBO(emissive_tris, ssbo_array);
-    PushDataToSSBO(materials_ssbo, ssbo_array);
-    PushDataToSSBO(bvh_ssbo, ssbo_array);
-    PushDataToSSBO(emissive_spheres_ssbo, ssbo_array);
+        texture_array = scene.model.texture_array;
+    }
 
     glUseProgram(display.compute_shader.id);
 
@@ -73,6 +136,59 @@ int main(int argc, char *argv[])
 
         cam.move(display.keyboard_state, display.delta_time, display.frame_count);
 
+        // Whatever arrived replaces the buffers, and the image accumulates anew
+        if (is_streaming)
+        {
+            TextureAtlas atlas;
+            SceneStreamUpdate update = PollSceneStream(scene_stream, scene, atlas);
+            if (update.failed)
+            {
+                printf("Failed to load model!\n");
+                scene_buffers.Release();
+                display.CloseDisplay();
+                return -1;
+            }
+
+            if (update.textures)
+            {
+                texture_array = UploadTextureAtlas(atlas, atlas.texels._data);
+            }
+
+            // The vertices arrive before the first meshes that use them
+            if (update.geometry)
+            {
+                mark_geometry(scene_buffers);
+                scene_buffers.MarkDirty(SceneBuffer::VERTICES);
+                has_geometry = true;
+            }
+
+            // The first materials come with the default spheres
+            if (update.materials)
+            {
+                scene_buffers.MarkDirty(SceneBuffer::MATERIALS);
+                scene_buffers.MarkDirty(SceneBuffer::SPHERES);
+                scene_buffers.MarkDirty(SceneBuffer::EMISSIVE_SPHERES);
+            }
+
+            if (update.textures)
+            {
+                scene_buffers.MarkDirty(SceneBuffer::MATERIALS);
+                scene_buffers.MarkDirty(SceneBuffer::TEXTURE_RECORDS);
+            }
+
+            if (update.geometry || update.materials || update.textures)
+            {
+                display.frame_count = 0;
+            }
+
+            is_streaming = !update.done;
+        }
+        else if (SwapRefinedBVH(refinement, scene))
+        {
+            mark_geometry(scene_buffers);
+            display.frame_count = 0;
+        }
+
         glClear(GL_COLOR_BUFFER_BIT);
 
         glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 0, -1, "COMPUTE");
@@ -82,9 +198,9 @@ int main(int argc, char *argv[])
 
             glBindTextureUnit(1, display.cubemap_texture);
 
-			if(model.texture_array != (uint32) -1)
+			if(texture_array != (uint32) -1)
 			{
-            	glBindTextureUnit(2, model.texture_array);
+            	glBindTextureUnit(2, texture_array);
 			}
 
             if (display.frame_count == 0)
@@ -97,8 +213,22 @@ int main(int argc, char *argv[])
 			FrameData frame_data { pcg32_random(), display.frame_count++, BOUNCE_COUNT, 0 };
 			glNamedBufferSubData(display.frame_data_ubo, 0, sizeof(FrameData), &frame_data);
 
-            glDispatchCompute(NUM_WORK_GROUPS_X, NUM_WORK_GROUPS_Y, 1);
-            glMemoryBarrier(GL_ALL_BARRIER_BITS);
+            // Until the first meshes of a stream arrive there's nothing to trace
+            if (has_geometry)
+            {
+                if (!is_baked)
+                {
+                    scene_buffers.Upload(scene);
+                }
+
+                glDispatchCompute(NUM_WORK_GROUPS_X, NUM_WORK_GROUPS_Y, 1);
+                glMemoryBarrier(GL_ALL_BARRIER_BITS);
+
+                if (!is_baked)
+                {
+                    scene_buffers.Fence();
+                }
+            }
 
             glBindTextureUnit(2, 0);
             glBindTextureUnit(1, 0);
@@ -120,6 +250,7 @@ int main(int argc, char *argv[])
 		display.FrameEndMarker();
     }
 
+    scene_buffers.Release();
     display.CloseDisplay();
     return 0;
 }
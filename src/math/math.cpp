@@ -156,24 +156,6 @@ glm::vec3 pixl::map_to_unit_hemisphere_cosine_weighted_criver(glm::vec2 uv, glm:
 	return normalize(p + normal);
 }
 
-glm::vec3 pixl::map_to_triangle(glm::vec2 vec2, Triangle tri)
-{
-	float u = vec2.x;
-	float v = vec2.y;
-
-	if (u + v > 1.0f)
-	{
-		// The generated point is outside triangle but
-		// within the parallelogram defined by the 2 edges
-		// of the triangle (v1-v0 and v2-v0)
-		u = 1.0f - u;
-		v = 1.0f - v;
-	}
-
-	glm::vec3 p = u * tri.edge1 + v * tri.edge2;
-	return p + tri.v0;
-}
-
 // https://jcgt.org/published/0006/01/01/
 void pixl::orthonormal_basis(glm::vec3 &n, glm::vec3 &t, glm::vec3 &bt)
 {
@@ -209,3 +191,11 @@ glm::vec2 pixl::octahedral_normal_encoding(glm::vec3 n)
 	n_xy = (n.z >= 0.0f) ? n_xy : octahedral_wrap(n_xy);
 	return n_xy;
 }
+glm::vec3 pixl::octahedral_normal_decoding(glm::vec2 f)
+{
+	glm::vec3 n(f.x, f.y, 1.0f - fabsf(f.x) - fabsf(f.y));
+	float t = pixl::max(-n.z, 0.0f);
+	n.x += n.x >= 0.0f ? -t : t;
+	n.y += n.y >= 0.0f ? -t : t;
+	return glm::normalize(n);
+}
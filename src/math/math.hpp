@@ -5,8 +5,6 @@
 #include <glm/vec3.hpp>
 #include <glm/mat3x3.hpp>
 
-struct Triangle;
-
 constexpr float PI = 3.14159265f;
 constexpr float EPSILON = 0.0001f;
 
@@ -52,8 +50,6 @@ glm::vec3 map_to_unit_sphere(glm::vec2 vec2);
 
 glm::vec3 map_to_unit_hemisphere_cosine_weighted_criver(glm::vec2 uv, glm::vec3 normal);
 
-glm::vec3 map_to_triangle(glm::vec2 vec2, Triangle tri);
-
 void orthonormal_basis(glm::vec3 &n, glm::vec3 &t, glm::vec3 &bt);
 
 glm::mat3 construct_TNB_matrix(glm::vec3 &n);
@@ -61,4 +57,6 @@ glm::mat3 construct_TNB_matrix(glm::vec3 &n);
 glm::vec2 octahedral_wrap(const glm::vec2 &v);
 
 glm::vec2 octahedral_normal_encoding(glm::vec3 n);
+
+glm::vec3 octahedral_normal_decoding(glm::vec2 f);
 }
@@ -0,0 +1,1306 @@
+#include "mesh_loader.h"
+#include "loader.h"
+#include "core/hash.hpp"
+#include "core/mapped_file.hpp"
+#include "math/math.hpp"
+#include "scene/material.hpp"
+#include "scene/scene_file.hpp"
+
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <string>
+
+// Like in bvh.cpp, serial when OpenMP isn't available. Every iteration
+// is a whole chunk, so they are handed out one at a time.
+#if defined(_OPENMP)
+#define PARALLEL_FOR _Pragma("omp parallel for schedule(dynamic, 1)")
+#else
+#define PARALLEL_FOR
+#endif
+
+// Text that one task of the OBJ loader parses. It ends after the first
+// newline past this many bytes.
+constexpr uint64 OBJ_CHUNK_BYTES = 4ull * 1024 * 1024;
+
+// Vertices, faces or triangles that one task handles
+constexpr uint32 MESH_CHUNK_ELEMENTS = 64 * 1024;
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start_time)
+{
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+	return elapsed.count();
+}
+
+static uint32 chunk_count(uint32 element_count)
+{
+	return (element_count + MESH_CHUNK_ELEMENTS - 1) / MESH_CHUNK_ELEMENTS;
+}
+
+// Every vertex gets the area weighted normal of the triangles around it,
+// like glTF primitives without normals
+static void compute_vertex_normals(const Array<glm::vec3> &positions, const Array<IndexedTriangleGLSL> &triangles, Array<glm::vec3> &out_normals)
+{
+	out_normals.resize(positions.size);
+	memset(out_normals._data, 0, (size_t) positions.size * sizeof(glm::vec3));
+	for (uint32 i = 0; i < triangles.size; i++)
+	{
+		const uint32 *corners = triangles._data[i].vertices;
+		glm::vec3 p0 = positions._data[corners[0]];
+		glm::vec3 area_normal = glm::cross(positions._data[corners[1]] - p0, positions._data[corners[2]] - p0);
+		out_normals._data[corners[0]] += area_normal;
+		out_normals._data[corners[1]] += area_normal;
+		out_normals._data[corners[2]] += area_normal;
+	}
+
+	PARALLEL_FOR
+	for (uint32 chunk = 0; chunk < chunk_count(positions.size); chunk++)
+	{
+		uint32 end = pixl::min((chunk + 1) * MESH_CHUNK_ELEMENTS, positions.size);
+		for (uint32 i = chunk * MESH_CHUNK_ELEMENTS; i < end; i++)
+		{
+			float length = glm::length(out_normals._data[i]);
+			out_normals._data[i] = length > 0.0f ? out_normals._data[i] / length : glm::vec3(0.0f, 1.0f, 0.0f);
+		}
+	}
+}
+
+// One vertex for every position, with the normal and texture coordinates
+// of the same index where the file has them
+static void build_shared_vertices(const Array<glm::vec3> &positions, const Array<glm::vec3> &normals, const Array<glm::vec2> &uvs,
+								  const Array<IndexedTriangleGLSL> &triangles, Array<VertexGLSL> &out_vertices)
+{
+	Array<glm::vec3> computed_normals;
+	const glm::vec3 *vertex_normals = normals._data;
+	if (normals.size != positions.size)
+	{
+		compute_vertex_normals(positions, triangles, computed_normals);
+		vertex_normals = computed_normals._data;
+	}
+
+	out_vertices.resize(positions.size);
+
+	PARALLEL_FOR
+	for (uint32 chunk = 0; chunk < chunk_count(positions.size); chunk++)
+	{
+		uint32 end = pixl::min((chunk + 1) * MESH_CHUNK_ELEMENTS, positions.size);
+		for (uint32 i = chunk * MESH_CHUNK_ELEMENTS; i < end; i++)
+		{
+			glm::vec2 uv = i < uvs.size ? uvs._data[i] : glm::vec2(0.0f);
+			out_vertices._data[i] = VertexGLSL(positions._data[i], vertex_normals[i], uv);
+		}
+	}
+}
+
+// Makes the vertices and triangles the single mesh and instance of the model
+static void finish_model(Array<VertexGLSL> &vertices, Array<IndexedTriangleGLSL> &triangles, Model &out_mesh)
+{
+	ModelMesh mesh {};
+	mesh.tri_count = triangles.size;
+	mesh.vertex_count = vertices.size;
+
+	out_mesh.vertices.swap(vertices);
+	out_mesh.triangles.swap(triangles);
+	out_mesh.materials.append(MaterialGLSL(glm::vec3(0.8f), glm::vec3(0.0f), glm::vec3(0.0f), 0.0f, -1, MaterialType::MATERIAL_LAMBERTIAN));
+	out_mesh.meshes.append(mesh);
+	out_mesh.instances.append(ModelInstance { 0, (uint32) -1, glm::mat4(1.0f) });
+
+	printf("--> Num loaded tris: %u\n", out_mesh.triangles.size);
+	printf("--> Num loaded vertices: %u\n", out_mesh.vertices.size);
+}
+
+static void print_throughput(uint64 bytes, double parse_ms, double total_ms)
+{
+	double megabytes = (double) bytes / (1024.0 * 1024.0);
+	printf("--> Parsed %.1f MB in %.1f ms (%.0f MB/s), %.1f ms in total\n", megabytes, parse_ms, megabytes / (parse_ms / 1000.0), total_ms);
+}
+
+// ---------------------------------------------------------------------------
+// OBJ
+
+enum class OBJLine
+{
+	POSITION,
+	UV,
+	NORMAL,
+	FACE,
+	OTHER
+};
+
+// What one chunk of the text holds. The first pass counts the lines of
+// every chunk, so that the second one knows where their elements go.
+struct OBJChunk
+{
+	const char *begin;
+	const char *end;
+
+	uint32 position_count;
+	uint32 uv_count;
+	uint32 normal_count;
+	uint32 tri_count;
+
+	// Where the elements of the chunk start in the whole file
+	uint64 first_position;
+	uint64 first_uv;
+	uint64 first_normal;
+	uint64 first_tri;
+
+	bool has_corner_indices; // faces with texture coordinate or normal indices
+	bool split_corners;      // corners whose other indices differ from the position index
+	bool missing_normals;    // corners without a normal index
+	const char *error;
+};
+
+static bool is_blank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char *skip_blanks(const char *p, const char *end)
+{
+	while (p < end && is_blank(*p))
+	{
+		p++;
+	}
+	return p;
+}
+
+static const char *line_end(const char *p, const char *end)
+{
+	const char *newline = (const char *) memchr(p, '\n', (size_t) (end - p));
+	return newline != nullptr ? newline : end;
+}
+
+// Moves `p` past the keyword of the line
+static OBJLine classify_line(const char *&p, const char *end)
+{
+	p = skip_blanks(p, end);
+	if (end - p < 2)
+	{
+		return OBJLine::OTHER;
+	}
+
+	if (p[0] == 'f' && is_blank(p[1]))
+	{
+		p += 1;
+		return OBJLine::FACE;
+	}
+
+	if (p[0] != 'v')
+	{
+		return OBJLine::OTHER;
+	}
+
+	if (is_blank(p[1]))
+	{
+		p += 1;
+		return OBJLine::POSITION;
+	}
+
+	if (end - p >= 3 && is_blank(p[2]) && (p[1] == 't' || p[1] == 'n'))
+	{
+		OBJLine line = p[1] == 't' ? OBJLine::UV : OBJLine::NORMAL;
+		p += 2;
+		return line;
+	}
+
+	return OBJLine::OTHER;
+}
+
+static bool parse_floats(const char *&p, const char *end, float *out_values, uint32 count)
+{
+	for (uint32 i = 0; i < count; i++)
+	{
+		p = skip_blanks(p, end);
+		if (p < end && *p == '+')
+		{
+			p++;
+		}
+
+		std::from_chars_result result = std::from_chars(p, end, out_values[i]);
+		if (result.ec != std::errc())
+		{
+			return false;
+		}
+		p = result.ptr;
+	}
+	return true;
+}
+
+// OBJ indices start at 1, negative ones count back from the last element
+// defined before the line. Positive ones may point ahead.
+static bool parse_index(const char *&p, const char *end, uint64 defined_count, uint64 total_count, uint32 &out_index)
+{
+	long long value = 0;
+	std::from_chars_result result = std::from_chars(p, end, value);
+	if (result.ec != std::errc() || value == 0)
+	{
+		return false;
+	}
+	p = result.ptr;
+
+	long long index = value > 0 ? value - 1 : (long long) defined_count + value;
+	out_index = (uint32) index;
+	return index >= 0 && (uint64) index < total_count;
+}
+
+// Counts the elements of a chunk and the triangles its faces are split into
+static void count_obj_chunk(OBJChunk &chunk)
+{
+	for (const char *p = chunk.begin; p < chunk.end;)
+	{
+		const char *end = line_end(p, chunk.end);
+		switch (classify_line(p, end))
+		{
+			case OBJLine::POSITION: chunk.position_count++; break;
+			case OBJLine::UV: chunk.uv_count++; break;
+			case OBJLine::NORMAL: chunk.normal_count++; break;
+			case OBJLine::FACE:
+			{
+				uint32 corner_count = 0;
+				for (p = skip_blanks(p, end); p < end; p = skip_blanks(p, end))
+				{
+					const char *corner = p;
+					while (p < end && !is_blank(*p))
+					{
+						p++;
+					}
+					chunk.has_corner_indices = chunk.has_corner_indices || memchr(corner, '/', (size_t) (p - corner)) != nullptr;
+					corner_count++;
+				}
+				chunk.tri_count += corner_count >= 3 ? corner_count - 2 : 0;
+				break;
+			}
+			case OBJLine::OTHER: break;
+		}
+		p = end < chunk.end ? end + 1 : end;
+	}
+}
+
+// The indices of a face corner, ~0u for the ones it doesn't have
+struct OBJCorner
+{
+	uint32 position;
+	uint32 uv;
+	uint32 normal;
+};
+
+// Everything the file holds, the positions of the triangles are in `triangles`
+struct OBJData
+{
+	Array<glm::vec3> positions;
+	Array<glm::vec2> uvs;
+	Array<glm::vec3> normals;
+	Array<IndexedTriangleGLSL> triangles;
+	Array<uint32> corner_uvs; // 3 per triangle, only when some face has them
+	Array<uint32> corner_normals;
+};
+
+static void parse_obj_chunk(OBJChunk &chunk, OBJData &data)
+{
+	uint64 position_index = chunk.first_position;
+	uint64 uv_index = chunk.first_uv;
+	uint64 normal_index = chunk.first_normal;
+	uint64 tri_index = chunk.first_tri;
+	bool has_corner_arrays = data.corner_uvs.size > 0;
+
+	for (const char *p = chunk.begin; p < chunk.end && chunk.error == nullptr;)
+	{
+		const char *end = line_end(p, chunk.end);
+		switch (classify_line(p, end))
+		{
+			case OBJLine::POSITION:
+				if (!parse_floats(p, end, &data.positions._data[position_index++].x, 3))
+				{
+					chunk.error = "Invalid vertex position";
+				}
+				break;
+
+			case OBJLine::UV:
+				if (!parse_floats(p, end, &data.uvs._data[uv_index++].x, 2))
+				{
+					chunk.error = "Invalid texture coordinate";
+				}
+				break;
+
+			case OBJLine::NORMAL:
+				if (!parse_floats(p, end, &data.normals._data[normal_index++].x, 3))
+				{
+					chunk.error = "Invalid vertex normal";
+				}
+				break;
+
+			case OBJLine::FACE:
+			{
+				// Polygons are split into a fan around their first corner
+				OBJCorner first {}, previous {};
+				uint32 corner_count = 0;
+				for (p = skip_blanks(p, end); p < end && chunk.error == nullptr; p = skip_blanks(p, end))
+				{
+					OBJCorner corner { 0, ~0u, ~0u };
+					bool valid = parse_index(p, end, position_index, data.positions.size, corner.position);
+					if (valid && p < end && *p == '/')
+					{
+						p++;
+						if (p < end && *p != '/')
+						{
+							valid = parse_index(p, end, uv_index, data.uvs.size, corner.uv);
+						}
+						if (valid && p < end && *p == '/')
+						{
+							p++;
+							valid = parse_index(p, end, normal_index, data.normals.size, corner.normal);
+						}
+					}
+
+					if (!valid || (p < end && !is_blank(*p)))
+					{
+						chunk.error = "Invalid face or face with missing vertices";
+						break;
+					}
+
+					chunk.split_corners = chunk.split_corners || (corner.uv != ~0u && corner.uv != corner.position) ||
+										  (corner.normal != ~0u && corner.normal != corner.position);
+					chunk.missing_normals = chunk.missing_normals || corner.normal == ~0u;
+
+					if (corner_count == 0)
+					{
+						first = corner;
+					}
+					else if (corner_count >= 2)
+					{
+						OBJCorner corners[3] = { first, previous, corner };
+						IndexedTriangleGLSL &triangle = data.triangles._data[tri_index];
+						triangle.mat_index = 0;
+						for (uint32 i = 0; i < 3; i++)
+						{
+							triangle.vertices[i] = corners[i].position;
+							if (has_corner_arrays)
+							{
+								data.corner_uvs._data[3 * tri_index + i] = corners[i].uv;
+								data.corner_normals._data[3 * tri_index + i] = corners[i].normal;
+							}
+						}
+						tri_index++;
+					}
+					previous = corner;
+					corner_count++;
+				}
+				break;
+			}
+
+			case OBJLine::OTHER: break;
+		}
+		p = end < chunk.end ? end + 1 : end;
+	}
+}
+
+// Splits the text into chunks that end after a newline
+static void split_obj_chunks(const char *text, uint64 size, Array<OBJChunk> &out_chunks)
+{
+	uint64 begin = 0;
+	while (begin < size)
+	{
+		uint64 end = size;
+		if (size - begin > OBJ_CHUNK_BYTES)
+		{
+			const char *newline = (const char *) memchr(text + begin + OBJ_CHUNK_BYTES, '\n', size - begin - OBJ_CHUNK_BYTES);
+			end = newline != nullptr ? (uint64) (newline - text) + 1 : size;
+		}
+
+		OBJChunk chunk {};
+		chunk.begin = text + begin;
+		chunk.end = text + end;
+		out_chunks.append(chunk);
+		begin = end;
+	}
+}
+
+bool LoadOBJ(const char *path, Model &out_mesh)
+{
+	auto start_time = std::chrono::steady_clock::now();
+
+	MappedFile file;
+	if (!file.Open(path))
+	{
+		printf("ERROR (OBJ Loader): Failed to open %s!\n", path);
+		return false;
+	}
+	file.Prefetch(0, file.size);
+
+	printf("Loading OBJ data from path: %s\n", path);
+
+	Array<OBJChunk> chunks;
+	split_obj_chunks((const char *) file.data, file.size, chunks);
+
+	PARALLEL_FOR
+	for (uint32 i = 0; i < chunks.size; i++)
+	{
+		count_obj_chunk(chunks._data[i]);
+	}
+
+	uint64 position_total = 0, uv_total = 0, normal_total = 0, tri_total = 0;
+	bool has_corner_indices = false;
+	for (uint32 i = 0; i < chunks.size; i++)
+	{
+		OBJChunk &chunk = chunks[i];
+		chunk.first_position = position_total;
+		chunk.first_uv = uv_total;
+		chunk.first_normal = normal_total;
+		chunk.first_tri = tri_total;
+		position_total += chunk.position_count;
+		uv_total += chunk.uv_count;
+		normal_total += chunk.normal_count;
+		tri_total += chunk.tri_count;
+		has_corner_indices = has_corner_indices || chunk.has_corner_indices;
+	}
+
+	// One vertex per corner is the most the model can end up with
+	if (position_total >= (uint32) -1 || uv_total >= (uint32) -1 || normal_total >= (uint32) -1 || 3 * tri_total >= (uint32) -1)
+	{
+		printf("ERROR (OBJ Loader): %s has too many vertices or triangles!\n", path);
+		return false;
+	}
+
+	OBJData data;
+	data.positions.resize((uint32) position_total);
+	data.uvs.resize((uint32) uv_total);
+	data.normals.resize((uint32) normal_total);
+	data.triangles.resize((uint32) tri_total);
+	if (has_corner_indices)
+	{
+		data.corner_uvs.resize((uint32) (3 * tri_total));
+		data.corner_normals.resize((uint32) (3 * tri_total));
+	}
+
+	PARALLEL_FOR
+	for (uint32 i = 0; i < chunks.size; i++)
+	{
+		parse_obj_chunk(chunks._data[i], data);
+	}
+
+	bool split_corners = false;
+	bool missing_normals = false;
+	for (uint32 i = 0; i < chunks.size; i++)
+	{
+		if (chunks[i].error != nullptr)
+		{
+			printf("ERROR (OBJ Loader): %s in %s!\n", chunks[i].error, path);
+			return false;
+		}
+		split_corners = split_corners || chunks[i].split_corners;
+		missing_normals = missing_normals || chunks[i].missing_normals;
+	}
+
+	double parse_ms = elapsed_ms(start_time);
+
+	// Most scans use the same index for every attribute of a corner, so the
+	// vertices are shared like in the file. Otherwise every corner gets a
+	// vertex of its own.
+	Array<VertexGLSL> vertices;
+	if (!split_corners)
+	{
+		build_shared_vertices(data.positions, data.normals, data.uvs, data.triangles, vertices);
+	}
+	else
+	{
+		Array<glm::vec3> position_normals;
+		if (missing_normals)
+		{
+			compute_vertex_normals(data.positions, data.triangles, position_normals);
+		}
+
+		vertices.resize(3 * data.triangles.size);
+
+		PARALLEL_FOR
+		for (uint32 chunk = 0; chunk < chunk_count(data.triangles.size); chunk++)
+		{
+			uint32 end = pixl::min((chunk + 1) * MESH_CHUNK_ELEMENTS, data.triangles.size);
+			for (uint32 i = chunk * MESH_CHUNK_ELEMENTS; i < end; i++)
+			{
+				for (uint32 j = 0; j < 3; j++)
+				{
+					uint32 corner = 3 * i + j;
+					uint32 position = data.triangles._data[i].vertices[j];
+					uint32 uv = data.corner_uvs._data[corner];
+					uint32 normal = data.corner_normals._data[corner];
+					vertices._data[corner] = VertexGLSL(data.positions._data[position],
+														normal != ~0u ? data.normals._data[normal] : position_normals._data[position],
+														uv != ~0u ? data.uvs._data[uv] : glm::vec2(0.0f));
+					data.triangles._data[i].vertices[j] = corner;
+				}
+			}
+		}
+	}
+
+	finish_model(vertices, data.triangles, out_mesh);
+	print_throughput(file.size, parse_ms, elapsed_ms(start_time));
+	return true;
+}
+
+// ---------------------------------------------------------------------------
+// PLY
+
+enum class PLYType : uint8
+{
+	INVALID,
+	INT8,
+	UINT8,
+	INT16,
+	UINT16,
+	INT32,
+	UINT32,
+	FLOAT32,
+	FLOAT64
+};
+
+struct PLYProperty
+{
+	char name[32];
+	PLYType type;       // of the value, or of the items of a list
+	PLYType count_type; // INVALID unless the property is a list
+	uint32 offset;      // in the record, ~0u after a list
+};
+
+struct PLYElement
+{
+	char name[32];
+	uint64 count;
+	uint32 first_property;
+	uint32 property_count;
+	uint32 record_size; // of the scalars before the first list
+	bool has_lists;     // records differ in size
+};
+
+struct PLYHeader
+{
+	Array<PLYElement> elements;
+	Array<PLYProperty> properties; // of all elements, one after the other
+	bool big_endian = false;
+	uint64 data_offset = 0;
+};
+
+static PLYType ply_type(const char *name)
+{
+	static const struct
+	{
+		const char *name;
+		PLYType type;
+	} types[] = {
+		{ "char", PLYType::INT8 }, { "int8", PLYType::INT8 }, { "uchar", PLYType::UINT8 }, { "uint8", PLYType::UINT8 },
+		{ "short", PLYType::INT16 }, { "int16", PLYType::INT16 }, { "ushort", PLYType::UINT16 }, { "uint16", PLYType::UINT16 },
+		{ "int", PLYType::INT32 }, { "int32", PLYType::INT32 }, { "uint", PLYType::UINT32 }, { "uint32", PLYType::UINT32 },
+		{ "float", PLYType::FLOAT32 }, { "float32", PLYType::FLOAT32 }, { "double", PLYType::FLOAT64 }, { "float64", PLYType::FLOAT64 }
+	};
+
+	for (const auto &type : types)
+	{
+		if (strcmp(name, type.name) == 0)
+		{
+			return type.type;
+		}
+	}
+	return PLYType::INVALID;
+}
+
+static uint32 ply_type_size(PLYType type)
+{
+	switch (type)
+	{
+		case PLYType::INT8:
+		case PLYType::UINT8: return 1;
+		case PLYType::INT16:
+		case PLYType::UINT16: return 2;
+		case PLYType::INT32:
+		case PLYType::UINT32:
+		case PLYType::FLOAT32: return 4;
+		case PLYType::FLOAT64: return 8;
+		default: return 0;
+	}
+}
+
+// Copies a value out of the file in the byte order of the machine, which
+// is assumed to be little endian like everywhere else in the renderer
+template <typename T>
+static T load_ply_value(const uint8 *p, bool swap)
+{
+	T value;
+	if (!swap)
+	{
+		memcpy(&value, p, sizeof(T));
+		return value;
+	}
+
+	uint8 bytes[sizeof(T)];
+	for (uint32 i = 0; i < sizeof(T); i++)
+	{
+		bytes[i] = p[sizeof(T) - 1 - i];
+	}
+	memcpy(&value, bytes, sizeof(T));
+	return value;
+}
+
+static double read_ply_float(const uint8 *p, PLYType type, bool swap)
+{
+	switch (type)
+	{
+		case PLYType::INT8: return (double) (int8) p[0];
+		case PLYType::UINT8: return (double) p[0];
+		case PLYType::INT16: return (double) load_ply_value<int16>(p, swap);
+		case PLYType::UINT16: return (double) load_ply_value<uint16>(p, swap);
+		case PLYType::INT32: return (double) load_ply_value<int32>(p, swap);
+		case PLYType::UINT32: return (double) load_ply_value<uint32>(p, swap);
+		case PLYType::FLOAT32: return (double) load_ply_value<float>(p, swap);
+		case PLYType::FLOAT64: return load_ply_value<double>(p, swap);
+		default: return 0.0;
+	}
+}
+
+static bool is_ply_integer(PLYType type)
+{
+	return type != PLYType::INVALID && type != PLYType::FLOAT32 && type != PLYType::FLOAT64;
+}
+
+// Negative for the floating point types, which can't be counts or indices
+static long long read_ply_integer(const uint8 *p, PLYType type, bool swap)
+{
+	switch (type)
+	{
+		case PLYType::INT8: return (long long) (int8) p[0];
+		case PLYType::UINT8: return (long long) p[0];
+		case PLYType::INT16: return (long long) load_ply_value<int16>(p, swap);
+		case PLYType::UINT16: return (long long) load_ply_value<uint16>(p, swap);
+		case PLYType::INT32: return (long long) load_ply_value<int32>(p, swap);
+		case PLYType::UINT32: return (long long) load_ply_value<uint32>(p, swap);
+		default: return -1;
+	}
+}
+
+static bool parse_ply_header(const MappedFile &file, PLYHeader &out_header)
+{
+	const char *text = (const char *) file.data;
+	const char *end = text + file.size;
+	if (file.size < 4 || memcmp(text, "ply", 3) != 0 || (text[3] != '\n' && text[3] != '\r'))
+	{
+		printf("ERROR (PLY Loader): Not a PLY file!\n");
+		return false;
+	}
+
+	bool has_format = false;
+	for (const char *p = text; p < end;)
+	{
+		const char *newline = line_end(p, end);
+		std::string line(p, (size_t) (newline - p));
+		if (!line.empty() && line.back() == '\r')
+		{
+			line.pop_back();
+		}
+		p = newline < end ? newline + 1 : end;
+
+		char word[32] = {};
+		char type_name[16] = {};
+		char item_type_name[16] = {};
+		char name[32] = {};
+		unsigned long long count = 0;
+
+		if (line == "end_header")
+		{
+			out_header.data_offset = (uint64) (p - text);
+			if (!has_format)
+			{
+				printf("ERROR (PLY Loader): The header has no format!\n");
+				return false;
+			}
+			return true;
+		}
+		else if (sscanf(line.c_str(), "format %31s", word) == 1)
+		{
+			has_format = true;
+			out_header.big_endian = strcmp(word, "binary_big_endian") == 0;
+			if (!out_header.big_endian && strcmp(word, "binary_little_endian") != 0)
+			{
+				printf("ERROR (PLY Loader): Only binary PLY files are supported, not %s!\n", word);
+				return false;
+			}
+		}
+		else if (sscanf(line.c_str(), "element %31s %llu", name, &count) == 2)
+		{
+			PLYElement element {};
+			memcpy(element.name, name, sizeof(element.name));
+			element.count = count;
+			element.first_property = out_header.properties.size;
+			out_header.elements.append(element);
+		}
+		else if (sscanf(line.c_str(), "property list %15s %15s %31s", type_name, item_type_name, name) == 3 ||
+				 sscanf(line.c_str(), "property %15s %31s", item_type_name, name) == 2)
+		{
+			PLYProperty property {};
+			memcpy(property.name, name, sizeof(property.name));
+			property.type = ply_type(item_type_name);
+			property.count_type = type_name[0] != '\0' ? ply_type(type_name) : PLYType::INVALID;
+
+			bool is_list = type_name[0] != '\0';
+			if (out_header.elements.size == 0 || property.type == PLYType::INVALID || (is_list && !is_ply_integer(property.count_type)))
+			{
+				printf("ERROR (PLY Loader): Invalid property '%s'!\n", line.c_str());
+				return false;
+			}
+
+			PLYElement &element = out_header.elements.back();
+			property.offset = element.has_lists ? ~0u : element.record_size;
+			out_header.properties.append(property);
+			element.property_count++;
+
+			if (is_list)
+			{
+				element.has_lists = true;
+			}
+			else if (!element.has_lists)
+			{
+				element.record_size += ply_type_size(property.type);
+			}
+		}
+	}
+
+	printf("ERROR (PLY Loader): The header has no end!\n");
+	return false;
+}
+
+static const PLYProperty *find_ply_property(const PLYHeader &header, const PLYElement &element, const char *name)
+{
+	for (uint32 i = 0; i < element.property_count; i++)
+	{
+		const PLYProperty &property = header.properties._data[element.first_property + i];
+		if (strcmp(property.name, name) == 0)
+		{
+			return &property;
+		}
+	}
+	return nullptr;
+}
+
+// Size of the record at `p`, 0 if it runs past `end`. If the element's
+// property `list_index` is a list, its items and their count are returned.
+static uint64 read_ply_record(const PLYHeader &header, const PLYElement &element, uint32 list_index, const uint8 *p, const uint8 *end,
+							  const uint8 *&out_items, uint32 &out_item_count)
+{
+	uint64 available = (uint64) (end - p);
+	uint64 size = 0;
+	for (uint32 i = 0; i < element.property_count; i++)
+	{
+		const PLYProperty &property = header.properties._data[element.first_property + i];
+		if (property.count_type == PLYType::INVALID)
+		{
+			size += ply_type_size(property.type);
+			continue;
+		}
+
+		uint32 count_size = ply_type_size(property.count_type);
+		if (size + count_size > available)
+		{
+			return 0;
+		}
+
+		long long count = read_ply_integer(p + size, property.count_type, header.big_endian);
+		if (count < 0)
+		{
+			return 0;
+		}
+
+		size += count_size;
+		if (i == list_index)
+		{
+			out_items = p + size;
+			out_item_count = (uint32) count;
+		}
+		size += (uint64) count * ply_type_size(property.type);
+	}
+	return size > 0 && size <= available ? size : 0;
+}
+
+// Moves `offset` past all records of an element
+static bool skip_ply_element(const PLYHeader &header, const PLYElement &element, const MappedFile &file, uint64 &offset)
+{
+	if (!element.has_lists)
+	{
+		if (element.record_size > 0 && element.count > (file.size - offset) / element.record_size)
+		{
+			return false;
+		}
+		offset += element.count * element.record_size;
+		return true;
+	}
+
+	const uint8 *items = nullptr;
+	uint32 item_count = 0;
+	for (uint64 i = 0; i < element.count; i++)
+	{
+		uint64 size = read_ply_record(header, element, ~0u, file.data + offset, file.data + file.size, items, item_count);
+		if (size == 0)
+		{
+			return false;
+		}
+		offset += size;
+	}
+	return true;
+}
+
+// A run of faces that one task splits into triangles
+struct PLYFaceChunk
+{
+	const uint8 *begin;
+	uint64 first_tri;
+	uint32 face_count;
+	bool size_mismatch; // a face that isn't a triangle, when every face was assumed to be one
+	const char *error;
+};
+
+struct PLYFaces
+{
+	const PLYHeader *header;
+	const PLYElement *element;
+	uint32 index_property; // of the element
+	PLYType index_type;
+	uint32 vertex_count;
+	const uint8 *data_end;
+	uint64 triangle_record_size; // of a triangle, if every face is assumed to be one, else 0
+};
+
+// The faces that nearly every scanner writes: a uchar count of 3 and three
+// 32 bit indices in the byte order of the machine, and nothing else
+static bool has_plain_triangles(const PLYFaces &faces)
+{
+	const PLYProperty &indices = faces.header->properties._data[faces.element->first_property + faces.index_property];
+	return faces.triangle_record_size == 1 + 3 * sizeof(uint32) && faces.element->property_count == 1 && !faces.header->big_endian &&
+		   indices.count_type == PLYType::UINT8 && (indices.type == PLYType::INT32 || indices.type == PLYType::UINT32);
+}
+
+static void parse_plain_triangles(const PLYFaces &faces, PLYFaceChunk &chunk, Array<IndexedTriangleGLSL> &triangles)
+{
+	const uint8 *p = chunk.begin;
+	IndexedTriangleGLSL *chunk_triangles = &triangles._data[chunk.first_tri];
+	for (uint32 face = 0; face < chunk.face_count; face++, p += faces.triangle_record_size)
+	{
+		if (p[0] != 3)
+		{
+			chunk.size_mismatch = true;
+			return;
+		}
+
+		// Negative indices turn into huge ones
+		IndexedTriangleGLSL &triangle = chunk_triangles[face];
+		memcpy(triangle.vertices, p + 1, 3 * sizeof(uint32));
+		triangle.mat_index = 0;
+		if (triangle.vertices[0] >= faces.vertex_count || triangle.vertices[1] >= faces.vertex_count || triangle.vertices[2] >= faces.vertex_count)
+		{
+			chunk.error = "A face references a missing vertex";
+			return;
+		}
+	}
+}
+
+static void parse_ply_faces(const PLYFaces &faces, PLYFaceChunk &chunk, Array<IndexedTriangleGLSL> &triangles)
+{
+	if (has_plain_triangles(faces))
+	{
+		parse_plain_triangles(faces, chunk, triangles);
+		return;
+	}
+
+	bool swap = faces.header->big_endian;
+	uint32 index_size = ply_type_size(faces.index_type);
+	const uint8 *p = chunk.begin;
+	uint64 tri_index = chunk.first_tri;
+
+	for (uint32 face = 0; face < chunk.face_count; face++)
+	{
+		const uint8 *indices = nullptr;
+		uint32 index_count = 0;
+		uint64 size = read_ply_record(*faces.header, *faces.element, faces.index_property, p, faces.data_end, indices, index_count);
+		if (size == 0)
+		{
+			chunk.error = "A face runs past the end of the file";
+			return;
+		}
+
+		if (faces.triangle_record_size != 0 && (size != faces.triangle_record_size || index_count != 3))
+		{
+			chunk.size_mismatch = true;
+			return;
+		}
+
+		// Polygons are split into a fan around their first corner
+		uint32 first = 0, previous = 0;
+		for (uint32 i = 0; i < index_count; i++)
+		{
+			long long index = read_ply_integer(indices + i * index_size, faces.index_type, swap);
+			if (index < 0 || index >= (long long) faces.vertex_count)
+			{
+				chunk.error = "A face references a missing vertex";
+				return;
+			}
+
+			if (i == 0)
+			{
+				first = (uint32) index;
+			}
+			else if (i >= 2)
+			{
+				IndexedTriangleGLSL &triangle = triangles._data[tri_index++];
+				triangle.vertices[0] = first;
+				triangle.vertices[1] = previous;
+				triangle.vertices[2] = (uint32) index;
+				triangle.mat_index = 0;
+			}
+			previous = (uint32) index;
+		}
+		p += size;
+	}
+}
+
+// Assumes that every face is a triangle, which is all that most scans
+// have, so that the chunks follow from the size of one record
+static void split_ply_triangles(const PLYFaces &faces, const uint8 *begin, Array<PLYFaceChunk> &out_chunks, uint64 &out_tri_count)
+{
+	uint32 face_count = (uint32) faces.element->count;
+	for (uint32 chunk = 0; chunk < chunk_count(face_count); chunk++)
+	{
+		PLYFaceChunk face_chunk {};
+		face_chunk.begin = begin + (uint64) chunk * MESH_CHUNK_ELEMENTS * faces.triangle_record_size;
+		face_chunk.first_tri = (uint64) chunk * MESH_CHUNK_ELEMENTS;
+		face_chunk.face_count = pixl::min(MESH_CHUNK_ELEMENTS, face_count - chunk * MESH_CHUNK_ELEMENTS);
+		out_chunks.append(face_chunk);
+	}
+	out_tri_count = face_count;
+}
+
+// Walks the faces once to find where every chunk starts, for faces that
+// differ in size
+static bool split_ply_faces(const PLYFaces &faces, const uint8 *begin, Array<PLYFaceChunk> &out_chunks, uint64 &out_tri_count)
+{
+	out_chunks.clear();
+	out_tri_count = 0;
+
+	const uint8 *p = begin;
+	uint32 face_count = (uint32) faces.element->count;
+	for (uint32 face = 0; face < face_count; face++)
+	{
+		if (face % MESH_CHUNK_ELEMENTS == 0)
+		{
+			PLYFaceChunk chunk {};
+			chunk.begin = p;
+			chunk.first_tri = out_tri_count;
+			chunk.face_count = pixl::min(MESH_CHUNK_ELEMENTS, face_count - face);
+			out_chunks.append(chunk);
+		}
+
+		const uint8 *indices = nullptr;
+		uint32 index_count = 0;
+		uint64 size = read_ply_record(*faces.header, *faces.element, faces.index_property, p, faces.data_end, indices, index_count);
+		if (size == 0)
+		{
+			printf("ERROR (PLY Loader): A face runs past the end of the file!\n");
+			return false;
+		}
+
+		out_tri_count += index_count >= 3 ? index_count - 2 : 0;
+		p += size;
+	}
+	return true;
+}
+
+bool LoadPLY(const char *path, Model &out_mesh)
+{
+	auto start_time = std::chrono::steady_clock::now();
+
+	MappedFile file;
+	if (!file.Open(path))
+	{
+		printf("ERROR (PLY Loader): Failed to open %s!\n", path);
+		return false;
+	}
+	file.Prefetch(0, file.size);
+
+	printf("Loading PLY data from path: %s\n", path);
+
+	PLYHeader header;
+	if (!parse_ply_header(file, header))
+	{
+		return false;
+	}
+
+	// Only the vertex and face elements are read, the others are skipped
+	const PLYElement *vertex_element = nullptr;
+	const PLYElement *face_element = nullptr;
+	uint64 vertex_offset = 0;
+	uint64 face_offset = 0;
+	uint64 offset = header.data_offset;
+	for (uint32 i = 0; i < header.elements.size && (vertex_element == nullptr || face_element == nullptr); i++)
+	{
+		const PLYElement &element = header.elements._data[i];
+		if (strcmp(element.name, "vertex") == 0)
+		{
+			vertex_element = &element;
+			vertex_offset = offset;
+		}
+		else if (strcmp(element.name, "face") == 0)
+		{
+			face_element = &element;
+			face_offset = offset;
+		}
+
+		if (!skip_ply_element(header, element, file, offset))
+		{
+			printf("ERROR (PLY Loader): The %s element runs past the end of the file!\n", element.name);
+			return false;
+		}
+	}
+
+	if (vertex_element == nullptr || face_element == nullptr)
+	{
+		printf("ERROR (PLY Loader): %s needs a vertex and a face element!\n", path);
+		return false;
+	}
+
+	if (vertex_element->count >= (uint32) -1 || face_element->count >= (uint32) -1)
+	{
+		printf("ERROR (PLY Loader): %s has too many vertices or faces!\n", path);
+		return false;
+	}
+
+	const PLYProperty *x = find_ply_property(header, *vertex_element, "x");
+	const PLYProperty *y = find_ply_property(header, *vertex_element, "y");
+	const PLYProperty *z = find_ply_property(header, *vertex_element, "z");
+	if (vertex_element->has_lists || x == nullptr || y == nullptr || z == nullptr)
+	{
+		printf("ERROR (PLY Loader): The vertices need x, y and z and no lists!\n");
+		return false;
+	}
+
+	const PLYProperty *nx = find_ply_property(header, *vertex_element, "nx");
+	const PLYProperty *ny = find_ply_property(header, *vertex_element, "ny");
+	const PLYProperty *nz = find_ply_property(header, *vertex_element, "nz");
+	bool has_normals = nx != nullptr && ny != nullptr && nz != nullptr;
+
+	const char *uv_names[][2] = { { "u", "v" }, { "s", "t" }, { "texture_u", "texture_v" } };
+	const PLYProperty *u = nullptr;
+	const PLYProperty *v = nullptr;
+	for (uint32 i = 0; i < 3 && (u == nullptr || v == nullptr); i++)
+	{
+		u = find_ply_property(header, *vertex_element, uv_names[i][0]);
+		v = find_ply_property(header, *vertex_element, uv_names[i][1]);
+	}
+	bool has_uvs = u != nullptr && v != nullptr;
+
+	PLYFaces faces {};
+	faces.header = &header;
+	faces.element = face_element;
+	faces.vertex_count = (uint32) vertex_element->count;
+	faces.data_end = file.data + file.size;
+	faces.index_property = ~0u;
+	faces.triangle_record_size = 0;
+
+	bool other_lists = false;
+	for (uint32 i = 0; i < face_element->property_count; i++)
+	{
+		const PLYProperty &property = header.properties._data[face_element->first_property + i];
+		bool is_indices = strcmp(property.name, "vertex_indices") == 0 || strcmp(property.name, "vertex_index") == 0;
+		if (is_indices && property.count_type != PLYType::INVALID && is_ply_integer(property.type))
+		{
+			faces.index_property = i;
+			faces.index_type = property.type;
+			faces.triangle_record_size += ply_type_size(property.count_type) + 3 * ply_type_size(property.type);
+		}
+		else
+		{
+			other_lists = other_lists || property.count_type != PLYType::INVALID;
+			faces.triangle_record_size += property.count_type == PLYType::INVALID ? ply_type_size(property.type) : 0;
+		}
+	}
+
+	if (faces.index_property == ~0u)
+	{
+		printf("ERROR (PLY Loader): The faces need a list of integer vertex_indices!\n");
+		return false;
+	}
+
+	if (other_lists || face_offset + face_element->count * faces.triangle_record_size > file.size)
+	{
+		faces.triangle_record_size = 0;
+	}
+
+	Array<glm::vec3> positions;
+	Array<glm::vec3> normals;
+	Array<glm::vec2> uvs;
+	positions.resize(faces.vertex_count);
+	normals.resize(has_normals ? faces.vertex_count : 0);
+	uvs.resize(has_uvs ? faces.vertex_count : 0);
+
+	bool swap = header.big_endian;
+	const uint8 *vertex_data = file.data + vertex_offset;
+	uint32 vertex_stride = vertex_element->record_size;
+
+	// Three floats next to each other are copied as they are
+	auto is_plain_vec3 = [swap](const PLYProperty *x, const PLYProperty *y, const PLYProperty *z)
+	{
+		return !swap && x->type == PLYType::FLOAT32 && y->type == PLYType::FLOAT32 && z->type == PLYType::FLOAT32 &&
+			   y->offset == x->offset + 4 && z->offset == x->offset + 8;
+	};
+	bool plain_positions = is_plain_vec3(x, y, z);
+	bool plain_normals = has_normals && is_plain_vec3(nx, ny, nz);
+
+	PARALLEL_FOR
+	for (uint32 chunk = 0; chunk < chunk_count(faces.vertex_count); chunk++)
+	{
+		uint32 end = pixl::min((chunk + 1) * MESH_CHUNK_ELEMENTS, faces.vertex_count);
+		for (uint32 i = chunk * MESH_CHUNK_ELEMENTS; i < end; i++)
+		{
+			const uint8 *record = vertex_data + (uint64) i * vertex_stride;
+			if (plain_positions)
+			{
+				memcpy(&positions._data[i], record + x->offset, sizeof(glm::vec3));
+			}
+			else
+			{
+				positions._data[i] = glm::vec3((float) read_ply_float(record + x->offset, x->type, swap),
+											   (float) read_ply_float(record + y->offset, y->type, swap),
+											   (float) read_ply_float(record + z->offset, z->type, swap));
+			}
+
+			if (plain_normals)
+			{
+				memcpy(&normals._data[i], record + nx->offset, sizeof(glm::vec3));
+			}
+			else if (has_normals)
+			{
+				normals._data[i] = glm::vec3((float) read_ply_float(record + nx->offset, nx->type, swap),
+											 (float) read_ply_float(record + ny->offset, ny->type, swap),
+											 (float) read_ply_float(record + nz->offset, nz->type, swap));
+			}
+			if (has_uvs)
+			{
+				uvs._data[i] = glm::vec2((float) read_ply_float(record + u->offset, u->type, swap),
+										 (float) read_ply_float(record + v->offset, v->type, swap));
+			}
+		}
+	}
+
+	// Triangles are split into chunks right away, other polygons need a
+	// walk over all faces first. That walk is also the fallback when a
+	// face turns out not to be a triangle after all.
+	Array<PLYFaceChunk> face_chunks;
+	uint64 tri_count = 0;
+	if (faces.triangle_record_size != 0)
+	{
+		split_ply_triangles(faces, file.data + face_offset, face_chunks, tri_count);
+	}
+	else if (!split_ply_faces(faces, file.data + face_offset, face_chunks, tri_count))
+	{
+		return false;
+	}
+
+	Array<IndexedTriangleGLSL> triangles;
+	for (;;)
+	{
+		if (tri_count >= (uint32) -1)
+		{
+			printf("ERROR (PLY Loader): %s has too many triangles!\n", path);
+			return false;
+		}
+		triangles.resize((uint32) tri_count);
+
+		PARALLEL_FOR
+		for (uint32 i = 0; i < face_chunks.size; i++)
+		{
+			parse_ply_faces(faces, face_chunks._data[i], triangles);
+		}
+
+		bool size_mismatch = false;
+		for (uint32 i = 0; i < face_chunks.size; i++)
+		{
+			if (face_chunks[i].error != nullptr)
+			{
+				printf("ERROR (PLY Loader): %s in %s!\n", face_chunks[i].error, path);
+				return false;
+			}
+			size_mismatch = size_mismatch || face_chunks[i].size_mismatch;
+		}
+
+		if (!size_mismatch)
+		{
+			break;
+		}
+
+		faces.triangle_record_size = 0;
+		if (!split_ply_faces(faces, file.data + face_offset, face_chunks, tri_count))
+		{
+			return false;
+		}
+	}
+
+	double parse_ms = elapsed_ms(start_time);
+
+	Array<VertexGLSL> vertices;
+	build_shared_vertices(positions, normals, uvs, triangles, vertices);
+	finish_model(vertices, triangles, out_mesh);
+	print_throughput(file.size, parse_ms, elapsed_ms(start_time));
+	return true;
+}
+
+// ---------------------------------------------------------------------------
+
+// Case insensitive, like ".obj"
+static bool has_extension(const char *path, const char *extension)
+{
+	size_t length = strlen(path);
+	size_t extension_length = strlen(extension);
+	if (length < extension_length)
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < extension_length; i++)
+	{
+		if (tolower((unsigned char) path[length - extension_length + i]) != extension[i])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool LoadModel(const char *path, Model &out_mesh, bool upload_textures)
+{
+	if (has_extension(path, ".obj"))
+	{
+		return LoadOBJ(path, out_mesh);
+	}
+	if (has_extension(path, ".ply"))
+	{
+		return LoadPLY(path, out_mesh);
+	}
+	return LoadGLTF(path, out_mesh, upload_textures);
+}
+
+bool HashModelSource(const char *path, uint64 &out_hash)
+{
+	if (IsSceneFile(path))
+	{
+		return ReadSceneFileSourceHash(path, out_hash);
+	}
+
+	if (!has_extension(path, ".obj") && !has_extension(path, ".ply"))
+	{
+		return HashGLTFSource(path, out_hash);
+	}
+
+	MappedFile file;
+	if (!file.Open(path))
+	{
+		return false;
+	}
+
+	out_hash = HashCombine(0, HashBytes(file.data, file.size));
+	return true;
+}
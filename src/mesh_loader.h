@@ -0,0 +1,23 @@
+#pragma once
+#include "scene/model.h"
+
+// Loaders for the plain triangle meshes that scanning produces, which can
+// be several gigabytes. The file is mapped and cut into chunks at line or
+// face boundaries, and the chunks are parsed in parallel. Each file becomes
+// a single mesh and instance with one grey material into `out_mesh`.
+
+// Wavefront OBJ: positions, texture coordinates, normals and polygon faces,
+// which are split into fans. Materials, groups and objects are ignored.
+bool LoadOBJ(const char *path, Model &out_mesh);
+
+// Binary PLY of either endianness with a vertex and a face element. The
+// vertices need x, y and z and may have nx, ny, nz and u, v (or s, t).
+bool LoadPLY(const char *path, Model &out_mesh);
+
+// Loads .obj and .ply files with the loaders above and everything else
+// with LoadGLTF
+bool LoadModel(const char *path, Model &out_mesh, bool upload_textures);
+
+// Hash of the contents of the model, see HashGLTFSource. For a .pxscene
+// file it is the hash of the model it was baked from.
+bool HashModelSource(const char *path, uint64 &out_hash);
@@ -0,0 +1,1229 @@
+#include "pathtracer.hpp"
+#include "cpu/compressed_traversal.hpp"
+#include "cpu/traversal_stack.hpp"
+#include "cpu/wide_bvh.hpp"
+#include "math/math.hpp"
+
+#include <stb_image.h>
+
+#include <glm/geometric.hpp>
+#include <glm/mat3x3.hpp>
+#include <glm/matrix.hpp>
+#include <glm/packing.hpp>
+#include <cmath>
+
+constexpr float TWO_PI = 6.28318530f;
+
+bool LoadEnvironmentMap(const char *path, EnvironmentMap &out_map)
+{
+	int w = -1, h = -1, c = -1;
+	stbi_hdr_to_ldr_gamma(1.0f);
+	uint8 *data = stbi_load(path, &w, &h, &c, 3);
+	if (data == nullptr)
+	{
+		return false;
+	}
+
+	uint32 num_bytes = (uint32) w * (uint32) h * 3;
+	out_map.texels.resize(num_bytes);
+	memcpy(out_map.texels._data, data, num_bytes);
+	out_map.width = (uint32) w;
+	out_map.height = (uint32) h;
+
+	stbi_image_free(data);
+	return true;
+}
+
+CameraGrid::CameraGrid(const glm::vec3 &origin, const glm::vec3 &forward, const glm::vec3 &right, uint32 width, uint32 height)
+	: origin(origin)
+{
+	float grid_height = 2.0f;
+	float grid_width = grid_height * (float) width / (float) height;
+
+	glm::vec3 cam_up = glm::normalize(glm::cross(right, forward));
+	grid_x = right * grid_width;
+	grid_y = cam_up * grid_height;
+
+	grid_origin = origin - (grid_x * 0.5f) - (grid_y * 0.5f);
+	grid_origin += 2.0f * forward;
+
+	pixel_x = grid_x / (float) width;
+	pixel_y = grid_y / (float) height;
+}
+
+// Randomness (same hash and PCG variant as the compute shader)
+// https://www.shadertoy.com/view/XlGcRh
+
+uint32 seed3(uint32 x, uint32 y, uint32 z)
+{
+	return 19u * x + 47u * y + 101u * z + 131u;
+}
+
+static float hash_to_float(uint32 hash)
+{
+	// hash * (1 / MAX_UINT)
+	return (float) hash / (float) 0xfffffff0u;
+}
+
+static uint32 pcg(uint32 &rng_state)
+{
+	uint32 state = rng_state;
+	rng_state = rng_state * 747796405u + 2891336453u;
+	uint32 word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+// Make sure to generate a value in (0,1) rather than [0,1]
+static float rand(uint32 &rng_state)
+{
+	return pixl::max(EPSILON, pixl::min(1.0f - EPSILON, hash_to_float(pcg(rng_state))));
+}
+
+static glm::vec2 rand_vec2(uint32 &rng_state)
+{
+	float x = rand(rng_state);
+	float y = rand(rng_state);
+	return { x, y };
+}
+
+static glm::mat3 construct_tnb(const glm::vec3 &n)
+{
+	// Orthonormal basis
+	float s = n.z < 0.0f ? -1.0f : 1.0f;
+	float a = -1.0f / (s + n.z);
+	float b = n.x * n.y * a;
+
+	glm::vec3 t(1.0f + s * n.x * n.x * a, s * b, -s * n.x);
+	glm::vec3 bt(b, s + n.y * n.y * a, -n.y);
+
+	return { t, n, bt };
+}
+
+// NOTE: Assumes normalized vector "vec" in a hemisphere.
+// This results in a theta value in the range [0, PI],
+// and a phi value in the range [0, 2PI].
+static void cartesian_to_spherical(const glm::vec3 &vec, float &theta, float &phi)
+{
+	theta = acosf(glm::clamp(vec.y, -1.0f, 1.0f));
+	phi = atan2f(vec.x, vec.z) + PI;
+}
+
+// A simple lerp between 2 colors, used when no environment map is loaded
+static glm::vec3 sky_gradient(const glm::vec3 &dir)
+{
+	float t = 0.5f * (glm::normalize(dir).y + 1.0f);
+
+	glm::vec3 start_color(1.0f, 1.0f, 1.0f);
+	glm::vec3 end_color(0.546f, 0.824f, 0.925f);
+	return (1.0f - t) * start_color + t * end_color;
+}
+
+static glm::vec3 fetch_texel(EnvironmentMap &env, int32 x, int32 y)
+{
+	x = x < 0 ? 0 : (x >= (int32) env.width ? (int32) env.width - 1 : x);
+	y = y < 0 ? 0 : (y >= (int32) env.height ? (int32) env.height - 1 : y);
+
+	uint8 *texel = &env.texels._data[((uint32) y * env.width + (uint32) x) * 3];
+	return glm::vec3(texel[0], texel[1], texel[2]) * (1.0f / 255.0f);
+}
+
+glm::vec3 SkyColor(TraceContext &ctx, const glm::vec3 &dir)
+{
+	EnvironmentMap &env = *ctx.environment;
+	if (env.width == 0 || env.height == 0)
+	{
+		return sky_gradient(dir);
+	}
+
+	float theta, phi;
+	cartesian_to_spherical(dir, theta, phi);
+
+	phi += PI / 8.0f;
+	if (phi < 0.0f)
+		phi += TWO_PI;
+	if (phi > TWO_PI)
+		phi -= TWO_PI;
+
+	// Bilinear filtering with clamp to edge, like the GL_LINEAR sampler
+	float u = (phi / TWO_PI) * (float) env.width - 0.5f;
+	float v = (theta / PI) * (float) env.height - 0.5f;
+	float fu = floorf(u);
+	float fv = floorf(v);
+	float du = u - fu;
+	float dv = v - fv;
+
+	auto x = (int32) fu;
+	auto y = (int32) fv;
+	glm::vec3 top = (1.0f - du) * fetch_texel(env, x, y) + du * fetch_texel(env, x + 1, y);
+	glm::vec3 bottom = (1.0f - du) * fetch_texel(env, x, y + 1) + du * fetch_texel(env, x + 1, y + 1);
+	return (1.0f - dv) * top + dv * bottom;
+}
+
+// Intersection
+
+static float intersect_sphere(const glm::vec3 &ro, const glm::vec3 &rd, SphereGLSL &sphere)
+{
+	glm::vec3 oc = ro - glm::vec3(sphere.data);
+	float a = glm::dot(rd, rd);
+	float b = 2.0f * glm::dot(oc, rd);
+	float c = glm::dot(oc, oc) - sphere.data.w * sphere.data.w;
+	float discriminant = b * b - 4.0f * a * c;
+	if (discriminant >= 0)
+	{
+		if (discriminant <= EPSILON)
+		{
+			float t = -b / (2.0f * a);
+			if (t >= TMIN && t <= TMAX)
+			{
+				return t;
+			}
+		}
+		else
+		{
+			float sqrt_discriminant = sqrtf(discriminant);
+			float t1 = (-b + sqrt_discriminant) / (2.0f * a);
+			float t2 = (-b - sqrt_discriminant) / (2.0f * a);
+			if (t1 > t2)
+			{
+				pixl::swap(&t1, &t2);
+			}
+
+			if (t1 >= TMIN && t1 <= TMAX)
+			{
+				return t1;
+			}
+
+			if (t2 >= TMIN && t2 <= TMAX)
+			{
+				return t2;
+			}
+		}
+	}
+
+	return -1.0f;
+}
+
+void FillTriangleHit(TraceContext &ctx, const glm::vec3 &rd, uint32 tri_index, float t, float u, float v, HitData &data)
+{
+	IndexedTriangleGLSL &tri = ctx.scene->triangles[tri_index];
+	const VertexGLSL &vertex0 = ctx.scene->vertices._data[tri.vertices[0]];
+	const VertexGLSL &vertex1 = ctx.scene->vertices._data[tri.vertices[1]];
+	const VertexGLSL &vertex2 = ctx.scene->vertices._data[tri.vertices[2]];
+	glm::vec3 edge1 = vertex1.position - vertex0.position;
+	glm::vec3 edge2 = vertex2.position - vertex0.position;
+
+	glm::vec3 n0 = pixl::octahedral_normal_decoding(glm::unpackHalf2x16(vertex0.normal));
+	glm::vec3 n1 = pixl::octahedral_normal_decoding(glm::unpackHalf2x16(vertex1.normal));
+	glm::vec3 n2 = pixl::octahedral_normal_decoding(glm::unpackHalf2x16(vertex2.normal));
+
+	data.t = t;
+	data.mat_index = tri.mat_index;
+	data.object_index = tri_index;
+	data.object_type = 0;
+
+	float w = 1.0f - u - v;
+	data.uvs = w * glm::unpackHalf2x16(vertex0.uv) +
+			   u * glm::unpackHalf2x16(vertex1.uv) +
+			   v * glm::unpackHalf2x16(vertex2.uv);
+
+	glm::vec3 surface_normal = glm::normalize(glm::cross(edge1, edge2));
+	data.normal = glm::normalize(w * n0 + u * n1 + v * n2);
+	data.normal *= glm::dot(surface_normal, rd) < 0.0f ? 1.0f : -1.0f;
+}
+
+// Moller-Trumbore ray-triangle intersection algorithm
+bool IntersectTriangle(TraceContext &ctx, const glm::vec3 &ro, const glm::vec3 &rd, uint32 tri_index, HitData &data, float tmax)
+{
+	IndexedTriangleGLSL &tri = ctx.scene->triangles[tri_index];
+	glm::vec3 v0 = ctx.scene->vertices._data[tri.vertices[0]].position;
+	glm::vec3 edge1 = ctx.scene->vertices._data[tri.vertices[1]].position - v0;
+	glm::vec3 edge2 = ctx.scene->vertices._data[tri.vertices[2]].position - v0;
+	glm::vec3 pvec = glm::cross(rd, edge2);
+	float dt = glm::dot(edge1, pvec);
+
+	// Ray direction parallel to the triangle plane. The determinant scales
+	// with the triangle and the ray direction, which are both in the space of
+	// the instance, so only an exact 0 is skipped instead of a fixed threshold.
+	float inv_determinant = 1.0f / dt;
+	glm::vec3 tvec = ro - v0;
+	float u = glm::dot(tvec, pvec) * inv_determinant;
+	if (dt == 0.0f || (u < 0.0f) || (u > 1.0f))
+		return false;
+
+	glm::vec3 qvec = glm::cross(tvec, edge1);
+	float v = inv_determinant * glm::dot(rd, qvec);
+
+	// Computing t
+	float t = inv_determinant * glm::dot(edge2, qvec);
+	if ((v >= 0.0f) && (u + v <= 1.0f) && t > TMIN && t < tmax)
+	{
+		FillTriangleHit(ctx, rd, tri_index, t, u, v, data);
+		return true;
+	}
+
+	return false;
+}
+
+// Slab method
+// https://tavianator.com/2011/ray_box.html
+static glm::vec2 intersect_aabb(const glm::vec3 &ro, const glm::vec3 &inv_dir, BVHNodeGLSL &node, float t)
+{
+	glm::vec3 tmin = (glm::vec3(node.data1) - ro) * inv_dir;
+	glm::vec3 tmax = (glm::vec3(node.data2) - ro) * inv_dir;
+	glm::vec3 t0 = glm::min(tmin, tmax);
+	glm::vec3 t1 = glm::max(tmin, tmax);
+	return { pixl::max(t0.x, pixl::max(t0.y, pixl::max(t0.z, TMIN))), pixl::min(t1.x, pixl::min(t1.y, pixl::min(t1.z, t))) };
+}
+
+static bool intersect_leaf(TraceContext &ctx, const glm::vec3 &ro, const glm::vec3 &rd, BVHNodeGLSL &leaf, HitData &data, float &tmax)
+{
+	bool hit_anything = false;
+
+	auto first_prim = leaf.FirstChildOrTri();
+	auto num_tris = leaf.TriCount();
+	for (uint32 i = 0; i < num_tris; i++)
+	{
+		if (IntersectTriangle(ctx, ro, rd, first_prim + i, data, tmax))
+		{
+			hit_anything = true;
+			tmax = data.t;
+		}
+	}
+
+	return hit_anything;
+}
+
+// Same traversal as `intersect_bvh_stack` in the compute shader, except that
+// the leaves of both children are intersected separately, so the primitives
+// of sibling leaves don't need to be adjacent in memory. Used for the top
+// level BVH as well as for the BVHs of the meshes, `leaf_test` intersects
+// whatever the leaves hold.
+template<typename LeafTest>
+static bool intersect_bvh_stack(Array<BVHNodeGLSL> &bvh_nodes, uint32 root_index, const glm::vec3 &ro, const glm::vec3 &rd,
+								float &tmax, LeafTest leaf_test)
+{
+	if (bvh_nodes.size == 0)
+	{
+		return false;
+	}
+
+	glm::vec3 inv_dir = 1.0f / rd;
+
+	BVHNodeGLSL &root = bvh_nodes[root_index];
+	if (root.IsLeaf())
+	{
+		return leaf_test(root);
+	}
+
+	bool hit_anything = false;
+
+	TraversalStack<uint32, 64> stack;
+	auto current_index = root.FirstChildOrTri();
+
+	while (true)
+	{
+		BVHNodeGLSL &node_left = bvh_nodes[current_index];
+		BVHNodeGLSL &node_right = bvh_nodes[current_index + 1];
+
+		glm::vec2 intersect_left = intersect_aabb(ro, inv_dir, node_left, tmax);
+		glm::vec2 intersect_right = intersect_aabb(ro, inv_dir, node_right, tmax);
+		bool hit_left = intersect_left.x <= intersect_left.y;
+		bool hit_right = intersect_right.x <= intersect_right.y;
+
+		if (hit_left && node_left.IsLeaf())
+		{
+			hit_anything |= leaf_test(node_left);
+			hit_left = false;
+		}
+
+		if (hit_right && node_right.IsLeaf())
+		{
+			hit_anything |= leaf_test(node_right);
+			hit_right = false;
+		}
+
+		if (hit_left)
+		{
+			if (hit_right)
+			{
+				auto first = node_left.FirstChildOrTri();
+				auto second = node_right.FirstChildOrTri();
+				if (intersect_left.x > intersect_right.x)
+				{
+					uint32 tmp = first;
+					first = second;
+					second = tmp;
+				}
+
+				stack.Push(second);
+				current_index = first;
+			}
+			else
+			{
+				current_index = node_left.FirstChildOrTri();
+			}
+		}
+		else if (hit_right)
+		{
+			current_index = node_right.FirstChildOrTri();
+		}
+		else
+		{
+			if (stack.size == 0)
+			{
+				break;
+			}
+
+			current_index = stack.Pop();
+		}
+	}
+
+	return hit_anything;
+}
+
+bool IntersectInstance(TraceContext &ctx, const glm::vec3 &ro, const glm::vec3 &rd, uint32 instance_index, HitData &data, float &tmax)
+{
+	InstanceGLSL &instance = ctx.scene->instances[instance_index];
+	bool is_identity = instance.data.z != 0;
+
+	// The direction isn't normalized after the transform, so the distances
+	// along the ray are the same in both spaces
+	glm::vec3 object_ro = is_identity ? ro : instance.PointToObject(ro);
+	glm::vec3 object_rd = is_identity ? rd : instance.DirectionToObject(rd);
+
+	bool hit_anything;
+	if (ctx.compressed_bvh != nullptr)
+	{
+		hit_anything = IntersectCompressedBVH(ctx, object_ro, object_rd, data, tmax, ctx.compressed_bvh->mesh_roots._data[instance.data.y]);
+	}
+	else if (ctx.wide_bvh != nullptr)
+	{
+		hit_anything = IntersectWideBVH(ctx, object_ro, object_rd, data, tmax, ctx.wide_bvh->mesh_roots._data[instance.data.y]);
+	}
+	else
+	{
+		hit_anything = intersect_bvh_stack(ctx.scene->bvh_nodes, instance.data.x, object_ro, object_rd, tmax,
+										   [&](BVHNodeGLSL &leaf) { return intersect_leaf(ctx, object_ro, object_rd, leaf, data, tmax); });
+	}
+
+	if (hit_anything)
+	{
+		data.instance_index = instance_index;
+		data.normal = is_identity ? data.normal : instance.NormalToWorld(data.normal);
+	}
+
+	return hit_anything;
+}
+
+static bool intersect_instances(TraceContext &ctx, const glm::vec3 &ro, const glm::vec3 &rd, HitData &data, float &tmax)
+{
+	return intersect_bvh_stack(ctx.scene->tlas_nodes, 0, ro, rd, tmax, [&](BVHNodeGLSL &leaf)
+	{
+		bool hit_anything = false;
+
+		auto first_instance = leaf.FirstChildOrTri();
+		auto num_instances = leaf.TriCount();
+		for (uint32 i = 0; i < num_instances; i++)
+		{
+			hit_anything |= IntersectInstance(ctx, ro, rd, first_instance + i, data, tmax);
+		}
+
+		return hit_anything;
+	});
+}
+
+bool IntersectSpheres(TraceContext &ctx, const glm::vec3 &ro, const glm::vec3 &rd, HitData &result, float &tmax)
+{
+	bool hit_anything = false;
+
+	Array<SphereGLSL> &spheres = ctx.scene->spheres;
+	for (uint32 i = 0; i < spheres.size; i++)
+	{
+		SphereGLSL &current_sphere = spheres[i];
+		float current_t = intersect_sphere(ro, rd, current_sphere);
+		if (current_t >= TMIN && current_t <= tmax)
+		{
+			tmax = current_t;
+			hit_anything = true;
+			result.t = current_t;
+			result.normal = (ro + rd * current_t - glm::vec3(current_sphere.data)) / current_sphere.data.w;
+			result.mat_index = current_sphere.mat_index.x;
+			result.object_index = i;
+			result.object_type = 1;
+		}
+	}
+
+	return hit_anything;
+}
+
+bool Intersect(TraceContext &ctx, const glm::vec3 &ro, const glm::vec3 &rd, HitData &result)
+{
+	ctx.ray_count++;
+
+	float tmax = TMAX;
+	bool hit_anything = intersect_instances(ctx, ro, rd, result, tmax);
+	hit_anything |= IntersectSpheres(ctx, ro, rd, result, tmax);
+
+	return hit_anything;
+}
+
+// BRDFs
+
+static glm::vec3 oren_nayar_brdf(const glm::vec3 &albedo, float roughness, const glm::vec3 &wi, const glm::vec3 &wo)
+{
+	float theta_i, phi_i;
+	cartesian_to_spherical(wi, theta_i, phi_i);
+
+	float theta_o, phi_o;
+	cartesian_to_spherical(wo, theta_o, phi_o);
+
+	float squared_roughness = roughness * roughness;
+	float A = 1.0f - 0.5f * squared_roughness / (squared_roughness + 0.33f);
+	float B = 0.45f * squared_roughness / (squared_roughness + 0.09f);
+	float alpha = pixl::max(theta_i, theta_o);
+	float beta = pixl::min(theta_i, theta_o);
+	return (albedo / PI) * (A + B * pixl::max(0.0f, cosf(phi_i - phi_o)) * sinf(alpha) * tanf(beta));
+}
+
+static float positive_characteristic_func(float value)
+{
+	return value > 0.0f ? 1.0f : 0.0f;
+}
+
+static glm::vec3 importance_sample_trowbridge_reitz(const glm::vec3 &wo, float alpha_ggx, uint32 &rng_state, glm::vec3 &wi)
+{
+	float alpha_squared = alpha_ggx * alpha_ggx;
+
+	// Generate 2 random numbers for theta and phi, respectively
+	glm::vec2 e = rand_vec2(rng_state);
+
+	// This is dot(wm, n) or dot(wm, wg)
+	float theta = acosf(sqrtf((1.0f - e.x) / ((alpha_squared - 1.0f) * e.x + 1.0f)));
+	float phi = TWO_PI * e.y;
+
+	// Generate the microfacet normal we are looking for
+	float cos_theta = cosf(theta);
+	float sin_theta = sinf(theta);
+	glm::vec3 wm(sin_theta * cosf(phi), cos_theta, sin_theta * sinf(phi));
+
+	// Generate the incident direction by reflecting the outgoing by the microfacet normal
+	wi = glm::normalize(glm::reflect(-wo, wm));
+
+	return wm;
+}
+
+// Trowbridge-Reitz NDF (also knows as the GGX NDF)
+static float trowbridge_reitz_NDF(const glm::vec3 &wm, const glm::vec3 &wg, float alpha_ggx)
+{
+	float wg_dot_wm = glm::dot(wg, wm);
+	float squared_alpha = pixl::max(EPSILON * 10.0f, alpha_ggx * alpha_ggx);
+
+	float denominator = PI * powf(1.0f + wg_dot_wm * wg_dot_wm * (squared_alpha - 1.0f), 2.0f);
+
+	return positive_characteristic_func(wg_dot_wm) * squared_alpha / denominator;
+}
+
+// Lambda function for GGX used in the Smith shadowing-masking function
+static float trowbridge_reitz_lambda(const glm::vec3 &dir, float alpha_ggx)
+{
+	float cos_theta = dir.y;
+	float sin_theta_2 = pixl::max(0.0f, 1.0f - cos_theta * cos_theta);
+	float tan_theta = sqrtf(sin_theta_2) / cos_theta;
+	float a = 1.0f / (alpha_ggx * tan_theta);
+	return -0.5f + 0.5f * sqrtf(1.0f + 1.0f / (a * a));
+}
+
+// Smith joint shadowing-masking function (height correlated form)
+static float G2(const glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &wm, float alpha_ggx)
+{
+	float result = positive_characteristic_func(glm::dot(wm, wo)) * positive_characteristic_func(glm::dot(wm, wi));
+	result /= (1.0f + trowbridge_reitz_lambda(wo, alpha_ggx) + trowbridge_reitz_lambda(wi, alpha_ggx));
+	return result;
+}
+
+// Schlick's approximation for the Fresnel term
+static glm::vec3 F(const glm::vec3 &wm, const glm::vec3 &wi, const glm::vec3 &F0)
+{
+	return F0 + (glm::vec3(1.0f) - F0) * powf(1.0f - pixl::min(1.0f, pixl::max(0.0f, glm::dot(wm, wi))), 5.0f);
+}
+
+static glm::vec3 GGX_Smith_BRDF_non_IS(const glm::vec3 &wo, const glm::vec3 &wi, const glm::vec3 &F0, float alpha_ggx)
+{
+	// n or wg is always up in tangent space
+	glm::vec3 wg(0.0f, 1.0f, 0.0f);
+	glm::vec3 wm = glm::normalize(wo + wi);
+
+	glm::vec3 result = F(wm, wi, F0) * G2(wi, wo, wm, alpha_ggx) * trowbridge_reitz_NDF(wm, wg, alpha_ggx);
+	result /= pixl::max(EPSILON * 10.0f, 4.0f * fabsf(glm::dot(wg, wi)) * fabsf(glm::dot(wg, wo)));
+	return result;
+}
+
+static glm::vec3 GGX_Smith_BRDF(const glm::vec3 &wo, const glm::vec3 &wm, const glm::vec3 &wi, const glm::vec3 &F0, float alpha_ggx)
+{
+	// n or wg is always up in tangent space
+	glm::vec3 wg(0.0f, 1.0f, 0.0f);
+
+	// The below results from importance sampling the GGX NDF and having some terms cancel out
+	glm::vec3 result = F(wm, wi, F0) * G2(wi, wo, wm, alpha_ggx) * fabsf(glm::dot(wo, wm));
+	result /= pixl::max(EPSILON * 10.0f, fabsf(glm::dot(wg, wo)) * fabsf(glm::dot(wg, wm)));
+	return result;
+}
+
+// Pick wi with basis around the normal
+static glm::vec3 pick_wi(const glm::vec3 &wo, MaterialGLSL &mat, bool using_NEE, glm::vec3 &wm, float &cos_theta, float &pdf, uint32 &rng_state)
+{
+	bool is_ggx = IMPORTANCE_SAMPLE_GGX && !using_NEE;
+	float mat_type = mat.data2.w;
+	if (mat_type == -1.0f || mat_type == 0.0f || mat_type == 1.0f || (mat_type == 2.0f && !is_ggx))
+	{
+		wm = glm::vec3(0.0f, 1.0f, 0.0f);
+		glm::vec3 wi = pixl::map_to_unit_hemisphere_cosine_weighted_criver(rand_vec2(rng_state), wm);
+		cos_theta = glm::dot(wm, wi);
+		pdf = cos_theta / PI;
+		return wi;
+	}
+
+	if (mat_type == 2.0f && is_ggx)
+	{
+		cos_theta = 1.0f;
+		pdf = 1.0f;
+
+		float alpha_ggx = mat.data1.w;
+
+		glm::vec3 wi;
+		wm = importance_sample_trowbridge_reitz(wo, alpha_ggx, rng_state, wi);
+		return wi;
+	}
+
+	// ERROR: material not handled!
+	return glm::vec3(INFINITY);
+}
+
+static glm::vec3 calc_BRDF(const glm::vec3 &wo, const glm::vec3 &wm, const glm::vec3 &wi, MaterialGLSL &mat, bool using_NEE)
+{
+	glm::vec3 brdf(1.0f, 1.0f, 0.0f);
+
+	auto mat_type = (int32) mat.data2.w;
+	glm::vec3 albedo = mat.diffuse();
+	glm::vec3 F0 = mat.specular();
+
+	// The base color texture is already applied by hit_material
+
+	// Light source
+	if (mat_type == -1)
+	{
+		brdf = glm::vec3(0.0f);
+	}
+
+	// Oren-Nayar diffuse BRDF
+	if (mat_type == 1)
+	{
+		brdf = oren_nayar_brdf(albedo, mat.data1.w, wi, wo);
+	}
+
+	// Lambertian diffuse BRDF
+	if (mat_type == 0)
+	{
+		brdf = albedo / PI;
+	}
+
+	// Specular BRDF
+	if (mat_type == 2)
+	{
+		if (IMPORTANCE_SAMPLE_GGX && !using_NEE)
+		{
+			brdf = GGX_Smith_BRDF(wo, wm, wi, F0, mat.data1.w);
+		}
+		else
+		{
+			brdf = GGX_Smith_BRDF_non_IS(wo, wi, F0, mat.data1.w);
+		}
+	}
+
+	return brdf;
+}
+
+static float area_triangle(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2)
+{
+	glm::vec3 edge1 = v1 - v0;
+	glm::vec3 edge2 = v2 - v0;
+	return sqrtf(glm::dot(edge1, edge1) * glm::dot(edge2, edge2)) * 0.5f;
+}
+
+static float area_sphere(float r)
+{
+	return 4.0f * PI * r * r;
+}
+
+static glm::vec3 map_to_triangle(glm::vec2 vec, const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2)
+{
+	float u = vec.x;
+	float v = vec.y;
+
+	if (u + v > 1.0f)
+	{
+		// The generated point is outside triangle but
+		// within the parallelogram defined by the 2 edges
+		// of the triangle (v1-v0 and v2-v0)
+		u = 1.0f - u;
+		v = 1.0f - v;
+	}
+
+	glm::vec3 p = u * (v1 - v0) + v * (v2 - v0);
+	return p + v0;
+}
+
+// Picks a point on a random light source, returning its area and material
+static glm::vec3 sample_light_source(TraceContext &ctx, uint32 &rng_state, float &light_area, MaterialGLSL &light_source_mat)
+{
+	Scene &scene = *ctx.scene;
+	uint32 num_light_sources = scene.light_tris.size + scene.emissive_spheres.size;
+	uint32 picked_light_source = pcg(rng_state) % num_light_sources;
+
+	// Triangle light source
+	if (scene.light_tris.size > 0 && picked_light_source < scene.light_tris.size)
+	{
+		TriangleGLSL &light_source = scene.light_tris[picked_light_source];
+		light_area = area_triangle(light_source.v0(), light_source.v1(), light_source.v2());
+		light_source_mat = scene.materials[light_source.data4.w];
+		return map_to_triangle(rand_vec2(rng_state), light_source.v0(), light_source.v1(), light_source.v2());
+	}
+
+	// Sphere light source
+	SphereGLSL &light_source = scene.spheres[scene.emissive_spheres[picked_light_source - scene.light_tris.size]];
+
+	float radius = light_source.data.w;
+	light_area = area_sphere(radius);
+	light_source_mat = scene.materials[light_source.mat_index.x];
+
+	// get a random point on unit sphere, scale the sphere up/down according
+	// to the light source's radius, and move the point relative to the light
+	// source's spherical origin.
+	return pixl::map_to_unit_sphere(rand_vec2(rng_state)) * radius + glm::vec3(light_source.data);
+}
+
+// Textures
+
+// Width of a ray, which picks the mip level of the textures it hits. Camera
+// rays have exact differentials from the camera grid. The rays of later
+// bounces are treated as cones that spread like a camera ray, whatever the
+// curvature of the surfaces they bounced off.
+struct RayFootprint
+{
+	float width;  // at the origin of the ray
+	float spread; // growth of the width per unit of distance
+};
+
+static RayFootprint camera_footprint(TraceContext &ctx)
+{
+	if (ctx.camera == nullptr)
+	{
+		return RayFootprint { 0.0f, 0.0f };
+	}
+
+	// The grid is 2 units in front of the camera
+	const CameraGrid &cam = *ctx.camera;
+	return RayFootprint { 0.0f, glm::length(cam.pixel_y) / 2.0f };
+}
+
+// Solves for the change of the barycentric coordinates that moves a point
+// by `dp` in the plane of the triangle, and returns the change of its UVs
+static glm::vec2 uv_differential(const glm::vec3 &edge1, const glm::vec3 &edge2, const glm::vec2 &duv1, const glm::vec2 &duv2, const glm::vec3 &dp)
+{
+	float e11 = glm::dot(edge1, edge1);
+	float e12 = glm::dot(edge1, edge2);
+	float e22 = glm::dot(edge2, edge2);
+	float determinant = e11 * e22 - e12 * e12;
+	if (determinant == 0.0f)
+	{
+		return glm::vec2(0.0f);
+	}
+
+	float d1 = glm::dot(edge1, dp);
+	float d2 = glm::dot(edge2, dp);
+	float u = (e22 * d1 - e12 * d2) / determinant;
+	float v = (e11 * d2 - e12 * d1) / determinant;
+	return u * duv1 + v * duv2;
+}
+
+// Width of the ray at a triangle hit in UVs. The hit is in the space of
+// the mesh, the ray and its differentials are moved there as well.
+static float triangle_uv_footprint(TraceContext &ctx, const HitData &data, const glm::vec3 &rd, bool camera_ray, float hit_width)
+{
+	IndexedTriangleGLSL &tri = ctx.scene->triangles[data.object_index];
+	const VertexGLSL &vertex0 = ctx.scene->vertices._data[tri.vertices[0]];
+	const VertexGLSL &vertex1 = ctx.scene->vertices._data[tri.vertices[1]];
+	const VertexGLSL &vertex2 = ctx.scene->vertices._data[tri.vertices[2]];
+	glm::vec3 edge1 = vertex1.position - vertex0.position;
+	glm::vec3 edge2 = vertex2.position - vertex0.position;
+	glm::vec2 uv0 = glm::unpackHalf2x16(vertex0.uv);
+	glm::vec2 duv1 = glm::unpackHalf2x16(vertex1.uv) - uv0;
+	glm::vec2 duv2 = glm::unpackHalf2x16(vertex2.uv) - uv0;
+	glm::vec3 face_normal = glm::cross(edge1, edge2);
+
+	InstanceGLSL &instance = ctx.scene->instances[data.instance_index];
+	bool is_identity = instance.data.z != 0;
+	glm::vec3 object_rd = is_identity ? rd : instance.DirectionToObject(rd);
+	float normal_dot = glm::dot(object_rd, face_normal);
+	if (normal_dot == 0.0f)
+	{
+		return 1.0f;
+	}
+
+	if (camera_ray)
+	{
+		// Change of the normalized direction per pixel, at the point of the
+		// grid that the ray passes through
+		const CameraGrid &cam = *ctx.camera;
+		glm::vec3 grid_normal = glm::normalize(glm::cross(cam.grid_x, cam.grid_y));
+		float grid_distance = glm::dot(cam.grid_origin - cam.origin, grid_normal) / glm::dot(rd, grid_normal);
+		glm::vec3 ddx = (cam.pixel_x - rd * glm::dot(rd, cam.pixel_x)) / grid_distance;
+		glm::vec3 ddy = (cam.pixel_y - rd * glm::dot(rd, cam.pixel_y)) / grid_distance;
+		if (!is_identity)
+		{
+			ddx = instance.DirectionToObject(ddx);
+			ddy = instance.DirectionToObject(ddy);
+		}
+
+		// The hit moves along the ray's change and then along the ray,
+		// until it is back in the plane of the triangle
+		glm::vec3 dpdx = data.t * (ddx - object_rd * (glm::dot(ddx, face_normal) / normal_dot));
+		glm::vec3 dpdy = data.t * (ddy - object_rd * (glm::dot(ddy, face_normal) / normal_dot));
+		glm::vec2 duvdx = uv_differential(edge1, edge2, duv1, duv2, dpdx);
+		glm::vec2 duvdy = uv_differential(edge1, edge2, duv1, duv2, dpdy);
+		return pixl::max(glm::length(duvdx), glm::length(duvdy));
+	}
+
+	// The cone widens where it hits the triangle at a grazing angle. Its
+	// width is moved into the space of the mesh along with the ray.
+	float object_width = hit_width * glm::length(object_rd);
+	float cos_theta = std::fabs(normal_dot) / (glm::length(object_rd) * glm::length(face_normal));
+	float uv_area = std::fabs(duv1.x * duv2.y - duv1.y * duv2.x);
+	float area = glm::length(face_normal);
+	return object_width * sqrtf(uv_area / area) / pixl::max(cos_theta, 1e-3f);
+}
+
+// Material of a hit with its base color texture applied, the same way as
+// calc_BRDF in the shader does it. Widens the footprint to the hit, which
+// is where the next ray starts.
+static MaterialGLSL hit_material(TraceContext &ctx, const HitData &data, const glm::vec3 &rd, bool camera_ray, RayFootprint &footprint)
+{
+	MaterialGLSL mat = ctx.scene->materials[data.mat_index];
+	if (ctx.texture_cache == nullptr)
+	{
+		return mat;
+	}
+
+	float hit_width = footprint.width + footprint.spread * data.t;
+	if (mat.data3.w > -1.0f && data.object_type == 0)
+	{
+		float uv_footprint = triangle_uv_footprint(ctx, data, rd, camera_ray && ctx.camera != nullptr, hit_width);
+		glm::vec3 diffuse_texture = ctx.texture_cache->Sample((uint32) mat.data3.w, data.uvs, uv_footprint, ctx.texture_stats);
+		mat.data1 *= glm::vec4(diffuse_texture, 1.0f);
+		if (mat.data2.w == 2.0f)
+		{
+			mat.data2 *= glm::vec4(diffuse_texture, 1.0f);
+		}
+	}
+
+	footprint.width = hit_width;
+	return mat;
+}
+
+// Estimators
+
+// The camera ray of a path may already have been traced as part of a packet
+static bool intersect_path(TraceContext &ctx, const glm::vec3 &ro, const glm::vec3 &rd, HitData &data, const PrimaryHit *primary)
+{
+	if (primary == nullptr)
+	{
+		return Intersect(ctx, ro, rd, data);
+	}
+
+	data = primary->data;
+	return primary->hit;
+}
+
+glm::vec3 EstimatorPathTracingBRDF(TraceContext &ctx, glm::vec3 ro, glm::vec3 rd, uint32 rng_state, const PrimaryHit *primary)
+{
+	glm::vec3 color(0.0f);
+
+	// ( BRDF * dot(Nx, psi) ) / PDF(psi)
+	glm::vec3 throughput_term(1.0f);
+	RayFootprint footprint = camera_footprint(ctx);
+
+	for (uint32 b = 0; b < ctx.bounce_count; b++)
+	{
+		HitData data {};
+		if (!intersect_path(ctx, ro, rd, data, b == 0 ? primary : nullptr)) // ray goes off into infinity
+		{
+			color += throughput_term * SkyColor(ctx, rd) * ENVIRONMENT_MAP_LE;
+			return color;
+		}
+
+		MaterialGLSL mat = hit_material(ctx, data, rd, b == 0, footprint);
+
+		// Generate TNB matrix to map directions in terms of the normal vector
+		glm::mat3 inverse_tnb = construct_tnb(data.normal);
+		glm::mat3 tnb = glm::transpose(inverse_tnb);
+
+		// add the light that the material emits
+		color += throughput_term * mat.emitted_radiance();
+
+		// Intersection point and new ray
+		ro = ro + (rd * data.t) + (NORMAL_OFFSET * data.normal);
+
+		// These get set by pick_wi
+		float pdf, cos_theta;
+		glm::vec3 wm;
+
+		glm::vec3 wo = glm::normalize(tnb * -rd);
+		glm::vec3 wi = pick_wi(wo, mat, false, wm, cos_theta, pdf, rng_state);
+		rd = glm::normalize(inverse_tnb * wi);
+
+		glm::vec3 BRDF = calc_BRDF(wo, wm, wi, mat, false);
+
+		// update throughput
+		throughput_term *= cos_theta * BRDF / pdf;
+	}
+
+	return color;
+}
+
+glm::vec3 EstimatorPathTracingNEE(TraceContext &ctx, glm::vec3 ro, glm::vec3 rd, uint32 rng_state, const PrimaryHit *primary)
+{
+	Scene &scene = *ctx.scene;
+
+	glm::vec3 color(0.0f);
+	glm::vec3 throughput_term(1.0f);
+
+	bool prev_bounce_specular = false;
+	RayFootprint footprint = camera_footprint(ctx);
+
+	for (uint32 bounce = 0; bounce < ctx.bounce_count; bounce++)
+	{
+		HitData data {};
+		if (!intersect_path(ctx, ro, rd, data, bounce == 0 ? primary : nullptr))
+		{
+			// No intersection with scene, add env map contribution
+			color += throughput_term * SkyColor(ctx, rd) * ENVIRONMENT_MAP_LE;
+			return color;
+		}
+
+		// Generate TNB matrix to map directions in terms of the normal vector
+		glm::mat3 inverse_tnb = construct_tnb(data.normal);
+		glm::mat3 tnb = glm::transpose(inverse_tnb);
+
+		glm::vec3 wo = glm::normalize(tnb * -rd);
+
+		MaterialGLSL mat = hit_material(ctx, data, rd, bounce == 0, footprint);
+		float mat_type = mat.data2.w;
+
+		uint32 num_light_sources = scene.light_tris.size + scene.emissive_spheres.size;
+		bool can_use_NEE = num_light_sources > 0;
+		can_use_NEE = can_use_NEE && (mat_type == 0.0f || mat_type == 1.0f || (mat_type == 2.0f && mat.data1.w * mat.data1.w > NEE_SPECULAR_ROUGHNESS_CUTOFF));
+
+		// add light that is emitted from surface (but stop right afterwards)
+		if (mat_type == -1.0f)
+		{
+			if (bounce == 0 || (bounce > 0 && prev_bounce_specular))
+				color += throughput_term * mat.emitted_radiance();
+
+			return color;
+		}
+		// If there is at least 1 light source in the scene and the material
+		// of the surface we hit is diffuse, we can use NEE.
+		else if (can_use_NEE)
+		{
+			// sample light sources for direct illumination
+			glm::vec3 direct_illumination(0.0f);
+			for (uint32 shadow_ray_index = 0; shadow_ray_index < NUM_SHADOW_RAYS; shadow_ray_index++)
+			{
+				// pick a light source
+				float pdf_pick_light = 1.0f / (float) num_light_sources;
+
+				float light_area = 0.0f;
+				MaterialGLSL light_source_mat;
+				glm::vec3 y = sample_light_source(ctx, rng_state, light_area, light_source_mat);
+
+				float pdf_pick_point_on_light = 1.0f / light_area;
+
+				// PDF in terms of area, for picking point on light source k
+				float pdf_light_area = pdf_pick_light * pdf_pick_point_on_light;
+
+				// Send out a shadow ray in direction x->y
+				glm::vec3 shadow_ro = ro + rd * data.t + NORMAL_OFFSET * data.normal;
+				glm::vec3 dist_vec = y - shadow_ro;
+				glm::vec3 shadow_rd = glm::normalize(dist_vec);
+
+				// Check if ray hits anything before hitting the light source
+				HitData shadow_data {};
+				bool shadow_hit_anything = Intersect(ctx, shadow_ro, shadow_rd, shadow_data);
+
+				// Visibility check means we have a clear line of sight!
+				glm::vec3 shadow_ray_hit = shadow_ro + shadow_rd * shadow_data.t;
+				if (shadow_hit_anything && glm::all(glm::lessThanEqual(glm::abs(y - shadow_ray_hit), glm::vec3(FLOAT_COMPARE))))
+				{
+					glm::vec3 wi = glm::normalize(tnb * shadow_rd);
+					glm::vec3 wm = glm::normalize(tnb * data.normal);
+
+					glm::vec3 BRDF = calc_BRDF(wo, wm, wi, mat, true);
+
+					// We want to only add light contribution from lights within
+					// the hemisphere solid angle above X, and not from lights behind it.
+					float cos_theta_x = pixl::max(0.0f, glm::dot(data.normal, shadow_rd));
+
+					// We can sample the light from both sides, it doesn't have to
+					// be a one-sided light source.
+					float cos_theta_y = pixl::max(0.0f, glm::dot(shadow_data.normal, -shadow_rd));
+
+					float squared_dist = glm::dot(dist_vec, dist_vec);
+					float G = cos_theta_x * cos_theta_y / squared_dist;
+
+					direct_illumination += light_source_mat.emitted_radiance() * BRDF * G / pdf_light_area;
+				}
+			}
+			direct_illumination /= (float) NUM_SHADOW_RAYS;
+
+			// Because we are calculating for a non-emissive point, we can safely
+			// add the direct illumination to this point.
+			color += throughput_term * direct_illumination;
+		}
+
+		ro += rd * data.t + NORMAL_OFFSET * data.normal;
+
+		glm::vec3 wm;
+		float cos_theta_x, pdf;
+		glm::vec3 wi = pick_wi(wo, mat, true, wm, cos_theta_x, pdf, rng_state);
+		rd = glm::normalize(inverse_tnb * wi);
+
+		glm::vec3 BRDF = calc_BRDF(wo, wm, wi, mat, true);
+		prev_bounce_specular = mat_type == 2.0f && mat.data1.w * mat.data1.w <= NEE_SPECULAR_ROUGHNESS_CUTOFF;
+
+		// Update the throughput term
+		throughput_term *= BRDF * cos_theta_x / pdf;
+	}
+
+	return color;
+}
+
+static float balance_heuristic(float pdf_a, float pdf_b)
+{
+	return pdf_a / (pdf_a + pdf_b);
+}
+
+glm::vec3 EstimatorPathTracingMIS(TraceContext &ctx, glm::vec3 ro, glm::vec3 rd, uint32 rng_state, const PrimaryHit *primary)
+{
+	Scene &scene = *ctx.scene;
+
+	glm::vec3 color(0.0f);
+	glm::vec3 throughput_term(1.0f);
+
+	HitData data {};
+	bool hit_anything = intersect_path(ctx, ro, rd, data, primary);
+	if (!hit_anything)
+	{
+		// No intersection with scene, add env map contribution
+		return SkyColor(ctx, rd) * ENVIRONMENT_MAP_LE;
+	}
+
+	glm::vec3 y = ro + rd * data.t + NORMAL_OFFSET * data.normal;
+	glm::vec3 normal_y = data.normal;
+	RayFootprint footprint = camera_footprint(ctx);
+	MaterialGLSL mat_y = hit_material(ctx, data, rd, true, footprint);
+
+	// Add light contribution from first bounce if it hit a light source
+	color += mat_y.emitted_radiance();
+
+	uint32 num_light_sources = scene.light_tris.size + scene.emissive_spheres.size;
+
+	uint32 num_bounces = ctx.bounce_count + 1;
+	for (uint32 b = 1; b < num_bounces; b++)
+	{
+		glm::vec3 x = y;
+		glm::vec3 normal_x = normal_y;
+		MaterialGLSL mat_x = mat_y;
+		float mat_x_type = mat_x.data2.w;
+		float alpha_squared = mat_x.data1.w * mat_x.data1.w;
+
+		// Generate TNB matrix to map directions in terms of the normal vector
+		glm::mat3 inverse_tnb = construct_tnb(normal_x);
+		glm::mat3 tnb = glm::transpose(inverse_tnb);
+
+		glm::vec3 wo = glm::normalize(tnb * -rd);
+
+		// If there is at least 1 light source in the scene, and the material of the
+		// surface is diffuse, we can calculate the direct light contribution (NEE)
+		bool can_use_NEE = num_light_sources > 0;
+		can_use_NEE = can_use_NEE && (mat_x_type == 0.0f || mat_x_type == 1.0f || (mat_x_type == 2.0f && alpha_squared > NEE_SPECULAR_ROUGHNESS_CUTOFF));
+
+		if (can_use_NEE)
+		{
+			// sample light sources for direct illumination
+			glm::vec3 direct_illumination(0.0f);
+			for (uint32 shadow_ray_index = 0; shadow_ray_index < NUM_SHADOW_RAYS; shadow_ray_index++)
+			{
+				// pick a light source
+				float pdf_pick_light = 1.0f / (float) num_light_sources;
+
+				float light_area = 0.0f;
+				MaterialGLSL light_source_mat;
+				glm::vec3 y_nee = sample_light_source(ctx, rng_state, light_area, light_source_mat);
+
+				// Send out a shadow ray in direction x->y
+				glm::vec3 dist_vec = y_nee - x;
+				glm::vec3 shadow_rd = glm::normalize(dist_vec);
+				glm::vec3 shadow_ro = x;
+
+				float squared_dist = glm::dot(dist_vec, dist_vec);
+
+				// We want to only add light contribution from lights within
+				// the hemisphere solid angle above X, and not from lights behind it.
+				float cos_theta_x = pixl::max(0.0f, glm::dot(normal_x, shadow_rd));
+
+				// Check if ray hits anything before hitting the light source
+				HitData shadow_data {};
+				bool shadow_hit_anything = Intersect(ctx, shadow_ro, shadow_rd, shadow_data);
+
+				// Visibility check means we have a clear line of sight!
+				if (shadow_hit_anything && glm::all(glm::lessThan(y_nee - (shadow_ro + shadow_rd * shadow_data.t), glm::vec3(FLOAT_COMPARE))))
+				{
+					glm::vec3 wi = glm::normalize(tnb * shadow_rd);
+					glm::vec3 wm = glm::normalize(tnb * data.normal);
+
+					glm::vec3 BRDF = calc_BRDF(wo, wm, wi, mat_x, true);
+
+					// Degenerate (zero area) light triangles can never be hit by BSDF
+					// samples, and would turn the balance heuristic into inf / inf.
+					float cos_theta_y = glm::dot(shadow_data.normal, -shadow_rd);
+					if (cos_theta_y > 0.0f && light_area > 0.0f)
+					{
+						float pdf_pick_point_on_light = 1.0f / light_area;
+
+						// PDF in terms of area, for picking point on light source k
+						float pdf_light_area = pdf_pick_light * pdf_pick_point_on_light;
+
+						// PDF in terms of solid angle, for picking point on light source k
+						float pdf_NEE_sa = pdf_light_area * squared_dist / cos_theta_y;
+
+						// PDF in terms of solid angle, for picking ray from cos. weighted hemisphere
+						// NOTE: We do not use importance sampling for GGX here because we are
+						// importance sampling only the light sources.
+						float pdf_BSDF_sa = cos_theta_x / PI;
+
+						// weight for NEE
+						float wNEE = balance_heuristic(pdf_NEE_sa, pdf_BSDF_sa);
+
+						direct_illumination += light_source_mat.emitted_radiance() * BRDF * cos_theta_x * wNEE / pdf_NEE_sa;
+					}
+				}
+			}
+			direct_illumination /= (float) NUM_SHADOW_RAYS;
+
+			color += throughput_term * direct_illumination;
+		}
+
+		ro = x + NORMAL_OFFSET * normal_x;
+
+		// Pick a new direction
+		float cos_theta_x, pdf_BSDF_sa;
+		glm::vec3 wm;
+		glm::vec3 wi = pick_wi(wo, mat_x, false, wm, cos_theta_x, pdf_BSDF_sa, rng_state);
+		rd = glm::normalize(inverse_tnb * wi);
+
+		glm::vec3 BRDF = calc_BRDF(wo, wm, wi, mat_x, false);
+
+		hit_anything = Intersect(ctx, ro, rd, data);
+		if (!hit_anything)
+		{
+			// No intersection with scene, add env map contribution
+			color += ENVIRONMENT_MAP_LE * throughput_term * BRDF * cos_theta_x * SkyColor(ctx, rd) / pdf_BSDF_sa;
+
+			return color;
+		}
+
+		float cos_theta_y = glm::dot(data.normal, -rd);
+		normal_y = data.normal;
+
+		y = ro + rd * data.t + NORMAL_OFFSET * normal_y;
+		mat_y = hit_material(ctx, data, rd, false, footprint);
+
+		// If we can use NEE on the hit surface
+		float wBSDF = 1.0f;
+		if (can_use_NEE && cos_theta_y > 0.0f)
+		{
+			// If the hit surface is a light source, we need to calculate the pdf for NEE
+			if (mat_y.data2.w == -1.0f)
+			{
+				float pdf_NEE_area = 0.0f;
+
+				// Triangle light source
+				if (data.object_type == 0)
+				{
+					IndexedTriangleGLSL &tri_NEE = scene.triangles[data.object_index];
+					InstanceGLSL &instance_NEE = scene.instances[data.instance_index];
+					pdf_NEE_area = 1.0f / area_triangle(instance_NEE.PointToWorld(scene.vertices[tri_NEE.vertices[0]].position),
+														instance_NEE.PointToWorld(scene.vertices[tri_NEE.vertices[1]].position),
+														instance_NEE.PointToWorld(scene.vertices[tri_NEE.vertices[2]].position));
+				}
+				// Sphere light source
+				else if (data.object_type == 1)
+				{
+					SphereGLSL &sphere_NEE = scene.spheres[data.object_index];
+					pdf_NEE_area = 1.0f / area_sphere(sphere_NEE.data.w);
+				}
+
+				pdf_NEE_area /= (float) num_light_sources;
+
+				float pdf_NEE_sa = pdf_NEE_area * data.t * data.t / cos_theta_y;
+				wBSDF = balance_heuristic(pdf_BSDF_sa, pdf_NEE_sa);
+			}
+
+			color += throughput_term * BRDF * mat_y.emitted_radiance() * cos_theta_y * wBSDF / pdf_BSDF_sa;
+		}
+
+		throughput_term *= BRDF * cos_theta_x / pdf_BSDF_sa;
+
+		if (!can_use_NEE)
+		{
+			if (mat_x_type == 2.0f && IMPORTANCE_SAMPLE_GGX)
+			{
+				color += throughput_term * mat_y.emitted_radiance();
+			}
+		}
+	}
+
+	return color;
+}
+
+glm::vec3 CameraRayDirection(const CameraGrid &cam, uint32 x, uint32 y, uint32 width, uint32 height, uint32 &rng_state)
+{
+	glm::vec2 uv_offset = rand_vec2(rng_state) - glm::vec2(0.5f, 0.5f);
+
+	float u = ((float) x + uv_offset.x) / (float) width;
+	float v = ((float) y + uv_offset.y) / (float) height;
+
+	glm::vec3 point_on_grid = cam.grid_origin + u * cam.grid_x + v * cam.grid_y;
+	return glm::normalize(point_on_grid - cam.origin);
+}
+
+glm::vec3 ShadePath(TraceContext &ctx, ViewMode view_mode, const glm::vec3 &ro, const glm::vec3 &rd, uint32 rng_state, const PrimaryHit *primary)
+{
+	switch (view_mode)
+	{
+	case ViewMode::BRDF_IMPORTANCE_SAMPLING:
+		return EstimatorPathTracingBRDF(ctx, ro, rd, rng_state, primary);
+	case ViewMode::NEXT_EVENT_ESTIMATION:
+		return EstimatorPathTracingNEE(ctx, ro, rd, rng_state, primary);
+	case ViewMode::MULTIPLE_IMPORTANCE_SAMPLING_BRDF_NEE:
+	default:
+		return EstimatorPathTracingMIS(ctx, ro, rd, rng_state, primary);
+	}
+}
+
+glm::vec3 RenderPixel(TraceContext &ctx, const CameraGrid &cam, ViewMode view_mode,
+					  uint32 x, uint32 y, uint32 width, uint32 height, uint32 rng_state)
+{
+	glm::vec3 ray_direction = CameraRayDirection(cam, x, y, width, height, rng_state);
+	return ShadePath(ctx, view_mode, cam.origin, ray_direction, rng_state, nullptr);
+}
@@ -1,566 +1,135 @@
 #pragma once
-#include "math/math.hpp"
-#include "scene/material.hpp"
-#include "scene/sphere.hpp"
-#include "scene/triangle.hpp"
-#include <cmath>
-
-#if 0
-// A simple lerp between 2 colors
-Vec3f SkyColor(Vec3f dir)
+#include "core/array.hpp"
+#include "cpu/texture_cache.hpp"
+#include "defines.hpp"
+#include "scene/camera.hpp"
+#include "scene/scene.hpp"
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+
+struct WideBVH;
+struct CompressedBVH;
+struct CameraGrid;
+
+// CPU port of the estimators in shaders/framebuffer.comp. Everything here
+// works directly on the SSBO formatted scene data (VertexGLSL,
+// IndexedTriangleGLSL, BVHNodeGLSL, SphereGLSL, MaterialGLSL) so that both renderers trace the exact same scene.
+
+// Ray constants
+constexpr float TMIN = 0.001f;
+constexpr float TMAX = 100.0f;
+constexpr uint32 NUM_SHADOW_RAYS = 1;
+
+// Misc
+constexpr float ENVIRONMENT_MAP_LE = 1.0f;
+constexpr bool IMPORTANCE_SAMPLE_GGX = true;
+constexpr float NEE_SPECULAR_ROUGHNESS_CUTOFF = 0.0f;
+constexpr float NORMAL_OFFSET = 0.005f;
+constexpr float FLOAT_COMPARE = 0.01f;
+
+// Equirectangular environment map, stored the same way as the
+// RGB8 data uploaded to the `u_cubemap` texture by the Display.
+struct EnvironmentMap
 {
-    Vec3f normalized_dir = NormalizeVec3f(dir);
-    float t = 0.5f * (normalized_dir.y + 1.0f);
+	Array<uint8> texels;
+	uint32 width = 0;
+	uint32 height = 0;
+};
 
-    Vec3f start_color = { 1.0f, 1.0f, 1.0f };
-    Vec3f end_color = { 0.546f, 0.824f, 0.925f };
-    return (1.0f - t) * start_color + t * end_color;
-}
+bool LoadEnvironmentMap(const char *path, EnvironmentMap &out_map);
 
-// Cast ray into the scene, have the ray bounce around
-// a predetermined number of times accumulating radiance
-// along the way, and return the color for the given pixel
-Vec3f EstimatorPathTracingLambertian(Ray ray, Scene scene, pcg32_random_t *rngptr)
+struct HitData
 {
-    Vec3f color { 0.0f, 0.0f, 0.0f };
-
-    // ( BRDF * dot(Nx, psi) ) / PDF(psi)
-    Vec3f throughput_term { 1.0f, 1.0f, 1.0f };
-
-    // Vignette effect (basically undoing We=1/cos^3(theta) )
-    // float32 theta = acosf(-ray.direction.z);
-    // throughput_term = throughput_term * powf(cosf(theta), 3);
-
-    int8 num_bounces = BOUNCE_COUNT;
-    for (uint8 b = 0; b < num_bounces; b++)
-    {
-        HitData data = {};
-        bool intersect = Intersect(ray, scene, &data);
-        if (!intersect) // ray goes off into infinity
-        {
-            if (b <= BOUNCE_COUNT)
-                color += throughput_term * SkyColor(ray.direction) * ENVIRONMENT_MAP_LE;
-            break;
-        }
-
-        Material *mat = scene.materials[data.mat_index];
-
-        // add the light that the material emits
-        if (b <= BOUNCE_COUNT)
-            color += throughput_term * mat->Le;
-
-        if (mat->type == MaterialType::MATERIAL_LAMBERTIAN)
-        {
-            Vec3f BRDF = PI * mat->diffuse;
-
-            // update throughput
-            // The PI is here because we are sampling w.r.t the pdf
-            // p(psi) = cos(theta) / PI       (cosine weighted sampling)
-            // This cosine term cancels out with the dot product in
-            // the throughput term and all that is left is the BRDF
-            throughput_term *= BRDF;
-
-            // pdf(psi) = cos(theta) / PI
-            Vec2f random_vec2f = RandomVec2fPCG(rngptr);
-            Vec3f dir = MapToUnitHemisphereCosineWeightedCriver(random_vec2f, data.normal);
-
-            // Intersection point and new ray
-            Vec3f point = data.point;
-            ray = { point + EPSILON * data.normal, dir, 1.0f / dir };
-        }
-        else if (mat->type == MaterialType::MATERIAL_IDEAL_REFLECTIVE)
-        {
-            Vec3f reflected_dir = Reflect(-ray.direction, data.normal);
-
-            // Intersection point and new ray
-            Vec3f point = data.point;
-            ray = { point + EPSILON * data.normal, reflected_dir, 1.0f / reflected_dir };
-
-            // If we sample uniformly or with cosine weighted sampling, then
-            // we would need to calculate the BRDF every single direction in the
-            // hemisphere. If the direction is the reflected direction, then
-            // the BRDF is 1, otherwise it is 0. But that is wasteful. Instead,
-            // we *only* pick the reflected direction (not the case for glossy or
-            // otherwise un-ideal reflective materials) so the pdf is 1, and the
-            // BRDF is 1. Because of this, we have an instant solution without
-            // having to sample the hemisphere at all. The throughput term is then
-            // BRDF*(Nx dot wi) = (Nx dot wi) = cos_theta_x
-            throughput_term *= mat->specular;
-        }
-        else if (mat->type == MaterialType::MATERIAL_PHONG)
-        {
-            // TODO: fix the diffuse part
-            float u = RandomNumberNormalizedPCG(rngptr);
-            Vec3f uvec = Vec3f(u);
-            if (uvec <= mat->diffuse * PI)
-            {
-                throughput_term *= PI * mat->diffuse;
-
-                // pdf(psi) = cos(theta) / PI
-                Vec2f random_vec2f = RandomVec2fPCG(rngptr);
-                Vec3f dir = MapToUnitHemisphereCosineWeightedCriver(random_vec2f, data.normal);
-
-                ray = { data.point + EPSILON * data.normal, dir, 1.0f / dir };
-            }
-            else if (uvec <= mat->diffuse * PI + mat->specular)
-            {
-                Vec3f Nx = data.normal;
-                Vec3f x = data.point + EPSILON * data.normal;
-
-                Vec3f reflected_dir = NormalizeVec3f(Reflect(-ray.direction, Nx));
-                Mat3f tnb = ConstructTNB(reflected_dir);
-
-                float inv = 1.0f / (mat->n_spec + 1.0f);
-
-                Vec2f random_vec2f = RandomVec2fPCG(rngptr);
-
-                float cos_alpha = powf(random_vec2f.x, inv);
-                float sin_alpha = sqrtf(1.0f - cos_alpha * cos_alpha);
-                float phi = 2.0f * PI * random_vec2f.y;
-
-                Vec3f dir = { sin_alpha * cosf(phi), cos_alpha, sin_alpha * sinf(phi) };
-
-                dir = tnb * dir;
-                ray = { x, dir, 1.0f / dir };
-
-                float cos_theta_x = Max(0.0f, Dot(dir, Nx));
-
-                float pdf_theta = ((mat->n_spec + 1.0f) / (2.0f * PI)) * powf(cos_alpha, mat->n_spec);
-                float theta_term = powf(cos_alpha, mat->n_spec) * ((mat->n_spec + 2.0f) / (2.0f * PI)) / pdf_theta;
-
-                throughput_term *= mat->specular * cos_theta_x * theta_term;
-            }
-        }
-    }
-
-    return color;
-}
-
-Vec3f EstimatorPathTracingLambertianNEE(Ray ray, Scene scene, pcg32_random_t *rngptr)
+	float t;
+	glm::vec3 normal;
+	uint32 mat_index;
+	uint32 object_index;
+	uint32 object_type; // 0 tri, 1 sphere
+	uint32 instance_index; // only set for triangles
+	glm::vec2 uvs;
+};
+
+// Per-thread state that is passed along to every estimator
+struct TraceContext
 {
-    Vec3f color = Vec3f(0.0f);
-    Vec3f throughput_term = Vec3f(1.0f);
-
-    Material *old_mat = nullptr;
-
-    for (int16 bounce = 0; bounce < BOUNCE_COUNT; bounce++)
-    {
-        HitData data = {};
-        bool intersect = Intersect(ray, scene, &data);
-        if (!intersect)
-        {
-            // No intersection with scene, add env map contribution
-            color += throughput_term * SkyColor(ray.direction) * ENVIRONMENT_MAP_LE;
-            break;
-        }
-
-        Vec3f &BRDF = scene.materials[data.mat_index]->diffuse; // convenience
-        Material *mat = scene.materials[data.mat_index];
-
-        // (x->y dot Nx)
-        float cos_theta = Dot(data.normal, ray.direction);
-        float pdf_cos_weighted_hemisphere = cos_theta / PI;
-
-        // add light that is emitted from surface (but stop right afterwards)
-        if (bounce <= BOUNCE_COUNT && mat->Le.x >= 0.5f)
-        {
-            // TODO: only add if the ray was added by a single lonely bounce from
-            // the mirror instead of just the last bounce being the mirror?
-            bool last_bounce_reflected = (old_mat != nullptr && old_mat->type == MaterialType::MATERIAL_IDEAL_REFLECTIVE);
-            if (bounce == 0 || last_bounce_reflected)
-                color = mat->Le;
-
-            return color;
-        }
-        // If there is at least 1 light source in the scene and the material
-        // of the surface we hit is diffuse, we can use NEE.
-        else if (scene.light_tris.size > 0 && (mat->type == MaterialType::MATERIAL_LAMBERTIAN || (mat->type == MaterialType::MATERIAL_PHONG && mat->specular == Vec3f(0.0f))))
-        {
-            // sample light sources for direct illumination
-            Vec3f direct_illumination = Vec3f(0.0f);
-            for (int8 shadow_ray_index = 0; shadow_ray_index < NUM_SHADOW_RAYS; shadow_ray_index++)
-            {
-                // pick a light source
-                float pdf_pick_light = 1.0f / (float)scene.light_tris.size;
-
-                int32 picked_light_source = (int32)(pcg32_random_r(rngptr) % scene.light_tris.size);
-                // TODO: FIX THIS
-                Triangle light_source = scene.tris[scene.light_tris[(uint32)picked_light_source]];
-
-                Material *light_source_mat = scene.materials[light_source.mat_index];
-                float light_area = Area(&light_source);
-                float pdf_pick_point_on_light = 1.0f / light_area;
-                Vec3f y = MapToTriangle(RandomVec2fPCG(rngptr), light_source);
-
-                // PDF in terms of area, for picking point on light source k
-                float pdf_light_area = pdf_pick_light * pdf_pick_point_on_light;
-
-                // Just for clarity
-                Vec3f x = data.point + EPSILON * data.normal;
-
-                // Send out a shadow ray in direction x->y
-                Vec3f dist_vec = y - x;
-                Vec3f shadow_ray_dir = NormalizeVec3f(dist_vec);
-                Ray shadow_ray = { x, shadow_ray_dir, 1.0f / shadow_ray_dir };
-
-                // Check if ray hits anything before hitting the light source
-                HitData shadow_data = {};
-                bool hit_anything = Intersect(shadow_ray, scene, &shadow_data);
-                if (!hit_anything)
-                {
-                    // It shouldn't be possible to send a ray towards the light
-                    // source and not hit anything in the scene, even the light
-                    // printf("ERROR: Shadow ray didn't hit anything!\n");
-                    // break;
-
-                    // return Vec3f(5.0f, 0.0f, 5.0f);
-                }
-
-                // Visibility check means we have a clear line of sight!
-                if (hit_anything && y == shadow_data.point)
-                {
-                    float squared_dist = Dot(dist_vec, dist_vec);
+	Scene *scene;
+	EnvironmentMap *environment;
+	uint32 bounce_count;
 
-                    // We want to only add light contribution from lights within
-                    // the hemisphere solid angle above X, and not from lights behind it.
-                    float cos_theta_x = Max(0.0f, Dot(data.normal, shadow_ray_dir));
+	// Collapsed copy of the bottom level BVHs in `scene->bvh_nodes`. Without
+	// it the binary BVHs are traversed the same way as in the shader.
+	const WideBVH *wide_bvh;
 
-                    // We can sample the light from both sides, it doesn't have to
-                    // be a one-sided light source.
-// #if TWO_SIDED_LIGHT
-// 					float32 cos_theta_y = Abs(Dot(shadow_data.normal, shadowRayDir));
-// #else
-                    float cos_theta_y = Max(0.0f, Dot(shadow_data.normal, -shadow_ray_dir));
-// #endif
+	// Compressed copy of the same BVHs, traversed instead of both when set
+	const CompressedBVH *compressed_bvh;
 
-                    float G = cos_theta_x * cos_theta_y / squared_dist;
+	// Number of rays traced through the scene so far
+	uint64 ray_count;
 
-                    direct_illumination += light_source_mat->Le * BRDF * G / pdf_light_area;
-                    //if (direct_illumination.x != direct_illumination.x || direct_illumination.y != direct_illumination.y || direct_illumination.z != direct_illumination.z)
-                    //{
-                        // printf("NaN!\n");
-                    //}
-                }
-            }
-            direct_illumination /= (float)NUM_SHADOW_RAYS;
+	// Base color textures are only sampled when set, from the tiles it
+	// pages in. Without `camera` every hit samples the first mip level.
+	TextureCache *texture_cache = nullptr;
+	const CameraGrid *camera = nullptr;
+	TextureLookupStats texture_stats {};
+};
 
-            // Because we are calculating for a non-emissive point, we can safely
-            // add the direct illumination to this point.
-            color += throughput_term * direct_illumination;
-
-            // Update the throughput term
-            throughput_term *= BRDF * cos_theta / pdf_cos_weighted_hemisphere;
-            // throughput_term *= PI * BRDF;
-
-            // Pick a new direction
-            Vec2f random_vec2f = RandomVec2fPCG(rngptr);
-            Vec3f dir = MapToUnitHemisphereCosineWeightedCriver(random_vec2f, data.normal);
-
-            Vec3f point = data.point;
-            ray = { point + EPSILON * data.normal, dir, 1.0f / dir };
-        }
-        else if (mat->type == MaterialType::MATERIAL_IDEAL_REFLECTIVE)
-        {
-            Vec3f reflected_dir = Reflect(-ray.direction, data.normal);
-
-            // Intersection point and new ray
-            Vec3f point = data.point;
-            ray = { point + EPSILON * data.normal, reflected_dir, 1.0f / reflected_dir };
-
-            // If we sample uniformly or with cosine weighted sampling, then
-            // we would need to calculate the BRDF every single direction in the
-            // hemisphere. If the direction is the reflected direction, then
-            // the BRDF is 1, otherwise it is 0. But that is wasteful. Instead,
-            // we *only* pick the reflected direction (not the case for glossy or
-            // otherwise un-ideal reflective materials) so the pdf is 1, and the
-            // BRDF is 1. Because of this, we have an instant solution without
-            // having to sample the hemisphere at all. The throughput term is then
-            // BRDF*(Nx dot wi) = (Nx dot wi) = cos_theta_x
-            // throughput_term *= Abs(cos_theta);
-        }
-        else if (mat->type == MaterialType::MATERIAL_PHONG)
-        {
-            // TODO: support the diffuse part
-
-            Vec3f Nx = data.normal;
-            Vec3f x = data.point + EPSILON * data.normal;
-
-            Vec3f reflected_dir = NormalizeVec3f(Reflect(-ray.direction, Nx));
-            Mat3f tnb = ConstructTNB(reflected_dir);
-
-            float inv = 1.0f / (mat->n_spec + 1.0f);
-
-            Vec2f random_vec2f = RandomVec2fPCG(rngptr);
-
-            float cos_alpha = powf(random_vec2f.x, inv);
-            float sin_alpha = sqrtf(1.0f - cos_alpha * cos_alpha);
-            float phi = 2.0f * PI * random_vec2f.y;
-
-            Vec3f dir = { sin_alpha * cosf(phi), cos_alpha, sin_alpha * sinf(phi) };
-
-            dir = tnb * dir;
-            ray = { x, dir, 1.0f / dir };
-
-            float cos_theta_x = Max(0.0f, Dot(dir, Nx));
-
-            float pdf_theta = ((mat->n_spec + 1.0f) / (2.0f * PI)) * powf(cos_alpha, mat->n_spec);
-            float theta_term = powf(cos_alpha, mat->n_spec) * ((mat->n_spec + 2.0f) / (2.0f * PI)) / pdf_theta;
-            throughput_term *= mat->specular * cos_theta_x * theta_term;
-        }
-
-        old_mat = mat;
-    }
-
-    return color;
-}
-
-Vec3f EstimatorPathTracingMIS(Ray ray, Scene scene, pcg32_random_t *rngptr)
+// The image plane that `render_function` spans in front of the camera
+struct CameraGrid
 {
-    Vec3f color = Vec3f(0.0f);
-    Vec3f throughput_term = Vec3f(1.0f);
-
-    HitData data = {};
-    bool intersect = Intersect(ray, scene, &data);
-    if (!intersect)
-    {
-        // No intersection with scene, add env map contribution
-        color += throughput_term * SkyColor(ray.direction) * ENVIRONMENT_MAP_LE;
-        return color;
-    }
-
-    Vec3f y = ray.origin + ray.direction * data.t + EPSILON * data.normal;
-    Vec3f normal_y = data.normal;
-    Material *mat_y = scene.materials[data.mat_index];
-
-    // Add light contribution from first bounce if it hit a light source
-    color += throughput_term * mat_y->Le;
+	glm::vec3 origin;
+	glm::vec3 grid_origin;
+	glm::vec3 grid_x;
+	glm::vec3 grid_y;
 
-    int8 num_bounces = BOUNCE_COUNT + 1;
-    for (uint8 b = 1; b < num_bounces; b++)
-    {
-        Vec3f x = y;
-        Vec3f normal_x = normal_y;
-        Material *mat_x = mat_y;
+	// One pixel along grid_x and grid_y, the differentials of the camera rays
+	glm::vec3 pixel_x;
+	glm::vec3 pixel_y;
 
-        // If there is at least 1 light source in the scene, and the material of the
-        // surface is diffuse, we can calculate the direct light contribution (NEE)
-        bool can_use_NEE = scene.light_tris.size > 0 && (mat_x->type == MaterialType::MATERIAL_LAMBERTIAN || (mat_x->type == MaterialType::MATERIAL_PHONG && mat_x->specular == Vec3f(0.0f))) && mat_x->Le.x < 0.1f;
+	CameraGrid(const glm::vec3 &origin, const glm::vec3 &forward, const glm::vec3 &right, uint32 width, uint32 height);
+};
 
-        if (can_use_NEE)
-        {
-            // sample light sources for direct illumination
-            for (int8 shadow_ray_index = 0; shadow_ray_index < NUM_SHADOW_RAYS; shadow_ray_index++)
-            {
-                // pick a light source
-                float pdf_pick_light = 1.0f / (float)scene.light_tris.size;
+uint32 seed3(uint32 x, uint32 y, uint32 z);
 
-                uint32 r = pcg32_random_r(rngptr);
-                int32 picked_light_source = (int32)(r % scene.light_tris.size);
-                Triangle light_source = scene.tris[scene.light_tris[(uint32)picked_light_source]];
+// Fills in the hit data (normal, uvs, material) of a triangle hit
+// at distance `t` with the barycentric coordinates `u` and `v`
+void FillTriangleHit(TraceContext &ctx, const glm::vec3 &rd, uint32 tri_index, float t, float u, float v, HitData &data);
 
-                Material *light_source_mat = scene.materials[light_source.mat_index];
-                Vec3f y_nee = MapToTriangle(RandomVec2fPCG(rngptr), light_source);
-                float light_area = Area(&light_source);
+bool IntersectTriangle(TraceContext &ctx, const glm::vec3 &ro, const glm::vec3 &rd, uint32 tri_index, HitData &data, float tmax);
 
-                // Just for clarity
-                Vec3f x_nee = x;
+// Closest hit of the world space ray with the mesh of one instance. The
+// hit normal is moved into world space, the rest of the hit data stays
+// relative to the mesh (triangle index, uvs).
+bool IntersectInstance(TraceContext &ctx, const glm::vec3 &ro, const glm::vec3 &rd, uint32 instance_index, HitData &data, float &tmax);
 
-                // Send out a shadow ray in direction x->y
-                Vec3f dist_vec = y_nee - x_nee;
-                Vec3f shadow_ray_dir = NormalizeVec3f(dist_vec);
-                Ray shadow_ray = { x_nee, shadow_ray_dir, 1.0f / shadow_ray_dir };
+// Tests the ray against every sphere, only accepting hits closer than `tmax`
+bool IntersectSpheres(TraceContext &ctx, const glm::vec3 &ro, const glm::vec3 &rd, HitData &result, float &tmax);
 
-                float squared_dist = Dot(dist_vec, dist_vec);
+bool Intersect(TraceContext &ctx, const glm::vec3 &ro, const glm::vec3 &rd, HitData &result);
 
-                // We want to only add light contribution from lights within
-                // the hemisphere solid angle above X, and not from lights behind it.
-                float cos_theta_x = Max(0.0f, Dot(normal_x, shadow_ray_dir));
+glm::vec3 SkyColor(TraceContext &ctx, const glm::vec3 &dir);
 
-                // Check if ray hits anything before hitting the light source
-                HitData shadow_data = {};
-                bool hit_anything = Intersect(shadow_ray, scene, &shadow_data);
-                if (!hit_anything)
-                {
-                    // return Vec3f(5.0f, 0.0f, 5.0f);
-                }
-
-                // Visibility check means we have a clear line of sight!
-                if (hit_anything && y_nee == shadow_data.point)
-                {
-//#if TWO_SIDED_LIGHT
-                    //float32 cos_theta_y = Dot(shadow_data.normal, -shadow_ray.direction);
-                    //Vec3f normalY_nee = shadow_data.normal * Sign(cos_theta_y);
-                    //cos_theta_y = Abs(cos_theta_y);
-//#else
-                    float cos_theta_y = Max(0.0f, Dot(shadow_data.normal, -shadow_ray.direction));
-                    // Vec3f normalY_nee = shadow_data.normal;
-                    if (cos_theta_y > 0.0f)
-//#endif
-                    {
-                        float pdf_pick_point_on_light = 1.0f / light_area;
-
-                        // PDF in terms of area, for picking point on light source k
-                        float pdf_light_area = pdf_pick_light * pdf_pick_point_on_light;
-
-                        // PDF in terms of solid angle, for picking point on light source k
-                        float pdf_light_sa = pdf_light_area * squared_dist / cos_theta_y;
-
-                        // PDF in terms of solid angle, for picking ray from cos. weighted hemisphere
-                        float pdf_BSDF_sa = cos_theta_x / PI;
-
-                        // weight for NEE
-                        // float32 wNEE = BalanceHeuristic(pdf_light_sa, pdf_BSDF_sa) / pdf_light_sa;
-                        float wNEE = 1.0f / (pdf_light_sa + pdf_BSDF_sa);
-
-                        color += light_source_mat->Le * mat_x->diffuse * cos_theta_x * throughput_term * wNEE;
-                    }
-                }
-            }
-        }
-
-        if (mat_x->type == MaterialType::MATERIAL_LAMBERTIAN)
-        {
-            // Pick a new direction
-            Vec2f random_vec2f = RandomVec2fPCG(rngptr);
-            Vec3f dir = MapToUnitHemisphereCosineWeightedCriver(random_vec2f, normal_x);
-            ray = { x + EPSILON * normal_x, dir, 1.0f / dir };
-        }
-        else if (mat_x->type == MaterialType::MATERIAL_IDEAL_REFLECTIVE)
-        {
-            // Pick the reflected direciton
-            Vec3f reflected_dir = NormalizeVec3f(Reflect(-ray.direction, normal_x));
-            ray = { x + EPSILON * normal_x, reflected_dir, 1.0f / reflected_dir };
-        }
-        else if (mat_x->type == MaterialType::MATERIAL_PHONG)
-        {
-            // Pick direction in the cosine lobe around reflected dir
-            Vec3f reflected_dir = NormalizeVec3f(Reflect(-ray.direction, normal_x));
-            Mat3f tnb = ConstructTNB(reflected_dir);
-
-            float inv = 1.0f / (mat_x->n_spec + 1.0f);
-
-            Vec2f random_vec2f = RandomVec2fPCG(rngptr);
-            float cos_alpha = powf(random_vec2f.x, inv);
-            float sin_alpha = sqrtf(1.0f - cos_alpha * cos_alpha);
-            float phi = 2.0f * PI * random_vec2f.y;
-
-            Vec3f dir = { sin_alpha * cosf(phi), cos_alpha, sin_alpha * sinf(phi) };
-            dir = tnb * dir;
-            ray = { x, dir, 1.0f / dir };
-        }
-
-        float cos_theta_x = Max(0.0f, Dot(normal_x, ray.direction));
-
-        intersect = Intersect(ray, scene, &data);
-        if (!intersect)
-        {
-            // No intersection with scene, add env map contribution
-            if (b <= BOUNCE_COUNT)
-            {
-                if (mat_x->type == MATERIAL_LAMBERTIAN)
-                    color += throughput_term * PI * mat_x->diffuse * SkyColor(ray.direction) * ENVIRONMENT_MAP_LE;
-                else if (mat_x->type == MATERIAL_IDEAL_REFLECTIVE)
-                    color += throughput_term * mat_x->specular * SkyColor(ray.direction) * cos_theta_x * ENVIRONMENT_MAP_LE;
-                else if (mat_x->type == MATERIAL_PHONG)
-                {
-                    float theta_term = 1.0f + 1.0f / (mat_x->n_spec + 1.0f);
-                    color += throughput_term * mat_x->specular * SkyColor(ray.direction) * cos_theta_x * theta_term * ENVIRONMENT_MAP_LE;
-                }
-
-                break;
-            }
-        }
-
-#if TWO_SIDED_LIGHT
-        float32 cos_theta_y = Dot(data.normal, -ray.direction);
-        normal_y = data.normal * Sign(cos_theta_y);
-        cos_theta_y = Abs(cos_theta_y);
-#else
-        float cos_theta_y = Max(0.0f, -Dot(data.normal, ray.direction));
-        normal_y = data.normal;
-#endif
-
-        float pdf_BSDF_sa = 0.0f;
-        if (mat_x->type == MaterialType::MATERIAL_LAMBERTIAN)
-        {
-            // Because the new ray direction is sampled using cosine weighted hemisphere
-            // sampling, the pdf is cos_theta / PI
-            pdf_BSDF_sa = cos_theta_y / PI;
-        }
-        else if (mat_x->type == MaterialType::MATERIAL_IDEAL_REFLECTIVE)
-        {
-            // We only sample the single direction, so the pdf is 1 for that
-            // reflected direction
-            pdf_BSDF_sa = 1.0f;
-        }
-        else if (mat_x->type == MaterialType::MATERIAL_PHONG)
-        {
-            // NOTE: it's this value because I assume the terms present in the pdf
-            // cancel out with the terms present in the specular term of the BRDF
-            // because I importance sample the specular term
-            pdf_BSDF_sa = 1.0f;
-        }
-
-        y = ray.origin + ray.direction * data.t + EPSILON * normal_y;
-        mat_y = scene.materials[data.mat_index];
-
-        float wBSDF = 1.0f;
-
-        // If we can use NEE on the hit surface
-        if (mat_x->type == MaterialType::MATERIAL_LAMBERTIAN && mat_x->Le.x < 0.1f && cos_theta_y > 0.0f)
-        {
-            // If the hit surface is a light source, we need to calculate
-            // the pdf for NEE
-            if (mat_y->Le.x > 0.1f && scene.light_tris.size > 0)
-            {
-                float pdf_NEE_area = 0.0f;
-                switch (data.object_type)
-                {
-                case ObjectType::SPHERE:
-                    pdf_NEE_area = 1.0f / Area(&scene.spheres[data.object_index]);
-                    break;
-                case ObjectType::TRIANGLE:
-                    pdf_NEE_area = 1.0f / Area(&scene.tris[data.object_index]);
-                    break;
-                default:
-                    // printf("Light source type unsupported for sampling!\n");
-                    break;
-                };
+// Camera ray that was already traced, e.g. as part of a ray packet
+struct PrimaryHit
+{
+	bool hit;
+	HitData data;
+};
 
-                pdf_NEE_area /= (float)(scene.light_tris.size);
-                float pdf_NEE_sa = pdf_NEE_area * data.t * data.t / cos_theta_y;
-                wBSDF = BalanceHeuristic(pdf_BSDF_sa, pdf_NEE_sa);
-            }
+// The estimators trace the camera ray themselves, unless its hit is passed in
+glm::vec3 EstimatorPathTracingBRDF(TraceContext &ctx, glm::vec3 ro, glm::vec3 rd, uint32 rng_state, const PrimaryHit *primary = nullptr);
 
-            if (b <= BOUNCE_COUNT)
-                color += throughput_term * mat_x->diffuse * mat_y->Le * PI * wBSDF;
-        }
-        else if (b <= BOUNCE_COUNT && cos_theta_y > 0.0f)
-        {
-            if (mat_x->type == MATERIAL_PHONG)
-            {
-                // Sampled w.r.t the cosine term
-                Vec3f diffuse_part = PI * mat_x->diffuse;
+glm::vec3 EstimatorPathTracingNEE(TraceContext &ctx, glm::vec3 ro, glm::vec3 rd, uint32 rng_state, const PrimaryHit *primary = nullptr);
 
-                // Sampled w.r.t the BRDF
-                float theta_term = 1.0f + 1.0f / (mat_x->n_spec + 1.0f);
-                Vec3f specular_part = mat_x->specular * theta_term * cos_theta_x;
+glm::vec3 EstimatorPathTracingMIS(TraceContext &ctx, glm::vec3 ro, glm::vec3 rd, uint32 rng_state, const PrimaryHit *primary = nullptr);
 
-                color += throughput_term * (diffuse_part + specular_part) * mat_y->Le * cos_theta_y;
-            }
-        }
+// Jittered direction of the camera ray through the given pixel. Consumes the
+// same random numbers as the compute shader before the estimator runs.
+glm::vec3 CameraRayDirection(const CameraGrid &cam, uint32 x, uint32 y, uint32 width, uint32 height, uint32 &rng_state);
 
-        if (mat_x->type == MaterialType::MATERIAL_LAMBERTIAN)
-            throughput_term *= PI * mat_x->diffuse;
-        else if (mat_x->type == MaterialType::MATERIAL_IDEAL_REFLECTIVE)
-            throughput_term *= mat_x->specular;
-        else if (mat_x->type == MaterialType::MATERIAL_PHONG)
-        {
-            float theta_term = 1.0f + 1.0f / (mat_x->n_spec + 1.0f);
-            throughput_term *= mat_x->specular * cos_theta_x * theta_term;
-        }
-    }
+// Runs the selected estimator for a path starting with the given ray
+glm::vec3 ShadePath(TraceContext &ctx, ViewMode view_mode, const glm::vec3 &ro, const glm::vec3 &rd, uint32 rng_state, const PrimaryHit *primary);
 
-    return color;
-}
-#endif
\ No newline at end of file
+// Generates a jittered camera ray through the given pixel and
+// returns the radiance estimate of the selected estimator.
+glm::vec3 RenderPixel(TraceContext &ctx, const CameraGrid &cam, ViewMode view_mode,
+					  uint32 x, uint32 y, uint32 width, uint32 height, uint32 rng_state);
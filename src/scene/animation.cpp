@@ -0,0 +1,457 @@
+#include "animation.hpp"
+#include "../math/math.hpp"
+#include "compressed_bvh.hpp"
+#include "scene.hpp"
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <glm/packing.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+// Same as in bvh.cpp, serial when OpenMP isn't available
+#if defined(_OPENMP)
+#define PARALLEL_FOR _Pragma("omp parallel for")
+#else
+#define PARALLEL_FOR
+#endif
+
+// Maximum number of components of a sampled value, more morph targets than
+// this are left at their rest weights
+constexpr uint32 MAX_CHANNEL_COMPONENTS = 64;
+
+static double milliseconds_since(std::chrono::steady_clock::time_point start_time)
+{
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+	return elapsed.count();
+}
+
+// Interpolates the keyframes of the channel at `time` into `out_value`,
+// following the glTF interpolation modes. Rotations are x, y, z, w.
+static void sample_channel(Model &model, const AnimationChannel &channel, float time, float *out_value)
+{
+	const float *times = &model.animation_times._data[channel.first_key];
+	const float *values = &model.animation_values._data[channel.first_value];
+	uint32 n = channel.component_count;
+
+	bool cubic = channel.interpolation == AnimationInterpolation::CUBIC_SPLINE;
+	uint32 key_stride = cubic ? 3 * n : n;
+	uint32 value_offset = cubic ? n : 0;
+
+	uint32 last_key = channel.key_count - 1;
+	if (time <= times[0] || time >= times[last_key] || channel.key_count == 1)
+	{
+		uint32 key = time <= times[0] ? 0 : last_key;
+		memcpy(out_value, values + key * key_stride + value_offset, n * sizeof(float));
+		return;
+	}
+
+	auto key = (uint32) (std::upper_bound(times, times + channel.key_count, time) - times - 1);
+	const float *v0 = values + key * key_stride + value_offset;
+	const float *v1 = values + (key + 1) * key_stride + value_offset;
+	float dt = times[key + 1] - times[key];
+	float s = (time - times[key]) / dt;
+
+	switch (channel.interpolation)
+	{
+		case AnimationInterpolation::STEP:
+		{
+			memcpy(out_value, v0, n * sizeof(float));
+			break;
+		}
+		case AnimationInterpolation::LINEAR:
+		{
+			if (channel.path == AnimationPath::ROTATION)
+			{
+				glm::quat q0(v0[3], v0[0], v0[1], v0[2]);
+				glm::quat q1(v1[3], v1[0], v1[1], v1[2]);
+				glm::quat q = glm::slerp(q0, q1, s);
+				out_value[0] = q.x;
+				out_value[1] = q.y;
+				out_value[2] = q.z;
+				out_value[3] = q.w;
+				break;
+			}
+
+			for (uint32 i = 0; i < n; i++)
+			{
+				out_value[i] = v0[i] + (v1[i] - v0[i]) * s;
+			}
+			break;
+		}
+		case AnimationInterpolation::CUBIC_SPLINE:
+		{
+			// Hermite spline between the values, with the out tangent of the
+			// first key and the in tangent of the second one
+			const float *out_tangent = v0 + n;
+			const float *in_tangent = v1 - n;
+			float s2 = s * s;
+			float s3 = s2 * s;
+			for (uint32 i = 0; i < n; i++)
+			{
+				out_value[i] = (2.0f * s3 - 3.0f * s2 + 1.0f) * v0[i] +
+							   (s3 - 2.0f * s2 + s) * dt * out_tangent[i] +
+							   (-2.0f * s3 + 3.0f * s2) * v1[i] +
+							   (s3 - s2) * dt * in_tangent[i];
+			}
+			break;
+		}
+	}
+}
+
+// Transform of a node relative to its parent as glTF defines it, which the
+// inverse bind matrices of the skins are made for. NodeLocalMatrix keeps
+// the order and axes that the loader has always placed the nodes with.
+static glm::mat4 gltf_local_matrix(const ModelNode &node, const glm::vec3 &translation, const glm::quat &rotation, const glm::vec3 &scale)
+{
+	if (node.has_matrix)
+	{
+		return node.matrix;
+	}
+
+	glm::mat4 matrix = glm::translate(glm::mat4(1.0f), translation);
+	matrix *= glm::mat4_cast(rotation);
+	return glm::scale(matrix, scale);
+}
+
+// Replaces the bottom level BVH of a deforming mesh with `nodes`, which
+// are relative to the mesh as CalculateBVH returns them. The nodes of all
+// meshes after it move when the node count changed.
+static void replace_mesh_nodes(Scene &scene, DeformingMesh &deforming, Array<BVHNodeGLSL> &nodes)
+{
+	SceneMesh &mesh = scene.meshes[deforming.mesh_index];
+	uint32 old_end = mesh.bvh_root + deforming.node_count;
+	auto shift = (int32) nodes.size - (int32) deforming.node_count;
+
+	if (shift == 0)
+	{
+		for (uint32 i = 0; i < nodes.size; i++)
+		{
+			BVHNodeGLSL node = nodes[i];
+			uint32 offset = node.IsLeaf() ? mesh.first_tri : mesh.bvh_root;
+			node.SetFirstChildOrTri(node.FirstChildOrTri() + offset);
+			scene.bvh_nodes[mesh.bvh_root + i] = node;
+		}
+		return;
+	}
+
+	Array<BVHNodeGLSL> bvh_nodes((uint32) ((int32) scene.bvh_nodes.size + shift));
+	for (uint32 i = 0; i < mesh.bvh_root; i++)
+	{
+		bvh_nodes.append(scene.bvh_nodes[i]);
+	}
+
+	for (uint32 i = 0; i < nodes.size; i++)
+	{
+		BVHNodeGLSL node = nodes[i];
+		uint32 offset = node.IsLeaf() ? mesh.first_tri : mesh.bvh_root;
+		node.SetFirstChildOrTri(node.FirstChildOrTri() + offset);
+		bvh_nodes.append(node);
+	}
+
+	for (uint32 i = old_end; i < scene.bvh_nodes.size; i++)
+	{
+		BVHNodeGLSL node = scene.bvh_nodes[i];
+		if (!node.IsLeaf())
+		{
+			node.SetFirstChildOrTri((uint32) ((int32) node.FirstChildOrTri() + shift));
+		}
+		bvh_nodes.append(node);
+	}
+
+	scene.bvh_nodes = bvh_nodes;
+
+	for (uint32 i = 0; i < scene.meshes.size; i++)
+	{
+		if (i != deforming.mesh_index && scene.meshes[i].bvh_root >= old_end)
+		{
+			scene.meshes[i].bvh_root = (uint32) ((int32) scene.meshes[i].bvh_root + shift);
+		}
+	}
+
+	deforming.node_count = nodes.size;
+}
+
+// Replaces the BVH of a deforming mesh with `nodes` and its triangles with
+// `sorted_tris` in their new order, which moves its emissive triangles
+// along. Every triangle has to be in `sorted_tris` once.
+static void replace_mesh_bvh(Scene &scene, DeformingMesh &deforming, Array<BVHNodeGLSL> &nodes, Array<IndexedTriangleGLSL> &sorted_tris)
+{
+	SceneMesh &mesh = scene.meshes[deforming.mesh_index];
+	for (uint32 i = 0; i < sorted_tris.size; i++)
+	{
+		scene.triangles[mesh.first_tri + i] = sorted_tris[i];
+	}
+
+	// Every triangle is referenced once, so the emissive ones stay as many
+	Array<uint32> emissive_tris = FindEmissiveTris(sorted_tris, scene.materials);
+	for (uint32 i = 0; i < emissive_tris.size && i < mesh.emissive_count; i++)
+	{
+		scene.emissive_tris[mesh.first_emissive + i] = mesh.first_tri + emissive_tris[i];
+	}
+
+	replace_mesh_nodes(scene, deforming, nodes);
+}
+
+// Builds the BVH of a deforming mesh again from its current vertices. The
+// rebuild options never split triangles, so the sorted triangles are all
+// of them once.
+static void rebuild_mesh(Scene &scene, DeformingMesh &deforming)
+{
+	SceneMesh &mesh = scene.meshes[deforming.mesh_index];
+
+	Array<IndexedTriangleGLSL> sorted_tris;
+	Array<BVHNodeGLSL> nodes = CalculateBVH(&scene.triangles._data[mesh.first_tri], mesh.tri_count, scene.vertices, sorted_tris,
+											scene.animation.rebuild_options);
+
+	replace_mesh_bvh(scene, deforming, nodes, sorted_tris);
+	deforming.build_cost = BVHSahCost(scene.bvh_nodes, mesh.bvh_root, deforming.node_count);
+}
+
+// The refitted boxes can make CompressBVH collapse other children into a
+// node than at the build, whose leaves then aren't next to each other.
+// Orders the triangles of a refitted mesh again, as CalculateBVH does.
+static void order_refitted_mesh(Scene &scene, DeformingMesh &deforming)
+{
+	SceneMesh &mesh = scene.meshes[deforming.mesh_index];
+
+	Array<BVHNodeGLSL> nodes(deforming.node_count);
+	for (uint32 i = 0; i < deforming.node_count; i++)
+	{
+		BVHNodeGLSL node = scene.bvh_nodes[mesh.bvh_root + i];
+		uint32 offset = node.IsLeaf() ? mesh.first_tri : mesh.bvh_root;
+		node.SetFirstChildOrTri(node.FirstChildOrTri() - offset);
+		nodes.append(node);
+	}
+
+	Array<IndexedTriangleGLSL> sorted_tris(mesh.tri_count);
+	for (uint32 i = 0; i < mesh.tri_count; i++)
+	{
+		sorted_tris.append(scene.triangles[mesh.first_tri + i]);
+	}
+
+	OrderLeavesForCompression(nodes, sorted_tris, nullptr);
+	replace_mesh_bvh(scene, deforming, nodes, sorted_tris);
+}
+
+// Moves the vertices of a mesh by its morph targets and then by the joints
+// of its skin, from the model vertices into the scene vertices. The morph
+// targets keep the normals of the rest pose, the joints turn them.
+// `skin_matrices` are the glTF transforms of the nodes relative to the model.
+static void deform_mesh(Scene &scene, DeformingMesh &deforming, Array<float> &weights, Array<glm::mat4> &skin_matrices)
+{
+	Model &model = scene.model;
+	ModelMesh &model_mesh = model.meshes[deforming.mesh_index];
+	ModelNode &node = model.nodes[deforming.node_index];
+
+	uint32 target_count = pixl::min(model_mesh.morph_target_count, node.weight_count);
+	const float *node_weights = &weights._data[node.first_weight];
+
+	// glTF places a skinned mesh by its joints alone. The joints are taken
+	// relative to the node of the mesh, whose instance places it like every
+	// other mesh.
+	Array<glm::mat4> joint_matrices;
+	bool is_skinned = model_mesh.has_joints && node.skin >= 0;
+	if (is_skinned)
+	{
+		ModelSkin &skin = model.skins[(uint32) node.skin];
+		glm::mat4 node_from_model = glm::inverse(skin_matrices[deforming.node_index]);
+		joint_matrices.resize(skin.joint_count);
+		for (uint32 i = 0; i < skin.joint_count; i++)
+		{
+			uint32 joint = skin.first_joint + i;
+			joint_matrices[i] = node_from_model * skin_matrices[model.skin_joints[joint]] * model.inverse_bind_matrices[joint];
+		}
+	}
+
+	PARALLEL_FOR
+	for (uint32 i = 0; i < model_mesh.vertex_count; i++)
+	{
+		uint32 vertex = model_mesh.first_vertex + i;
+		glm::vec3 position = model.vertices._data[vertex].position;
+
+		const glm::vec3 *deltas = &model.morph_deltas._data[model_mesh.first_morph_delta + i * model_mesh.morph_target_count];
+		for (uint32 target = 0; target < target_count; target++)
+		{
+			position += node_weights[target] * deltas[target];
+		}
+
+		// Vertices without weights, or only for joints the skin doesn't
+		// have, stay where the morph targets put them
+		if (is_skinned)
+		{
+			const glm::uvec4 &joints = model.vertex_joints._data[model_mesh.first_joint_vertex + i];
+			const glm::vec4 &joint_weights = model.joint_weights._data[model_mesh.first_joint_vertex + i];
+
+			glm::mat4 skin_matrix(0.0f);
+			float weight_sum = 0.0f;
+			for (uint32 k = 0; k < 4; k++)
+			{
+				if (joints[k] < joint_matrices.size && joint_weights[k] > 0.0f)
+				{
+					skin_matrix += joint_weights[k] * joint_matrices._data[joints[k]];
+					weight_sum += joint_weights[k];
+				}
+			}
+
+			if (weight_sum > 0.0f)
+			{
+				// The weights should add up to one, exporters round them
+				skin_matrix /= weight_sum;
+				position = glm::vec3(skin_matrix * glm::vec4(position, 1.0f));
+
+				// Skins rarely scale unevenly, so the normals skip the
+				// inverse transpose
+				glm::vec3 normal = pixl::octahedral_normal_decoding(glm::unpackHalf2x16(model.vertices._data[vertex].normal));
+				normal = glm::mat3(skin_matrix) * normal;
+				float length = glm::length(normal);
+				if (length > 0.0f)
+				{
+					scene.vertices._data[vertex].normal = glm::packHalf2x16(pixl::octahedral_normal_encoding(normal / length));
+				}
+			}
+		}
+
+		scene.vertices._data[vertex].position = position;
+	}
+}
+
+AnimationStats AnimateScene(Scene &scene, float time, const AnimationOptions &options)
+{
+	AnimationStats stats {};
+	Model &model = scene.model;
+	if (model.instances.size == 0)
+	{
+		// Loaded from the cache, which only has the rest pose
+		return stats;
+	}
+
+	auto start_time = std::chrono::steady_clock::now();
+
+	// Rest pose of every node, with the animated properties replaced
+	uint32 node_count = model.nodes.size;
+	Array<glm::vec3> translations(node_count);
+	Array<glm::quat> rotations(node_count);
+	Array<glm::vec3> scales(node_count);
+	for (uint32 i = 0; i < node_count; i++)
+	{
+		translations.append(model.nodes[i].translation);
+		rotations.append(model.nodes[i].rotation);
+		scales.append(model.nodes[i].scale);
+	}
+	Array<float> weights = model.node_weights;
+
+	float local_time = model.animation_duration > 0.0f ? std::fmod(time, model.animation_duration) : 0.0f;
+	for (uint32 i = 0; i < model.animation_channels.size; i++)
+	{
+		AnimationChannel &channel = model.animation_channels[i];
+		if (channel.component_count > MAX_CHANNEL_COMPONENTS || channel.node_index >= node_count)
+		{
+			continue;
+		}
+
+		float value[MAX_CHANNEL_COMPONENTS];
+		sample_channel(model, channel, local_time, value);
+
+		uint32 node_index = channel.node_index;
+		switch (channel.path)
+		{
+			case AnimationPath::TRANSLATION:
+				translations[node_index] = glm::vec3(value[0], value[1], value[2]);
+				break;
+			case AnimationPath::ROTATION:
+				rotations[node_index] = glm::normalize(glm::quat(value[3], value[0], value[1], value[2]));
+				break;
+			case AnimationPath::SCALE:
+				scales[node_index] = glm::vec3(value[0], value[1], value[2]);
+				break;
+			case AnimationPath::WEIGHTS:
+			{
+				ModelNode &node = model.nodes[node_index];
+				for (uint32 w = 0; w < node.weight_count && w < channel.component_count; w++)
+				{
+					weights[node.first_weight + w] = value[w];
+				}
+				break;
+			}
+		}
+	}
+
+	Array<glm::mat4> local_matrices(node_count);
+	for (uint32 i = 0; i < node_count; i++)
+	{
+		local_matrices.append(NodeLocalMatrix(model.nodes[i], translations[i], rotations[i], scales[i]));
+	}
+
+	// The skins need their joints posed before the meshes are deformed
+	Array<glm::mat4> skin_matrices;
+	if (model.skins.size > 0)
+	{
+		Array<glm::mat4> gltf_local_matrices(node_count);
+		for (uint32 i = 0; i < node_count; i++)
+		{
+			gltf_local_matrices.append(gltf_local_matrix(model.nodes[i], translations[i], rotations[i], scales[i]));
+		}
+		ComputeNodeWorldMatrices(model.nodes, gltf_local_matrices._data, skin_matrices);
+	}
+
+	for (uint32 i = 0; i < scene.animation.meshes.size; i++)
+	{
+		deform_mesh(scene, scene.animation.meshes[i], weights, skin_matrices);
+	}
+
+	stats.pose_ms = milliseconds_since(start_time);
+	start_time = std::chrono::steady_clock::now();
+
+	for (uint32 i = 0; i < scene.animation.meshes.size; i++)
+	{
+		DeformingMesh &deforming = scene.animation.meshes[i];
+		SceneMesh &mesh = scene.meshes[deforming.mesh_index];
+
+		float cost = RefitBVH(scene.bvh_nodes, mesh.bvh_root, deforming.node_count, scene.triangles, scene.vertices);
+		float cost_ratio = deforming.build_cost > 0.0f ? cost / deforming.build_cost : 1.0f;
+		stats.max_cost_ratio = pixl::max(stats.max_cost_ratio, cost_ratio);
+
+		if (cost_ratio > options.rebuild_threshold)
+		{
+			rebuild_mesh(scene, deforming);
+			stats.rebuild_count++;
+		}
+		else
+		{
+			order_refitted_mesh(scene, deforming);
+			stats.refit_count++;
+		}
+	}
+
+	stats.bvh_ms = milliseconds_since(start_time);
+	start_time = std::chrono::steady_clock::now();
+
+	Array<glm::mat4> world_matrices;
+	ComputeNodeWorldMatrices(model.nodes, local_matrices._data, world_matrices);
+
+	// The instances were reordered by the last top level build, they find
+	// their node through the index they keep. Instances without a node, like
+	// the baked meshes, stay where they were placed, but their BVH moves
+	// along when a mesh in front of it was rebuilt.
+	for (uint32 i = 0; i < scene.instances.size; i++)
+	{
+		InstanceGLSL &instance = scene.instances[i];
+		uint32 node_index = instance.data.w;
+		uint32 mesh_index = instance.data.y;
+		instance.data.x = scene.meshes[mesh_index].bvh_root;
+		if (node_index >= node_count)
+		{
+			continue;
+		}
+
+		instance = InstanceGLSL(model.placement_matrix * world_matrices[node_index], scene.meshes[mesh_index].bvh_root, mesh_index, node_index);
+	}
+
+	UpdateTopLevel(scene);
+
+	stats.top_level_ms = milliseconds_since(start_time);
+	return stats;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "../core/array.hpp"
+#include "../defines.hpp"
+#include "bvh.h"
+
+struct Scene;
+
+// A mesh with morph targets or joints. Its vertices are deformed in place
+// every frame, from the vertices of the model, and its bottom level BVH is
+// refitted to match.
+struct DeformingMesh
+{
+	uint32 mesh_index;
+	uint32 node_index; // the node whose weights and skin deform the mesh
+	uint32 node_count; // nodes of its bottom level BVH
+	float build_cost;  // SAH cost right after its BVH was last built
+};
+
+struct SceneAnimation
+{
+	Array<DeformingMesh> meshes;
+
+	// Builder for the deforming meshes. It never splits triangles, so their
+	// triangle ranges keep their size when a BVH is built again.
+	BVHBuildOptions rebuild_options;
+};
+
+struct AnimationOptions
+{
+	// The BVH of a deforming mesh is built again instead of refitted once
+	// its SAH cost grew by this factor since it was last built. 0 builds
+	// them again every frame.
+	float rebuild_threshold = 1.5f;
+};
+
+struct AnimationStats
+{
+	uint32 refit_count;
+	uint32 rebuild_count;
+	float max_cost_ratio; // worst SAH cost after a refit, over the cost at the last build
+	double pose_ms;       // node transforms, morph targets and skins
+	double bvh_ms;        // refits and rebuilds of the deforming meshes
+	double top_level_ms;
+};
+
+// Poses the nodes and morph target weights at `time` seconds into the
+// animation of the model, looping it. Moves the instances, deforms the
+// meshes with morph targets or skins and updates their BVHs, then rebuilds
+// the top level. Only works on scenes built from the model, not from the
+// cache.
+AnimationStats AnimateScene(Scene &scene, float time, const AnimationOptions &options = AnimationOptions());
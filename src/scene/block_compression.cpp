@@ -0,0 +1,528 @@
+#include "block_compression.hpp"
+
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <glm/vec3.hpp>
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+constexpr uint32 BLOCK_TEXEL_COUNT = BC_BLOCK_TEXELS * BC_BLOCK_TEXELS;
+
+// Refinements of the endpoints after the first guess
+constexpr uint32 REFINE_ITERATIONS = 2;
+
+static uint16 pack_565(const glm::vec3 &color)
+{
+	glm::vec3 c = glm::clamp(color, 0.0f, 255.0f);
+	auto r = (uint32) (c.r * (31.0f / 255.0f) + 0.5f);
+	auto g = (uint32) (c.g * (63.0f / 255.0f) + 0.5f);
+	auto b = (uint32) (c.b * (31.0f / 255.0f) + 0.5f);
+	return (uint16) ((r << 11) | (g << 5) | b);
+}
+
+// Expands the channels by repeating their top bits, like the GPU does
+static void unpack_565(uint16 packed, int32 *out_color)
+{
+	int32 r = (packed >> 11) & 31;
+	int32 g = (packed >> 5) & 63;
+	int32 b = packed & 31;
+	out_color[0] = (r << 3) | (r >> 2);
+	out_color[1] = (g << 2) | (g >> 4);
+	out_color[2] = (b << 3) | (b >> 2);
+}
+
+// The 4 colors of a block in index order
+static void block_palette(uint16 color0, uint16 color1, int32 palette[4][3])
+{
+	unpack_565(color0, palette[0]);
+	unpack_565(color1, palette[1]);
+	for (uint32 c = 0; c < 3; c++)
+	{
+		if (color0 > color1)
+		{
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		}
+		else
+		{
+			palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+			palette[3][c] = 0;
+		}
+	}
+}
+
+// Picks the closest palette color for every texel. Returns the squared
+// error of the block.
+static uint32 choose_indices(const uint8 *texels, uint16 color0, uint16 color1, uint8 *out_indices)
+{
+	int32 palette[4][3];
+	block_palette(color0, color1, palette);
+
+	uint32 error = 0;
+	for (uint32 i = 0; i < BLOCK_TEXEL_COUNT; i++)
+	{
+		const uint8 *texel = texels + 3 * i;
+		uint32 best_error = ~0u;
+		for (uint8 p = 0; p < 4; p++)
+		{
+			int32 dr = texel[0] - palette[p][0];
+			int32 dg = texel[1] - palette[p][1];
+			int32 db = texel[2] - palette[p][2];
+			auto texel_error = (uint32) (dr * dr + dg * dg + db * db);
+			if (texel_error < best_error)
+			{
+				best_error = texel_error;
+				out_indices[i] = p;
+			}
+		}
+		error += best_error;
+	}
+	return error;
+}
+
+// Endpoints at both ends of the colors, along the direction in which they
+// spread the most
+static void principal_endpoints(const glm::vec3 *colors, glm::vec3 &out_start, glm::vec3 &out_end)
+{
+	glm::vec3 mean(0.0f);
+	glm::vec3 min_color(255.0f);
+	glm::vec3 max_color(0.0f);
+	for (uint32 i = 0; i < BLOCK_TEXEL_COUNT; i++)
+	{
+		mean += colors[i];
+		min_color = glm::min(min_color, colors[i]);
+		max_color = glm::max(max_color, colors[i]);
+	}
+	mean /= (float) BLOCK_TEXEL_COUNT;
+
+	float covariance[6] = {};
+	for (uint32 i = 0; i < BLOCK_TEXEL_COUNT; i++)
+	{
+		glm::vec3 d = colors[i] - mean;
+		covariance[0] += d.r * d.r;
+		covariance[1] += d.r * d.g;
+		covariance[2] += d.r * d.b;
+		covariance[3] += d.g * d.g;
+		covariance[4] += d.g * d.b;
+		covariance[5] += d.b * d.b;
+	}
+
+	// Power iteration, starting from the diagonal of the bounding box
+	glm::vec3 axis = max_color - min_color;
+	for (uint32 iteration = 0; iteration < 8; iteration++)
+	{
+		glm::vec3 next(covariance[0] * axis.r + covariance[1] * axis.g + covariance[2] * axis.b,
+					   covariance[1] * axis.r + covariance[3] * axis.g + covariance[4] * axis.b,
+					   covariance[2] * axis.r + covariance[4] * axis.g + covariance[5] * axis.b);
+		float length = glm::length(next);
+		if (length < 1e-6f)
+		{
+			break;
+		}
+		axis = next / length;
+	}
+
+	float axis_length = glm::length(axis);
+	if (axis_length < 1e-6f)
+	{
+		out_start = mean;
+		out_end = mean;
+		return;
+	}
+	axis /= axis_length;
+
+	float t_min = std::numeric_limits<float>::max();
+	float t_max = -std::numeric_limits<float>::max();
+	for (uint32 i = 0; i < BLOCK_TEXEL_COUNT; i++)
+	{
+		float t = glm::dot(colors[i] - mean, axis);
+		t_min = glm::min(t_min, t);
+		t_max = glm::max(t_max, t);
+	}
+
+	out_start = mean + axis * t_max;
+	out_end = mean + axis * t_min;
+}
+
+// How much of the start endpoint each index of the BC1 4 color mode takes
+static const float BC1_START_WEIGHTS[4] = {1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f};
+
+// Least squares endpoints for the given indices, with the share of the
+// start endpoint of every index. Returns false when the indices leave the
+// system singular.
+static bool fit_endpoints(const glm::vec3 *colors, const uint8 *indices, const float *start_weights, glm::vec3 &out_start, glm::vec3 &out_end)
+{
+	float aa = 0.0f;
+	float ab = 0.0f;
+	float bb = 0.0f;
+	glm::vec3 ax(0.0f);
+	glm::vec3 bx(0.0f);
+	for (uint32 i = 0; i < BLOCK_TEXEL_COUNT; i++)
+	{
+		float a = start_weights[indices[i]];
+		float b = 1.0f - a;
+		aa += a * a;
+		ab += a * b;
+		bb += b * b;
+		ax += a * colors[i];
+		bx += b * colors[i];
+	}
+
+	float determinant = aa * bb - ab * ab;
+	if (std::fabs(determinant) < 1e-6f)
+	{
+		return false;
+	}
+
+	out_start = (ax * bb - bx * ab) / determinant;
+	out_end = (bx * aa - ax * ab) / determinant;
+	return true;
+}
+
+// Endpoints in the 4 color mode, which needs color0 > color1. Equal ones
+// fall back to the 3 color mode, where index 0 is still color0.
+static uint32 encode_endpoints(const uint8 *texels, glm::vec3 start, glm::vec3 end, uint16 &out_color0, uint16 &out_color1, uint8 *out_indices)
+{
+	uint16 color0 = pack_565(start);
+	uint16 color1 = pack_565(end);
+	if (color0 < color1)
+	{
+		uint16 swap = color0;
+		color0 = color1;
+		color1 = swap;
+	}
+
+	out_color0 = color0;
+	out_color1 = color1;
+	return choose_indices(texels, color0, color1, out_indices);
+}
+
+void EncodeBC1Block(const uint8 *texels, uint8 *out_block)
+{
+	glm::vec3 colors[BLOCK_TEXEL_COUNT];
+	for (uint32 i = 0; i < BLOCK_TEXEL_COUNT; i++)
+	{
+		colors[i] = glm::vec3(texels[3 * i], texels[3 * i + 1], texels[3 * i + 2]);
+	}
+
+	glm::vec3 start;
+	glm::vec3 end;
+	principal_endpoints(colors, start, end);
+
+	uint16 color0 = 0;
+	uint16 color1 = 0;
+	uint8 indices[BLOCK_TEXEL_COUNT];
+	uint32 error = encode_endpoints(texels, start, end, color0, color1, indices);
+
+	for (uint32 iteration = 0; iteration < REFINE_ITERATIONS && error > 0 && color0 != color1; iteration++)
+	{
+		if (!fit_endpoints(colors, indices, BC1_START_WEIGHTS, start, end))
+		{
+			break;
+		}
+
+		uint16 fitted0 = 0;
+		uint16 fitted1 = 0;
+		uint8 fitted_indices[BLOCK_TEXEL_COUNT];
+		uint32 fitted_error = encode_endpoints(texels, start, end, fitted0, fitted1, fitted_indices);
+		if (fitted_error >= error)
+		{
+			break;
+		}
+
+		error = fitted_error;
+		color0 = fitted0;
+		color1 = fitted1;
+		memcpy(indices, fitted_indices, sizeof(indices));
+	}
+
+	uint32 packed_indices = 0;
+	for (uint32 i = 0; i < BLOCK_TEXEL_COUNT; i++)
+	{
+		packed_indices |= (uint32) indices[i] << (2 * i);
+	}
+
+	out_block[0] = (uint8) (color0 & 0xFF);
+	out_block[1] = (uint8) (color0 >> 8);
+	out_block[2] = (uint8) (color1 & 0xFF);
+	out_block[3] = (uint8) (color1 >> 8);
+	for (uint32 i = 0; i < 4; i++)
+	{
+		out_block[4 + i] = (uint8) (packed_indices >> (8 * i));
+	}
+}
+
+void DecodeBC1Block(const uint8 *block, uint8 *out_texels)
+{
+	auto color0 = (uint16) (block[0] | (block[1] << 8));
+	auto color1 = (uint16) (block[2] | (block[3] << 8));
+	uint32 packed_indices = block[4] | (block[5] << 8) | (block[6] << 16) | ((uint32) block[7] << 24);
+
+	int32 palette[4][3];
+	block_palette(color0, color1, palette);
+
+	for (uint32 i = 0; i < BLOCK_TEXEL_COUNT; i++)
+	{
+		uint32 index = (packed_indices >> (2 * i)) & 3;
+		for (uint32 c = 0; c < 3; c++)
+		{
+			out_texels[3 * i + c] = (uint8) palette[index][c];
+		}
+	}
+}
+
+// Weights of the end endpoint for the 16 indices of BC7, out of 64
+static const uint32 BC7_WEIGHTS[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+// BC7_WEIGHTS as the share of the start endpoint, for fit_endpoints
+static const float BC7_START_WEIGHTS[16] = {
+	64.0f / 64.0f, 60.0f / 64.0f, 55.0f / 64.0f, 51.0f / 64.0f, 47.0f / 64.0f, 43.0f / 64.0f, 38.0f / 64.0f, 34.0f / 64.0f,
+	30.0f / 64.0f, 26.0f / 64.0f, 21.0f / 64.0f, 17.0f / 64.0f, 13.0f / 64.0f, 9.0f / 64.0f, 4.0f / 64.0f, 0.0f / 64.0f};
+
+// Endpoints of a mode 6 block, 7 bits per channel and the lowest bit of
+// each endpoint
+struct BC7Endpoints
+{
+	uint8 colors[2][3];
+	uint8 p_bits[2];
+};
+
+static uint8 quantize_bc7_channel(float value, uint8 p_bit)
+{
+	float quantized = (glm::clamp(value, 0.0f, 255.0f) - (float) p_bit) * 0.5f + 0.5f;
+	return (uint8) glm::clamp((int32) quantized, 0, 127);
+}
+
+static BC7Endpoints quantize_bc7_endpoints(const glm::vec3 &start, const glm::vec3 &end, uint8 p_bit0, uint8 p_bit1)
+{
+	BC7Endpoints endpoints;
+	endpoints.p_bits[0] = p_bit0;
+	endpoints.p_bits[1] = p_bit1;
+	for (uint32 c = 0; c < 3; c++)
+	{
+		endpoints.colors[0][c] = quantize_bc7_channel(start[c], p_bit0);
+		endpoints.colors[1][c] = quantize_bc7_channel(end[c], p_bit1);
+	}
+	return endpoints;
+}
+
+// The 16 colors of a block in index order
+static void bc7_palette(const BC7Endpoints &endpoints, int32 palette[16][3])
+{
+	for (uint32 c = 0; c < 3; c++)
+	{
+		auto start = (uint32) ((endpoints.colors[0][c] << 1) | endpoints.p_bits[0]);
+		auto end = (uint32) ((endpoints.colors[1][c] << 1) | endpoints.p_bits[1]);
+		for (uint32 i = 0; i < 16; i++)
+		{
+			palette[i][c] = (int32) (((64 - BC7_WEIGHTS[i]) * start + BC7_WEIGHTS[i] * end + 32) >> 6);
+		}
+	}
+}
+
+// Projects every texel onto the line between the endpoints and picks the
+// closest of the palette colors around it. Returns the squared error of
+// the block.
+static uint32 choose_bc7_indices(const uint8 *texels, const BC7Endpoints &endpoints, uint8 *out_indices)
+{
+	int32 palette[16][3];
+	bc7_palette(endpoints, palette);
+
+	glm::vec3 start((float) palette[0][0], (float) palette[0][1], (float) palette[0][2]);
+	glm::vec3 axis = glm::vec3((float) palette[15][0], (float) palette[15][1], (float) palette[15][2]) - start;
+	float axis_length2 = glm::dot(axis, axis);
+
+	uint32 error = 0;
+	for (uint32 i = 0; i < BLOCK_TEXEL_COUNT; i++)
+	{
+		const uint8 *texel = texels + 3 * i;
+		glm::vec3 color(texel[0], texel[1], texel[2]);
+		float t = axis_length2 > 0.0f ? glm::dot(color - start, axis) / axis_length2 : 0.0f;
+		int32 guess = glm::clamp((int32) (t * 15.0f + 0.5f), 0, 15);
+
+		uint32 best_error = ~0u;
+		for (int32 p = glm::max(guess - 1, 0); p <= glm::min(guess + 1, 15); p++)
+		{
+			int32 dr = texel[0] - palette[p][0];
+			int32 dg = texel[1] - palette[p][1];
+			int32 db = texel[2] - palette[p][2];
+			auto texel_error = (uint32) (dr * dr + dg * dg + db * db);
+			if (texel_error < best_error)
+			{
+				best_error = texel_error;
+				out_indices[i] = (uint8) p;
+			}
+		}
+		error += best_error;
+	}
+	return error;
+}
+
+// Writes the lowest `count` bits of `value` from bit `offset` on, the
+// first bit of a block is the lowest of its first byte
+static void write_bits(uint8 *block, uint32 &offset, uint32 value, uint32 count)
+{
+	for (uint32 i = 0; i < count; i++, offset++)
+	{
+		block[offset >> 3] |= (uint8) (((value >> i) & 1) << (offset & 7));
+	}
+}
+
+static uint32 read_bits(const uint8 *block, uint32 &offset, uint32 count)
+{
+	uint32 value = 0;
+	for (uint32 i = 0; i < count; i++, offset++)
+	{
+		value |= (uint32) ((block[offset >> 3] >> (offset & 7)) & 1) << i;
+	}
+	return value;
+}
+
+void EncodeBC7Block(const uint8 *texels, uint8 *out_block)
+{
+	glm::vec3 colors[BLOCK_TEXEL_COUNT];
+	for (uint32 i = 0; i < BLOCK_TEXEL_COUNT; i++)
+	{
+		colors[i] = glm::vec3(texels[3 * i], texels[3 * i + 1], texels[3 * i + 2]);
+	}
+
+	glm::vec3 principal_start;
+	glm::vec3 principal_end;
+	principal_endpoints(colors, principal_start, principal_end);
+
+	BC7Endpoints best;
+	uint8 best_indices[BLOCK_TEXEL_COUNT];
+	uint32 best_error = ~0u;
+	for (uint8 p_bits = 0; p_bits < 4 && best_error > 0; p_bits++)
+	{
+		uint8 p_bit0 = p_bits & 1;
+		uint8 p_bit1 = p_bits >> 1;
+		glm::vec3 start = principal_start;
+		glm::vec3 end = principal_end;
+
+		BC7Endpoints endpoints = quantize_bc7_endpoints(start, end, p_bit0, p_bit1);
+		uint8 indices[BLOCK_TEXEL_COUNT];
+		uint32 error = choose_bc7_indices(texels, endpoints, indices);
+
+		for (uint32 iteration = 0; iteration < REFINE_ITERATIONS && error > 0; iteration++)
+		{
+			if (!fit_endpoints(colors, indices, BC7_START_WEIGHTS, start, end))
+			{
+				break;
+			}
+
+			BC7Endpoints fitted = quantize_bc7_endpoints(start, end, p_bit0, p_bit1);
+			uint8 fitted_indices[BLOCK_TEXEL_COUNT];
+			uint32 fitted_error = choose_bc7_indices(texels, fitted, fitted_indices);
+			if (fitted_error >= error)
+			{
+				break;
+			}
+
+			error = fitted_error;
+			endpoints = fitted;
+			memcpy(indices, fitted_indices, sizeof(indices));
+		}
+
+		if (error < best_error)
+		{
+			best_error = error;
+			best = endpoints;
+			memcpy(best_indices, indices, sizeof(best_indices));
+		}
+	}
+
+	// The first index is stored without its highest bit, which has to be
+	// 0. Swapping the endpoints mirrors the indices to get there.
+	if (best_indices[0] >= 8)
+	{
+		for (uint32 c = 0; c < 3; c++)
+		{
+			uint8 swap = best.colors[0][c];
+			best.colors[0][c] = best.colors[1][c];
+			best.colors[1][c] = swap;
+		}
+		uint8 swap = best.p_bits[0];
+		best.p_bits[0] = best.p_bits[1];
+		best.p_bits[1] = swap;
+
+		for (uint32 i = 0; i < BLOCK_TEXEL_COUNT; i++)
+		{
+			best_indices[i] = (uint8) (15 - best_indices[i]);
+		}
+	}
+
+	memset(out_block, 0, BC7_BLOCK_BYTES);
+	uint32 offset = 0;
+	write_bits(out_block, offset, 1u << 6, 7);
+	for (uint32 c = 0; c < 3; c++)
+	{
+		write_bits(out_block, offset, best.colors[0][c], 7);
+		write_bits(out_block, offset, best.colors[1][c], 7);
+	}
+	write_bits(out_block, offset, 127, 7);
+	write_bits(out_block, offset, 127, 7);
+	write_bits(out_block, offset, best.p_bits[0], 1);
+	write_bits(out_block, offset, best.p_bits[1], 1);
+	for (uint32 i = 0; i < BLOCK_TEXEL_COUNT; i++)
+	{
+		write_bits(out_block, offset, best_indices[i], i == 0 ? 3 : 4);
+	}
+}
+
+bool DecodeBC7Block(const uint8 *block, uint8 *out_texels)
+{
+	if ((block[0] & 0x7F) != (1u << 6))
+	{
+		memset(out_texels, 0, BLOCK_TEXEL_COUNT * 3);
+		return false;
+	}
+
+	BC7Endpoints endpoints;
+	uint32 offset = 7;
+	for (uint32 c = 0; c < 3; c++)
+	{
+		endpoints.colors[0][c] = (uint8) read_bits(block, offset, 7);
+		endpoints.colors[1][c] = (uint8) read_bits(block, offset, 7);
+	}
+	offset += 14; // alpha
+	endpoints.p_bits[0] = (uint8) read_bits(block, offset, 1);
+	endpoints.p_bits[1] = (uint8) read_bits(block, offset, 1);
+
+	int32 palette[16][3];
+	bc7_palette(endpoints, palette);
+
+	for (uint32 i = 0; i < BLOCK_TEXEL_COUNT; i++)
+	{
+		uint32 index = read_bits(block, offset, i == 0 ? 3 : 4);
+		for (uint32 c = 0; c < 3; c++)
+		{
+			out_texels[3 * i + c] = (uint8) palette[index][c];
+		}
+	}
+	return true;
+}
+
+uint64 SquaredError(const uint8 *a, const uint8 *b, uint32 texel_count)
+{
+	uint64 error = 0;
+	for (uint32 i = 0; i < 3 * texel_count; i++)
+	{
+		int32 d = (int32) a[i] - (int32) b[i];
+		error += (uint64) (d * d);
+	}
+	return error;
+}
+
+double PSNR(uint64 squared_error, uint64 channel_count)
+{
+	if (squared_error == 0 || channel_count == 0)
+	{
+		return std::numeric_limits<double>::infinity();
+	}
+
+	double mean_squared_error = (double) squared_error / (double) channel_count;
+	return 10.0 * std::log10(255.0 * 255.0 / mean_squared_error);
+}
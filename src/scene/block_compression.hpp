@@ -0,0 +1,39 @@
+#pragma once
+#include "../defines.hpp"
+
+// Both formats compress blocks of 4x4 texels.
+constexpr uint32 BC_BLOCK_TEXELS = 4;
+
+// BC1 (DXT1) stores a block of RGB texels in 8 bytes: two RGB565
+// endpoints and a 2 bit index per texel into the 4 colors between them.
+constexpr uint32 BC1_BLOCK_BYTES = 8;
+
+// BC7 stores a block in 16 bytes, in one of 8 modes. The encoder only
+// writes mode 6: two RGBA endpoints with 7 bits per channel and a shared
+// lowest bit each, and a 4 bit index per texel into the 16 colors between
+// them. Alpha is unused, it ends up at 254 or 255.
+constexpr uint32 BC7_BLOCK_BYTES = 16;
+
+// Encodes 16 RGB8 texels, row after row, into one block. The endpoints
+// start on the principal axis of the colors and are then fitted to the
+// chosen indices by least squares.
+void EncodeBC1Block(const uint8 *texels, uint8 *out_block);
+
+// Decodes a block into 16 RGB8 texels the way the GPU does, including the
+// 3 color mode that the encoder only uses for blocks of a single color
+void DecodeBC1Block(const uint8 *block, uint8 *out_texels);
+
+// Encodes 16 RGB8 texels like EncodeBC1Block, trying every combination of
+// the lowest endpoint bits
+void EncodeBC7Block(const uint8 *texels, uint8 *out_block);
+
+// Decodes a block of mode 6 into 16 RGB8 texels the way the GPU does.
+// Returns false for the other modes, whose texels are left black.
+bool DecodeBC7Block(const uint8 *block, uint8 *out_texels);
+
+// Summed squared error over the channels of `texel_count` RGB8 texels
+uint64 SquaredError(const uint8 *a, const uint8 *b, uint32 texel_count);
+
+// Peak signal to noise ratio of 8 bit channels, in dB, from the summed
+// squared error over `channel_count` values. Identical data gives infinity.
+double PSNR(uint64 squared_error, uint64 channel_count);
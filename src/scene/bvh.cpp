@@ -1,75 +1,465 @@
 #include "bvh.h"
+#include "compressed_bvh.hpp"
+#include "instance.hpp"
 #include "../math/math.hpp"
 
+#include <bvh/binned_sah_builder.hpp>
+#include <bvh/bvh.hpp>
+#include <bvh/hierarchy_refitter.hpp>
+#include <bvh/leaf_collapser.hpp>
+#include <bvh/linear_bvh_builder.hpp>
+#include <bvh/locally_ordered_clustering_builder.hpp>
+#include <bvh/node_layout_optimizer.hpp>
+#include <bvh/parallel_reinsertion_optimizer.hpp>
+#include <bvh/spatial_split_bvh_builder.hpp>
 #include <bvh/sweep_sah_builder.hpp>
 #include <bvh/triangle.hpp>
 #include <bvh/vector.hpp>
-#include <bvh/bvh.hpp>
+
+#include <glm/common.hpp>
+
+#include <chrono>
+#include <cstring>
+
+// The builders of the bvh library already run in parallel with OpenMP. The
+// conversions to and from its format are parallelized the same way, and are
+// serial when OpenMP isn't available.
+#if defined(_OPENMP)
+#define PARALLEL_FOR _Pragma("omp parallel for")
+#else
+#define PARALLEL_FOR
+#endif
 
 BVHNodeGLSL::BVHNodeGLSL(const glm::vec3 &bmin, const glm::vec3 &bmax, uint32 first_child_or_tri, uint32 num_tris)
-	: data1(bmin.x, bmin.y, bmin.z, (float) first_child_or_tri),
-	  data2(bmax.x, bmax.y, bmax.z, (float) num_tris)
+	: data1(bmin.x, bmin.y, bmin.z, glm::uintBitsToFloat(first_child_or_tri)),
+	  data2(bmax.x, bmax.y, bmax.z, glm::uintBitsToFloat(num_tris))
 {}
 
-inline std::vector<bvh::Triangle<float>> ConvertToLibFormat(Array<TriangleGLSL> &tris)
+uint32 BVHNodeGLSL::FirstChildOrTri() const
 {
-	std::vector<bvh::Triangle<float>> primitives;
-	primitives.reserve(tris.size);
+	return glm::floatBitsToUint(data1.w);
+}
 
-	for (uint32_t i = 0; i < tris.size; i++)
+uint32 BVHNodeGLSL::TriCount() const
+{
+	return glm::floatBitsToUint(data2.w);
+}
+
+bool BVHNodeGLSL::IsLeaf() const
+{
+	return TriCount() > 0;
+}
+
+void BVHNodeGLSL::SetFirstChildOrTri(uint32 first_child_or_tri)
+{
+	data1.w = glm::uintBitsToFloat(first_child_or_tri);
+}
+
+static const char *builder_names[] = { "sweep", "binned", "sbvh", "lbvh", "ploc" };
+
+const char *BVHBuilderName(BVHBuilder builder)
+{
+	return builder_names[(uint32) builder];
+}
+
+bool ParseBVHBuilder(const char *name, BVHBuilder &out_builder)
+{
+	for (uint32 i = 0; i < sizeof(builder_names) / sizeof(builder_names[0]); i++)
 	{
-		const TriangleGLSL &tri = tris[i];
-		bvh::Vector3<float> p0(tri.v0().x, tri.v0().y, tri.v0().z);
-		bvh::Vector3<float> p1(tri.v1().x, tri.v1().y, tri.v1().z);
-		bvh::Vector3<float> p2(tri.v2().x, tri.v2().y, tri.v2().z);
-		primitives.emplace_back(p0, p1, p2);
+		if (strcmp(name, builder_names[i]) == 0)
+		{
+			out_builder = (BVHBuilder) i;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bvh::Vector3<float> vertex_position(Array<VertexGLSL> &vertices, uint32 index)
+{
+	const glm::vec3 &position = vertices._data[index].position;
+	return { position.x, position.y, position.z };
+}
+
+// Only the SBVH builder needs the triangles themselves, to split them
+inline std::vector<bvh::Triangle<float>> ConvertToLibFormat(const IndexedTriangleGLSL *tris, uint32 tri_count, Array<VertexGLSL> &vertices)
+{
+	std::vector<bvh::Triangle<float>> primitives(tri_count);
+
+	PARALLEL_FOR
+	for (uint32_t i = 0; i < tri_count; i++)
+	{
+		const IndexedTriangleGLSL &tri = tris[i];
+		primitives[i] = bvh::Triangle<float>(vertex_position(vertices, tri.vertices[0]),
+											 vertex_position(vertices, tri.vertices[1]),
+											 vertex_position(vertices, tri.vertices[2]));
 	}
 
 	return primitives;
 }
 
-Array<BVHNodeGLSL> CalculateBVH(Array<TriangleGLSL> &glsl_tris, Array<TriangleGLSL> &sorted_glsl_tris)
+// Bounding boxes and centers of the triangles, which is all that the other
+// builders look at, in one pass over the shared vertices
+static void compute_triangle_bounds(const IndexedTriangleGLSL *tris, uint32 tri_count, Array<VertexGLSL> &vertices,
+									bvh::BoundingBox<float> *out_bboxes, bvh::Vector3<float> *out_centers)
 {
-	std::vector<bvh::Triangle<float>> primitives = ConvertToLibFormat(glsl_tris);
+	PARALLEL_FOR
+	for (uint32 i = 0; i < tri_count; i++)
+	{
+		bvh::Vector3<float> p0 = vertex_position(vertices, tris[i].vertices[0]);
+		bvh::Vector3<float> p1 = vertex_position(vertices, tris[i].vertices[1]);
+		bvh::Vector3<float> p2 = vertex_position(vertices, tris[i].vertices[2]);
+
+		bvh::BoundingBox<float> bbox(p0);
+		bbox.extend(p1);
+		bbox.extend(p2);
+		out_bboxes[i] = bbox;
+		out_centers[i] = (p0 + p1 + p2) * (1.0f / 3.0f);
+	}
+}
+
+// SAH cost of the whole tree relative to the root, with a traversal cost of
+// 1 per node and an intersection cost of 1 per triangle (same as the library)
+static float compute_sah_cost(bvh::Bvh<float> &bvh)
+{
+	float cost = 0.0f;
+	for (size_t i = 0; i < bvh.node_count; i++)
+	{
+		bvh::Bvh<float>::Node &node = bvh.nodes[i];
+		float half_area = node.bounding_box_proxy().half_area();
+		cost += half_area * (node.is_leaf() ? (float) node.primitive_count : 1.0f);
+	}
+	return cost / bvh.nodes[0].bounding_box_proxy().half_area();
+}
+
+static double milliseconds_since(std::chrono::steady_clock::time_point start_time)
+{
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+	return elapsed.count();
+}
+
+// Runs the optimization passes of the bvh library one after the other and
+// reports how each of them changed the SAH cost
+static void optimize_bvh(bvh::Bvh<float> &bvh, bool verbose)
+{
+	if (bvh.nodes[0].is_leaf())
+	{
+		return;
+	}
+
+	float cost = compute_sah_cost(bvh);
+	if (verbose)
+		printf("--> BVH SAH cost after the build: %.2f (%zu nodes)\n", cost, bvh.node_count);
+
+	auto start_time = std::chrono::steady_clock::now();
+	bvh::ParallelReinsertionOptimizer<bvh::Bvh<float>> reinsertion_optimizer(bvh);
+	reinsertion_optimizer.optimize();
+	float new_cost = compute_sah_cost(bvh);
+	if (verbose)
+		printf("--> Reinsertion:     %.2f -> %.2f in %.1f ms\n", cost, new_cost, milliseconds_since(start_time));
+	cost = new_cost;
+
+	start_time = std::chrono::steady_clock::now();
+	bvh::LeafCollapser<bvh::Bvh<float>> leaf_collapser(bvh);
+	leaf_collapser.collapse();
+	new_cost = compute_sah_cost(bvh);
+	if (verbose)
+		printf("--> Leaf collapsing: %.2f -> %.2f in %.1f ms (%zu nodes)\n", cost, new_cost, milliseconds_since(start_time), bvh.node_count);
+	cost = new_cost;
+
+	// Only moves nodes around, so the cost stays the same
+	start_time = std::chrono::steady_clock::now();
+	bvh::NodeLayoutOptimizer<bvh::Bvh<float>> layout_optimizer(bvh);
+	layout_optimizer.optimize();
+	new_cost = compute_sah_cost(bvh);
+	if (verbose)
+		printf("--> Node layout:     %.2f -> %.2f in %.1f ms\n", cost, new_cost, milliseconds_since(start_time));
+}
+
+static Array<BVHNodeGLSL> convert_nodes(bvh::Bvh<float> &bvh)
+{
+	auto node_count = (uint32) bvh.node_count;
+	Array<BVHNodeGLSL> bvh_nodes(node_count);
+	bvh_nodes.size = node_count;
+
+	PARALLEL_FOR
+	for (uint32 i = 0; i < node_count; i++)
+	{
+		bvh::Bvh<float>::Node &node = bvh.nodes[i];
+		bvh::BoundingBox<float> bbox = node.bounding_box_proxy().to_bounding_box();
+		glm::vec3 bmin(bbox.min[0], bbox.min[1], bbox.min[2]);
+		glm::vec3 bmax(bbox.max[0], bbox.max[1], bbox.max[2]);
+
+		bvh_nodes[i] = BVHNodeGLSL(bmin, bmax, (uint32) node.first_child_or_primitive, (uint32) node.primitive_count);
+	}
+
+	return bvh_nodes;
+}
+
+Array<BVHNodeGLSL> CalculateBVH(const IndexedTriangleGLSL *glsl_tris, uint32 tri_count, Array<VertexGLSL> &vertices, Array<IndexedTriangleGLSL> &sorted_glsl_tris, const BVHBuildOptions &options, Array<uint32> *out_primitive_indices)
+{
+	if (tri_count == 0)
+	{
+		sorted_glsl_tris = Array<IndexedTriangleGLSL>();
+		return Array<BVHNodeGLSL>();
+	}
+
+	auto start_time = std::chrono::steady_clock::now();
 
 	// Compute the global bounding box and the centers of the primitives.
 	// This is the input of the BVH construction algorithm.
 	// Note: Using the bounding box centers instead of the primitive centers is possible,
 	// but usually leads to lower-quality BVHs.
-	auto [bboxes, centers] = bvh::compute_bounding_boxes_and_centers(primitives.data(), primitives.size());
-	auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), primitives.size());
+	auto bboxes = std::make_unique<bvh::BoundingBox<float>[]>(tri_count);
+	auto centers = std::make_unique<bvh::Vector3<float>[]>(tri_count);
+	compute_triangle_bounds(glsl_tris, tri_count, vertices, bboxes.get(), centers.get());
+	auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), tri_count);
 
 	// Create an acceleration data structure on the primitives
 	bvh::Bvh<float> bvh;
-	bvh::SweepSahBuilder<bvh::Bvh<float>> builder(bvh);
-	builder.build(global_bbox, bboxes.get(), centers.get(), primitives.size());
+	size_t reference_count = tri_count;
+	switch (options.builder)
+	{
+		case BVHBuilder::SWEEP_SAH:
+		{
+			bvh::SweepSahBuilder<bvh::Bvh<float>> sweep_builder(bvh);
+			sweep_builder.build(global_bbox, bboxes.get(), centers.get(), tri_count);
+			break;
+		}
+		case BVHBuilder::BINNED_SAH:
+		{
+			bvh::BinnedSahBuilder<bvh::Bvh<float>, 16> binned_builder(bvh);
+			binned_builder.build(global_bbox, bboxes.get(), centers.get(), tri_count);
+			break;
+		}
+		case BVHBuilder::SPATIAL_SPLIT:
+		{
+			std::vector<bvh::Triangle<float>> primitives = ConvertToLibFormat(glsl_tris, tri_count, vertices);
+			bvh::SpatialSplitBvhBuilder<bvh::Bvh<float>, bvh::Triangle<float>, 64> spatial_builder(bvh);
+			reference_count = spatial_builder.build(global_bbox, primitives.data(), bboxes.get(), centers.get(), tri_count);
+			break;
+		}
+		case BVHBuilder::LBVH:
+		{
+			bvh::LinearBvhBuilder<bvh::Bvh<float>, uint32_t> linear_builder(bvh);
+			linear_builder.build(global_bbox, bboxes.get(), centers.get(), tri_count);
+			break;
+		}
+		case BVHBuilder::PLOC:
+		{
+			bvh::LocallyOrderedClusteringBuilder<bvh::Bvh<float>, uint32_t> ploc_builder(bvh);
+			ploc_builder.build(global_bbox, bboxes.get(), centers.get(), tri_count);
+			break;
+		}
+	}
+
+	if (options.optimize)
+	{
+		optimize_bvh(bvh, options.verbose);
+	}
+
+	// Leaves reference consecutive ranges of the primitive indices, so the
+	// sorted triangles are just the triangles in primitive index order
+	auto sorted_count = (uint32) reference_count;
+	sorted_glsl_tris.resize(sorted_count);
+	if (out_primitive_indices)
+	{
+		out_primitive_indices->resize(sorted_count);
+	}
+
+	PARALLEL_FOR
+	for (uint32 i = 0; i < sorted_count; i++)
+	{
+		auto index_into_unsorted_primitives = (uint32) bvh.primitive_indices[i];
+		sorted_glsl_tris[i] = glsl_tris[index_into_unsorted_primitives];
+		if (out_primitive_indices)
+		{
+			(*out_primitive_indices)[i] = index_into_unsorted_primitives;
+		}
+	}
+
+	Array<BVHNodeGLSL> bvh_nodes = convert_nodes(bvh);
+	OrderLeavesForCompression(bvh_nodes, sorted_glsl_tris, out_primitive_indices);
+
+	if (options.verbose)
+	{
+		printf("Calculated BVH for scene with the %s builder%s in %.1f ms, using %u nodes and %u triangle references.\n",
+			   BVHBuilderName(options.builder), options.optimize ? " (optimized)" : "", milliseconds_since(start_time), bvh_nodes.size, sorted_count);
+	}
+	return bvh_nodes;
+}
+
+static float half_area(const BVHNodeGLSL &node)
+{
+	glm::vec3 extent = glm::vec3(node.data2) - glm::vec3(node.data1);
+	return extent.x * (extent.y + extent.z) + extent.y * extent.z;
+}
+
+float BVHSahCost(Array<BVHNodeGLSL> &bvh_nodes, uint32 root, uint32 node_count)
+{
+	float cost = 0.0f;
+	for (uint32 i = root; i < root + node_count; i++)
+	{
+		BVHNodeGLSL &node = bvh_nodes[i];
+		cost += half_area(node) * (node.IsLeaf() ? (float) node.TriCount() : 1.0f);
+	}
+
+	float root_area = half_area(bvh_nodes[root]);
+	return root_area > 0.0f ? cost / root_area : 0.0f;
+}
+
+float RefitBVH(Array<BVHNodeGLSL> &bvh_nodes, uint32 root, uint32 node_count, Array<IndexedTriangleGLSL> &sorted_glsl_tris, Array<VertexGLSL> &vertices)
+{
+	// The refitter of the bvh library works on its own node format, with the
+	// children relative to the root. Leaves keep referencing the triangles
+	// by their index in the whole array.
+	bvh::Bvh<float> bvh;
+	bvh.node_count = node_count;
+	bvh.nodes = std::make_unique<bvh::Bvh<float>::Node[]>(node_count);
 
-	sorted_glsl_tris = Array<TriangleGLSL>(glsl_tris.size);
-	sorted_glsl_tris.size = glsl_tris.size;
+	PARALLEL_FOR
+	for (uint32 i = 0; i < node_count; i++)
+	{
+		BVHNodeGLSL &node = bvh_nodes[root + i];
+		uint32 primitive_count = node.TriCount();
+		uint32 first_child_or_primitive = node.FirstChildOrTri();
+		bvh.nodes[i].primitive_count = primitive_count;
+		bvh.nodes[i].first_child_or_primitive = primitive_count > 0 ? first_child_or_primitive : first_child_or_primitive - root;
+	}
 
-	Array<BVHNodeGLSL> bvh_nodes;
-	for (uint32 i = 0; i < bvh.node_count; i++)
+	bvh::HierarchyRefitter<bvh::Bvh<float>> refitter(bvh);
+	refitter.refit([&](bvh::Bvh<float>::Node &leaf)
 	{
-		bvh::Bvh<float>::Node node = bvh.nodes[i];
-		bvh::BoundingBox<float> bbox = node.bounding_box_proxy().to_bounding_box();
-		glm::vec3 bmin(bbox.min[0], bbox.min[1], bbox.min[2]);
-		glm::vec3 bmax(bbox.max[0], bbox.max[1], bbox.max[2]);
+		bvh::BoundingBox<float> bbox = bvh::BoundingBox<float>::empty();
+		for (size_t i = 0; i < leaf.primitive_count; i++)
+		{
+			IndexedTriangleGLSL &tri = sorted_glsl_tris._data[leaf.first_child_or_primitive + i];
+			for (uint32 vertex : tri.vertices)
+			{
+				bbox.extend(vertex_position(vertices, vertex));
+			}
+		}
+		leaf.bounding_box_proxy() = bbox;
+	});
 
-		BVHNodeGLSL result_node(bmin, bmax, node.first_child_or_primitive, node.primitive_count);
-		bvh_nodes.append(result_node);
+	PARALLEL_FOR
+	for (uint32 i = 0; i < node_count; i++)
+	{
+		bvh::BoundingBox<float> bbox = bvh.nodes[i].bounding_box_proxy().to_bounding_box();
+		BVHNodeGLSL &node = bvh_nodes[root + i];
+		node = BVHNodeGLSL(glm::vec3(bbox.min[0], bbox.min[1], bbox.min[2]), glm::vec3(bbox.max[0], bbox.max[1], bbox.max[2]),
+						   node.FirstChildOrTri(), node.TriCount());
+	}
 
-		if (node.is_leaf())
+	return compute_sah_cost(bvh);
+}
+
+uint32 BVHDepth(const BVHNodeGLSL *bvh_nodes, uint32 root)
+{
+	const BVHNodeGLSL &node = bvh_nodes[root];
+	if (node.IsLeaf())
+	{
+		return 1;
+	}
+
+	uint32 first_child = node.FirstChildOrTri();
+	return 1 + glm::max(BVHDepth(bvh_nodes, first_child), BVHDepth(bvh_nodes, first_child + 1));
+}
+
+uint32 CollectWideChildren(Array<BVHNodeGLSL> &bvh_nodes, uint32 index, uint32 max_children, uint32 *out_children)
+{
+	uint32 child_count = 0;
+
+	BVHNodeGLSL &node = bvh_nodes[index];
+	if (node.IsLeaf())
+	{
+		// Only happens for a root that is a leaf
+		out_children[child_count++] = index;
+		return child_count;
+	}
+
+	uint32 first_child = node.FirstChildOrTri();
+	out_children[child_count++] = first_child;
+	out_children[child_count++] = first_child + 1;
+
+	// The child with the largest area is the one most rays would otherwise
+	// have to descend into
+	while (child_count < max_children)
+	{
+		int32 best_child = -1;
+		float best_area = -1.0f;
+		for (uint32 i = 0; i < child_count; i++)
 		{
-			for (uint32 j = 0; j < node.primitive_count; j++)
+			BVHNodeGLSL &child = bvh_nodes[out_children[i]];
+			if (!child.IsLeaf() && half_area(child) > best_area)
 			{
-				uint32 index_into_sorted_primitives = node.first_child_or_primitive + j;
-				uint32 index_into_unsorted_primitives = (uint32) bvh.primitive_indices[index_into_sorted_primitives];
-				TriangleGLSL prev_tri = glsl_tris[index_into_unsorted_primitives];
-				sorted_glsl_tris[index_into_sorted_primitives] = prev_tri;
+				best_child = (int32) i;
+				best_area = half_area(child);
 			}
 		}
+
+		if (best_child < 0)
+		{
+			break;
+		}
+
+		uint32 first_grandchild = bvh_nodes[out_children[best_child]].FirstChildOrTri();
+		out_children[best_child] = first_grandchild;
+		out_children[child_count++] = first_grandchild + 1;
 	}
 
-	printf("Calculated BVH for scene, using %u nodes.\n", bvh_nodes.size);
-	return bvh_nodes;
-}
\ No newline at end of file
+	return child_count;
+}
+
+Array<BVHNodeGLSL> CalculateTLAS(Array<InstanceGLSL> &instances, Array<BVHNodeGLSL> &bvh_nodes)
+{
+	if (instances.size == 0)
+	{
+		return Array<BVHNodeGLSL>();
+	}
+
+	// World space bounds of every instance, from the 8 corners of the root
+	// of its bottom level BVH
+	auto instance_count = (size_t) instances.size;
+	std::vector<bvh::BoundingBox<float>> bboxes(instance_count);
+	std::vector<bvh::Vector3<float>> centers(instance_count);
+	for (uint32 i = 0; i < instances.size; i++)
+	{
+		InstanceGLSL &instance = instances[i];
+		BVHNodeGLSL &root = bvh_nodes[instance.data.x];
+
+		bvh::BoundingBox<float> bbox = bvh::BoundingBox<float>::empty();
+		for (uint32 corner = 0; corner < 8; corner++)
+		{
+			glm::vec3 point((corner & 1) ? root.data2.x : root.data1.x,
+							(corner & 2) ? root.data2.y : root.data1.y,
+							(corner & 4) ? root.data2.z : root.data1.z);
+			point = instance.PointToWorld(point);
+			bbox.extend(bvh::Vector3<float>(point.x, point.y, point.z));
+		}
+
+		// Rays are intersected with the triangles in the space of the mesh,
+		// which rounds differently. Without some margin, hits right on the
+		// faces of the box (e.g. on a floor) can end up just outside of it.
+		float margin = 1e-4f * (1.0f + pixl::max(bvh::length(bbox.min), bvh::length(bbox.max)));
+		bbox.min -= bvh::Vector3<float>(margin);
+		bbox.max += bvh::Vector3<float>(margin);
+
+		bboxes[i] = bbox;
+		centers[i] = bbox.center();
+	}
+
+	auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.data(), instance_count);
+
+	bvh::Bvh<float> bvh;
+	bvh::SweepSahBuilder<bvh::Bvh<float>> sweep_builder(bvh);
+	sweep_builder.build(global_bbox, bboxes.data(), centers.data(), instance_count);
+
+	Array<InstanceGLSL> unsorted_instances = instances;
+	for (uint32 i = 0; i < instances.size; i++)
+	{
+		instances[i] = unsorted_instances[(uint32) bvh.primitive_indices[i]];
+	}
+
+	return convert_nodes(bvh);
+}
@@ -4,6 +4,9 @@
 #include "../core/array.hpp"
 #include "triangle.hpp"
 
+// The child index and triangle count are stored as the bits of the last
+// float of each row, since a float only holds integers up to 2^24 exactly.
+// The shader reads them back with floatBitsToUint.
 struct BVHNodeGLSL
 {
     glm::vec4 data1; // bmin.x, bmin.y, bmin.z, left/first_tri
@@ -11,6 +14,77 @@ struct BVHNodeGLSL
 
 	BVHNodeGLSL() = default;
 	BVHNodeGLSL(const glm::vec3 &bmin, const glm::vec3 &bmax, uint32 first_child_or_tri, uint32 num_tris);
+
+	[[nodiscard]] uint32 FirstChildOrTri() const;
+	[[nodiscard]] uint32 TriCount() const;
+	[[nodiscard]] bool IsLeaf() const;
+
+	void SetFirstChildOrTri(uint32 first_child_or_tri);
+};
+
+// Construction algorithms of the bvh library. The SAH builders give the
+// fastest trees to trace, the Morton code based ones (LBVH, PLOC) build
+// much faster on big scenes, which helps when iterating on a scene.
+enum class BVHBuilder
+{
+	SWEEP_SAH,     // full sweep SAH, the default
+	BINNED_SAH,    // binned SAH, close in quality and faster to build
+	SPATIAL_SPLIT, // SBVH, splits triangles that straddle a split plane
+	LBVH,          // linear BVH over 30-bit Morton codes
+	PLOC           // parallel locally ordered clustering over Morton codes
 };
 
-Array<BVHNodeGLSL> CalculateBVH(Array<TriangleGLSL> &glsl_tris, Array<TriangleGLSL> &sorted_glsl_tris);
\ No newline at end of file
+// Names as used on the command line: sweep, binned, sbvh, lbvh, ploc
+const char *BVHBuilderName(BVHBuilder builder);
+bool ParseBVHBuilder(const char *name, BVHBuilder &out_builder);
+
+struct BVHBuildOptions
+{
+	BVHBuilder builder = BVHBuilder::SWEEP_SAH;
+
+	// Runs parallel reinsertion, leaf collapsing and a node layout pass
+	// after the build. This takes a while longer, but lowers the SAH cost
+	// (mostly for the Morton code based builders) and stores the nodes
+	// with the largest surface area, which most rays visit, at the front.
+	bool optimize = false;
+
+	// Prints the build time and statistics. Turned off for the bottom
+	// level BVHs of scenes with many meshes, which report in one line.
+	bool verbose = true;
+};
+
+// Builds the BVH of `tri_count` triangles with the given options and writes
+// them to `sorted_glsl_tris` in the order the leaves reference them. The
+// SBVH builder references a triangle from every leaf it was split into, so
+// there can be more sorted triangles than input triangles, but only their
+// indices are repeated. If `out_primitive_indices` is set, it receives the
+// index into `glsl_tris` of every sorted triangle. The leaves are ordered
+// the way CompressBVH needs them, see OrderLeavesForCompression.
+Array<BVHNodeGLSL> CalculateBVH(const IndexedTriangleGLSL *glsl_tris, uint32 tri_count, Array<VertexGLSL> &vertices, Array<IndexedTriangleGLSL> &sorted_glsl_tris, const BVHBuildOptions &options = BVHBuildOptions(), Array<uint32> *out_primitive_indices = nullptr);
+
+// SAH cost of the BVH of `node_count` nodes starting at `root`, relative to
+// the area of the root. Compares the quality of trees of different sizes.
+float BVHSahCost(Array<BVHNodeGLSL> &bvh_nodes, uint32 root, uint32 node_count);
+
+// Recomputes the bounds of the BVH of `node_count` nodes starting at `root`
+// from its triangles after they moved, without changing which triangles
+// the leaves reference. This is much faster than building it again, but
+// the tree gets worse the further the triangles move from where it was
+// built. Returns the SAH cost afterwards.
+float RefitBVH(Array<BVHNodeGLSL> &bvh_nodes, uint32 root, uint32 node_count, Array<IndexedTriangleGLSL> &sorted_glsl_tris, Array<VertexGLSL> &vertices);
+
+// Nodes on the longest path from `root` down to a leaf
+uint32 BVHDepth(const BVHNodeGLSL *bvh_nodes, uint32 root);
+
+// Gathers up to `max_children` descendants of the inner node `index` to
+// become the children of one wide node, by repeatedly opening up the inner
+// child with the largest surface area. A leaf is returned as its only
+// child. Writes the binary node indices to `out_children`, returns the count.
+uint32 CollectWideChildren(Array<BVHNodeGLSL> &bvh_nodes, uint32 index, uint32 max_children, uint32 *out_children);
+
+struct InstanceGLSL;
+
+// Builds the top level BVH over the instances, whose bottom level BVH roots
+// are stored in `bvh_nodes`. The leaves reference ranges of `instances`,
+// which are reordered to match, the same way the triangles are for CalculateBVH.
+Array<BVHNodeGLSL> CalculateTLAS(Array<InstanceGLSL> &instances, Array<BVHNodeGLSL> &bvh_nodes);
@@ -0,0 +1,257 @@
+#include "compressed_bvh.hpp"
+
+#include <glm/common.hpp>
+#include <glm/integer.hpp>
+
+#include <cmath>
+#include <cstdio>
+
+static float scale_from_exponent(uint32 exponent)
+{
+	return glm::uintBitsToFloat(exponent << 23);
+}
+
+float CompressedBVHScale(const CompressedBVHNode &node, uint32 axis)
+{
+	return scale_from_exponent(node.exponents[axis]);
+}
+
+uint32 CompressedBVHDepth(const CompressedBVHNode *nodes, uint32 root)
+{
+	const CompressedBVHNode &node = nodes[root];
+
+	uint32 depth = 0;
+	for (uint32 i = 0; i < (uint32) glm::bitCount((uint32) node.inner_mask); i++)
+	{
+		depth = glm::max(depth, CompressedBVHDepth(nodes, node.child_base + i));
+	}
+	return depth + 1;
+}
+
+// Smallest power of two scale that still reaches from `origin` to `max`
+// in 255 steps, as a biased exponent. Kept away from 0, which would make
+// the scale a denormal.
+static uint32 frame_exponent(float origin, float max)
+{
+	int exponent = 0;
+	std::frexp((max - origin) / 255.0f, &exponent);
+
+	auto biased = (uint32) glm::clamp(exponent + 127, 1, 254);
+	while (biased < 254 && origin + 255.0f * scale_from_exponent(biased) < max)
+	{
+		biased++;
+	}
+	return biased;
+}
+
+// Rounds the child bounds outwards. The decoded planes are checked with the
+// same arithmetic the traversal uses, so rounding in the addition can't
+// make a decoded box smaller than the exact one.
+static void quantize_bounds(float origin, float scale, float min, float max, uint8 &out_lo, uint8 &out_hi)
+{
+	float lo = glm::clamp(std::floor((min - origin) / scale), 0.0f, 255.0f);
+	while (lo > 0.0f && origin + lo * scale > min)
+	{
+		lo -= 1.0f;
+	}
+
+	float hi = glm::clamp(std::ceil((max - origin) / scale), 0.0f, 255.0f);
+	while (hi < 255.0f && origin + hi * scale < max)
+	{
+		hi += 1.0f;
+	}
+
+	out_lo = (uint8) lo;
+	out_hi = (uint8) hi;
+}
+
+// Splits the leaves that are too large for a compressed node in halves,
+// until they fit. The halves get the box of the leaf.
+static void split_large_leaves(Array<BVHNodeGLSL> &bvh_nodes)
+{
+	// The new leaves are appended, so they are split again if needed
+	for (uint32 i = 0; i < bvh_nodes.size; i++)
+	{
+		BVHNodeGLSL leaf = bvh_nodes[i];
+		if (leaf.TriCount() <= COMPRESSED_BVH_MAX_LEAF_TRIS)
+		{
+			continue;
+		}
+
+		glm::vec3 bmin = glm::vec3(leaf.data1);
+		glm::vec3 bmax = glm::vec3(leaf.data2);
+		uint32 half = leaf.TriCount() / 2;
+		uint32 first_child = bvh_nodes.size;
+		bvh_nodes.append(BVHNodeGLSL(bmin, bmax, leaf.FirstChildOrTri(), half));
+		bvh_nodes.append(BVHNodeGLSL(bmin, bmax, leaf.FirstChildOrTri() + half, leaf.TriCount() - half));
+		bvh_nodes[i] = BVHNodeGLSL(bmin, bmax, first_child, 0);
+	}
+}
+
+// Appends the triangles of the leaves that compress_node collapses into
+// the node of `binary_index` in slot order, then those of its inner children
+static void order_leaves(Array<BVHNodeGLSL> &bvh_nodes, uint32 binary_index, Array<IndexedTriangleGLSL> &sorted_tris, Array<uint32> *primitive_indices,
+						 Array<IndexedTriangleGLSL> &out_tris, Array<uint32> &out_primitive_indices)
+{
+	uint32 children[COMPRESSED_BVH_WIDTH];
+	uint32 child_count = CollectWideChildren(bvh_nodes, binary_index, COMPRESSED_BVH_WIDTH, children);
+
+	for (uint32 i = 0; i < child_count; i++)
+	{
+		BVHNodeGLSL &child = bvh_nodes[children[i]];
+		if (!child.IsLeaf())
+		{
+			continue;
+		}
+
+		uint32 first_tri = child.FirstChildOrTri();
+		child.SetFirstChildOrTri(out_tris.size);
+		for (uint32 j = 0; j < child.TriCount(); j++)
+		{
+			out_tris.append(sorted_tris[first_tri + j]);
+			if (primitive_indices)
+			{
+				out_primitive_indices.append((*primitive_indices)[first_tri + j]);
+			}
+		}
+	}
+
+	for (uint32 i = 0; i < child_count; i++)
+	{
+		if (!bvh_nodes[children[i]].IsLeaf())
+		{
+			order_leaves(bvh_nodes, children[i], sorted_tris, primitive_indices, out_tris, out_primitive_indices);
+		}
+	}
+}
+
+void OrderLeavesForCompression(Array<BVHNodeGLSL> &bvh_nodes, Array<IndexedTriangleGLSL> &sorted_tris, Array<uint32> *primitive_indices)
+{
+	if (bvh_nodes.size == 0)
+	{
+		return;
+	}
+
+	split_large_leaves(bvh_nodes);
+
+	Array<IndexedTriangleGLSL> ordered_tris(sorted_tris.size);
+	Array<uint32> ordered_primitive_indices(primitive_indices ? primitive_indices->size : 0);
+	order_leaves(bvh_nodes, 0, sorted_tris, primitive_indices, ordered_tris, ordered_primitive_indices);
+
+	sorted_tris.swap(ordered_tris);
+	if (primitive_indices)
+	{
+		primitive_indices->swap(ordered_primitive_indices);
+	}
+}
+
+static void compress_node(Array<BVHNodeGLSL> &bvh_nodes, uint32 binary_index, uint32 compressed_index, CompressedBVH &out_bvh)
+{
+	uint32 children[COMPRESSED_BVH_WIDTH];
+	uint32 child_count = CollectWideChildren(bvh_nodes, binary_index, COMPRESSED_BVH_WIDTH, children);
+
+	// Reserve the nodes of the inner children first, next to each other,
+	// so that their indices are known while filling in this node
+	uint32 child_base = out_bvh.nodes.size;
+	for (uint32 i = 0; i < child_count; i++)
+	{
+		if (!bvh_nodes[children[i]].IsLeaf())
+		{
+			out_bvh.nodes.append(CompressedBVHNode {});
+		}
+	}
+
+	glm::vec3 frame_min = glm::vec3(bvh_nodes[children[0]].data1);
+	glm::vec3 frame_max = glm::vec3(bvh_nodes[children[0]].data2);
+	for (uint32 i = 1; i < child_count; i++)
+	{
+		frame_min = glm::min(frame_min, glm::vec3(bvh_nodes[children[i]].data1));
+		frame_max = glm::max(frame_max, glm::vec3(bvh_nodes[children[i]].data2));
+	}
+
+	CompressedBVHNode &node = out_bvh.nodes[compressed_index];
+	node.origin = frame_min;
+	for (uint32 axis = 0; axis < 3; axis++)
+	{
+		node.exponents[axis] = (uint8) frame_exponent(frame_min[(int32) axis], frame_max[(int32) axis]);
+	}
+	node.inner_mask = 0;
+	node.child_base = child_base;
+	node.tri_base = 0;
+
+	// Where the triangles of the next leaf have to start
+	uint32 next_tri = COMPRESSED_BVH_EMPTY;
+	for (uint32 i = 0; i < COMPRESSED_BVH_WIDTH; i++)
+	{
+		node.tri_count[i] = 0;
+		if (i >= child_count)
+		{
+			for (uint32 axis = 0; axis < 3; axis++)
+			{
+				node.lo[axis][i] = 255;
+				node.hi[axis][i] = 0;
+			}
+			continue;
+		}
+
+		BVHNodeGLSL &child = bvh_nodes[children[i]];
+		for (uint32 axis = 0; axis < 3; axis++)
+		{
+			quantize_bounds(node.origin[(int32) axis], CompressedBVHScale(node, axis),
+							child.data1[(int32) axis], child.data2[(int32) axis], node.lo[axis][i], node.hi[axis][i]);
+		}
+
+		if (!child.IsLeaf())
+		{
+			node.inner_mask |= (uint8) (1u << i);
+			continue;
+		}
+
+		if (next_tri == COMPRESSED_BVH_EMPTY)
+		{
+			node.tri_base = child.FirstChildOrTri();
+			next_tri = node.tri_base;
+		}
+
+		if (child.TriCount() > COMPRESSED_BVH_MAX_LEAF_TRIS || child.FirstChildOrTri() != next_tri)
+		{
+			printf("ERROR (CompressBVH): The leaves weren't prepared by OrderLeavesForCompression.\n");
+		}
+
+		node.tri_count[i] = (uint8) glm::min(child.TriCount(), COMPRESSED_BVH_MAX_LEAF_TRIS);
+		next_tri += node.tri_count[i];
+	}
+
+	uint32 compressed_child = child_base;
+	for (uint32 i = 0; i < child_count; i++)
+	{
+		if (!bvh_nodes[children[i]].IsLeaf())
+		{
+			compress_node(bvh_nodes, children[i], compressed_child++, out_bvh);
+		}
+	}
+}
+void CompressBVH(Array<BVHNodeGLSL> &bvh_nodes, Array<SceneMesh> &meshes, CompressedBVH &out_bvh)
+{
+	out_bvh.nodes.clear();
+	out_bvh.mesh_roots.clear();
+
+	for (uint32 i = 0; i < meshes.size; i++)
+	{
+		if (meshes[i].tri_count == 0)
+		{
+			// Has no instances, see LoadScene
+			out_bvh.mesh_roots.append(COMPRESSED_BVH_EMPTY);
+			continue;
+		}
+
+		uint32 root = out_bvh.nodes.size;
+		out_bvh.mesh_roots.append(root);
+		out_bvh.nodes.append(CompressedBVHNode {});
+		compress_node(bvh_nodes, meshes[i].bvh_root, root, out_bvh);
+	}
+
+	printf("Compressed BVH into %u nodes (%.2f MB, the binary nodes take %.2f MB).\n", out_bvh.nodes.size,
+		   (double) (out_bvh.nodes.size * sizeof(CompressedBVHNode)) / (1024.0 * 1024.0),
+		   (double) (bvh_nodes.size * sizeof(BVHNodeGLSL)) / (1024.0 * 1024.0));
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include "../core/array.hpp"
+#include "../defines.hpp"
+#include "bvh.h"
+#include "instance.hpp"
+
+#include <cstddef>
+#include <glm/vec3.hpp>
+
+// Compressed nodes are always 8 wide, on the CPU as well as on the GPU
+constexpr uint32 COMPRESSED_BVH_WIDTH = 8;
+
+// Most triangles a leaf may reference, since compressed nodes count them in
+// a byte. OrderLeavesForCompression splits the larger leaves.
+constexpr uint32 COMPRESSED_BVH_MAX_LEAF_TRIS = 255;
+
+// Mesh root of a mesh without triangles
+constexpr uint32 COMPRESSED_BVH_EMPTY = 0xFFFFFFFF;
+
+// Stack entries of a CPU traversal that are kept on the call stack, enough
+// for trees up to 64 levels deep: every visited node pushes at most 7
+// entries, and the collapsed trees are at most as deep as the binary ones.
+// Deeper ones spill into the heap, see TraversalStack.
+constexpr uint32 COMPRESSED_BVH_STACK_SIZE = 64 * (COMPRESSED_BVH_WIDTH - 1);
+
+// One 8 wide node in 80 bytes (an uncompressed 8 wide node takes 256).
+// The child boxes are stored relative to a frame that covers all of them:
+//
+//     plane = origin + q * 2^(exponent - 127)
+//
+// with the 8 bit q rounded outwards, so that the decoded boxes always
+// contain the exact ones. The scales are powers of two, so q * scale is
+// exact and the CPU and the shader decode the same planes.
+//
+// The children are packed to the front. The inner ones are consecutive
+// nodes from `child_base` on, and the triangles of the leaves follow each
+// other from `tri_base` on, both in slot order. Slot i is therefore inner
+// child child_base + popcount(inner_mask & ((1 << i) - 1)), or the
+// `tri_count[i]` triangles after those of the leaves in front of it. An
+// empty slot is neither, and its box is inverted (lo = 255, hi = 0).
+// Laid out as 5 uvec4 for `CompressedNode` in shaders/framebuffer.comp.
+struct CompressedBVHNode
+{
+	glm::vec3 origin;
+	uint8 exponents[3]; // biased exponents of the x, y and z scales
+	uint8 inner_mask;
+
+	uint32 child_base;
+	uint32 tri_base;
+	uint8 tri_count[COMPRESSED_BVH_WIDTH]; // 0 for inner and empty slots
+
+	uint8 lo[3][COMPRESSED_BVH_WIDTH];
+	uint8 hi[3][COMPRESSED_BVH_WIDTH];
+};
+
+// The shader reads the node by byte offset, see `CompressedNode`
+static_assert(offsetof(CompressedBVHNode, inner_mask) == 15, "CompressedBVHNode has to match the layout of the shader");
+static_assert(offsetof(CompressedBVHNode, child_base) == 16, "CompressedBVHNode has to match the layout of the shader");
+static_assert(offsetof(CompressedBVHNode, tri_base) == 20, "CompressedBVHNode has to match the layout of the shader");
+static_assert(offsetof(CompressedBVHNode, tri_count) == 24, "CompressedBVHNode has to match the layout of the shader");
+static_assert(offsetof(CompressedBVHNode, lo) == 32, "CompressedBVHNode has to match the layout of the shader");
+static_assert(offsetof(CompressedBVHNode, hi) == 56, "CompressedBVHNode has to match the layout of the shader");
+static_assert(sizeof(CompressedBVHNode) == 80, "CompressedBVHNode has to match the layout of the shader");
+
+struct CompressedBVH
+{
+	Array<CompressedBVHNode> nodes;
+	Array<uint32> mesh_roots; // root node of every mesh
+};
+
+// Prepares the binary BVH of one mesh, with its root at 0, to be compressed.
+// Leaves with more than COMPRESSED_BVH_MAX_LEAF_TRIS triangles are split,
+// and the sorted triangles (and their primitive indices, if given) are
+// moved so that the leaves that collapse into one node are next to each
+// other. Called by CalculateBVH, so every BVH of a mesh is prepared.
+void OrderLeavesForCompression(Array<BVHNodeGLSL> &bvh_nodes, Array<IndexedTriangleGLSL> &sorted_tris, Array<uint32> *primitive_indices);
+
+// Collapses and compresses the binary BVHs of the meshes (as produced by
+// CalculateBVH). Leaves keep their triangle ranges, so the same sorted
+// triangle array is used by both.
+void CompressBVH(Array<BVHNodeGLSL> &bvh_nodes, Array<SceneMesh> &meshes, CompressedBVH &out_bvh);
+
+// Nodes on the longest path from `root` down
+uint32 CompressedBVHDepth(const CompressedBVHNode *nodes, uint32 root);
+
+// Scale of an axis of the node
+float CompressedBVHScale(const CompressedBVHNode &node, uint32 axis);
@@ -0,0 +1,57 @@
+#include "instance.hpp"
+
+#include <glm/geometric.hpp>
+#include <glm/mat3x3.hpp>
+#include <glm/matrix.hpp>
+
+InstanceGLSL::InstanceGLSL(const glm::mat4 &object_to_world, uint32 bvh_root, uint32 mesh_index, uint32 node_index)
+	: world_to_object(glm::inverse(object_to_world)), object_to_world(object_to_world)
+{
+	data.x = bvh_root;
+	data.y = mesh_index;
+	data.z = object_to_world == glm::mat4(1.0f) ? 1 : 0;
+	data.w = node_index;
+}
+
+glm::vec3 InstanceGLSL::PointToObject(const glm::vec3 &point) const
+{
+	return glm::vec3(world_to_object * glm::vec4(point, 1.0f));
+}
+
+glm::vec3 InstanceGLSL::DirectionToObject(const glm::vec3 &direction) const
+{
+	return glm::mat3(world_to_object) * direction;
+}
+
+glm::vec3 InstanceGLSL::PointToWorld(const glm::vec3 &point) const
+{
+	return glm::vec3(object_to_world * glm::vec4(point, 1.0f));
+}
+
+glm::vec3 InstanceGLSL::NormalToWorld(const glm::vec3 &normal) const
+{
+	return glm::normalize(glm::transpose(glm::mat3(world_to_object)) * normal);
+}
+
+Array<TriangleGLSL> FindLightTris(Array<InstanceGLSL> &instances, Array<SceneMesh> &meshes,
+								  Array<IndexedTriangleGLSL> &tris, Array<VertexGLSL> &vertices, Array<uint32> &emissive_tris)
+{
+	Array<TriangleGLSL> light_tris;
+	for (uint32 i = 0; i < instances.size; i++)
+	{
+		InstanceGLSL &instance = instances[i];
+		SceneMesh &mesh = meshes[instance.data.y];
+		for (uint32 j = 0; j < mesh.emissive_count; j++)
+		{
+			// Only the positions are used by the light sampling, the
+			// normals, uvs and material stay the same
+			TriangleGLSL light_tri(tris[emissive_tris[mesh.first_emissive + j]], vertices);
+			light_tri.data1 = glm::vec4(instance.PointToWorld(glm::vec3(light_tri.data1)), light_tri.data1.w);
+			light_tri.data2 = glm::vec4(instance.PointToWorld(glm::vec3(light_tri.data2)), light_tri.data2.w);
+			light_tri.data3 = glm::vec4(instance.PointToWorld(glm::vec3(light_tri.data3)), light_tri.data3.w);
+			light_tris.append(light_tri);
+		}
+	}
+
+	return light_tris;
+}
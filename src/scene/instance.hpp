@@ -0,0 +1,43 @@
+#pragma once
+#include "../defines.hpp"
+#include "../core/array.hpp"
+#include "triangle.hpp"
+#include <glm/mat4x4.hpp>
+#include <glm/vec4.hpp>
+
+// Triangles and bottom level BVH of one mesh. All meshes of a scene share
+// the triangle and node arrays, each one owns a contiguous range of both.
+struct SceneMesh
+{
+	uint32 bvh_root;       // root node of the mesh in `Scene::bvh_nodes`
+	uint32 first_tri;
+	uint32 tri_count;      // sorted triangles, including SBVH references
+	uint32 first_emissive; // range in `Scene::emissive_tris`
+	uint32 emissive_count;
+};
+
+// One placement of a mesh in the world. Rays are moved into the space of
+// the mesh instead of the triangles into world space, so every instance of
+// a mesh traces against the same triangles and bottom level BVH.
+struct InstanceGLSL
+{
+	glm::mat4 world_to_object {};
+	glm::mat4 object_to_world {};
+	glm::uvec4 data {}; // bvh_root, mesh_index, is_identity, node_index
+
+	InstanceGLSL() = default;
+
+	InstanceGLSL(const glm::mat4 &object_to_world, uint32 bvh_root, uint32 mesh_index, uint32 node_index);
+
+	[[nodiscard]] glm::vec3 PointToObject(const glm::vec3 &point) const;
+	[[nodiscard]] glm::vec3 DirectionToObject(const glm::vec3 &direction) const;
+	[[nodiscard]] glm::vec3 PointToWorld(const glm::vec3 &point) const;
+
+	// Object space normal to a normalized world space normal
+	[[nodiscard]] glm::vec3 NormalToWorld(const glm::vec3 &normal) const;
+};
+
+// World space copies of the emissive triangles of every instance, which is
+// what next event estimation samples from
+Array<TriangleGLSL> FindLightTris(Array<InstanceGLSL> &instances, Array<SceneMesh> &meshes,
+								  Array<IndexedTriangleGLSL> &tris, Array<VertexGLSL> &vertices, Array<uint32> &emissive_tris);
@@ -1,49 +1,178 @@
 #include "model.h"
+#include "../math/math.hpp"
 #include "material.hpp"
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/packing.hpp>
 
-Model::Model(Array<struct Triangle> &triangles,
-           Array<struct MaterialGLSL> &materials,
-		   glm::mat4 &model_matrix,
-           uint32 texture_array)
-        : triangles(triangles),
-          materials(materials),
-          model_matrix(model_matrix),
-          texture_array(texture_array)
+// Same as in bvh.cpp, serial when OpenMP isn't available
+#if defined(_OPENMP)
+#define PARALLEL_FOR _Pragma("omp parallel for")
+#else
+#define PARALLEL_FOR
+#endif
+
+void Model::ApplyModelMatrixToInstances()
+{
+	for (uint32 i = 0; i < instances.size; i++)
+	{
+		instances[i].transform = model_matrix * instances[i].transform;
+	}
+	placement_matrix = model_matrix;
+	model_matrix = glm::mat4(1.0f);
+}
+
+Model::Model()
+	: animation_duration(0.0f), model_matrix(1.0f), placement_matrix(1.0f), texture_array((uint32) -1), texture_budget(TEXTURE_BUDGET_BYTES), cache_textures(true)
 {}
 
-Array<TriangleGLSL> Model::ConvertToSSBOFormat()
+glm::mat4 NodeLocalMatrix(const ModelNode &node, const glm::vec3 &translation, const glm::quat &rotation, const glm::vec3 &scale)
 {
-    Array<TriangleGLSL> mesh_tris_ssbo(triangles.size);
-    for (uint32 i = 0; i < triangles.size; i++)
-    {
-        TriangleGLSL glsl_tri(triangles[i]);
-        mesh_tris_ssbo.append(glsl_tri);
-    }
-
-    return mesh_tris_ssbo;
+	if (node.has_matrix)
+	{
+		return node.matrix;
+	}
+
+	// Same order and axes as the loader has always used for the rest pose
+	glm::mat4 matrix = glm::scale(glm::mat4(1.0f), glm::vec3(scale.x, scale.z, scale.y));
+	matrix *= glm::mat4_cast(rotation);
+	matrix = glm::translate(matrix, glm::vec3(translation.x, translation.z, translation.y));
+	return matrix;
 }
 
-void Model::ApplyModelMatrixToTris()
+// Breadth first from the roots, with the children of every node gathered
+// up front. Nodes that are part of a cycle, which glTF doesn't allow, are
+// never reached and left out.
+static void parents_first_order(const Array<ModelNode> &nodes, Array<uint32> &out_order)
 {
-	glm::mat3 normal_matrix = glm::mat3(glm::transpose(glm::inverse(model_matrix)));
-    for(uint32 i = 0; i < triangles.size; i++)
-    {
-        Triangle &current_tri = triangles[i];
-        current_tri.v0 = model_matrix * glm::vec4(current_tri.v0, 1.0f);
-        current_tri.v1 = model_matrix * glm::vec4(current_tri.v1, 1.0f);
-        current_tri.v2 = model_matrix * glm::vec4(current_tri.v2, 1.0f);
-
-		current_tri.n0 = glm::normalize(normal_matrix * current_tri.n0);
-		current_tri.n1 = glm::normalize(normal_matrix * current_tri.n1);
-		current_tri.n2 = glm::normalize(normal_matrix * current_tri.n2);
-    }
-	model_matrix = glm::mat4(1.0f);
+	uint32 node_count = nodes.size;
+	Array<uint32> first_child;
+	first_child.resize(node_count + 1);
+	memset(first_child._data, 0, first_child.size * sizeof(uint32));
+	for (uint32 i = 0; i < node_count; i++)
+	{
+		int32 parent = nodes._data[i].parent;
+		if (parent >= 0 && (uint32) parent < node_count)
+		{
+			first_child._data[parent + 1]++;
+		}
+	}
+	for (uint32 i = 0; i < node_count; i++)
+	{
+		first_child._data[i + 1] += first_child._data[i];
+	}
+
+	Array<uint32> children;
+	Array<uint32> child_cursor = first_child;
+	children.resize(node_count);
+	out_order.resize(node_count);
+	uint32 order_size = 0;
+	for (uint32 i = 0; i < node_count; i++)
+	{
+		int32 parent = nodes._data[i].parent;
+		if (parent >= 0 && (uint32) parent < node_count)
+		{
+			children._data[child_cursor._data[parent]++] = i;
+		}
+		else
+		{
+			out_order._data[order_size++] = i;
+		}
+	}
+
+	for (uint32 i = 0; i < order_size; i++)
+	{
+		uint32 node = out_order._data[i];
+		for (uint32 child = first_child._data[node]; child < first_child._data[node + 1]; child++)
+		{
+			out_order._data[order_size++] = children._data[child];
+		}
+	}
+	out_order.size = order_size;
 }
 
-Model::Model()
-	: model_matrix(1.0f), texture_array((uint32) -1)
-{}
+void ComputeNodeWorldMatrices(const Array<ModelNode> &nodes, const glm::mat4 *local_matrices, Array<glm::mat4> &out_world_matrices)
+{
+	out_world_matrices.resize(nodes.size);
+	for (uint32 i = 0; i < nodes.size; i++)
+	{
+		out_world_matrices._data[i] = glm::mat4(1.0f);
+	}
+
+	Array<uint32> order;
+	parents_first_order(nodes, order);
+	for (uint32 i = 0; i < order.size; i++)
+	{
+		uint32 node = order._data[i];
+		int32 parent = nodes._data[node].parent;
+		out_world_matrices._data[node] = parent >= 0 ? out_world_matrices._data[parent] * local_matrices[node] : local_matrices[node];
+	}
+}
+
+uint32 Model::BakeSingleUseInstances()
+{
+	// A node moves when an animation moves it or any of its parents
+	Array<uint8> is_animated;
+	is_animated.resize(nodes.size);
+	memset(is_animated._data, 0, is_animated.size);
+	for (uint32 i = 0; i < animation_channels.size; i++)
+	{
+		AnimationChannel &channel = animation_channels[i];
+		if (channel.node_index < nodes.size && channel.path != AnimationPath::WEIGHTS)
+		{
+			is_animated[channel.node_index] = 1;
+		}
+	}
+
+	Array<uint32> order;
+	parents_first_order(nodes, order);
+	for (uint32 i = 0; i < order.size; i++)
+	{
+		uint32 node = order._data[i];
+		int32 parent = nodes._data[node].parent;
+		is_animated._data[node] |= parent >= 0 ? is_animated._data[parent] : 0;
+	}
+
+	Array<uint32> use_counts;
+	use_counts.resize(meshes.size);
+	memset(use_counts._data, 0, use_counts.size * sizeof(uint32));
+	for (uint32 i = 0; i < instances.size; i++)
+	{
+		use_counts[instances[i].mesh_index]++;
+	}
+
+	uint32 baked_count = 0;
+	for (uint32 i = 0; i < instances.size; i++)
+	{
+		ModelInstance &instance = instances[i];
+		ModelMesh &mesh = meshes[instance.mesh_index];
+		bool is_moved = instance.node_index < nodes.size && is_animated[instance.node_index] != 0;
+		if (use_counts[instance.mesh_index] != 1 || mesh.morph_target_count > 0 || mesh.has_joints || is_moved || instance.transform == glm::mat4(1.0f))
+		{
+			continue;
+		}
+
+		// Normals follow the inverse transpose, so that they stay
+		// perpendicular under non-uniform scales
+		glm::mat4 transform = instance.transform;
+		glm::mat3 normal_transform = glm::transpose(glm::inverse(glm::mat3(transform)));
+		VertexGLSL *mesh_vertices = &vertices._data[mesh.first_vertex];
+
+		PARALLEL_FOR
+		for (uint32 v = 0; v < mesh.vertex_count; v++)
+		{
+			VertexGLSL &vertex = mesh_vertices[v];
+			vertex.position = glm::vec3(transform * glm::vec4(vertex.position, 1.0f));
+			glm::vec3 normal = pixl::octahedral_normal_decoding(glm::unpackHalf2x16(vertex.normal));
+			vertex.normal = glm::packHalf2x16(pixl::octahedral_normal_encoding(glm::normalize(normal_transform * normal)));
+		}
+
+		instance.transform = glm::mat4(1.0f);
+		instance.node_index = (uint32) -1;
+		baked_count++;
+	}
+
+	return baked_count;
+}
 
 void Model::Translate(const glm::vec3 &translation)
 {
@@ -1,30 +1,150 @@
 #pragma once
 #include "../core/array.hpp"
 #include "../defines.hpp"
+#include "texture.hpp"
 #include "triangle.hpp"
+#include <glm/gtc/quaternion.hpp>
 #include <glm/mat4x4.hpp>
 
+// Triangle and vertex ranges of one glTF mesh in `Model::triangles` and
+// `Model::vertices`
+struct ModelMesh
+{
+	uint32 first_tri;
+	uint32 tri_count;
+	uint32 first_vertex;
+	uint32 vertex_count;
+
+	// Position offsets of the morph targets in `Model::morph_deltas`, stored
+	// per vertex with one offset for every target
+	uint32 morph_target_count;
+	uint32 first_morph_delta;
+
+	// Skin joints and weights of its vertices in `Model::vertex_joints` and
+	// `Model::joint_weights`, only for meshes with the attributes
+	bool has_joints;
+	uint32 first_joint_vertex;
+};
+
+// A node of the glTF scene that places a mesh, with its world transform
+struct ModelInstance
+{
+	uint32 mesh_index;
+	uint32 node_index; // (uint32) -1 for meshes without a node
+	glm::mat4 transform;
+};
+
+// A glTF node with its rest pose, kept so that animations can move it
+struct ModelNode
+{
+	int32 parent; // -1 for root nodes
+
+	glm::vec3 translation;
+	glm::quat rotation;
+	glm::vec3 scale;
+	glm::mat4 matrix;
+	bool has_matrix; // animations can't move nodes that use a matrix
+
+	// Morph target weights of its mesh in `Model::node_weights`
+	uint32 first_weight;
+	uint32 weight_count;
+
+	int32 skin; // index in `Model::skins` that moves its mesh, -1 for none
+};
+
+// Joints of a glTF skin, nodes in `Model::skin_joints` with their inverse
+// bind matrices at the same index of `Model::inverse_bind_matrices`
+struct ModelSkin
+{
+	uint32 first_joint;
+	uint32 joint_count;
+};
+
+enum class AnimationPath
+{
+	TRANSLATION,
+	ROTATION,
+	SCALE,
+	WEIGHTS
+};
+
+enum class AnimationInterpolation
+{
+	STEP,
+	LINEAR,
+	CUBIC_SPLINE // every key stores an in tangent, the value and an out tangent
+};
+
+// Keyframes of one property of one node. The key times and values are
+// ranges of `Model::animation_times` and `Model::animation_values`.
+struct AnimationChannel
+{
+	uint32 node_index;
+	AnimationPath path;
+	AnimationInterpolation interpolation;
+	uint32 component_count; // per value, e.g. 4 for rotations
+	uint32 first_key;
+	uint32 key_count;
+	uint32 first_value;
+};
+
+// Transform of a node relative to its parent, for the given pose
+glm::mat4 NodeLocalMatrix(const ModelNode &node, const glm::vec3 &translation, const glm::quat &rotation, const glm::vec3 &scale);
+
+// Transform of every node relative to the model, from the local matrices of
+// all nodes. Each node is visited once, parents before their children,
+// whatever order the file lists them in.
+void ComputeNodeWorldMatrices(const Array<ModelNode> &nodes, const glm::mat4 *local_matrices, Array<glm::mat4> &out_world_matrices);
+
 struct Model
 {
-    Array<struct Triangle> triangles;
+	// Released by LoadScene once the scene has its own copies. The vertices
+	// are only kept as the rest pose of meshes with morph targets or joints.
+	Array<VertexGLSL> vertices;
+	Array<IndexedTriangleGLSL> triangles; // reference `vertices` by their index in the whole array
     Array<struct MaterialGLSL> materials;
+	Array<ModelMesh> meshes;
+	Array<ModelInstance> instances;
+
+	// Node hierarchy, morph targets, skins and the first animation of the file
+	Array<ModelNode> nodes;
+	Array<float> node_weights;
+	Array<glm::vec3> morph_deltas;
+	Array<ModelSkin> skins;
+	Array<uint32> skin_joints;
+	Array<glm::mat4> inverse_bind_matrices;
+	Array<glm::uvec4> vertex_joints; // indices into the joints of the skin
+	Array<glm::vec4> joint_weights;
+	Array<AnimationChannel> animation_channels;
+	Array<float> animation_times;
+	Array<float> animation_values;
+	float animation_duration;
 
 	glm::mat4 model_matrix;
-    uint32 texture_array;
+	glm::mat4 placement_matrix; // the model matrix the instances were placed with
+    uint32 texture_array;                    // pages of the texture atlas
+	Array<TextureRecordGLSL> texture_records; // where each texture is in them
+	uint64 texture_budget;                    // bytes the pages may take, see PackTextureAtlas
+	bool cache_textures;                      // keep the built pages in `<path>.textures`
 
 	Model();
 
-	Model(Array<struct Triangle> &triangles,
-         Array<struct MaterialGLSL> &materials,
-		 glm::mat4 &model_matrix,
-         uint32 texture_array);
-
-    Array<TriangleGLSL> ConvertToSSBOFormat();
-
 	void Translate(const glm::vec3 &translation);
 	void Rotate(const glm::vec3 &rotation);
 	void Scale(const glm::vec3 &scale);
 	void Scale(float scale);
-    void ApplyModelMatrixToTris();
+
+	// Places every instance with the model matrix and resets it. The
+	// triangles stay in the space of their mesh. The matrix is kept in
+	// `placement_matrix` for placing animated instances again.
+	void ApplyModelMatrixToInstances();
+
+	// Moves the vertices of every mesh that only one instance places into
+	// the world, in place of its mesh space, and places that instance with
+	// the identity, so rays skip the transform into mesh space. Meshes with
+	// morph targets or joints and those on animated nodes stay as they are. The baked
+	// instances lose their node, animations no longer place them. Returns
+	// the number of baked meshes.
+	uint32 BakeSingleUseInstances();
 };
 
@@ -0,0 +1,717 @@
+#include "scene.hpp"
+#include "../loader.h"
+#include "../mesh_loader.h"
+#include "scene_cache.hpp"
+#include "scene_file.hpp"
+
+#include <glm/trigonometric.hpp>
+
+#include <chrono>
+#include <cstring>
+#include <string>
+
+// Builds the bottom level BVH of one mesh and appends its sorted triangles,
+// nodes and emissive triangles to the scene
+static void build_mesh(const IndexedTriangleGLSL *mesh_tris, uint32 tri_count, Scene &out_scene, const BVHBuildOptions &bvh_options)
+{
+	SceneMesh mesh {};
+	mesh.bvh_root = out_scene.bvh_nodes.size;
+	mesh.first_tri = out_scene.triangles.size;
+	mesh.first_emissive = out_scene.emissive_tris.size;
+
+	Array<IndexedTriangleGLSL> sorted_tris;
+	Array<uint32> primitive_indices;
+	Array<BVHNodeGLSL> nodes = CalculateBVH(mesh_tris, tri_count, out_scene.vertices, sorted_tris, bvh_options, &primitive_indices);
+
+	// The nodes of all meshes share one array, so the child and triangle
+	// indices are moved to where the mesh ends up in it
+	for (uint32 i = 0; i < nodes.size; i++)
+	{
+		BVHNodeGLSL &node = nodes[i];
+		uint32 offset = node.IsLeaf() ? mesh.first_tri : mesh.bvh_root;
+		node.SetFirstChildOrTri(node.FirstChildOrTri() + offset);
+		out_scene.bvh_nodes.append(node);
+	}
+
+	// The SBVH builder can reference the same triangle from several
+	// leaves. Lights are sampled uniformly from this list, so every
+	// emissive triangle may only be in it once.
+	Array<uint32> emissive_tris = FindEmissiveTris(sorted_tris, out_scene.materials);
+	Array<bool> is_listed(tri_count);
+	is_listed.size = tri_count;
+	memset(is_listed._data, 0, is_listed.size * sizeof(bool));
+
+	for (uint32 i = 0; i < emissive_tris.size; i++)
+	{
+		uint32 original_index = primitive_indices[emissive_tris[i]];
+		if (!is_listed[original_index])
+		{
+			is_listed[original_index] = true;
+			out_scene.emissive_tris.append(mesh.first_tri + emissive_tris[i]);
+		}
+	}
+
+	for (uint32 i = 0; i < sorted_tris.size; i++)
+	{
+		out_scene.triangles.append(sorted_tris[i]);
+	}
+
+	mesh.tri_count = sorted_tris.size;
+	mesh.emissive_count = out_scene.emissive_tris.size - mesh.first_emissive;
+	out_scene.meshes.append(mesh);
+}
+
+// Keeps what AnimateScene needs to deform a mesh with morph targets or
+// joints. A mesh is deformed once, so all nodes that use it follow the
+// weights and the skin of the first.
+static void add_deforming_mesh(Scene &out_scene, uint32 mesh_index, uint32 bvh_root)
+{
+	Model &model = out_scene.model;
+	SceneAnimation &animation = out_scene.animation;
+
+	DeformingMesh deforming {};
+	deforming.mesh_index = mesh_index;
+	deforming.node_index = (uint32) -1;
+	deforming.node_count = out_scene.bvh_nodes.size - bvh_root;
+	deforming.build_cost = BVHSahCost(out_scene.bvh_nodes, bvh_root, deforming.node_count);
+
+	uint32 node_uses = 0;
+	for (uint32 i = 0; i < model.instances.size; i++)
+	{
+		ModelInstance &instance = model.instances[i];
+		if (instance.mesh_index == mesh_index && instance.node_index != (uint32) -1)
+		{
+			if (node_uses == 0)
+			{
+				deforming.node_index = instance.node_index;
+			}
+			node_uses++;
+		}
+	}
+
+	if (deforming.node_index == (uint32) -1)
+	{
+		return;
+	}
+
+	if (node_uses > 1)
+	{
+		printf("WARNING: Mesh %u with morph targets or joints is used by %u nodes, all of them follow the first one.\n", mesh_index, node_uses);
+	}
+
+	animation.meshes.append(deforming);
+}
+
+// Loads the model and places it in the world, ready for the BVHs of its
+// meshes to be built
+static bool load_model(const char *model_path, Scene &out_scene, bool upload_textures)
+{
+	Model &model = out_scene.model;
+	if (!LoadModel(model_path, model, upload_textures))
+	{
+		return false;
+	}
+
+	// Apply model matrix to instances
+	model.Translate(glm::vec3(0.0f, -2.0f, -6.0f));
+	model.Rotate(glm::vec3(0.0f, glm::radians(-90.0f), 0.0f));
+	model.Scale(2.0f);
+	model.ApplyModelMatrixToInstances();
+
+	uint32 baked_count = model.BakeSingleUseInstances();
+	if (baked_count > 0)
+	{
+		printf("--> Moved %u meshes that are placed once into the world\n", baked_count);
+	}
+
+	out_scene.materials = model.materials;
+
+	// Every triangle of the model references its vertices by their index in
+	// the whole array, so they are kept as they are. The model only keeps
+	// its own copy as the rest pose of meshes with morph targets or joints.
+	bool has_deforming_meshes = false;
+	for (uint32 i = 0; i < model.meshes.size; i++)
+	{
+		has_deforming_meshes = has_deforming_meshes || model.meshes[i].morph_target_count > 0 || model.meshes[i].has_joints;
+	}
+
+	if (has_deforming_meshes)
+	{
+		out_scene.vertices = model.vertices;
+	}
+	else
+	{
+		out_scene.vertices.swap(model.vertices);
+	}
+
+	// Only SBVH can reference a triangle more than once, so this is usually
+	// the only allocation of the sorted triangles
+	out_scene.triangles.resize(model.triangles.size);
+	out_scene.triangles.size = 0;
+	return true;
+}
+
+// Appends the instances of the meshes from `first_mesh` up to `end_mesh`
+// that have any triangles, in the order of the model
+static void append_instances(Scene &scene, uint32 first_mesh, uint32 end_mesh, Array<InstanceGLSL> &out_instances)
+{
+	Model &model = scene.model;
+	for (uint32 i = 0; i < model.instances.size; i++)
+	{
+		ModelInstance &model_instance = model.instances[i];
+		if (model_instance.mesh_index < first_mesh || model_instance.mesh_index >= end_mesh)
+		{
+			continue;
+		}
+
+		SceneMesh &mesh = scene.meshes[model_instance.mesh_index];
+		if (mesh.tri_count > 0)
+		{
+			out_instances.append(InstanceGLSL(model_instance.transform, mesh.bvh_root, model_instance.mesh_index, model_instance.node_index));
+		}
+	}
+}
+
+// Builds the BVH of every mesh of the loaded model, finds their emissive
+// triangles and places the instances. `mesh_built` is called with the
+// number of meshes that are done after each one, and stops the build when
+// it returns false.
+template<typename MeshBuilt>
+static bool build_meshes(Scene &out_scene, const BVHBuildOptions &bvh_options, MeshBuilt mesh_built)
+{
+	Model &model = out_scene.model;
+	auto start_time = std::chrono::steady_clock::now();
+
+	// A single mesh reports its own build, like a scene without instancing
+	BVHBuildOptions mesh_options = bvh_options;
+	mesh_options.verbose = model.meshes.size == 1;
+
+	SceneAnimation &animation = out_scene.animation;
+	animation.rebuild_options = mesh_options;
+	animation.rebuild_options.verbose = false;
+	if (animation.rebuild_options.builder == BVHBuilder::SPATIAL_SPLIT)
+	{
+		animation.rebuild_options.builder = BVHBuilder::SWEEP_SAH;
+	}
+
+	for (uint32 mesh_index = 0; mesh_index < model.meshes.size; mesh_index++)
+	{
+		ModelMesh &model_mesh = model.meshes[mesh_index];
+		bool is_deforming = (model_mesh.morph_target_count > 0 || model_mesh.has_joints) && model_mesh.tri_count > 0;
+		uint32 bvh_root = out_scene.bvh_nodes.size;
+		build_mesh(&model.triangles._data[model_mesh.first_tri], model_mesh.tri_count, out_scene,
+				   is_deforming ? animation.rebuild_options : mesh_options);
+
+		if (is_deforming)
+		{
+			add_deforming_mesh(out_scene, mesh_index, bvh_root);
+		}
+
+		if (!mesh_built(mesh_index + 1))
+		{
+			return false;
+		}
+	}
+
+	if (!mesh_options.verbose)
+	{
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+		printf("Calculated BVHs of %u meshes with the %s builder%s in %.1f ms, using %u nodes, %u triangle references and %u vertices.\n",
+			   model.meshes.size, BVHBuilderName(bvh_options.builder), bvh_options.optimize ? " (optimized)" : "",
+			   elapsed.count(), out_scene.bvh_nodes.size, out_scene.triangles.size, out_scene.vertices.size);
+	}
+
+	append_instances(out_scene, 0, model.meshes.size, out_scene.instances);
+	return true;
+}
+
+// Loads the model, builds the BVH of every mesh, finds their emissive
+// triangles and places the instances. This is the part of the scene that
+// gets cached. With `keep_triangles` the model keeps its triangles, so
+// that the BVHs can be built again, see prepare_refinement.
+static bool build_model(const char *model_path, Scene &out_scene, bool upload_textures, const BVHBuildOptions &bvh_options, bool keep_triangles = false)
+{
+	if (!load_model(model_path, out_scene, upload_textures) ||
+		!build_meshes(out_scene, bvh_options, [](uint32) { return true; }))
+	{
+		return false;
+	}
+
+	// The scene has its own sorted copy of every triangle now
+	if (!keep_triangles)
+	{
+		out_scene.model.triangles = Array<IndexedTriangleGLSL>();
+	}
+	return true;
+}
+
+// Options of the quick build that a scene is rendered with while the BVHs
+// of `bvh_options` are built, or false if those are about as quick
+static bool preview_options(const BVHBuildOptions &bvh_options, BVHBuildOptions &out_options)
+{
+	if (bvh_options.builder == BVHBuilder::LBVH && !bvh_options.optimize)
+	{
+		return false;
+	}
+
+	out_options = bvh_options;
+	out_options.builder = BVHBuilder::LBVH;
+	out_options.optimize = false;
+	return true;
+}
+
+// Copies what build_meshes needs from a scene that was built with a
+// preview BVH and kept its model triangles, which move along, so the BVHs
+// can be built again on another thread while the scene is rendered
+static void prepare_refinement(Scene &scene, Scene &out_refined)
+{
+	out_refined.model.meshes = scene.model.meshes;
+	out_refined.model.instances = scene.model.instances;
+	out_refined.model.triangles.swap(scene.model.triangles);
+	out_refined.vertices = scene.vertices;
+	out_refined.materials = scene.materials;
+
+	out_refined.triangles.resize(out_refined.model.triangles.size);
+	out_refined.triangles.size = 0;
+}
+
+// Moves the refined meshes, their instances and the deforming meshes into
+// the scene and rebuilds its top level. The instances are placed again in
+// the order of the model, so the scene ends up as if it had been built
+// with the final builder right away.
+static void take_refined_meshes(Scene &refined, Scene &scene)
+{
+	scene.triangles.swap(refined.triangles);
+	scene.bvh_nodes.swap(refined.bvh_nodes);
+	scene.emissive_tris.swap(refined.emissive_tris);
+	scene.meshes.swap(refined.meshes);
+	scene.instances.swap(refined.instances);
+	scene.animation.meshes.swap(refined.animation.meshes);
+	scene.animation.rebuild_options = refined.animation.rebuild_options;
+
+	refined.triangles = Array<IndexedTriangleGLSL>();
+	refined.bvh_nodes = Array<BVHNodeGLSL>();
+	refined.emissive_tris = Array<uint32>();
+	refined.meshes = Array<SceneMesh>();
+	refined.instances = Array<InstanceGLSL>();
+	refined.animation.meshes = Array<DeformingMesh>();
+
+	UpdateTopLevel(scene);
+}
+
+// The spheres that every scene gets after the model, with materials of
+// their own behind those of the model
+static void add_default_spheres(Scene &out_scene)
+{
+//	out_scene.materials.append(MaterialGLSL(glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(1000.0f), 0.0f, 0, MaterialType::MATERIAL_LIGHT));
+//	out_scene.spheres.append(SphereGLSL(glm::vec3(6.5f, 2.0f, -3.0f), 0.1f, out_scene.materials.size - 1));
+
+	Array<MaterialGLSL> &materials = out_scene.materials;
+	Array<SphereGLSL> &spheres = out_scene.spheres;
+	materials.append(MaterialGLSL(glm::vec3(0.0f), glm::vec3(0.944f, 0.776f, 0.373f), glm::vec3(0.0f), 0.0f, -1, MaterialType::MATERIAL_SPECULAR_METAL));
+	spheres.append(SphereGLSL(glm::vec3(-1.0f, 1.0f, -5.0f), 0.3f, materials.size - 1));
+	materials.append(MaterialGLSL(glm::vec3(0.0f), glm::vec3(0.944f, 0.776f, 0.373f), glm::vec3(0.0f), 0.1f, -1, MaterialType::MATERIAL_SPECULAR_METAL));
+	spheres.append(SphereGLSL(glm::vec3(-0.4f, 1.0f, -5.0f), 0.3f, materials.size - 1));
+	materials.append(MaterialGLSL(glm::vec3(0.0f), glm::vec3(0.944f, 0.776f, 0.373f), glm::vec3(0.0f), 0.15f, -1, MaterialType::MATERIAL_SPECULAR_METAL));
+	spheres.append(SphereGLSL(glm::vec3(0.2f, 1.0f, -5.0f), 0.3f, materials.size - 1));
+	materials.append(MaterialGLSL(glm::vec3(0.0f), glm::vec3(0.944f, 0.776f, 0.373f), glm::vec3(0.0f), 0.2f, -1, MaterialType::MATERIAL_SPECULAR_METAL));
+	spheres.append(SphereGLSL(glm::vec3(0.8f, 1.0f, -5.0f), 0.3f, materials.size - 1));
+
+	out_scene.emissive_spheres = FindEmissiveSpheres(spheres, materials);
+}
+
+void UpdateTopLevel(Scene &scene)
+{
+	// The traversals start at the root an instance keeps, not at the one of its mesh
+	for (uint32 i = 0; i < scene.instances.size; i++)
+	{
+		InstanceGLSL &instance = scene.instances[i];
+		if (instance.data.x != scene.meshes[instance.data.y].bvh_root)
+		{
+			printf("ERROR (UpdateTopLevel): Instance %u starts at BVH node %u, its mesh at %u.\n",
+				   i, instance.data.x, scene.meshes[instance.data.y].bvh_root);
+		}
+	}
+
+	scene.tlas_nodes = CalculateTLAS(scene.instances, scene.bvh_nodes);
+	scene.light_tris = FindLightTris(scene.instances, scene.meshes, scene.triangles, scene.vertices, scene.emissive_tris);
+}
+
+// Builds the BVHs of a scene that is rendered with its preview BVHs in
+// the meantime, and caches them when `cache_path` isn't empty
+static void refine_bvh(BVHRefinement *refinement, BVHBuildOptions bvh_options, std::string cache_path, uint64 cache_key, bool has_textures)
+{
+	Scene &refined = refinement->refined;
+	bool succeeded = build_meshes(refined, bvh_options, [&](uint32)
+	{
+		return !refinement->cancel.load(std::memory_order_relaxed);
+	});
+	refined.model.triangles = Array<IndexedTriangleGLSL>();
+
+	if (succeeded && !cache_path.empty())
+	{
+		WriteSceneCache(cache_path.c_str(), cache_key, refined, has_textures);
+	}
+
+	refinement->succeeded = succeeded;
+	refinement->done.store(true, std::memory_order_release);
+}
+
+BVHRefinement::~BVHRefinement()
+{
+	cancel = true;
+	if (thread.joinable())
+	{
+		thread.join();
+	}
+}
+
+bool SwapRefinedBVH(BVHRefinement &refinement, Scene &scene, bool wait)
+{
+	if (!refinement.thread.joinable() || (!wait && !refinement.done.load(std::memory_order_acquire)))
+	{
+		return false;
+	}
+
+	refinement.thread.join();
+	if (!refinement.succeeded)
+	{
+		return false;
+	}
+
+	take_refined_meshes(refinement.refined, scene);
+	refinement.refined = Scene();
+	return true;
+}
+
+bool LoadScene(const char *model_path, Scene &out_scene, bool upload_textures, const BVHBuildOptions &bvh_options, bool use_cache, BVHRefinement *refinement)
+{
+	// Baked with its spheres, top level BVH and lights, there's nothing left to do
+	if (IsSceneFile(model_path))
+	{
+		return LoadSceneFile(model_path, out_scene, upload_textures);
+	}
+
+	auto start_time = std::chrono::steady_clock::now();
+
+	std::string cache_path = std::string(model_path) + ".cache";
+	uint64 source_hash = 0;
+	use_cache = use_cache && HashModelSource(model_path, source_hash);
+	uint64 cache_key = SceneCacheKey(source_hash, bvh_options, upload_textures);
+
+	out_scene.model.cache_textures = use_cache;
+
+	bool has_textures = false;
+	if (use_cache && LoadSceneCache(cache_path.c_str(), cache_key, out_scene, has_textures))
+	{
+		if (upload_textures && has_textures && !LoadGLTFTextures(model_path, out_scene.model))
+		{
+			return false;
+		}
+	}
+	else
+	{
+		BVHBuildOptions build_options = bvh_options;
+		bool preview = refinement != nullptr && preview_options(bvh_options, build_options);
+		if (!build_model(model_path, out_scene, upload_textures, build_options, preview))
+		{
+			return false;
+		}
+
+		// The cache gets the final BVHs, written by the refinement thread
+		bool has_textures = out_scene.model.texture_array != (uint32) -1;
+		if (preview)
+		{
+			prepare_refinement(out_scene, refinement->refined);
+			refinement->thread = std::thread(refine_bvh, refinement, bvh_options, use_cache ? cache_path : std::string(), cache_key, has_textures);
+		}
+		else if (use_cache)
+		{
+			WriteSceneCache(cache_path.c_str(), cache_key, out_scene, has_textures);
+		}
+	}
+
+	UpdateTopLevel(out_scene);
+
+	add_default_spheres(out_scene);
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+	printf("Loaded scene in %.1f ms.\n", elapsed.count());
+	return true;
+}
+
+// Appends the elements of `source` from `first` on
+template<typename T>
+static void append_range(Array<T> &target, Array<T> &source, uint32 first)
+{
+	if (first >= source.size)
+	{
+		return;
+	}
+
+	uint32 offset = target.size;
+	target.resize(offset + source.size - first);
+	memcpy(target._data + offset, source._data + first, (uint64) (source.size - first) * sizeof(T));
+}
+
+// How much of the scene that the thread builds was handed over
+struct StreamProgress
+{
+	uint32 meshes;
+	uint32 triangles;
+	uint32 nodes;
+	uint32 emissive_tris;
+	uint32 instances;
+};
+
+// Hands over the vertices and the materials, without their textures while
+// those are still to come. The atlas comes with the materials that use
+// it, so the renderer never sees one without the other.
+static void publish_materials(SceneStream &stream, Scene &building, bool strip_textures, bool atlas_ready)
+{
+	std::lock_guard<std::mutex> lock(stream.mutex);
+	Scene &ready = stream.ready;
+	if (stream.published_vertices == 0)
+	{
+		ready.vertices = building.vertices;
+		stream.published_vertices = building.vertices.size;
+	}
+
+	ready.materials = building.materials;
+	for (uint32 i = 0; i < ready.materials.size && strip_textures; i++)
+	{
+		ready.materials[i].data3.w = -1.0f;
+	}
+	stream.materials_changed = true;
+	stream.textures_ready = atlas_ready;
+}
+
+// Hands over the meshes built since the last call with their instances.
+// A scene from the cache has no model instances, but all of its own.
+static void publish_meshes(SceneStream &stream, Scene &building, StreamProgress &published, bool from_cache)
+{
+	std::lock_guard<std::mutex> lock(stream.mutex);
+	Scene &ready = stream.ready;
+	append_range(ready.triangles, building.triangles, published.triangles);
+	append_range(ready.bvh_nodes, building.bvh_nodes, published.nodes);
+	append_range(ready.emissive_tris, building.emissive_tris, published.emissive_tris);
+	append_range(ready.meshes, building.meshes, published.meshes);
+	if (from_cache)
+	{
+		append_range(ready.instances, building.instances, published.instances);
+	}
+	else
+	{
+		append_instances(building, published.meshes, building.meshes.size, ready.instances);
+	}
+
+	published.meshes = building.meshes.size;
+	published.triangles = building.triangles.size;
+	published.nodes = building.bvh_nodes.size;
+	published.emissive_tris = building.emissive_tris.size;
+	published.instances = building.instances.size;
+
+	printf("--> Streamed %u meshes with %u triangles\n", published.meshes, published.triangles);
+}
+
+static void stream_scene(SceneStream *stream, std::string model_path, BVHBuildOptions bvh_options, bool use_cache, bool build_textures, uint64 texture_budget, bool preview_bvh)
+{
+	auto start_time = std::chrono::steady_clock::now();
+
+	std::string cache_path = model_path + ".cache";
+	uint64 source_hash = 0;
+	use_cache = use_cache && HashModelSource(model_path.c_str(), source_hash);
+	uint64 cache_key = SceneCacheKey(source_hash, bvh_options, build_textures);
+
+	Scene building;
+	bool has_textures = false;
+	bool from_cache = use_cache && LoadSceneCache(cache_path.c_str(), cache_key, building, has_textures);
+	if (!from_cache && !load_model(model_path.c_str(), building, false))
+	{
+		std::lock_guard<std::mutex> lock(stream->mutex);
+		stream->failed = true;
+		stream->done = true;
+		return;
+	}
+
+	for (uint32 i = 0; i < building.materials.size && !from_cache; i++)
+	{
+		has_textures = has_textures || building.materials[i].data3.w > -1.0f;
+	}
+	bool textures_pending = build_textures && has_textures;
+	publish_materials(*stream, building, textures_pending, false);
+
+	BVHBuildOptions build_options = bvh_options;
+	bool preview = preview_bvh && !from_cache && preview_options(bvh_options, build_options);
+
+	// Every batch has at least as many triangles as all batches before it,
+	// so the renderer uploads the whole scene only a few times
+	StreamProgress published {};
+	bool complete = from_cache || build_meshes(building, build_options, [&](uint32)
+	{
+		if (building.triangles.size - published.triangles >= published.triangles)
+		{
+			publish_meshes(*stream, building, published, false);
+		}
+		return !stream->cancel.load(std::memory_order_relaxed);
+	});
+
+	// The preview BVHs are built again below, from the model triangles
+	Scene refined;
+	if (preview)
+	{
+		prepare_refinement(building, refined);
+	}
+	building.model.triangles = Array<IndexedTriangleGLSL>();
+
+	if (complete)
+	{
+		publish_meshes(*stream, building, published, from_cache);
+
+		if (use_cache && !from_cache && !preview)
+		{
+			WriteSceneCache(cache_path.c_str(), cache_key, building, textures_pending);
+		}
+
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+		printf("Streamed scene in %.1f ms.\n", elapsed.count());
+	}
+
+	// The atlas is only read by the renderer once `textures_ready` is set
+	if (complete && textures_pending)
+	{
+		if (BuildGLTFTextureAtlas(model_path.c_str(), texture_budget, use_cache, stream->atlas))
+		{
+			publish_materials(*stream, building, false, true);
+		}
+		else
+		{
+			printf("WARNING: Failed to build the textures of %s, the materials stay untextured.\n", model_path.c_str());
+		}
+	}
+
+	// The renderer keeps tracing the preview until the final BVHs replace
+	// all meshes at once
+	if (complete && preview && build_meshes(refined, bvh_options, [&](uint32) { return !stream->cancel.load(std::memory_order_relaxed); }))
+	{
+		refined.model.triangles = Array<IndexedTriangleGLSL>();
+		if (use_cache)
+		{
+			WriteSceneCache(cache_path.c_str(), cache_key, refined, textures_pending);
+		}
+
+		std::lock_guard<std::mutex> lock(stream->mutex);
+		stream->refined.triangles.swap(refined.triangles);
+		stream->refined.bvh_nodes.swap(refined.bvh_nodes);
+		stream->refined.emissive_tris.swap(refined.emissive_tris);
+		stream->refined.meshes.swap(refined.meshes);
+		stream->refined.instances.swap(refined.instances);
+		stream->refined_ready = true;
+	}
+
+	std::lock_guard<std::mutex> lock(stream->mutex);
+	stream->done = true;
+}
+
+SceneStream::~SceneStream()
+{
+	cancel = true;
+	if (thread.joinable())
+	{
+		thread.join();
+	}
+}
+
+bool StartSceneStream(const char *model_path, SceneStream &out_stream, bool build_textures, uint64 texture_budget, const BVHBuildOptions &bvh_options,
+					  bool use_cache, bool preview_bvh)
+{
+	if (IsSceneFile(model_path))
+	{
+		printf("ERROR: %s is baked, load it with LoadScene!\n", model_path);
+		return false;
+	}
+
+	out_stream.thread = std::thread(stream_scene, &out_stream, std::string(model_path), bvh_options, use_cache, build_textures, texture_budget, preview_bvh);
+	return true;
+}
+
+SceneStreamUpdate PollSceneStream(SceneStream &stream, Scene &scene, TextureAtlas &out_atlas)
+{
+	// Never waits for the thread, which holds the lock while it hands over
+	SceneStreamUpdate update;
+	std::unique_lock<std::mutex> lock(stream.mutex, std::try_to_lock);
+	if (!lock.owns_lock())
+	{
+		return update;
+	}
+
+	Scene &ready = stream.ready;
+	if (ready.vertices.size > 0)
+	{
+		scene.vertices.swap(ready.vertices);
+		ready.vertices = Array<VertexGLSL>();
+	}
+
+	if (stream.materials_changed)
+	{
+		// The default spheres come right after the materials of the model
+		if (scene.materials.size == 0)
+		{
+			scene.materials.swap(ready.materials);
+			add_default_spheres(scene);
+		}
+		else
+		{
+			memcpy(scene.materials._data, ready.materials._data, (uint64) ready.materials.size * sizeof(MaterialGLSL));
+		}
+
+		ready.materials = Array<MaterialGLSL>();
+		stream.materials_changed = false;
+		update.materials = true;
+	}
+
+	if (ready.meshes.size > 0)
+	{
+		append_range(scene.triangles, ready.triangles, 0);
+		append_range(scene.bvh_nodes, ready.bvh_nodes, 0);
+		append_range(scene.emissive_tris, ready.emissive_tris, 0);
+		append_range(scene.meshes, ready.meshes, 0);
+		append_range(scene.instances, ready.instances, 0);
+		ready.triangles = Array<IndexedTriangleGLSL>();
+		ready.bvh_nodes = Array<BVHNodeGLSL>();
+		ready.emissive_tris = Array<uint32>();
+		ready.meshes = Array<SceneMesh>();
+		ready.instances = Array<InstanceGLSL>();
+
+		UpdateTopLevel(scene);
+		update.geometry = true;
+	}
+
+	// Every mesh is in the scene by now, the refined ones replace them
+	if (stream.refined_ready)
+	{
+		take_refined_meshes(stream.refined, scene);
+		stream.refined_ready = false;
+		update.geometry = true;
+	}
+
+	if (stream.textures_ready)
+	{
+		out_atlas.texels.swap(stream.atlas.texels);
+		out_atlas.records.swap(stream.atlas.records);
+		out_atlas.format = stream.atlas.format;
+		out_atlas.page_size = stream.atlas.page_size;
+		out_atlas.page_count = stream.atlas.page_count;
+		out_atlas.psnr = stream.atlas.psnr;
+		out_atlas.min_filter = stream.atlas.min_filter;
+		out_atlas.mag_filter = stream.atlas.mag_filter;
+		scene.model.texture_records = out_atlas.records;
+
+		stream.textures_ready = false;
+		update.textures = true;
+	}
+
+	update.failed = stream.failed;
+	update.done = stream.done;
+	return update;
+}
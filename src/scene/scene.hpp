@@ -0,0 +1,135 @@
+#pragma once
+#include "../core/array.hpp"
+#include "../defines.hpp"
+#include "animation.hpp"
+#include "bvh.h"
+#include "instance.hpp"
+#include "material.hpp"
+#include "model.h"
+#include "sphere.hpp"
+#include "triangle.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// Everything the renderers need to trace the scene, in the same layout
+// that gets pushed to the SSBOs of the compute shader. The vertices and
+// triangles of every mesh are stored once, in the space of the mesh, and
+// the top level BVH over the instances places them in the world.
+struct Scene
+{
+	Model model;
+
+	Array<VertexGLSL> vertices;           // per mesh, same order as in the model
+	Array<IndexedTriangleGLSL> triangles; // per mesh, sorted in BVH leaf order
+	Array<BVHNodeGLSL> bvh_nodes;  // the bottom level BVHs of all meshes
+	Array<MaterialGLSL> materials;
+	Array<SphereGLSL> spheres;
+
+	Array<SceneMesh> meshes;
+	Array<InstanceGLSL> instances; // sorted in top level BVH leaf order
+	Array<BVHNodeGLSL> tlas_nodes;
+
+	Array<uint32> emissive_tris;     // object space, per mesh
+	Array<TriangleGLSL> light_tris;  // world space, per instance
+	Array<uint32> emissive_spheres;
+
+	SceneAnimation animation;
+};
+
+// The BVHs of the given options, built on a background thread for a scene
+// that LoadScene built with the LBVH builder first, see SwapRefinedBVH
+struct BVHRefinement
+{
+	std::thread thread;
+	std::atomic<bool> cancel { false };
+	std::atomic<bool> done { false };
+	bool succeeded = false; // written by the thread before `done`
+
+	Scene refined; // only touched by the thread until `done`
+
+	BVHRefinement() = default;
+	BVHRefinement(const BVHRefinement &) = delete;
+	BVHRefinement &operator=(const BVHRefinement &) = delete;
+	~BVHRefinement(); // stops the thread after the mesh it is building
+};
+
+// Loads the glTF model at the given path, places it in the world and
+// adds the default spheres. If `upload_textures` is false, no OpenGL
+// calls are made, so this can be used without a context. The BVH is built
+// with the given options. With `use_cache`, the geometry, BVH and materials
+// are read from `<model_path>.cache` when it was written for the same model
+// contents and options, and the cache is (re)written otherwise. A .pxscene
+// file is loaded as it was baked, see scene_file.hpp.
+//
+// With a `refinement`, a scene that has to be built gets quick LBVHs
+// instead, and the BVHs of `bvh_options` are built on a thread that also
+// writes the cache.
+bool LoadScene(const char *model_path, Scene &out_scene, bool upload_textures = true, const BVHBuildOptions &bvh_options = BVHBuildOptions(),
+			   bool use_cache = true, BVHRefinement *refinement = nullptr);
+
+// Once the refinement thread is done, moves its meshes and BVHs into the
+// scene and rebuilds the top level, so the scene is exactly as if it had
+// been loaded without a preview. With `wait` it blocks until then. Returns
+// true when the scene changed, and false while the thread is still busy or
+// if there is nothing to swap.
+bool SwapRefinedBVH(BVHRefinement &refinement, Scene &scene, bool wait = false);
+
+// Rebuilds the top level BVH and the world space light triangles after
+// instances were added, removed or moved. The meshes stay as they are.
+void UpdateTopLevel(Scene &scene);
+
+// What PollSceneStream changed in the scene, so the renderer knows what to
+// upload again
+struct SceneStreamUpdate
+{
+	bool geometry = false;  // meshes and instances were added, the top level was rebuilt
+	bool materials = false;
+	bool textures = false;  // the atlas arrived, together with the textured materials
+	bool done = false;      // nothing more will come
+	bool failed = false;    // the model couldn't be loaded
+};
+
+// Loads a scene on a background thread and hands the meshes over in
+// batches as their BVHs are built, so rendering can start with the first
+// ones. Every batch has at least as many triangles as all before it, so a
+// renderer that uploads the scene again for each one uploads it only about
+// twice in total. The materials are untextured until the texture atlas is
+// built, last. The scene is cached like by LoadScene, but not animated.
+// With a preview BVH, the batches get LBVHs and the BVHs of the given
+// options replace all of them once the textures are done.
+struct SceneStream
+{
+	std::thread thread;
+	std::atomic<bool> cancel { false };
+
+	// Handed over by the thread, only touched under the mutex
+	std::mutex mutex;
+	Scene ready; // the parts that the renderer hasn't taken yet
+	TextureAtlas atlas;
+	uint32 published_vertices = 0;
+	bool materials_changed = false;
+	bool textures_ready = false;
+	Scene refined; // the final meshes that replace the preview
+	bool refined_ready = false;
+	bool done = false;
+	bool failed = false;
+
+	SceneStream() = default;
+	SceneStream(const SceneStream &) = delete;
+	SceneStream &operator=(const SceneStream &) = delete;
+	~SceneStream(); // stops the thread after the mesh it is building
+};
+
+// Starts loading a model like LoadScene. With `build_textures` the atlas
+// is built for UploadTextureAtlas, but nothing is uploaded, the thread
+// never touches OpenGL.
+bool StartSceneStream(const char *model_path, SceneStream &out_stream, bool build_textures, uint64 texture_budget,
+					  const BVHBuildOptions &bvh_options = BVHBuildOptions(), bool use_cache = true, bool preview_bvh = false);
+
+// Moves whatever the thread finished since the last call into `scene`,
+// which starts out empty, and rebuilds its top level BVH. Returns right
+// away if the thread is busy handing over. The atlas, once it arrives, is
+// moved to `out_atlas`.
+SceneStreamUpdate PollSceneStream(SceneStream &stream, Scene &scene, TextureAtlas &out_atlas);
@@ -0,0 +1,361 @@
+#include "scene_buffers.hpp"
+#include "compressed_bvh.hpp"
+#include "scene.hpp"
+#include "scene_file.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+// Bytes of one element of every buffer, in the order of SceneBuffer
+static const uint32 buffer_strides[SCENE_BUFFER_COUNT] = {
+	sizeof(SphereGLSL),
+	sizeof(IndexedTriangleGLSL),
+	sizeof(TriangleGLSL),
+	sizeof(MaterialGLSL),
+	sizeof(BVHNodeGLSL),
+	sizeof(uint32),
+	sizeof(InstanceGLSL),
+	sizeof(BVHNodeGLSL),
+	sizeof(CompressedBVHNode),
+	sizeof(uint32),
+	sizeof(VertexGLSL),
+	sizeof(TextureRecordGLSL),
+};
+
+// The buffers that are edited while rendering get rings, see SceneBuffers
+static const bool buffer_is_ring[SCENE_BUFFER_COUNT] = {
+	true,  // spheres
+	false, // triangles
+	true,  // light triangles
+	true,  // materials
+	false, // BVH nodes
+	true,  // emissive spheres
+	true,  // instances
+	true,  // top level BVH
+	false, // compressed BVH nodes
+	false, // compressed mesh roots
+	false, // vertices
+	false, // texture records
+};
+
+static const GLbitfield ring_flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+template<typename T>
+static void array_range(Array<T> &array, const void *&out_data, uint64 &out_bytes)
+{
+	out_data = array._data;
+	out_bytes = (uint64) array.size * sizeof(T);
+}
+
+static void scene_buffer_data(Scene &scene, CompressedBVH &compressed_bvh, SceneBuffer buffer, const void *&out_data, uint64 &out_bytes)
+{
+	switch (buffer)
+	{
+	case SceneBuffer::SPHERES: array_range(scene.spheres, out_data, out_bytes); break;
+	case SceneBuffer::TRIANGLES: array_range(scene.triangles, out_data, out_bytes); break;
+	case SceneBuffer::LIGHT_TRIS: array_range(scene.light_tris, out_data, out_bytes); break;
+	case SceneBuffer::MATERIALS: array_range(scene.materials, out_data, out_bytes); break;
+	case SceneBuffer::BVH_NODES: array_range(scene.bvh_nodes, out_data, out_bytes); break;
+	case SceneBuffer::EMISSIVE_SPHERES: array_range(scene.emissive_spheres, out_data, out_bytes); break;
+	case SceneBuffer::INSTANCES: array_range(scene.instances, out_data, out_bytes); break;
+	case SceneBuffer::TLAS_NODES: array_range(scene.tlas_nodes, out_data, out_bytes); break;
+	case SceneBuffer::COMPRESSED_NODES: array_range(compressed_bvh.nodes, out_data, out_bytes); break;
+	case SceneBuffer::COMPRESSED_MESH_ROOTS: array_range(compressed_bvh.mesh_roots, out_data, out_bytes); break;
+	case SceneBuffer::VERTICES: array_range(scene.vertices, out_data, out_bytes); break;
+	case SceneBuffer::TEXTURE_RECORDS: array_range(scene.model.texture_records, out_data, out_bytes); break;
+	default: out_data = nullptr; out_bytes = 0; break;
+	}
+}
+
+static void mark_bytes(SceneBufferBinding &binding, uint64 begin, uint64 end)
+{
+	for (uint32 i = 0; i < SCENE_BUFFER_FRAMES; i++)
+	{
+		if (binding.dirty_begin[i] >= binding.dirty_end[i])
+		{
+			binding.dirty_begin[i] = begin;
+			binding.dirty_end[i] = end;
+		}
+		else
+		{
+			binding.dirty_begin[i] = std::min(binding.dirty_begin[i], begin);
+			binding.dirty_end[i] = std::max(binding.dirty_end[i], end);
+		}
+	}
+}
+
+static void wait_for_fence(GLsync &fence)
+{
+	if (fence == nullptr)
+	{
+		return;
+	}
+
+	while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+	{
+	}
+	glDeleteSync(fence);
+	fence = nullptr;
+}
+
+// Replaces the ring with one whose copies hold at least `bytes`. The old
+// buffer lives on until the frames that read it are done, but none of its
+// contents move over, so every copy is written again in full.
+static void grow_ring(SceneBufferBinding &binding, uint64 bytes, uint64 alignment)
+{
+	uint64 capacity = std::max(bytes, binding.copy_capacity + binding.copy_capacity / 2);
+	capacity = (capacity + alignment - 1) / alignment * alignment;
+
+	glDeleteBuffers(1, &binding.buffer);
+	glCreateBuffers(1, &binding.buffer);
+	glNamedBufferStorage(binding.buffer, (GLsizeiptr) (capacity * SCENE_BUFFER_FRAMES), nullptr, ring_flags);
+	binding.mapping = (uint8 *) glMapNamedBufferRange(binding.buffer, 0, (GLsizeiptr) (capacity * SCENE_BUFFER_FRAMES), ring_flags);
+	binding.copy_capacity = capacity;
+
+	mark_bytes(binding, 0, ~0ull);
+}
+
+// Writes what the copy of `frame` missed and binds that copy
+static void upload_ring(SceneBufferBinding &binding, uint32 index, uint32 frame, const void *data, uint64 bytes, uint64 alignment)
+{
+	// Elements that were added or dropped at the end changed for all copies
+	if (bytes != binding.size)
+	{
+		mark_bytes(binding, std::min(bytes, binding.size), bytes);
+		binding.size = bytes;
+	}
+
+	if (bytes > binding.copy_capacity)
+	{
+		grow_ring(binding, bytes, alignment);
+	}
+
+	uint64 copy_offset = (uint64) frame * binding.copy_capacity;
+	uint64 begin = binding.dirty_begin[frame];
+	uint64 end = std::min(binding.dirty_end[frame], bytes);
+	if (begin < end)
+	{
+		memcpy(binding.mapping + copy_offset + begin, (const uint8 *) data + begin, end - begin);
+	}
+	binding.dirty_begin[frame] = 0;
+	binding.dirty_end[frame] = 0;
+
+	// The shader reads the length of its arrays from the bound range
+	if (bytes > 0)
+	{
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, index, binding.buffer, (GLintptr) copy_offset, (GLsizeiptr) bytes);
+	}
+	else
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, index, 0);
+	}
+}
+
+// Creates the buffer again if it was marked, and binds it
+static void upload_immutable(SceneBufferBinding &binding, uint32 index, const void *data, uint64 bytes)
+{
+	if (binding.dirty_begin[0] < binding.dirty_end[0])
+	{
+		glDeleteBuffers(1, &binding.buffer);
+		binding.buffer = 0;
+		if (bytes > 0)
+		{
+			glCreateBuffers(1, &binding.buffer);
+			glNamedBufferStorage(binding.buffer, (GLsizeiptr) bytes, data, 0);
+		}
+
+		binding.size = bytes;
+		for (uint32 i = 0; i < SCENE_BUFFER_FRAMES; i++)
+		{
+			binding.dirty_begin[i] = 0;
+			binding.dirty_end[i] = 0;
+		}
+	}
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, index, binding.buffer);
+}
+
+uint32 GPUStackEntries(const BVHNodeGLSL *bvh_nodes, const SceneMesh *meshes, uint32 mesh_count,
+					   const CompressedBVHNode *compressed_nodes, const uint32 *compressed_mesh_roots)
+{
+	// Both traversals push at most one entry per level they descend, the
+	// compressed one keeps the inner children a node hit in one entry
+	uint32 entries = 0;
+	for (uint32 i = 0; i < mesh_count; i++)
+	{
+		if (meshes[i].tri_count == 0)
+		{
+			continue;
+		}
+
+		uint32 depth = GPU_COMPRESSED_BVH ? CompressedBVHDepth(compressed_nodes, compressed_mesh_roots[i]) : BVHDepth(bvh_nodes, meshes[i].bvh_root);
+		entries = std::max(entries, depth);
+	}
+	return entries;
+}
+
+SceneBuffers::SceneBuffers()
+{
+	MarkAllDirty();
+}
+
+SceneBuffers::~SceneBuffers()
+{
+	Release();
+}
+
+void SceneBuffers::MarkDirty(SceneBuffer buffer, uint32 first, uint32 count)
+{
+	auto index = (uint32) buffer;
+	uint64 stride = buffer_strides[index];
+	mark_bytes(bindings[index], first * stride, ((uint64) first + count) * stride);
+
+	// Compressed from the nodes of every mesh, so it changes as a whole
+	if (buffer == SceneBuffer::BVH_NODES)
+	{
+		MarkDirty(SceneBuffer::COMPRESSED_NODES);
+		MarkDirty(SceneBuffer::COMPRESSED_MESH_ROOTS);
+	}
+}
+
+void SceneBuffers::MarkDirty(SceneBuffer buffer)
+{
+	mark_bytes(bindings[(uint32) buffer], 0, ~0ull);
+	if (buffer == SceneBuffer::BVH_NODES)
+	{
+		MarkDirty(SceneBuffer::COMPRESSED_NODES);
+		MarkDirty(SceneBuffer::COMPRESSED_MESH_ROOTS);
+	}
+}
+
+void SceneBuffers::MarkAllDirty()
+{
+	for (uint32 i = 0; i < SCENE_BUFFER_COUNT; i++)
+	{
+		mark_bytes(bindings[i], 0, ~0ull);
+	}
+}
+
+void SceneBuffers::Upload(Scene &scene)
+{
+	if (alignment == 0)
+	{
+		GLint offset_alignment = 0;
+		glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &offset_alignment);
+		alignment = (uint64) std::max(offset_alignment, 1);
+	}
+
+	frame = (frame + 1) % SCENE_BUFFER_FRAMES;
+	wait_for_fence(fences[frame]);
+
+	// Only needed to create its buffers, so it isn't kept around
+	CompressedBVH compressed_bvh;
+	SceneBufferBinding &compressed_nodes = bindings[(uint32) SceneBuffer::COMPRESSED_NODES];
+	if (compressed_nodes.dirty_begin[0] < compressed_nodes.dirty_end[0])
+	{
+		CompressBVH(scene.bvh_nodes, scene.meshes, compressed_bvh);
+		blas_stack_entries = GPUStackEntries(scene.bvh_nodes._data, scene.meshes._data, scene.meshes.size, compressed_bvh.nodes._data, compressed_bvh.mesh_roots._data);
+	}
+
+	// The instances move every frame of an animation, the top level BVH is
+	// only measured again when it changed
+	SceneBufferBinding &tlas_nodes = bindings[(uint32) SceneBuffer::TLAS_NODES];
+	if (tlas_nodes.dirty_begin[frame] < tlas_nodes.dirty_end[frame] || tlas_nodes.size != (uint64) scene.tlas_nodes.size * sizeof(BVHNodeGLSL))
+	{
+		tlas_stack_entries = scene.tlas_nodes.size > 0 ? BVHDepth(scene.tlas_nodes._data, 0) : 0;
+	}
+
+	for (uint32 i = 0; i < SCENE_BUFFER_COUNT; i++)
+	{
+		const void *data = nullptr;
+		uint64 bytes = 0;
+		scene_buffer_data(scene, compressed_bvh, (SceneBuffer) i, data, bytes);
+
+		if (buffer_is_ring[i])
+		{
+			upload_ring(bindings[i], i, frame, data, bytes, alignment);
+		}
+		else
+		{
+			upload_immutable(bindings[i], i, data, bytes);
+		}
+	}
+
+	BindStackSpill(tlas_stack_entries + blas_stack_entries);
+}
+
+void SceneBuffers::BindStackSpill(uint32 entries)
+{
+	uint64 spilled = entries > GPU_BVH_STACK_SIZE ? entries - GPU_BVH_STACK_SIZE : 0;
+	uint64 bytes = spilled * WIDTH * HEIGHT * GPU_STACK_ENTRY_BYTES;
+	if (bytes != stack_spill.size)
+	{
+		glDeleteBuffers(1, &stack_spill.buffer);
+		stack_spill.buffer = 0;
+		if (bytes > 0)
+		{
+			glCreateBuffers(1, &stack_spill.buffer);
+			glNamedBufferStorage(stack_spill.buffer, (GLsizeiptr) bytes, nullptr, 0);
+			printf("The BVHs need %u stack entries, %.1f MB of them spill out of shared memory.\n", entries,
+				   (double) bytes / (1024.0 * 1024.0));
+		}
+		stack_spill.size = bytes;
+	}
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, STACK_SPILL_BINDING, stack_spill.buffer);
+}
+
+void SceneBuffers::BindStackSpill(const SceneFile &scene_file)
+{
+	uint32 tlas_entries = 0;
+	if (scene_file.Count(SceneFileSection::TLAS_NODES) > 0)
+	{
+		tlas_entries = BVHDepth((const BVHNodeGLSL *) scene_file.Data(SceneFileSection::TLAS_NODES), 0);
+	}
+
+	BindStackSpill(tlas_entries + GPUStackEntries((const BVHNodeGLSL *) scene_file.Data(SceneFileSection::BVH_NODES),
+												  (const SceneMesh *) scene_file.Data(SceneFileSection::MESHES), scene_file.Count(SceneFileSection::MESHES),
+												  (const CompressedBVHNode *) scene_file.Data(SceneFileSection::COMPRESSED_NODES),
+												  (const uint32 *) scene_file.Data(SceneFileSection::COMPRESSED_MESH_ROOTS)));
+}
+
+void SceneBuffers::Fence()
+{
+	if (fences[frame] != nullptr)
+	{
+		glDeleteSync(fences[frame]);
+	}
+	fences[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void SceneBuffers::Release()
+{
+	for (uint32 i = 0; i < SCENE_BUFFER_FRAMES; i++)
+	{
+		if (fences[i] != nullptr)
+		{
+			glDeleteSync(fences[i]);
+			fences[i] = nullptr;
+		}
+	}
+
+	// Deleting a mapped buffer unmaps it
+	for (uint32 i = 0; i < SCENE_BUFFER_COUNT; i++)
+	{
+		if (bindings[i].buffer != 0)
+		{
+			glDeleteBuffers(1, &bindings[i].buffer);
+		}
+		bindings[i] = SceneBufferBinding();
+	}
+
+	if (stack_spill.buffer != 0)
+	{
+		glDeleteBuffers(1, &stack_spill.buffer);
+	}
+	stack_spill = SceneBufferBinding();
+	blas_stack_entries = 0;
+	tlas_stack_entries = 0;
+	MarkAllDirty();
+}
@@ -0,0 +1,121 @@
+#pragma once
+#include "../defines.hpp"
+
+#include <glad/glad.h>
+
+struct BVHNodeGLSL;
+struct CompressedBVHNode;
+struct Scene;
+struct SceneFile;
+struct SceneMesh;
+
+// The shader storage buffers of a scene, in the order of their bindings in
+// shaders/framebuffer.comp
+enum class SceneBuffer : uint32
+{
+	SPHERES,
+	TRIANGLES,
+	LIGHT_TRIS,
+	MATERIALS,
+	BVH_NODES,
+	EMISSIVE_SPHERES,
+	INSTANCES,
+	TLAS_NODES,
+	COMPRESSED_NODES, // built from the BVH nodes, changes with them
+	COMPRESSED_MESH_ROOTS,
+	VERTICES,
+	TEXTURE_RECORDS,
+
+	COUNT
+};
+
+constexpr uint32 SCENE_BUFFER_COUNT = (uint32) SceneBuffer::COUNT;
+
+// Frames the GPU may still be reading while the next one is written. Every
+// dynamic buffer holds a copy of its contents for each of them.
+constexpr uint32 SCENE_BUFFER_FRAMES = 3;
+
+// BVH_STACK_SIZE and COMPRESSED_BVH in shaders/framebuffer.comp: the stack
+// entries of an invocation that are kept in shared memory, and which
+// bottom level BVHs it traverses
+constexpr uint32 GPU_BVH_STACK_SIZE = 32;
+constexpr bool GPU_COMPRESSED_BVH = true;
+
+// The buffer that takes the stack entries beyond GPU_BVH_STACK_SIZE, bound
+// after those of the scene
+constexpr uint32 STACK_SPILL_BINDING = SCENE_BUFFER_COUNT;
+constexpr uint32 GPU_STACK_ENTRY_BYTES = 8;
+
+// Stack entries the shader needs at most to traverse the bottom level BVHs:
+// one per level of the deepest. The top level traversal pushes one more per
+// level, below them, see BVHDepth.
+uint32 GPUStackEntries(const BVHNodeGLSL *bvh_nodes, const SceneMesh *meshes, uint32 mesh_count,
+					   const CompressedBVHNode *compressed_nodes, const uint32 *compressed_mesh_roots);
+
+struct SceneBufferBinding
+{
+	GLuint buffer = 0;
+	uint8 *mapping = nullptr; // persistent, null for the immutable buffers
+	uint64 copy_capacity = 0; // bytes of one copy, a multiple of the offset alignment
+	uint64 size = 0;          // bytes of the scene array in the last upload
+
+	// Bytes that changed since each copy was last written, empty when
+	// begin >= end. The immutable buffers only use the first.
+	uint64 dirty_begin[SCENE_BUFFER_FRAMES] = {};
+	uint64 dirty_end[SCENE_BUFFER_FRAMES] = {};
+};
+
+// Keeps the buffers of a scene on the GPU and uploads only what changed.
+//
+// The small buffers that an interactive session edits (spheres, materials,
+// lights, instances and the top level BVH) are persistently mapped rings
+// with a copy per frame in flight, guarded by a fence per frame. A change
+// is marked as a range of elements, and each copy gets exactly the ranges
+// it missed, so editing one material writes one material per copy. A ring
+// grows when its array outgrows it.
+//
+// The geometry (triangles, bottom level BVHs, vertices and texture
+// records) is created as immutable buffers that the GPU reads fastest,
+// and created again as a whole when it is marked.
+//
+// The traversal stack gets a spill buffer with room for every invocation
+// of a frame, as large as the deepest BVHs need beyond the shared stack,
+// so that no entry is ever dropped. Most scenes need none.
+struct SceneBuffers
+{
+	SceneBufferBinding bindings[SCENE_BUFFER_COUNT];
+	SceneBufferBinding stack_spill;
+	uint32 blas_stack_entries = 0; // since the BVH nodes were last marked
+	uint32 tlas_stack_entries = 0; // since the top level BVH was last marked
+	GLsync fences[SCENE_BUFFER_FRAMES] = {};
+	uint32 frame = 0;       // the copy that the current frame reads
+	uint64 alignment = 0;   // of buffer offsets, queried on the first upload
+
+	SceneBuffers();
+	SceneBuffers(const SceneBuffers &) = delete;
+	SceneBuffers &operator=(const SceneBuffers &) = delete;
+	~SceneBuffers();
+
+	// Marks `count` elements from `first` on as changed in the scene. The
+	// caller keeps the scene consistent itself, for example calls
+	// UpdateTopLevel after moving an instance or making a material emissive.
+	void MarkDirty(SceneBuffer buffer, uint32 first, uint32 count);
+	void MarkDirty(SceneBuffer buffer);
+	void MarkAllDirty();
+
+	// Waits until the GPU is done with the next copy, writes the changes
+	// into it and binds all buffers. Call once per frame before dispatching.
+	void Upload(Scene &scene);
+
+	// Sizes the stack spill buffer for `entries` stack entries per invocation
+	// and binds it. Upload does so for the scene, a baked scene that is
+	// uploaded on its own calls the overload for its file once.
+	void BindStackSpill(uint32 entries);
+	void BindStackSpill(const SceneFile &scene_file);
+
+	// Fences the copy of this frame, call after the last dispatch that reads it
+	void Fence();
+
+	// Deletes the buffers, while the context is still there
+	void Release();
+};
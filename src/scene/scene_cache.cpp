@@ -0,0 +1,288 @@
+#include "scene_cache.hpp"
+#include "../core/hash.hpp"
+#include "../core/mapped_file.hpp"
+#include "scene.hpp"
+
+#include <cstdio>
+#include <string>
+
+static const char scene_cache_magic[8] = { 'P', 'X', 'S', 'C', 'A', 'C', 'H', 'E' };
+static const char texture_cache_magic[8] = { 'P', 'X', 'T', 'E', 'X', 'T', 'U', 'R' };
+
+// Every array starts at a multiple of this, so it can be read in place
+constexpr uint64 SECTION_ALIGNMENT = 16;
+
+struct SceneCacheHeader
+{
+	char magic[8];
+	uint32 version;
+	uint32 has_textures;
+	uint64 key;
+
+	uint32 vertex_count;
+	uint32 triangle_count;
+	uint32 node_count;
+	uint32 material_count;
+	uint32 emissive_tri_count;
+	uint32 mesh_count;
+	uint32 instance_count;
+};
+
+struct TextureCacheHeader
+{
+	char magic[8];
+	uint32 version;
+	uint32 format;
+	uint64 key;
+
+	uint32 page_size;
+	uint32 page_count;
+	uint32 record_count;
+	uint32 texel_bytes;
+	double psnr;
+};
+
+static uint64 align_section(uint64 offset)
+{
+	return (offset + SECTION_ALIGNMENT - 1) & ~(SECTION_ALIGNMENT - 1);
+}
+
+uint64 SceneCacheKey(uint64 source_hash, const BVHBuildOptions &bvh_options, bool upload_textures)
+{
+	uint64 key = HashCombine(source_hash, SCENE_CACHE_VERSION);
+	key = HashCombine(key, (uint64) bvh_options.builder);
+	key = HashCombine(key, bvh_options.optimize ? 1 : 0);
+	key = HashCombine(key, upload_textures ? 1 : 0);
+	key = HashCombine(key, sizeof(VertexGLSL));
+	key = HashCombine(key, sizeof(IndexedTriangleGLSL));
+	key = HashCombine(key, sizeof(BVHNodeGLSL));
+	key = HashCombine(key, sizeof(MaterialGLSL));
+	key = HashCombine(key, sizeof(InstanceGLSL));
+	return key;
+}
+
+template<typename T>
+static bool read_section(const MappedFile &file, uint64 &offset, uint32 count, Array<T> &out_array)
+{
+	offset = align_section(offset);
+	uint64 section_size = (uint64) count * sizeof(T);
+	if (offset + section_size > file.size)
+	{
+		return false;
+	}
+
+	out_array.resize(count);
+	if (count > 0)
+	{
+		memcpy(out_array._data, file.data + offset, section_size);
+	}
+
+	offset += section_size;
+	return true;
+}
+
+bool LoadSceneCache(const char *cache_path, uint64 key, Scene &out_scene, bool &out_has_textures)
+{
+	MappedFile file;
+	if (!file.Open(cache_path))
+	{
+		return false;
+	}
+
+	SceneCacheHeader header;
+	if (file.size < sizeof(header))
+	{
+		printf("WARNING: Scene cache %s is truncated, rebuilding it.\n", cache_path);
+		return false;
+	}
+	memcpy(&header, file.data, sizeof(header));
+
+	if (memcmp(header.magic, scene_cache_magic, sizeof(header.magic)) != 0 ||
+		header.version != SCENE_CACHE_VERSION ||
+		header.key != key)
+	{
+		printf("Scene cache %s is out of date, rebuilding it.\n", cache_path);
+		return false;
+	}
+
+	uint64 offset = sizeof(header);
+	if (!read_section(file, offset, header.vertex_count, out_scene.vertices) ||
+		!read_section(file, offset, header.triangle_count, out_scene.triangles) ||
+		!read_section(file, offset, header.node_count, out_scene.bvh_nodes) ||
+		!read_section(file, offset, header.material_count, out_scene.materials) ||
+		!read_section(file, offset, header.emissive_tri_count, out_scene.emissive_tris) ||
+		!read_section(file, offset, header.mesh_count, out_scene.meshes) ||
+		!read_section(file, offset, header.instance_count, out_scene.instances))
+	{
+		printf("WARNING: Scene cache %s is truncated, rebuilding it.\n", cache_path);
+		return false;
+	}
+
+	out_has_textures = header.has_textures != 0;
+
+	printf("Loaded scene cache %s: %u vertices, %u triangles, %u BVH nodes, %u instances of %u meshes.\n", cache_path,
+		   header.vertex_count, header.triangle_count, header.node_count, header.instance_count, header.mesh_count);
+	return true;
+}
+
+template<typename T>
+static bool write_section(FILE *file, uint64 &offset, Array<T> &array)
+{
+	static const uint8 padding[SECTION_ALIGNMENT] = {};
+
+	uint64 aligned_offset = align_section(offset);
+	if (aligned_offset != offset && fwrite(padding, 1, aligned_offset - offset, file) != aligned_offset - offset)
+	{
+		return false;
+	}
+
+	offset = aligned_offset + (uint64) array.size * sizeof(T);
+	return array.size == 0 || fwrite(array._data, sizeof(T), array.size, file) == array.size;
+}
+
+bool WriteSceneCache(const char *cache_path, uint64 key, Scene &scene, bool has_textures)
+{
+	// Written next to the cache and renamed once complete, so a crash or a
+	// second instance never sees a half written file
+	std::string temp_path = std::string(cache_path) + ".tmp";
+	FILE *file = fopen(temp_path.c_str(), "wb");
+	if (file == nullptr)
+	{
+		printf("WARNING: Failed to write scene cache %s!\n", cache_path);
+		return false;
+	}
+
+	SceneCacheHeader header {};
+	memcpy(header.magic, scene_cache_magic, sizeof(header.magic));
+	header.version = SCENE_CACHE_VERSION;
+	header.has_textures = has_textures ? 1 : 0;
+	header.key = key;
+	header.vertex_count = scene.vertices.size;
+	header.triangle_count = scene.triangles.size;
+	header.node_count = scene.bvh_nodes.size;
+	header.material_count = scene.materials.size;
+	header.emissive_tri_count = scene.emissive_tris.size;
+	header.mesh_count = scene.meshes.size;
+	header.instance_count = scene.instances.size;
+
+	uint64 offset = sizeof(header);
+	bool success = fwrite(&header, sizeof(header), 1, file) == 1 &&
+				   write_section(file, offset, scene.vertices) &&
+				   write_section(file, offset, scene.triangles) &&
+				   write_section(file, offset, scene.bvh_nodes) &&
+				   write_section(file, offset, scene.materials) &&
+				   write_section(file, offset, scene.emissive_tris) &&
+				   write_section(file, offset, scene.meshes) &&
+				   write_section(file, offset, scene.instances);
+	success = fclose(file) == 0 && success;
+
+	if (success)
+	{
+		remove(cache_path);
+		success = rename(temp_path.c_str(), cache_path) == 0;
+	}
+
+	if (!success)
+	{
+		remove(temp_path.c_str());
+		printf("WARNING: Failed to write scene cache %s!\n", cache_path);
+		return false;
+	}
+
+	printf("Wrote scene cache %s.\n", cache_path);
+	return true;
+}
+
+uint64 TextureCacheKey(uint64 source_hash, uint64 budget_bytes, TextureFormat format)
+{
+	uint64 key = HashCombine(source_hash, TEXTURE_CACHE_VERSION);
+	key = HashCombine(key, budget_bytes);
+	key = HashCombine(key, (uint64) format);
+	key = HashCombine(key, sizeof(TextureRecordGLSL));
+	return key;
+}
+
+bool LoadTextureCache(const char *cache_path, uint64 key, TextureAtlas &out_atlas)
+{
+	MappedFile file;
+	if (!file.Open(cache_path))
+	{
+		return false;
+	}
+
+	TextureCacheHeader header;
+	if (file.size < sizeof(header))
+	{
+		printf("WARNING: Texture cache %s is truncated, rebuilding it.\n", cache_path);
+		return false;
+	}
+	memcpy(&header, file.data, sizeof(header));
+
+	if (memcmp(header.magic, texture_cache_magic, sizeof(header.magic)) != 0 ||
+		header.version != TEXTURE_CACHE_VERSION ||
+		header.key != key)
+	{
+		printf("Texture cache %s is out of date, rebuilding it.\n", cache_path);
+		return false;
+	}
+
+	uint64 offset = sizeof(header);
+	if (!read_section(file, offset, header.record_count, out_atlas.records) ||
+		!read_section(file, offset, header.texel_bytes, out_atlas.texels))
+	{
+		printf("WARNING: Texture cache %s is truncated, rebuilding it.\n", cache_path);
+		return false;
+	}
+
+	out_atlas.format = (TextureFormat) header.format;
+	out_atlas.page_size = header.page_size;
+	out_atlas.page_count = header.page_count;
+	out_atlas.psnr = header.psnr;
+
+	printf("Loaded texture cache %s: %u textures in %u pages.\n", cache_path, header.record_count, header.page_count);
+	return true;
+}
+
+bool WriteTextureCache(const char *cache_path, uint64 key, TextureAtlas &atlas)
+{
+	std::string temp_path = std::string(cache_path) + ".tmp";
+	FILE *file = fopen(temp_path.c_str(), "wb");
+	if (file == nullptr)
+	{
+		printf("WARNING: Failed to write texture cache %s!\n", cache_path);
+		return false;
+	}
+
+	TextureCacheHeader header {};
+	memcpy(header.magic, texture_cache_magic, sizeof(header.magic));
+	header.version = TEXTURE_CACHE_VERSION;
+	header.format = (uint32) atlas.format;
+	header.key = key;
+	header.page_size = atlas.page_size;
+	header.page_count = atlas.page_count;
+	header.record_count = atlas.records.size;
+	header.texel_bytes = atlas.texels.size;
+	header.psnr = atlas.psnr;
+
+	uint64 offset = sizeof(header);
+	bool success = fwrite(&header, sizeof(header), 1, file) == 1 &&
+				   write_section(file, offset, atlas.records) &&
+				   write_section(file, offset, atlas.texels);
+	success = fclose(file) == 0 && success;
+
+	if (success)
+	{
+		remove(cache_path);
+		success = rename(temp_path.c_str(), cache_path) == 0;
+	}
+
+	if (!success)
+	{
+		remove(temp_path.c_str());
+		printf("WARNING: Failed to write texture cache %s!\n", cache_path);
+		return false;
+	}
+
+	printf("Wrote texture cache %s.\n", cache_path);
+	return true;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "../defines.hpp"
+#include "bvh.h"
+#include "texture.hpp"
+
+struct Scene;
+
+// Bump whenever the cache layout or anything that LoadScene derives from
+// the model (transform, vertex, triangle or node format) changes
+constexpr uint32 SCENE_CACHE_VERSION = 10;
+
+// Bump whenever the packer or the encoder produce different pages
+constexpr uint32 TEXTURE_CACHE_VERSION = 2;
+
+// Identifies one build of a model: the hash of its source files together
+// with everything that changes what gets built from them
+uint64 SceneCacheKey(uint64 source_hash, const BVHBuildOptions &bvh_options, bool upload_textures);
+
+// Maps the cache file and copies the vertices, sorted triangles, bottom
+// level BVH nodes, model materials, emissive triangles, meshes and instances into
+// `out_scene`. Returns false if the file doesn't exist, is damaged, or was
+// written for a different key. `out_has_textures` tells whether the
+// materials use the texture array. The top level BVH isn't stored, it is
+// rebuilt from the instances in no time.
+bool LoadSceneCache(const char *cache_path, uint64 key, Scene &out_scene, bool &out_has_textures);
+
+// Writes the model part of the scene, before any spheres are added
+bool WriteSceneCache(const char *cache_path, uint64 key, Scene &scene, bool has_textures);
+
+// Identifies the texture atlas of a model: the hash of its source files
+// together with the budget and format the pages were built for
+uint64 TextureCacheKey(uint64 source_hash, uint64 budget_bytes, TextureFormat format);
+
+// Reads the pages and records of a texture atlas that WriteTextureCache
+// wrote for the same key, so the textures don't need to be decoded, packed
+// and compressed again
+bool LoadTextureCache(const char *cache_path, uint64 key, TextureAtlas &out_atlas);
+bool WriteTextureCache(const char *cache_path, uint64 key, TextureAtlas &atlas);
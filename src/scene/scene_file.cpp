@@ -0,0 +1,309 @@
+#include "scene_file.hpp"
+#include "../core/utils.h"
+#include "../loader.h"
+#include "scene.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+static const char scene_file_magic[8] = { 'P', 'X', 'S', 'C', 'E', 'N', 'E', '0' };
+
+// Bytes of one element of every section, in the order of SceneFileSection
+static const uint32 section_strides[SCENE_FILE_SECTION_COUNT] = {
+	sizeof(SphereGLSL),
+	sizeof(IndexedTriangleGLSL),
+	sizeof(TriangleGLSL),
+	sizeof(MaterialGLSL),
+	sizeof(BVHNodeGLSL),
+	sizeof(uint32),
+	sizeof(InstanceGLSL),
+	sizeof(BVHNodeGLSL),
+	sizeof(CompressedBVHNode),
+	sizeof(uint32),
+	sizeof(VertexGLSL),
+	sizeof(TextureRecordGLSL),
+	sizeof(SceneMesh),
+	sizeof(uint32),
+	sizeof(uint8),
+};
+
+static uint64 align_section(uint64 offset)
+{
+	return (offset + SCENE_FILE_ALIGNMENT - 1) & ~(SCENE_FILE_ALIGNMENT - 1);
+}
+
+static uint64 section_bytes(const SceneFileSectionEntry &entry)
+{
+	return (uint64) entry.count * entry.stride;
+}
+
+bool SceneFile::Open(const char *path)
+{
+	if (!file.Open(path))
+	{
+		printf("ERROR (Scene File): Failed to open %s!\n", path);
+		return false;
+	}
+
+	if (file.size < sizeof(header))
+	{
+		printf("ERROR (Scene File): %s is truncated!\n", path);
+		return false;
+	}
+	memcpy(&header, file.data, sizeof(header));
+
+	if (memcmp(header.magic, scene_file_magic, sizeof(header.magic)) != 0)
+	{
+		printf("ERROR (Scene File): %s is not a scene file!\n", path);
+		return false;
+	}
+
+	if (header.version != SCENE_FILE_VERSION)
+	{
+		printf("ERROR (Scene File): %s has version %u, expected %u. Bake it again.\n", path, header.version, SCENE_FILE_VERSION);
+		return false;
+	}
+
+	for (uint32 i = 0; i < SCENE_FILE_SECTION_COUNT; i++)
+	{
+		const SceneFileSectionEntry &entry = header.sections[i];
+		if (entry.stride != section_strides[i])
+		{
+			printf("ERROR (Scene File): %s was baked by a build with a different layout. Bake it again.\n", path);
+			return false;
+		}
+
+		if (entry.offset % SCENE_FILE_ALIGNMENT != 0 || entry.offset > file.size || section_bytes(entry) > file.size - entry.offset)
+		{
+			printf("ERROR (Scene File): %s is truncated!\n", path);
+			return false;
+		}
+	}
+
+	// The texture array is created with all levels of all pages, so they
+	// have to be there in full
+	if (header.page_count > 0)
+	{
+		TextureAtlas layout = AtlasLayout();
+		if (header.texture_format > (uint32) TextureFormat::BC7 ||
+			header.page_size == 0 || Count(SceneFileSection::TEXTURE_TEXELS) != layout.LevelOffset(TEXTURE_MIP_COUNT))
+		{
+			printf("ERROR (Scene File): The texture pages of %s are damaged!\n", path);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+uint32 SceneFile::Count(SceneFileSection section) const
+{
+	return header.sections[(uint32) section].count;
+}
+
+const uint8 *SceneFile::Data(SceneFileSection section) const
+{
+	return file.data + header.sections[(uint32) section].offset;
+}
+
+TextureAtlas SceneFile::AtlasLayout() const
+{
+	TextureAtlas layout;
+	layout.format = (TextureFormat) header.texture_format;
+	layout.page_size = header.page_size;
+	layout.page_count = header.page_count;
+	layout.psnr = header.psnr;
+	layout.min_filter = header.min_filter;
+	layout.mag_filter = header.mag_filter;
+	return layout;
+}
+
+bool IsSceneFile(const char *path)
+{
+	size_t length = strlen(path);
+	size_t extension_length = sizeof(SCENE_FILE_EXTENSION) - 1;
+	return length >= extension_length && strcmp(path + length - extension_length, SCENE_FILE_EXTENSION) == 0;
+}
+
+bool ReadSceneFileSourceHash(const char *path, uint64 &out_hash)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == nullptr)
+	{
+		return false;
+	}
+
+	SceneFileHeader header;
+	bool success = fread(&header, sizeof(header), 1, file) == 1 &&
+				   memcmp(header.magic, scene_file_magic, sizeof(header.magic)) == 0;
+	fclose(file);
+
+	if (success)
+	{
+		out_hash = header.source_hash;
+	}
+	return success;
+}
+
+bool LoadSceneFile(const char *path, Scene &out_scene, bool upload_textures)
+{
+	auto start_time = std::chrono::steady_clock::now();
+
+	SceneFile scene_file;
+	if (!scene_file.Open(path))
+	{
+		return false;
+	}
+
+	scene_file.Read(SceneFileSection::SPHERES, out_scene.spheres);
+	scene_file.Read(SceneFileSection::TRIANGLES, out_scene.triangles);
+	scene_file.Read(SceneFileSection::LIGHT_TRIS, out_scene.light_tris);
+	scene_file.Read(SceneFileSection::MATERIALS, out_scene.materials);
+	scene_file.Read(SceneFileSection::BVH_NODES, out_scene.bvh_nodes);
+	scene_file.Read(SceneFileSection::EMISSIVE_SPHERES, out_scene.emissive_spheres);
+	scene_file.Read(SceneFileSection::INSTANCES, out_scene.instances);
+	scene_file.Read(SceneFileSection::TLAS_NODES, out_scene.tlas_nodes);
+	scene_file.Read(SceneFileSection::VERTICES, out_scene.vertices);
+	scene_file.Read(SceneFileSection::MESHES, out_scene.meshes);
+	scene_file.Read(SceneFileSection::EMISSIVE_TRIS, out_scene.emissive_tris);
+	scene_file.Read(SceneFileSection::TEXTURE_RECORDS, out_scene.model.texture_records);
+
+	if (upload_textures && scene_file.header.page_count > 0)
+	{
+		out_scene.model.texture_array = UploadTextureAtlas(scene_file.AtlasLayout(), scene_file.Data(SceneFileSection::TEXTURE_TEXELS));
+	}
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+	printf("Loaded scene file %s: %u triangles, %u BVH nodes, %u instances of %u meshes in %.1f ms.\n", path,
+		   out_scene.triangles.size, out_scene.bvh_nodes.size, out_scene.instances.size, out_scene.meshes.size, elapsed.count());
+	return true;
+}
+
+void UploadSceneFile(const SceneFile &scene_file, Array<uint32> &ssbo_array, uint32 &out_texture_array)
+{
+	auto start_time = std::chrono::steady_clock::now();
+
+	// Every section the shader reads becomes its buffer as it is, the
+	// driver copies it straight out of the mapped pages
+	uint64 uploaded_bytes = 0;
+	for (uint32 i = 0; i < SCENE_FILE_BUFFER_COUNT; i++)
+	{
+		auto section = (SceneFileSection) i;
+		auto bytes = (uint32) section_bytes(scene_file.header.sections[i]);
+		PushDataToSSBO(scene_file.Data(section), bytes, ssbo_array);
+		uploaded_bytes += bytes;
+	}
+
+	out_texture_array = (uint32) -1;
+	if (scene_file.header.page_count > 0)
+	{
+		out_texture_array = UploadTextureAtlas(scene_file.AtlasLayout(), scene_file.Data(SceneFileSection::TEXTURE_TEXELS));
+		uploaded_bytes += scene_file.Count(SceneFileSection::TEXTURE_TEXELS);
+	}
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+	printf("Uploaded scene file: %.1f MB in %.1f ms.\n", (double) uploaded_bytes / (1024.0 * 1024.0), elapsed.count());
+}
+
+bool WriteSceneFile(const char *path, uint64 source_hash, Scene &scene, CompressedBVH &compressed_bvh, TextureAtlas *atlas)
+{
+	const void *section_data[SCENE_FILE_SECTION_COUNT] = {
+		scene.spheres._data,
+		scene.triangles._data,
+		scene.light_tris._data,
+		scene.materials._data,
+		scene.bvh_nodes._data,
+		scene.emissive_spheres._data,
+		scene.instances._data,
+		scene.tlas_nodes._data,
+		compressed_bvh.nodes._data,
+		compressed_bvh.mesh_roots._data,
+		scene.vertices._data,
+		atlas != nullptr ? atlas->records._data : nullptr,
+		scene.meshes._data,
+		scene.emissive_tris._data,
+		atlas != nullptr ? atlas->texels._data : nullptr,
+	};
+
+	const uint32 section_counts[SCENE_FILE_SECTION_COUNT] = {
+		scene.spheres.size,
+		scene.triangles.size,
+		scene.light_tris.size,
+		scene.materials.size,
+		scene.bvh_nodes.size,
+		scene.emissive_spheres.size,
+		scene.instances.size,
+		scene.tlas_nodes.size,
+		compressed_bvh.nodes.size,
+		compressed_bvh.mesh_roots.size,
+		scene.vertices.size,
+		atlas != nullptr ? atlas->records.size : 0,
+		scene.meshes.size,
+		scene.emissive_tris.size,
+		atlas != nullptr ? atlas->texels.size : 0,
+	};
+
+	SceneFileHeader header {};
+	memcpy(header.magic, scene_file_magic, sizeof(header.magic));
+	header.version = SCENE_FILE_VERSION;
+	header.source_hash = source_hash;
+	if (atlas != nullptr)
+	{
+		header.texture_format = (uint32) atlas->format;
+		header.page_size = atlas->page_size;
+		header.page_count = atlas->page_count;
+		header.min_filter = atlas->min_filter;
+		header.mag_filter = atlas->mag_filter;
+		header.psnr = atlas->psnr;
+	}
+
+	uint64 offset = sizeof(header);
+	for (uint32 i = 0; i < SCENE_FILE_SECTION_COUNT; i++)
+	{
+		SceneFileSectionEntry &entry = header.sections[i];
+		entry.offset = align_section(offset);
+		entry.count = section_counts[i];
+		entry.stride = section_strides[i];
+		offset = entry.offset + section_bytes(entry);
+	}
+
+	// Written next to the file and renamed once complete, like the caches
+	std::string temp_path = std::string(path) + ".tmp";
+	FILE *file = fopen(temp_path.c_str(), "wb");
+	if (file == nullptr)
+	{
+		printf("ERROR (Scene File): Failed to write %s!\n", path);
+		return false;
+	}
+
+	static const uint8 padding[SCENE_FILE_ALIGNMENT] = {};
+
+	bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+	offset = sizeof(header);
+	for (uint32 i = 0; i < SCENE_FILE_SECTION_COUNT && success; i++)
+	{
+		SceneFileSectionEntry &entry = header.sections[i];
+		uint64 bytes = section_bytes(entry);
+		success = (entry.offset == offset || fwrite(padding, 1, entry.offset - offset, file) == entry.offset - offset) &&
+				  (bytes == 0 || fwrite(section_data[i], 1, bytes, file) == bytes);
+		offset = entry.offset + bytes;
+	}
+	success = fclose(file) == 0 && success;
+
+	if (success)
+	{
+		remove(path);
+		success = rename(temp_path.c_str(), path) == 0;
+	}
+
+	if (!success)
+	{
+		remove(temp_path.c_str());
+		printf("ERROR (Scene File): Failed to write %s!\n", path);
+		return false;
+	}
+
+	printf("Wrote scene file %s: %.1f MB.\n", path, (double) offset / (1024.0 * 1024.0));
+	return true;
+}
@@ -0,0 +1,121 @@
+#pragma once
+#include "../core/array.hpp"
+#include "../core/mapped_file.hpp"
+#include "../defines.hpp"
+#include "compressed_bvh.hpp"
+#include "texture.hpp"
+
+struct Scene;
+
+// A .pxscene file is a scene that pathtracer-bake prepared ahead of time:
+// everything the renderers read, in the layout they read it in, so loading
+// it takes no parsing, BVH build or conversion. Unlike the scene cache it
+// doesn't depend on the source model, the default spheres, the top level
+// BVH, the world space lights, the compressed BVH and the texture pages are
+// all stored.
+constexpr char SCENE_FILE_EXTENSION[] = ".pxscene";
+
+// Bump whenever a section is added, removed or changes its layout
+constexpr uint32 SCENE_FILE_VERSION = 2;
+
+// Every section starts at a multiple of this, which covers the offset
+// alignment that OpenGL requires of buffers as well as any cache line
+constexpr uint64 SCENE_FILE_ALIGNMENT = 256;
+
+// The first sections are the shader storage buffers in the order of their
+// bindings in shaders/framebuffer.comp, the others are only read on the CPU
+enum class SceneFileSection : uint32
+{
+	SPHERES,
+	TRIANGLES,
+	LIGHT_TRIS,
+	MATERIALS,
+	BVH_NODES,
+	EMISSIVE_SPHERES,
+	INSTANCES,
+	TLAS_NODES,
+	COMPRESSED_NODES,
+	COMPRESSED_MESH_ROOTS,
+	VERTICES,
+	TEXTURE_RECORDS,
+
+	MESHES,
+	EMISSIVE_TRIS,
+	TEXTURE_TEXELS,
+
+	COUNT
+};
+
+constexpr uint32 SCENE_FILE_SECTION_COUNT = (uint32) SceneFileSection::COUNT;
+constexpr uint32 SCENE_FILE_BUFFER_COUNT = (uint32) SceneFileSection::MESHES;
+
+struct SceneFileSectionEntry
+{
+	uint64 offset;
+	uint32 count;
+	uint32 stride; // bytes of one element, checked against the running build
+};
+
+struct SceneFileHeader
+{
+	char magic[8];
+	uint32 version;
+	uint32 texture_format;
+	uint64 source_hash; // of the model the scene was baked from, keys its texture tiles
+
+	uint32 page_size;
+	uint32 page_count;
+	int32 min_filter;
+	int32 mag_filter;
+	double psnr;
+
+	SceneFileSectionEntry sections[SCENE_FILE_SECTION_COUNT];
+};
+
+// Read-only mapping of a .pxscene file. The sections are used where they
+// lie in the mapping, so its pages can be handed to OpenGL directly.
+struct SceneFile
+{
+	MappedFile file;
+	SceneFileHeader header {};
+
+	// Maps the file and checks that every section lies inside of it and has
+	// the layout of this build
+	bool Open(const char *path);
+
+	uint32 Count(SceneFileSection section) const;
+	const uint8 *Data(SceneFileSection section) const;
+
+	// The texture pages, with `texels` left empty, see UploadTextureAtlas
+	TextureAtlas AtlasLayout() const;
+
+	// Copies a section into an array, for the parts of a scene that are
+	// changed or extended after loading
+	template<typename T>
+	void Read(SceneFileSection section, Array<T> &out_array) const
+	{
+		out_array.resize(Count(section));
+		if (out_array.size > 0)
+		{
+			memcpy(out_array._data, Data(section), (uint64) out_array.size * sizeof(T));
+		}
+	}
+};
+
+bool IsSceneFile(const char *path);
+
+// Reads the hash of the model that a .pxscene file was baked from
+bool ReadSceneFileSourceHash(const char *path, uint64 &out_hash);
+
+// Copies everything but the compressed BVH and the texture pages into
+// `out_scene`. The model stays empty, a baked scene can't be animated. With
+// `upload_textures`, the texture array is created from the mapped pages.
+bool LoadSceneFile(const char *path, Scene &out_scene, bool upload_textures);
+
+// Creates the shader storage buffers of all sections the shader reads,
+// and the texture array, straight from the mapping of the file
+void UploadSceneFile(const SceneFile &scene_file, Array<uint32> &ssbo_array, uint32 &out_texture_array);
+
+// Writes a scene as LoadScene left it. The atlas may be null for a scene
+// without textures.
+bool WriteSceneFile(const char *path, uint64 source_hash, Scene &scene, CompressedBVH &compressed_bvh, TextureAtlas *atlas);
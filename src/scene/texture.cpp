@@ -0,0 +1,562 @@
+#include "texture.hpp"
+#include "../math/math.hpp"
+#include "block_compression.hpp"
+
+#include <stb_image.h>
+#include <stb_image_resize.h>
+
+#include <algorithm>
+#include <cstdio>
+
+// Same as in bvh.cpp, serial when OpenMP isn't available
+#if defined(_OPENMP)
+#define PARALLEL_FOR _Pragma("omp parallel for schedule(dynamic, 1)")
+#else
+#define PARALLEL_FOR
+#endif
+
+bool DecodeTexture(const uint8 *encoded, uint64 encoded_size, DecodedTexture &out_texture)
+{
+	int w = -1;
+	int h = -1;
+	int channels = -1;
+	out_texture.texels = stbi_load_from_memory(encoded, (int) encoded_size, &w, &h, &channels, TEXTURE_CHANNELS);
+	if (out_texture.texels == nullptr)
+	{
+		printf("ERROR (glTF Loader / Textures): Failed to load texture!\n");
+		return false;
+	}
+
+	out_texture.width = (uint32) w;
+	out_texture.height = (uint32) h;
+	return true;
+}
+
+void FreeTexture(DecodedTexture &texture)
+{
+	stbi_image_free(texture.texels);
+	texture.texels = nullptr;
+}
+
+uint32 TextureAtlas::LevelSize(uint32 level) const
+{
+	return pixl::max(page_size >> level, 1u);
+}
+
+static uint32 block_bytes(TextureFormat format)
+{
+	return format == TextureFormat::BC1 ? BC1_BLOCK_BYTES : BC7_BLOCK_BYTES;
+}
+
+static uint64 level_bytes(TextureFormat format, uint32 size)
+{
+	if (format != TextureFormat::RGB8)
+	{
+		uint64 blocks = (size + BC_BLOCK_TEXELS - 1) / BC_BLOCK_TEXELS;
+		return blocks * blocks * block_bytes(format);
+	}
+	return (uint64) size * size * TEXTURE_CHANNELS;
+}
+
+uint64 TextureAtlas::LevelBytes(uint32 level) const
+{
+	return level_bytes(format, LevelSize(level));
+}
+
+uint64 TextureAtlas::Bytes() const
+{
+	return texels.size;
+}
+
+uint64 TextureAtlas::LevelOffset(uint32 level) const
+{
+	uint64 offset = 0;
+	for (uint32 i = 0; i < level; i++)
+	{
+		offset += LevelBytes(i) * page_count;
+	}
+	return offset;
+}
+
+uint8 *TextureAtlas::Level(uint32 level)
+{
+	return texels._data + LevelOffset(level);
+}
+
+uint8 *TextureAtlas::Texels(uint32 page, uint32 level)
+{
+	return Level(level) + LevelBytes(level) * page;
+}
+
+// Where a texture ends up, at the size it is stored with
+struct PackedTexture
+{
+	uint32 width;
+	uint32 height;
+	uint32 page;
+	uint32 x; // of the padded rectangle
+	uint32 y;
+};
+
+// Texture with its padding on both sides, rounded up so that every
+// rectangle starts on a block of the last mip level
+static uint32 padded_size(uint32 size)
+{
+	return (size + 2 * TEXTURE_PADDING + TEXTURE_ALIGNMENT - 1) / TEXTURE_ALIGNMENT * TEXTURE_ALIGNMENT;
+}
+
+static uint64 padded_area(const PackedTexture &texture)
+{
+	return (uint64) padded_size(texture.width) * padded_size(texture.height);
+}
+
+static uint64 atlas_bytes(TextureFormat format, uint32 page_size, uint32 page_count)
+{
+	uint64 bytes = 0;
+	for (uint32 level = 0; level < TEXTURE_MIP_COUNT; level++)
+	{
+		bytes += level_bytes(format, pixl::max(page_size >> level, 1u));
+	}
+	return bytes * page_count;
+}
+
+static void halve(PackedTexture &texture)
+{
+	texture.width = pixl::max(texture.width / 2, 1u);
+	texture.height = pixl::max(texture.height / 2, 1u);
+}
+
+// Halves the largest textures until their padded area fits. Returns false
+// when nothing is left to shrink.
+static bool shrink_to_area(Array<PackedTexture> &textures, uint64 area_budget)
+{
+	uint64 area = 0;
+	for (uint32 i = 0; i < textures.size; i++)
+	{
+		area += padded_area(textures[i]);
+	}
+
+	while (area > area_budget)
+	{
+		uint32 largest = 0;
+		for (uint32 i = 1; i < textures.size; i++)
+		{
+			if ((uint64) textures[i].width * textures[i].height > (uint64) textures[largest].width * textures[largest].height)
+			{
+				largest = i;
+			}
+		}
+
+		PackedTexture &texture = textures[largest];
+		if (texture.width <= TEXTURE_PADDING && texture.height <= TEXTURE_PADDING)
+		{
+			return false;
+		}
+
+		area -= padded_area(texture);
+		halve(texture);
+		area += padded_area(texture);
+	}
+	return true;
+}
+
+// Smallest power of two page that holds the largest texture and, if the
+// maximum size allows it, all of them
+static uint32 choose_page_size(Array<PackedTexture> &textures)
+{
+	uint32 largest = 0;
+	uint64 area = 0;
+	for (uint32 i = 0; i < textures.size; i++)
+	{
+		largest = pixl::max(largest, pixl::max(padded_size(textures[i].width), padded_size(textures[i].height)));
+		area += padded_area(textures[i]);
+	}
+
+	uint32 page_size = TEXTURE_PAGE_MIN_SIZE;
+	while (page_size < TEXTURE_PAGE_MAX_SIZE && (page_size < largest || (uint64) page_size * page_size < area))
+	{
+		page_size *= 2;
+	}
+	return page_size;
+}
+
+// The top of the textures placed so far, as horizontal segments from the
+// left to the right edge of the page
+struct SkylineSegment
+{
+	uint32 x;
+	uint32 y;
+	uint32 width;
+};
+
+// Lowest y at which a rectangle fits with its left edge on segment
+// `first`, or ~0u when it leaves the page
+static uint32 skyline_fit(Array<SkylineSegment> &skyline, uint32 first, uint32 width, uint32 height, uint32 page_size)
+{
+	if (skyline[first].x + width > page_size)
+	{
+		return ~0u;
+	}
+
+	uint32 y = 0;
+	uint32 remaining = width;
+	for (uint32 i = first; remaining > 0; i++)
+	{
+		y = pixl::max(y, skyline[i].y);
+		remaining -= pixl::min(remaining, skyline[i].width);
+	}
+	return y + height <= page_size ? y : ~0u;
+}
+
+static void skyline_place(Array<SkylineSegment> &skyline, uint32 first, uint32 width, uint32 top)
+{
+	uint32 start = skyline[first].x;
+	uint32 end = start + width;
+
+	Array<SkylineSegment> placed(skyline.size + 2);
+	for (uint32 i = 0; i < first; i++)
+	{
+		placed.append(skyline[i]);
+	}
+
+	if (first > 0 && placed[first - 1].y == top)
+	{
+		placed[first - 1].width += width;
+	}
+	else
+	{
+		placed.append(SkylineSegment {start, top, width});
+	}
+
+	for (uint32 i = first; i < skyline.size; i++)
+	{
+		SkylineSegment segment = skyline[i];
+		uint32 segment_end = segment.x + segment.width;
+		if (segment_end <= end)
+		{
+			continue;
+		}
+		if (segment.x < end)
+		{
+			segment.width = segment_end - end;
+			segment.x = end;
+		}
+
+		SkylineSegment &last = placed.back();
+		if (last.y == segment.y)
+		{
+			last.width += segment.width;
+		}
+		else
+		{
+			placed.append(segment);
+		}
+	}
+
+	skyline.swap(placed);
+}
+
+// Fills one page after the other, each with the tallest textures that are
+// still left, at the lowest spot and then the leftmost one. Returns the
+// number of pages.
+static uint32 pack_pages(Array<PackedTexture> &textures, uint32 page_size)
+{
+	Array<uint32> order(textures.size);
+	for (uint32 i = 0; i < textures.size; i++)
+	{
+		order.append(i);
+	}
+	std::stable_sort(order._data, order._data + order.size, [&textures](uint32 a, uint32 b) {
+		return padded_size(textures._data[a].height) > padded_size(textures._data[b].height);
+	});
+
+	uint32 page_count = 0;
+	uint32 placed_count = 0;
+	while (placed_count < textures.size)
+	{
+		Array<SkylineSegment> skyline;
+		skyline.append(SkylineSegment {0, 0, page_size});
+
+		for (uint32 i = 0; i < order.size; i++)
+		{
+			if (order[i] == ~0u)
+			{
+				continue;
+			}
+
+			PackedTexture &texture = textures[order[i]];
+			uint32 width = padded_size(texture.width);
+			uint32 height = padded_size(texture.height);
+
+			uint32 best_segment = ~0u;
+			uint32 best_y = ~0u;
+			for (uint32 s = 0; s < skyline.size; s++)
+			{
+				uint32 y = skyline_fit(skyline, s, width, height, page_size);
+				if (y < best_y)
+				{
+					best_y = y;
+					best_segment = s;
+				}
+			}
+
+			if (best_segment == ~0u)
+			{
+				continue;
+			}
+
+			texture.page = page_count;
+			texture.x = skyline[best_segment].x;
+			texture.y = best_y;
+			skyline_place(skyline, best_segment, width, best_y + height);
+
+			order[i] = ~0u;
+			placed_count++;
+		}
+
+		page_count++;
+	}
+
+	return page_count;
+}
+
+static uint32 wrap_texel(int32 coordinate, uint32 size, bool repeat)
+{
+	if (repeat)
+	{
+		int32 wrapped = coordinate % (int32) size;
+		return (uint32) (wrapped < 0 ? wrapped + (int32) size : wrapped);
+	}
+	return (uint32) glm::clamp(coordinate, 0, (int32) size - 1);
+}
+
+// Copies a texture into its rectangle of level 0, resized if it was
+// shrunk, and fills the padding the way its UVs wrap
+static void copy_texture(const DecodedTexture &source, const PackedTexture &packed, TextureAtlas &atlas)
+{
+	const uint8 *texels = source.texels;
+	Array<uint8> resized;
+	if (packed.width != source.width || packed.height != source.height)
+	{
+		resized.resize(packed.width * packed.height * TEXTURE_CHANNELS);
+		stbir_resize_uint8(source.texels, (int) source.width, (int) source.height, 0,
+						   resized._data, (int) packed.width, (int) packed.height, 0, TEXTURE_CHANNELS);
+		texels = resized._data;
+	}
+
+	uint8 *page = atlas.Texels(packed.page, 0);
+	uint32 width = padded_size(packed.width);
+	uint32 height = padded_size(packed.height);
+	for (uint32 y = 0; y < height; y++)
+	{
+		uint32 source_y = wrap_texel((int32) y - (int32) TEXTURE_PADDING, packed.height, source.repeat_t);
+		const uint8 *source_row = texels + (uint64) source_y * packed.width * TEXTURE_CHANNELS;
+		uint8 *row = page + ((uint64) (packed.y + y) * atlas.page_size + packed.x) * TEXTURE_CHANNELS;
+
+		for (uint32 x = 0; x < width; x++)
+		{
+			uint32 source_x = wrap_texel((int32) x - (int32) TEXTURE_PADDING, packed.width, source.repeat_s);
+			memcpy(row + x * TEXTURE_CHANNELS, source_row + source_x * TEXTURE_CHANNELS, TEXTURE_CHANNELS);
+		}
+	}
+}
+
+// Box filter of 2x2 texels, the same as glGenerateTextureMipmap did before
+static void downsample(const uint8 *source, uint32 source_size, uint8 *destination)
+{
+	uint32 size = source_size / 2;
+	for (uint32 y = 0; y < size; y++)
+	{
+		for (uint32 x = 0; x < size; x++)
+		{
+			const uint8 *row0 = source + ((uint64) (2 * y) * source_size + 2 * x) * TEXTURE_CHANNELS;
+			const uint8 *row1 = row0 + (uint64) source_size * TEXTURE_CHANNELS;
+			uint8 *texel = destination + ((uint64) y * size + x) * TEXTURE_CHANNELS;
+			for (uint32 c = 0; c < TEXTURE_CHANNELS; c++)
+			{
+				uint32 sum = row0[c] + row0[TEXTURE_CHANNELS + c] + row1[c] + row1[TEXTURE_CHANNELS + c];
+				texel[c] = (uint8) ((sum + 2) / 4);
+			}
+		}
+	}
+}
+
+// Encodes every level of the RGB8 pages into blocks of `format`, in
+// parallel over the rows of blocks of all pages. The first level is decoded
+// again to measure what the compression lost, returns its PSNR.
+static double compress_atlas(TextureAtlas &atlas, TextureFormat format, Array<uint8> &out_blocks)
+{
+	TextureAtlas compressed;
+	compressed.format = format;
+	compressed.page_size = atlas.page_size;
+	compressed.page_count = atlas.page_count;
+	compressed.texels.resize((uint32) atlas_bytes(format, atlas.page_size, atlas.page_count));
+
+	uint32 bytes_per_block = block_bytes(format);
+	uint64 squared_error = 0;
+	for (uint32 level = 0; level < TEXTURE_MIP_COUNT; level++)
+	{
+		uint32 size = atlas.LevelSize(level);
+		uint32 blocks_per_row = size / BC_BLOCK_TEXELS;
+		uint32 row_count = blocks_per_row * atlas.page_count;
+
+		Array<uint64> row_errors(row_count);
+		row_errors.resize(row_count);
+
+		PARALLEL_FOR
+		for (uint32 row = 0; row < row_count; row++)
+		{
+			uint32 page = row / blocks_per_row;
+			uint32 block_y = row % blocks_per_row;
+			const uint8 *source = atlas.Texels(page, level);
+			uint8 *destination = compressed.Texels(page, level) + (uint64) block_y * blocks_per_row * bytes_per_block;
+
+			row_errors._data[row] = 0;
+			for (uint32 block_x = 0; block_x < blocks_per_row; block_x++)
+			{
+				uint8 texels[BC_BLOCK_TEXELS * BC_BLOCK_TEXELS * TEXTURE_CHANNELS];
+				for (uint32 y = 0; y < BC_BLOCK_TEXELS; y++)
+				{
+					const uint8 *source_row = source + ((uint64) (block_y * BC_BLOCK_TEXELS + y) * size + block_x * BC_BLOCK_TEXELS) * TEXTURE_CHANNELS;
+					memcpy(texels + y * BC_BLOCK_TEXELS * TEXTURE_CHANNELS, source_row, BC_BLOCK_TEXELS * TEXTURE_CHANNELS);
+				}
+
+				uint8 *block = destination + block_x * bytes_per_block;
+				if (format == TextureFormat::BC1)
+				{
+					EncodeBC1Block(texels, block);
+				}
+				else
+				{
+					EncodeBC7Block(texels, block);
+				}
+
+				if (level == 0)
+				{
+					uint8 decoded[BC_BLOCK_TEXELS * BC_BLOCK_TEXELS * TEXTURE_CHANNELS];
+					if (format == TextureFormat::BC1)
+					{
+						DecodeBC1Block(block, decoded);
+					}
+					else
+					{
+						DecodeBC7Block(block, decoded);
+					}
+					row_errors._data[row] += SquaredError(texels, decoded, BC_BLOCK_TEXELS * BC_BLOCK_TEXELS);
+				}
+			}
+		}
+
+		for (uint32 row = 0; level == 0 && row < row_count; row++)
+		{
+			squared_error += row_errors[row];
+		}
+	}
+
+	out_blocks.swap(compressed.texels);
+	return PSNR(squared_error, (uint64) atlas.page_size * atlas.page_size * TEXTURE_CHANNELS * atlas.page_count);
+}
+
+void PackTextureAtlas(const DecodedTexture *textures, uint32 texture_count, uint64 budget_bytes, TextureAtlas &out_atlas)
+{
+	TextureFormat format = out_atlas.format;
+
+	Array<PackedTexture> packed(texture_count);
+	for (uint32 i = 0; i < texture_count; i++)
+	{
+		PackedTexture texture {textures[i].width, textures[i].height, 0, 0, 0};
+		while (padded_size(texture.width) > TEXTURE_PAGE_MAX_SIZE || padded_size(texture.height) > TEXTURE_PAGE_MAX_SIZE)
+		{
+			halve(texture);
+		}
+		packed.append(texture);
+	}
+
+	// The pages never fit perfectly, so the area the textures may take
+	// shrinks with every try that ends up over the budget
+	uint64 full_page_area = (uint64) TEXTURE_PAGE_MAX_SIZE * TEXTURE_PAGE_MAX_SIZE;
+	uint64 area_budget = budget_bytes * full_page_area / atlas_bytes(format, TEXTURE_PAGE_MAX_SIZE, 1);
+	uint32 page_size = 0;
+	uint32 page_count = 0;
+	for (;;)
+	{
+		bool can_shrink = shrink_to_area(packed, area_budget);
+		page_size = choose_page_size(packed);
+		page_count = pack_pages(packed, page_size);
+
+		uint64 bytes = atlas_bytes(format, page_size, page_count);
+		if (bytes <= budget_bytes)
+		{
+			break;
+		}
+		if (!can_shrink)
+		{
+			printf("WARNING: Textures take %.1f MB even at their smallest, over the budget of %.1f MB.\n",
+				   (double) bytes / (1024.0 * 1024.0), (double) budget_bytes / (1024.0 * 1024.0));
+			break;
+		}
+
+		uint64 scaled_budget = area_budget * budget_bytes / bytes;
+		area_budget = scaled_budget < area_budget ? scaled_budget : area_budget - 1;
+	}
+
+	// The pages are built as RGB8 and compressed once complete
+	out_atlas.format = TextureFormat::RGB8;
+	out_atlas.page_size = page_size;
+	out_atlas.page_count = page_count;
+	out_atlas.psnr = PSNR(0, 0);
+	out_atlas.texels.resize((uint32) atlas_bytes(TextureFormat::RGB8, page_size, page_count));
+	out_atlas.records.resize(texture_count);
+
+	// The padding of every texture covers its whole rectangle, but not the
+	// space no texture was placed in
+	memset(out_atlas.texels._data, 0, out_atlas.LevelBytes(0) * page_count);
+
+	PARALLEL_FOR
+	for (uint32 i = 0; i < texture_count; i++)
+	{
+		const PackedTexture &texture = packed._data[i];
+		copy_texture(textures[i], texture, out_atlas);
+
+		auto inverse_size = 1.0f / (float) page_size;
+		TextureRecordGLSL &record = out_atlas.records._data[i];
+		record.scale_offset = glm::vec4((float) texture.width * inverse_size,
+										(float) texture.height * inverse_size,
+										(float) (texture.x + TEXTURE_PADDING) * inverse_size,
+										(float) (texture.y + TEXTURE_PADDING) * inverse_size);
+		record.data = glm::uvec4(texture.page, textures[i].repeat_s ? 1 : 0, textures[i].repeat_t ? 1 : 0, 0);
+	}
+
+	for (uint32 level = 1; level < TEXTURE_MIP_COUNT; level++)
+	{
+		PARALLEL_FOR
+		for (uint32 page = 0; page < page_count; page++)
+		{
+			downsample(out_atlas.Texels(page, level - 1), out_atlas.LevelSize(level - 1), out_atlas.Texels(page, level));
+		}
+	}
+
+	if (format == TextureFormat::RGB8)
+	{
+		return;
+	}
+
+	Array<uint8> blocks;
+	double psnr = compress_atlas(out_atlas, format, blocks);
+	if (psnr < TEXTURE_MIN_PSNR)
+	{
+		uint64 rgb8_bytes = out_atlas.Bytes();
+		if (rgb8_bytes <= budget_bytes)
+		{
+			printf("WARNING: The compressed textures only reach a PSNR of %.1f dB, below %.1f dB, so they stay RGB8.\n", psnr, TEXTURE_MIN_PSNR);
+			return;
+		}
+
+		printf("WARNING: The compressed textures only reach a PSNR of %.1f dB, below %.1f dB, but take %.1f MB as RGB8, over the budget of %.1f MB.\n",
+			   psnr, TEXTURE_MIN_PSNR, (double) rgb8_bytes / (1024.0 * 1024.0), (double) budget_bytes / (1024.0 * 1024.0));
+	}
+
+	out_atlas.texels.swap(blocks);
+	out_atlas.format = format;
+	out_atlas.psnr = psnr;
+}
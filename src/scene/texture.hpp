@@ -0,0 +1,91 @@
+#pragma once
+#include "../core/array.hpp"
+#include "../defines.hpp"
+
+#include <glm/vec4.hpp>
+
+// Base color textures keep their own size and are packed into square RGB8
+// pages, which are the layers of one texture array. Each texture gets a
+// record of the part of its page it covers, the shader maps its UVs there.
+constexpr uint32 TEXTURE_CHANNELS = 3;
+constexpr uint32 TEXTURE_PAGE_MIN_SIZE = 256;
+constexpr uint32 TEXTURE_PAGE_MAX_SIZE = 4096;
+
+// Only the first few mip levels are built. Every texture is surrounded by
+// copies of its own edges, which are still one texel wide in the last level,
+// so filtering never reaches into a neighbour. Textures start on whole
+// compressed blocks of the last level, so no block mixes two of them.
+constexpr uint32 TEXTURE_MIP_COUNT = 4;
+constexpr uint32 TEXTURE_PADDING = 1u << (TEXTURE_MIP_COUNT - 1);
+constexpr uint32 TEXTURE_ALIGNMENT = 4u << (TEXTURE_MIP_COUNT - 1);
+
+enum class TextureFormat : uint32
+{
+	RGB8,
+	BC1, // a sixth of the size of RGB8, see block_compression.hpp
+	BC7  // a third of the size of RGB8, and much closer to it than BC1
+};
+
+// Compressed pages whose first level comes out below this PSNR against the
+// RGB8 pages are kept as RGB8, if those fit in the budget
+constexpr double TEXTURE_MIN_PSNR = 35.0;
+
+// Default for the texels of all pages together, mip levels included
+constexpr uint64 TEXTURE_BUDGET_BYTES = 256ull * 1024 * 1024;
+
+struct TextureRecordGLSL
+{
+	glm::vec4 scale_offset {}; // uv scale x, y, uv offset x, y in the page
+	glm::uvec4 data {};        // page, repeat_s, repeat_t, unused
+};
+
+// An image decoded by stb_image, at its own size
+struct DecodedTexture
+{
+	uint8 *texels;
+	uint32 width;
+	uint32 height;
+	bool repeat_s; // how the UVs outside of [0, 1] wrap
+	bool repeat_t;
+};
+
+// Decodes an encoded image (PNG, JPEG, ...) to RGB8. The texels have to
+// be released with FreeTexture.
+bool DecodeTexture(const uint8 *encoded, uint64 encoded_size, DecodedTexture &out_texture);
+void FreeTexture(DecodedTexture &texture);
+
+// The pages of a model. The texels are stored level after level, and
+// every level holds all pages one after the other, so that one upload
+// fills a level of the whole array.
+struct TextureAtlas
+{
+	Array<uint8> texels; // RGB8 texels or blocks, row after row
+	Array<TextureRecordGLSL> records; // one per texture, in the same order
+	TextureFormat format = TextureFormat::BC7;
+	uint32 page_size = 0;
+	uint32 page_count = 0;
+	double psnr = 0.0; // of the first level after compression, against the RGB8 pages
+
+	// OpenGL filters of the texture array, taken from the sampler of the
+	// first texture, 0 where it doesn't set them
+	int32 min_filter = 0;
+	int32 mag_filter = 0;
+
+	uint32 LevelSize(uint32 level) const;
+	uint64 LevelBytes(uint32 level) const; // of one page
+	uint64 LevelOffset(uint32 level) const; // of the first page in `texels`
+	uint64 Bytes() const;
+
+	// First texel of a page in a mip level
+	uint8 *Texels(uint32 page, uint32 level);
+	uint8 *Level(uint32 level);
+};
+
+// Packs the textures into as few pages as the skyline packer manages and
+// builds their mip levels, then compresses them to the format set in
+// `out_atlas`. While the pages take more than `budget_bytes` in that
+// format, the largest texture is halved, so small ones keep their detail
+// longest. Pages that lose too much to the compression, see
+// TEXTURE_MIN_PSNR, are left as RGB8 if those fit in the budget. Either way
+// it prints a warning.
+void PackTextureAtlas(const DecodedTexture *textures, uint32 texture_count, uint64 budget_bytes, TextureAtlas &out_atlas);
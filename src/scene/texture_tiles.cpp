@@ -0,0 +1,261 @@
+#include "texture_tiles.hpp"
+#include "../core/hash.hpp"
+#include "../math/math.hpp"
+
+#include <cstring>
+
+// Same as in bvh.cpp, serial when OpenMP isn't available
+#if defined(_OPENMP)
+#define PARALLEL_FOR _Pragma("omp parallel for")
+#else
+#define PARALLEL_FOR
+#endif
+
+static const char texture_tiles_magic[8] = { 'P', 'X', 'T', 'I', 'L', 'E', 'S', '0' };
+
+static_assert(sizeof(TextureTilesHeader) <= TEXTURE_TILE_BYTES, "The header has to fit in the place of a tile");
+
+// fseek only takes a long, which is 32 bits on Windows
+static bool seek_file(FILE *file, uint64 offset)
+{
+#if defined(_WIN32)
+	return _fseeki64(file, (long long) offset, SEEK_SET) == 0;
+#else
+	return fseeko(file, (off_t) offset, SEEK_SET) == 0;
+#endif
+}
+
+static uint64 tile_offset(uint32 tile)
+{
+	return (1 + (uint64) tile) * TEXTURE_TILE_BYTES;
+}
+
+static uint32 pack_texel(const uint8 *rgb)
+{
+	return (uint32) rgb[0] | ((uint32) rgb[1] << 8) | ((uint32) rgb[2] << 16) | 0xFF000000u;
+}
+
+// Averages 2x2 texels of the level above. The last row or column of an odd
+// sized level is repeated instead of read past.
+static void downsample_level(const Array<uint32> &source, uint32 width, uint32 height, Array<uint32> &out_level)
+{
+	uint32 level_width = pixl::max(width / 2, 1u);
+	uint32 level_height = pixl::max(height / 2, 1u);
+	out_level.resize(level_width * level_height);
+
+	PARALLEL_FOR
+	for (uint32 y = 0; y < level_height; y++)
+	{
+		uint32 y0 = pixl::min(2 * y, height - 1);
+		uint32 y1 = pixl::min(2 * y + 1, height - 1);
+		for (uint32 x = 0; x < level_width; x++)
+		{
+			uint32 x0 = pixl::min(2 * x, width - 1);
+			uint32 x1 = pixl::min(2 * x + 1, width - 1);
+			uint32 corners[4] = { source._data[y0 * width + x0], source._data[y0 * width + x1],
+								  source._data[y1 * width + x0], source._data[y1 * width + x1] };
+
+			uint32 texel = 0xFF000000u;
+			for (uint32 c = 0; c < 3; c++)
+			{
+				uint32 sum = 2;
+				for (uint32 corner : corners)
+				{
+					sum += (corner >> (8 * c)) & 0xFF;
+				}
+				texel |= (sum / 4) << (8 * c);
+			}
+			out_level._data[y * level_width + x] = texel;
+		}
+	}
+}
+
+uint64 TextureTilesKey(uint64 source_hash)
+{
+	uint64 key = HashCombine(source_hash, TEXTURE_TILES_VERSION);
+	key = HashCombine(key, TEXTURE_TILE_SIZE);
+	return key;
+}
+
+bool TextureTilesWriter::Begin(const char *tiles_path, uint64 tiles_key)
+{
+	path = tiles_path;
+	key = tiles_key;
+	tile_count = 0;
+	failed = false;
+
+	file = fopen((path + ".tmp").c_str(), "wb");
+	if (file == nullptr)
+	{
+		printf("WARNING: Failed to write texture tiles %s!\n", tiles_path);
+		return false;
+	}
+
+	// Room for the header, which is only known once every tile is written
+	Array<uint8> header_tile;
+	header_tile.resize((uint32) TEXTURE_TILE_BYTES);
+	memset(header_tile._data, 0, header_tile.size);
+	failed = fwrite(header_tile._data, 1, header_tile.size, file) != header_tile.size;
+	return !failed;
+}
+
+void TextureTilesWriter::Add(const DecodedTexture &texture)
+{
+	TiledTexture tiled {};
+	tiled.first_level = levels.size;
+	tiled.repeat_s = texture.repeat_s ? 1 : 0;
+	tiled.repeat_t = texture.repeat_t ? 1 : 0;
+
+	uint32 width = texture.width;
+	uint32 height = texture.height;
+	Array<uint32> level(width * height);
+	level.resize(width * height);
+	for (uint32 i = 0; i < level.size; i++)
+	{
+		level._data[i] = pack_texel(texture.texels + 3 * i);
+	}
+
+	Array<uint32> tile;
+	tile.resize(TEXTURE_TILE_TEXELS);
+	for (;;)
+	{
+		TiledTextureLevel tiled_level {};
+		tiled_level.width = width;
+		tiled_level.height = height;
+		tiled_level.tiles_x = (width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+		tiled_level.first_tile = tile_count;
+		uint32 tiles_y = (height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+
+		for (uint32 tile_y = 0; tile_y < tiles_y && !failed; tile_y++)
+		{
+			for (uint32 tile_x = 0; tile_x < tiled_level.tiles_x && !failed; tile_x++)
+			{
+				for (uint32 y = 0; y < TEXTURE_TILE_SIZE; y++)
+				{
+					uint32 source_y = pixl::min(tile_y * TEXTURE_TILE_SIZE + y, height - 1);
+					for (uint32 x = 0; x < TEXTURE_TILE_SIZE; x++)
+					{
+						uint32 source_x = pixl::min(tile_x * TEXTURE_TILE_SIZE + x, width - 1);
+						tile._data[y * TEXTURE_TILE_SIZE + x] = level._data[source_y * width + source_x];
+					}
+				}
+				failed = fwrite(tile._data, sizeof(uint32), tile.size, file) != tile.size;
+			}
+		}
+
+		tile_count += tiled_level.tiles_x * tiles_y;
+		levels.append(tiled_level);
+		tiled.level_count++;
+
+		if (width == 1 && height == 1)
+		{
+			break;
+		}
+
+		Array<uint32> next_level;
+		downsample_level(level, width, height, next_level);
+		level.swap(next_level);
+		width = pixl::max(width / 2, 1u);
+		height = pixl::max(height / 2, 1u);
+	}
+
+	textures.append(tiled);
+}
+
+bool TextureTilesWriter::Finish()
+{
+	if (file == nullptr)
+	{
+		return false;
+	}
+
+	TextureTilesHeader header {};
+	memcpy(header.magic, texture_tiles_magic, sizeof(header.magic));
+	header.version = TEXTURE_TILES_VERSION;
+	header.tile_size = TEXTURE_TILE_SIZE;
+	header.key = key;
+	header.texture_count = textures.size;
+	header.level_count = levels.size;
+	header.tile_count = tile_count;
+
+	bool success = !failed &&
+				   (textures.size == 0 || fwrite(textures._data, sizeof(TiledTexture), textures.size, file) == textures.size) &&
+				   (levels.size == 0 || fwrite(levels._data, sizeof(TiledTextureLevel), levels.size, file) == levels.size) &&
+				   seek_file(file, 0) &&
+				   fwrite(&header, sizeof(header), 1, file) == 1;
+	success = fclose(file) == 0 && success;
+	file = nullptr;
+
+	std::string temp_path = path + ".tmp";
+	if (success)
+	{
+		remove(path.c_str());
+		success = rename(temp_path.c_str(), path.c_str()) == 0;
+	}
+
+	if (!success)
+	{
+		remove(temp_path.c_str());
+		printf("WARNING: Failed to write texture tiles %s!\n", path.c_str());
+		return false;
+	}
+
+	printf("Wrote texture tiles %s: %u textures in %u tiles, %.1f MB.\n", path.c_str(), textures.size, tile_count,
+		   (double) tile_offset(tile_count) / (1024.0 * 1024.0));
+	return true;
+}
+
+bool ReadTextureTilesIndex(FILE *file, uint64 key, Array<TiledTexture> &out_textures, Array<TiledTextureLevel> &out_levels, uint32 &out_tile_count)
+{
+	TextureTilesHeader header;
+	if (!seek_file(file, 0) || fread(&header, sizeof(header), 1, file) != 1)
+	{
+		return false;
+	}
+
+	if (memcmp(header.magic, texture_tiles_magic, sizeof(header.magic)) != 0 ||
+		header.version != TEXTURE_TILES_VERSION ||
+		header.tile_size != TEXTURE_TILE_SIZE ||
+		header.key != key)
+	{
+		return false;
+	}
+
+	out_textures.resize(header.texture_count);
+	out_levels.resize(header.level_count);
+	if (!seek_file(file, tile_offset(header.tile_count)) ||
+		(header.texture_count > 0 && fread(out_textures._data, sizeof(TiledTexture), header.texture_count, file) != header.texture_count) ||
+		(header.level_count > 0 && fread(out_levels._data, sizeof(TiledTextureLevel), header.level_count, file) != header.level_count))
+	{
+		return false;
+	}
+
+	// A damaged file must not send lookups outside of the tiles
+	for (uint32 i = 0; i < out_textures.size; i++)
+	{
+		TiledTexture &texture = out_textures[i];
+		if (texture.level_count == 0 || texture.first_level + texture.level_count > out_levels.size)
+		{
+			return false;
+		}
+	}
+
+	for (uint32 i = 0; i < out_levels.size; i++)
+	{
+		TiledTextureLevel &level = out_levels[i];
+		uint64 tiles_y = (level.height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+		if (level.width == 0 || level.height == 0 || level.tiles_x != (level.width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE ||
+			level.first_tile + level.tiles_x * tiles_y > header.tile_count)
+		{
+			return false;
+		}
+	}
+
+	out_tile_count = header.tile_count;
+	return true;
+}
+
+bool ReadTextureTile(FILE *file, uint32 tile, uint32 *out_texels)
+{
+	return seek_file(file, tile_offset(tile)) && fread(out_texels, sizeof(uint32), TEXTURE_TILE_TEXELS, file) == TEXTURE_TILE_TEXELS;
+}
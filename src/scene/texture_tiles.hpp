@@ -0,0 +1,82 @@
+#pragma once
+#include "../core/array.hpp"
+#include "../defines.hpp"
+#include "texture.hpp"
+
+#include <cstdio>
+#include <string>
+
+// The CPU renderer doesn't keep whole textures in memory. They are written
+// to a file as mip pyramids cut into square tiles of RGBA8 texels, and the
+// tiles are read back when a ray first needs them (see cpu/texture_cache.hpp).
+// The tiles at the right and bottom of a level repeat its last texels.
+constexpr uint32 TEXTURE_TILE_SIZE = 64;
+constexpr uint32 TEXTURE_TILE_TEXELS = TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE;
+constexpr uint64 TEXTURE_TILE_BYTES = TEXTURE_TILE_TEXELS * sizeof(uint32);
+
+// Bump whenever the layout of the file or the mip filter changes
+constexpr uint32 TEXTURE_TILES_VERSION = 1;
+
+struct TiledTexture
+{
+	uint32 first_level; // into the levels of the file
+	uint32 level_count; // down to 1x1
+	uint32 repeat_s;    // how the UVs outside of [0, 1] wrap
+	uint32 repeat_t;
+};
+
+struct TiledTextureLevel
+{
+	uint32 width;
+	uint32 height;
+	uint32 tiles_x;    // tiles per row
+	uint32 first_tile; // into the tiles of the file, row after row
+};
+
+// The header takes the place of the first tile, so every tile starts at a
+// multiple of its size. The textures and levels follow the last tile.
+struct TextureTilesHeader
+{
+	char magic[8];
+	uint32 version;
+	uint32 tile_size;
+	uint64 key;
+
+	uint32 texture_count;
+	uint32 level_count;
+	uint32 tile_count;
+	uint32 unused;
+};
+
+// Identifies the tiles of a model by the hash of its source files
+uint64 TextureTilesKey(uint64 source_hash);
+
+// Writes the textures one at a time, so that only the ones being added
+// need to be decoded. The file is written next to `path` and only takes
+// its place once Finish succeeded.
+struct TextureTilesWriter
+{
+	FILE *file = nullptr;
+	std::string path;
+	uint64 key = 0;
+
+	Array<TiledTexture> textures;
+	Array<TiledTextureLevel> levels;
+	uint32 tile_count = 0;
+	bool failed = false;
+
+	bool Begin(const char *tiles_path, uint64 tiles_key);
+
+	// Builds the mip levels of the texture with a box filter and writes
+	// their tiles. Texture indices follow the order they are added in.
+	void Add(const DecodedTexture &texture);
+
+	bool Finish();
+};
+
+// Reads the header, textures and levels of a tile file that was written
+// for `key`. Returns false if it was written for another one or is damaged.
+bool ReadTextureTilesIndex(FILE *file, uint64 key, Array<TiledTexture> &out_textures, Array<TiledTextureLevel> &out_levels, uint32 &out_tile_count);
+
+// Reads the TEXTURE_TILE_TEXELS texels of one tile
+bool ReadTextureTile(FILE *file, uint32 tile, uint32 *out_texels);
@@ -3,33 +3,11 @@
 #include "material.hpp"
 #include <glm/packing.hpp>
 
-Triangle::Triangle()
-        : v0(0.0f), v1(0.0f), v2(0.0f),
-	      n0(0.0f), n1(0.0f), n2(0.0f),
-          uv0(0.0f), uv1(0.0f), uv2(0.0f),
-          edge1(0.0f), edge2(0.0f), mat_index(0) {}
-
-Triangle::Triangle(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2, glm::vec3 n0, glm::vec3 n1, glm::vec3 n2, uint32 mat_index)
-        : v0(v0), v1(v1), v2(v2),
-	      n0(n0), n1(n1), n2(n2),
-          uv0(0.0f), uv1(0.0f), uv2(0.0f),
-		  edge1(v1 - v0), edge2(v2 - v0),
-          mat_index(mat_index) {}
-
-Triangle::Triangle(Array<glm::vec3> &vertices, Array<glm::vec3> &normals, Array<glm::vec2> &tex_coords, uint32 mat_index)
-        : v0(vertices[0]), v1(vertices[1]), v2(vertices[2]),
-	      n0(normals[0]), n1(normals[1]), n2(normals[2]),
-	      uv0(0.0f), uv1(0.0f), uv2(0.0f),
-	      edge1(v1 - v0), edge2(v2 - v0),
-          mat_index(mat_index)
-{
-	if(tex_coords.size == 3)
-	{
-		uv0 = tex_coords[0];
-		uv1 = tex_coords[1];
-		uv2 = tex_coords[2];
-	}
-}
+VertexGLSL::VertexGLSL(const glm::vec3 &position, const glm::vec3 &normal, const glm::vec2 &uv)
+	: position(position),
+	  normal(glm::packHalf2x16(pixl::octahedral_normal_encoding(normal))),
+	  uv(glm::packHalf2x16(uv))
+{}
 
 glm::vec3 TriangleGLSL::v0() const
 {
@@ -46,36 +24,23 @@ glm::vec3 TriangleGLSL::v2() const
 	return {data3.x, data3.y, data3.z};
 }
 
-TriangleGLSL::TriangleGLSL(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2,
-			 const glm::vec2 &uv0, const glm::vec2 &uv1, const glm::vec2 &uv2,
-			 const glm::vec3 &n0, const glm::vec3 &n1, const glm::vec3 &n2,
-			 uint32 mat_index)
-	: data1(v0.x, v0.y, v0.z, glm::uintBitsToFloat(glm::packHalf2x16(uv0))),
-	  data2(v1.x, v1.y, v1.z, glm::uintBitsToFloat(glm::packHalf2x16(uv1))),
-	  data3(v2.x, v2.y, v2.z, glm::uintBitsToFloat(glm::packHalf2x16(uv2))), data4(0)
+TriangleGLSL::TriangleGLSL(const IndexedTriangleGLSL &triangle, Array<VertexGLSL> &vertices)
 {
-    glm::vec2 n0_enc = pixl::octahedral_normal_encoding(n0);
-    glm::vec2 n1_enc = pixl::octahedral_normal_encoding(n1);
-    glm::vec2 n2_enc = pixl::octahedral_normal_encoding(n2);
-	data4.x = glm::packHalf2x16(n0_enc);
-	data4.y = glm::packHalf2x16(n1_enc);
-	data4.z = glm::packHalf2x16(n2_enc);
-	data4.w = mat_index;
+	VertexGLSL &vertex0 = vertices[triangle.vertices[0]];
+	VertexGLSL &vertex1 = vertices[triangle.vertices[1]];
+	VertexGLSL &vertex2 = vertices[triangle.vertices[2]];
+	data1 = glm::vec4(vertex0.position, glm::uintBitsToFloat(vertex0.uv));
+	data2 = glm::vec4(vertex1.position, glm::uintBitsToFloat(vertex1.uv));
+	data3 = glm::vec4(vertex2.position, glm::uintBitsToFloat(vertex2.uv));
+	data4 = glm::uvec4(vertex0.normal, vertex1.normal, vertex2.normal, triangle.mat_index);
 }
 
-TriangleGLSL::TriangleGLSL(const Triangle &triangle)
-	: TriangleGLSL(triangle.v0, triangle.v1, triangle.v2,
-				   triangle.uv0, triangle.uv1, triangle.uv2,
-				   triangle.n0, triangle.n1, triangle.n2,
-				   triangle.mat_index)
-{}
-
-Array<uint32> FindEmissiveTris(Array<TriangleGLSL> &tris, Array<struct MaterialGLSL> &materials)
+Array<uint32> FindEmissiveTris(Array<IndexedTriangleGLSL> &tris, Array<struct MaterialGLSL> &materials)
 {
 	Array<uint32> emissive_tris(tris.size);
 	for (uint32 i = 0; i < tris.size; i++)
 	{
-		MaterialGLSL current_mat = materials[tris[i].data4.w];
+		MaterialGLSL current_mat = materials[tris[i].mat_index];
 		if (current_mat.data3.x >= EPSILON || current_mat.data3.y >= EPSILON || current_mat.data3.z >= EPSILON)
 		{
 			emissive_tris.append(i);
@@ -5,24 +5,29 @@
 #include <glm/vec3.hpp>
 #include <glm/vec4.hpp>
 
-struct Triangle
+// One vertex of a mesh, shared by all of its triangles. 20 bytes, which the
+// shader reads as a struct of scalars (std430 doesn't pad it to 32).
+struct VertexGLSL
 {
-    glm::vec3 v0, v1, v2;
-    glm::vec3 n0, n1, n2;
-    glm::vec2 uv0, uv1, uv2;
+	glm::vec3 position;
+	uint32 normal; // octahedral encoding, packHalf2x16
+	uint32 uv;     // packHalf2x16
 
-    // Precomputed values
-    glm::vec3 edge1, edge2;
-
-    uint32 mat_index;
-
-    Triangle();
+	VertexGLSL() = default;
+	VertexGLSL(const glm::vec3 &position, const glm::vec3 &normal, const glm::vec2 &uv);
+};
 
-    Triangle(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2, glm::vec3 n0, glm::vec3 n1, glm::vec3 n2, uint32 mat_index);
+static_assert(sizeof(VertexGLSL) == 20, "VertexGLSL has to match the layout of the shader");
 
-    Triangle(Array<glm::vec3> &vertices, Array<glm::vec3> &normals, Array<glm::vec2> &tex_coords, uint32 mat_index);
+// Triangle that references its corners in the shared vertex array
+struct IndexedTriangleGLSL
+{
+	uint32 vertices[3];
+	uint32 mat_index;
 };
 
+// Triangle with the data of its corners copied in, which is what the light
+// triangles are made of
 struct TriangleGLSL
 {
     glm::vec4 data1; // v0.x, v0.y, v0.z, uv0
@@ -31,15 +36,11 @@ struct TriangleGLSL
 	glm::uvec4 data4; // n0_oct, n1_oct, n2_oct, mat_index
 
 	TriangleGLSL() = default;
-	explicit TriangleGLSL(const Triangle &triangle);
-	TriangleGLSL(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2,
-				 const glm::vec2 &uv0, const glm::vec2 &uv1, const glm::vec2 &uv2,
-				 const glm::vec3 &n0, const glm::vec3 &n1, const glm::vec3 &n2,
-				 uint32 mat_index);
+	TriangleGLSL(const IndexedTriangleGLSL &triangle, Array<VertexGLSL> &vertices);
 
 	[[nodiscard]] glm::vec3 v0() const;
 	[[nodiscard]] glm::vec3 v1() const;
 	[[nodiscard]] glm::vec3 v2() const;
 };
 
-Array<uint32> FindEmissiveTris(Array<TriangleGLSL> &tris, Array<struct MaterialGLSL> &materials);
+Array<uint32> FindEmissiveTris(Array<IndexedTriangleGLSL> &tris, Array<struct MaterialGLSL> &materials);